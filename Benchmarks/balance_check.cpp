@@ -0,0 +1,73 @@
+#include <iostream>
+#include <random>
+#include <cstdlib>
+
+#include <omp.h>
+
+#include "photonmap.hpp"
+
+using namespace std;
+
+////////////////////////////////////////////
+// Parallel kd-tree balancing check.
+////////////////////////////////////////////
+// Balances the same photons with one thread and with every core,
+// with photonmap.cpp built to spawn a task for every segment of
+// more than a few photons, and checks that both heaps hold the
+// same photon at every index. Exits with a failure otherwise.
+
+static const int N_PHOTONS = 500000;
+static const int N_ROUNDS = 10;
+
+static void store_photons(PhotonMap & map) {
+  mt19937 engine(12345);
+  uniform_real_distribution<float> dist(0.0f, 1.0f);
+  float pos[3], dir[3] = { 0.0f, -1.0f, 0.0f }, power[3];
+
+  for (int i = 0; i < N_PHOTONS; i++) {
+    pos[0] = dist(engine);
+    pos[1] = dist(engine);
+    pos[2] = dist(engine);
+    power[0] = power[1] = power[2] = dist(engine);
+    map.store(power, pos, dir, 1.0f);
+  }
+}
+
+int main() {
+  PhotonMap serial(N_PHOTONS);
+  float p_s[3], p_p[3], w_s[3], w_p[3];
+  int threads = omp_get_max_threads(), bad;
+
+  store_photons(serial);
+  omp_set_num_threads(1);
+  serial.balance();
+  omp_set_num_threads(threads);
+
+  // Task scheduling changes between runs, so a race shows up in some of them.
+  for (int r = 0; r < N_ROUNDS; r++) {
+    PhotonMap parallel(N_PHOTONS);
+
+    store_photons(parallel);
+    parallel.balance();
+
+    bad = 0;
+    for (int i = 1; i <= N_PHOTONS; i++) {
+      serial.photon_position(p_s, i);
+      parallel.photon_position(p_p, i);
+      serial.photon_power(w_s, i);
+      parallel.photon_power(w_p, i);
+      if (p_s[0] != p_p[0] || p_s[1] != p_p[1] || p_s[2] != p_p[2] || w_s[0] != w_p[0])
+	bad++;
+    }
+
+    if (bad > 0) {
+      cerr << "Round " << r << ": " << bad << " of " << N_PHOTONS << " photons differ from the serial kd-tree with "
+	   << threads << " threads." << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  cout << "The kd-trees balanced with 1 and " << threads << " threads are identical in " << N_ROUNDS << " rounds." << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Checks that workers of a distributed photon mapping render trace the
+# same photon maps on scenes with area lights: the image put together
+# from the tiles of WORKERS workers must be the image of a single process
+# with the sampler the coordinator gives the job. Run from the top of the
+# tree, usually through "make check". Settings are taken from the
+# environment:
+#
+#   WORKERS  Number of workers (2).
+#   SCENES   Scene files with area lights ("scenes/scene5.json scenes/scene7.json").
+#   PHOTONS  Primary photons per light source (20000).
+#   PORT     TCP port of the coordinator (5600).
+#   OUT      Directory for the images and logs (distributed_check).
+#
+# The exit status is 1 if a render failed or the images differ.
+
+WORKERS=${WORKERS:-2}
+SCENES=${SCENES:-"scenes/scene5.json scenes/scene7.json"}
+PHOTONS=${PHOTONS:-20000}
+PORT=${PORT:-5600}
+OUT=${OUT:-distributed_check}
+RAY=./ray
+
+if [ ! -x "$RAY" ]; then
+    echo "Build $RAY first, or run \"make check\"." >&2
+    exit 1
+fi
+
+mkdir -p "$OUT" || exit 1
+
+failed=0
+
+for scene in $SCENES; do
+    name=$(basename "$scene" .json)
+    run="$RAY -t jensen -s 4 -w 160x120 -p $PHOTONS"
+    status=ok
+
+    printf '%-12s ' "$name"
+
+    # Without -S the coordinator gives photon mapping jobs the independent sampler.
+    $run --coordinate "$PORT" -o "$OUT/$name.workers.png" "$scene" > "$OUT/$name.log" 2>&1 &
+    coordinator=$!
+    sleep 1
+
+    k=0
+    while [ $k -lt "$WORKERS" ]; do
+	"$RAY" --worker "127.0.0.1:$PORT" "$scene" > "$OUT/$name.$k.log" 2>&1 &
+	k=$((k + 1))
+    done
+
+    wait $coordinator || status=failed
+    wait
+    $run -S independent -o "$OUT/$name.single.png" "$scene" > "$OUT/$name.log" 2>&1 || status=failed
+
+    if [ $status = ok ] && ! cmp -s "$OUT/$name.workers.png" "$OUT/$name.single.png"; then
+	status="differs from a single process"
+    fi
+    [ "$status" != ok ] && failed=1
+
+    echo "$status"
+done
+
+exit $failed
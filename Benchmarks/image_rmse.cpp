@@ -0,0 +1,73 @@
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <cstdlib>
+
+#include <FreeImage.h>
+
+using namespace std;
+
+////////////////////////////////////////////
+// Image comparison.
+////////////////////////////////////////////
+// Prints the root mean square error over the 8 bit RGB channels of
+// two images of the same size, as used by the scene benchmark to
+// compare renders against reference images.
+
+static FIBITMAP * load(const char * file_name) {
+  FREE_IMAGE_FORMAT fif = FreeImage_GetFileType(file_name, 0);
+  FIBITMAP * bitmap, * rgb;
+
+  if (fif == FIF_UNKNOWN)
+    fif = FreeImage_GetFIFFromFilename(file_name);
+  if (fif == FIF_UNKNOWN || (bitmap = FreeImage_Load(fif, file_name, 0)) == NULL)
+    return NULL;
+
+  rgb = FreeImage_ConvertTo24Bits(bitmap);
+  FreeImage_Unload(bitmap);
+
+  return rgb;
+}
+
+int main(int argc, char ** argv) {
+  FIBITMAP * a, * b;
+  BYTE * la, * lb;
+  unsigned int w, h;
+  double sum = 0.0, d;
+
+  if (argc != 3) {
+    cerr << "USAGE: " << argv[0] << " IMAGE REFERENCE" << endl;
+    return EXIT_FAILURE;
+  }
+
+  FreeImage_Initialise();
+
+  if ((a = load(argv[1])) == NULL || (b = load(argv[2])) == NULL) {
+    cerr << "Could not load " << (a == NULL ? argv[1] : argv[2]) << endl;
+    return EXIT_FAILURE;
+  }
+
+  w = FreeImage_GetWidth(a);
+  h = FreeImage_GetHeight(a);
+  if (w != FreeImage_GetWidth(b) || h != FreeImage_GetHeight(b)) {
+    cerr << "Image sizes differ." << endl;
+    return EXIT_FAILURE;
+  }
+
+  for (unsigned int y = 0; y < h; y++) {
+    la = FreeImage_GetScanLine(a, y);
+    lb = FreeImage_GetScanLine(b, y);
+    for (unsigned int x = 0; x < 3 * w; x++) {
+      d = static_cast<double>(la[x]) - static_cast<double>(lb[x]);
+      sum += d * d;
+    }
+  }
+
+  cout << fixed << setprecision(4) << sqrt(sum / (3.0 * w * h)) << endl;
+
+  FreeImage_Unload(a);
+  FreeImage_Unload(b);
+  FreeImage_DeInitialise();
+
+  return EXIT_SUCCESS;
+}
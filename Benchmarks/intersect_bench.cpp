@@ -0,0 +1,173 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <cstdlib>
+
+#include <glm/glm.hpp>
+
+#include "primitive_store.hpp"
+#include "sphere.hpp"
+#include "disk.hpp"
+
+using namespace std;
+using glm::vec3;
+
+////////////////////////////////////////////
+// Ray-sphere and ray-disk intersection benchmark.
+////////////////////////////////////////////
+// Shoots random rays through a box of random spheres and disks and
+// times the closest hit search with the virtual intersect() of every
+// figure, with the scalar kernels of the primitive store and with its
+// SIMD kernels, checking that all of them find the same hits.
+
+static const int N_PRIMS = 1024;
+static const int N_RAYS = 20000;
+
+static mt19937 engine(12345);
+static uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+static double seconds_since(chrono::high_resolution_clock::time_point start) {
+  return chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+}
+
+static vec3 random_unit() {
+  vec3 v;
+
+  do
+    v = vec3(dist(engine), dist(engine), dist(engine)) * 2.0f - vec3(1.0f);
+  while (glm::dot(v, v) > 1.0f || glm::dot(v, v) < 1e-4f);
+
+  return glm::normalize(v);
+}
+
+// Closest hit of every ray with every figure through virtual calls.
+static double run_virtual(const vector<Figure *> & figs, const vector<Ray> & rays, vector<int> & hits) {
+  chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+  float t, _t;
+  Ray r;
+
+  for (size_t i = 0; i < rays.size(); i++) {
+    r = rays[i];
+    t = numeric_limits<float>::max();
+    hits[i] = -1;
+    for (size_t f = 0; f < figs.size(); f++) {
+      if (figs[f]->intersect(r, _t) && _t < t) {
+	t = _t;
+	hits[i] = f;
+      }
+    }
+  }
+
+  return seconds_since(start);
+}
+
+static double run_spheres(const sphere_array_t & s, const vector<Ray> & rays, vector<int> & hits, const bool simd) {
+  chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+  float t;
+
+  for (size_t i = 0; i < rays.size(); i++) {
+    t = numeric_limits<float>::max();
+    hits[i] = closest_sphere(s, 0, s.figs.size(), rays[i], t, NULL, simd);
+  }
+
+  return seconds_since(start);
+}
+
+static double run_disks(const disk_array_t & d, const vector<Ray> & rays, vector<int> & hits, const bool simd) {
+  chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+  float t;
+
+  for (size_t i = 0; i < rays.size(); i++) {
+    t = numeric_limits<float>::max();
+    hits[i] = closest_disk(d, 0, d.figs.size(), rays[i], t, NULL, simd);
+  }
+
+  return seconds_since(start);
+}
+
+static void report(const char * name, const double time, const size_t n_hits) {
+  cout << name << setw(8) << (static_cast<double>(N_PRIMS) * N_RAYS) / (1e6 * time) << " M intersections/s ("
+       << n_hits << " hits)" << endl;
+}
+
+static size_t count_hits(const vector<int> & hits) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < hits.size(); i++)
+    n += hits[i] >= 0;
+
+  return n;
+}
+
+int main() {
+  vector<Figure *> spheres, disks;
+  sphere_array_t s;
+  disk_array_t d;
+  vector<Ray> rays;
+  vector<int> h_virtual(N_RAYS), h_scalar(N_RAYS), h_simd(N_RAYS);
+  double t_virtual, t_scalar, t_simd;
+  int bad = 0;
+  vec3 p, n;
+
+  for (int i = 0; i < N_PRIMS; i++) {
+    p = vec3(dist(engine), dist(engine), dist(engine)) * 20.0f - vec3(10.0f);
+    spheres.push_back(new Sphere(p, 0.05f + (0.2f * dist(engine))));
+    s.x.push_back(p.x);
+    s.y.push_back(p.y);
+    s.z.push_back(p.z);
+    s.r.push_back(static_cast<Sphere *>(spheres.back())->m_radius);
+    s.figs.push_back(spheres.back());
+
+    p = vec3(dist(engine), dist(engine), dist(engine)) * 20.0f - vec3(10.0f);
+    n = random_unit();
+    disks.push_back(new Disk(p, n, 0.05f + (0.2f * dist(engine))));
+    d.px.push_back(p.x);
+    d.py.push_back(p.y);
+    d.pz.push_back(p.z);
+    d.nx.push_back(static_cast<Disk *>(disks.back())->m_normal.x);
+    d.ny.push_back(static_cast<Disk *>(disks.back())->m_normal.y);
+    d.nz.push_back(static_cast<Disk *>(disks.back())->m_normal.z);
+    d.r.push_back(static_cast<Disk *>(disks.back())->m_radius);
+    d.figs.push_back(disks.back());
+  }
+
+  // Rays from the faces of a larger box towards its inside.
+  for (int i = 0; i < N_RAYS; i++) {
+    p = random_unit() * 15.0f;
+    n = glm::normalize((vec3(dist(engine), dist(engine), dist(engine)) * 10.0f - vec3(5.0f)) - p);
+    rays.push_back(Ray(n, p));
+  }
+
+  cout << fixed << setprecision(2);
+  cout << N_PRIMS << " primitives, " << N_RAYS << " rays." << endl;
+
+  t_virtual = run_virtual(spheres, rays, h_virtual);
+  t_scalar = run_spheres(s, rays, h_scalar, false);
+  t_simd = run_spheres(s, rays, h_simd, true);
+  report("Spheres, virtual: ", t_virtual, count_hits(h_virtual));
+  report("Spheres, scalar:  ", t_scalar, count_hits(h_scalar));
+  report("Spheres, SIMD:    ", t_simd, count_hits(h_simd));
+  for (int i = 0; i < N_RAYS; i++)
+    bad += (h_scalar[i] != h_simd[i]) + (h_virtual[i] != h_simd[i]);
+
+  t_virtual = run_virtual(disks, rays, h_virtual);
+  t_scalar = run_disks(d, rays, h_scalar, false);
+  t_simd = run_disks(d, rays, h_simd, true);
+  report("Disks, virtual:   ", t_virtual, count_hits(h_virtual));
+  report("Disks, scalar:    ", t_scalar, count_hits(h_scalar));
+  report("Disks, SIMD:      ", t_simd, count_hits(h_simd));
+  for (int i = 0; i < N_RAYS; i++)
+    bad += (h_scalar[i] != h_simd[i]) + (h_virtual[i] != h_simd[i]);
+
+  cout << "Mismatched hits: " << bad << endl;
+
+  for (int i = 0; i < N_PRIMS; i++) {
+    delete spheres[i];
+    delete disks[i];
+  }
+
+  return bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
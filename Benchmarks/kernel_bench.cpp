@@ -0,0 +1,496 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+
+#include "sphere.hpp"
+#include "plane.hpp"
+#include "disk.hpp"
+#include "sampling.hpp"
+#include "environment.hpp"
+#include "rgbe.hpp"
+#include "photonmap.hpp"
+
+using namespace std;
+using glm::vec3;
+
+////////////////////////////////////////////
+// Kernel microbenchmarks.
+////////////////////////////////////////////
+// Times the hot kernels of the renderer one at a time, in the manner
+// of Google Benchmark: every benchmark is run with a growing number of
+// iterations until it takes at least the minimum time, then the time
+// per iteration is reported. Inputs are generated up front so only the
+// kernel is timed. Benchmarks can be selected with a substring of their
+// names, so an optimization of one kernel can be measured in isolation:
+//
+//   kernel_bench [-t MIN_SECONDS] [FILTER]
+
+// Times n iterations of a kernel, returns the elapsed seconds.
+typedef function<double(const size_t n)> kernel_t;
+
+typedef struct BENCHMARK {
+  string name;
+  kernel_t run;
+} benchmark_t;
+
+static const size_t N_INPUTS = 4096;
+static const size_t STORE_BATCH = 1 << 20;
+static const int IRRAD_PHOTONS = 1000000;
+static const unsigned int ENV_WIDTH = 1024;
+static const unsigned int ENV_HEIGHT = 512;
+
+static mt19937 engine(12345);
+static uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+static vector<benchmark_t> g_benchmarks;
+
+// Every kernel adds its results here so the compiler can not drop them.
+static volatile float g_sink;
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+static double seconds_since(chrono::high_resolution_clock::time_point start) {
+  return chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+}
+
+static void add(const string & name, const kernel_t & run) {
+  benchmark_t b;
+
+  b.name = name;
+  b.run = run;
+  g_benchmarks.push_back(b);
+}
+
+static vec3 random_unit() {
+  vec3 v;
+
+  do
+    v = vec3(dist(engine), dist(engine), dist(engine)) * 2.0f - vec3(1.0f);
+  while (glm::dot(v, v) > 1.0f || glm::dot(v, v) < 1e-4f);
+
+  return glm::normalize(v);
+}
+
+// Rays from a sphere of radius 5 around the origin towards the unit box,
+// so that a figure of unit size there is hit by a good share of them.
+static vector<Ray> random_rays() {
+  vector<Ray> rays;
+  vec3 o;
+
+  for (size_t i = 0; i < N_INPUTS; i++) {
+    o = random_unit() * 5.0f;
+    rays.push_back(Ray(glm::normalize((vec3(dist(engine), dist(engine), dist(engine)) * 3.0f - vec3(1.5f)) - o), o));
+  }
+
+  return rays;
+}
+
+// A point on a face of the unit box with the normal pointing inside,
+// like the walls of a Cornell box.
+static void random_surface_point(float pos[3], float normal[3]) {
+  int face = static_cast<int>(dist(engine) * 6.0f) % 6;
+  int axis = face / 2;
+
+  pos[0] = dist(engine);
+  pos[1] = dist(engine);
+  pos[2] = dist(engine);
+  pos[axis] = face % 2 == 0 ? 0.0f : 1.0f;
+  normal[0] = normal[1] = normal[2] = 0.0f;
+  normal[axis] = face % 2 == 0 ? 1.0f : -1.0f;
+}
+
+// Position, direction and power of a photon arriving at a wall.
+static void random_photon(float pos[3], float dir[3], float power[3]) {
+  float normal[3];
+  vec3 d;
+
+  random_surface_point(pos, normal);
+  d = glm::normalize(vec3(-normal[0], -normal[1], -normal[2]) + (vec3(dist(engine), dist(engine), dist(engine)) - vec3(0.5f)));
+  dir[0] = d.x; dir[1] = d.y; dir[2] = d.z;
+  power[0] = dist(engine); power[1] = dist(engine); power[2] = dist(engine);
+}
+
+static void store_random_photon(PhotonMap & map) {
+  float pos[3], dir[3], power[3];
+
+  random_photon(pos, dir, power);
+  map.store(power, pos, dir, 1.0f);
+}
+
+static PhotonMap * random_photon_map(const int n_photons) {
+  PhotonMap * map = new PhotonMap(n_photons);
+
+  for (int i = 0; i < n_photons; i++)
+    store_random_photon(*map);
+  map->scale_photon_power(1.0f / n_photons);
+
+  return map;
+}
+
+// Balanced maps are shared by the queries on the same number of photons.
+static const PhotonMap & balanced_photon_map(const int n_photons) {
+  static map<int, PhotonMap *> maps;
+  PhotonMap * m;
+
+  if (maps.count(n_photons) == 0) {
+    m = random_photon_map(n_photons);
+    m->balance();
+    maps[n_photons] = m;
+  }
+
+  return *maps[n_photons];
+}
+
+/* Writes a procedural sky as a PFM file, which FreeImage reads as RGB
+ * floats, and returns its name. The file is removed by the caller. */
+static string write_environment_texture() {
+  char name[] = "/tmp/kernel_bench_XXXXXX.pfm";
+  vector<float> row(3 * ENV_WIDTH);
+  int fd;
+  FILE * f;
+
+  if ((fd = mkstemps(name, 4)) < 0 || (f = fdopen(fd, "wb")) == NULL)
+    return "";
+
+  fprintf(f, "PF\n%u %u\n-1.0\n", ENV_WIDTH, ENV_HEIGHT);
+  for (unsigned int y = 0; y < ENV_HEIGHT; y++) {
+    for (unsigned int x = 0; x < ENV_WIDTH; x++) {
+      float s = 0.5f + 0.5f * sin(0.05f * x) * cos(0.07f * y);
+      row[3 * x] = 0.4f * s;
+      row[(3 * x) + 1] = 0.6f * s + (static_cast<float>(y) / ENV_HEIGHT);
+      row[(3 * x) + 2] = s;
+    }
+    fwrite(&row[0], sizeof(float), row.size(), f);
+  }
+  fclose(f);
+
+  return name;
+}
+
+////////////////////////////////////////////
+// Benchmarks.
+////////////////////////////////////////////
+
+static kernel_t intersect_kernel(const Figure * fig) {
+  vector<Ray> rays = random_rays();
+
+  return [fig, rays](const size_t n) {
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    float t, sum = 0.0f;
+    Ray r;
+
+    for (size_t i = 0; i < n; i++) {
+      r = rays[i & (N_INPUTS - 1)];
+      if (fig->intersect(r, t))
+	sum += t;
+    }
+
+    g_sink = g_sink + sum;
+    return seconds_since(start);
+  };
+}
+
+static void add_intersection_benchmarks() {
+  static Sphere sphere(vec3(0.0f), 1.0f);
+  static Plane plane(vec3(0.0f), glm::normalize(vec3(0.2f, 1.0f, 0.1f)));
+  static Disk disk(vec3(0.0f), glm::normalize(vec3(0.2f, 1.0f, 0.1f)), 1.0f);
+
+  add("Sphere::intersect", intersect_kernel(&sphere));
+  add("Plane::intersect", intersect_kernel(&plane));
+  add("Disk::intersect", intersect_kernel(&disk));
+}
+
+static void add_sampling_benchmarks() {
+  vector<float> u;
+  vector<vec3> normals;
+
+  for (size_t i = 0; i < N_INPUTS; i++) {
+    u.push_back(dist(engine));
+    u.push_back(dist(engine));
+    normals.push_back(random_unit());
+  }
+
+  add("sample_hemisphere+rotate_sample", [u, normals](const size_t n) {
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    vec3 s, sum(0.0f);
+    size_t j;
+
+    for (size_t i = 0; i < n; i++) {
+      j = i & (N_INPUTS - 1);
+      s = sample_hemisphere(u[2 * j], u[(2 * j) + 1]);
+      rotate_sample(s, normals[j]);
+      sum += s;
+    }
+
+    g_sink = g_sink + sum.x + sum.y + sum.z;
+    return seconds_since(start);
+  });
+}
+
+static kernel_t environment_kernel(Environment * env) {
+  vector<vec3> dirs;
+
+  for (size_t i = 0; i < N_INPUTS; i++)
+    dirs.push_back(random_unit());
+
+  return [env, dirs](const size_t n) {
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    vec3 sum(0.0f);
+    Ray r;
+
+    for (size_t i = 0; i < n; i++) {
+      r.m_direction = dirs[i & (N_INPUTS - 1)];
+      sum += env->get_color(r);
+    }
+
+    g_sink = g_sink + sum.x + sum.y + sum.z;
+    return seconds_since(start);
+  };
+}
+
+static void add_environment_benchmarks(const string & texture) {
+  static Environment background(NULL, false, vec3(0.5f, 0.6f, 1.0f));
+  static Environment * textured = NULL;
+
+  add("Environment::get_color/background", environment_kernel(&background));
+
+  if (texture.empty()) {
+    cerr << "Could not write the environment texture, skipping its benchmarks." << endl;
+    return;
+  }
+
+  textured = new Environment(texture.c_str(), false, vec3(1.0f));
+  add("Environment::get_color/texture", environment_kernel(textured));
+}
+
+static void add_rgbe_benchmarks() {
+  vector<float> colors;
+  vector<unsigned char> rgbe(4 * N_INPUTS);
+
+  // Colors over several orders of magnitude, like an HDR image.
+  for (size_t i = 0; i < 3 * N_INPUTS; i++)
+    colors.push_back(pow(10.0f, (6.0f * dist(engine)) - 3.0f));
+  for (size_t i = 0; i < N_INPUTS; i++)
+    float2rgbe(&rgbe[4 * i], colors[3 * i], colors[(3 * i) + 1], colors[(3 * i) + 2]);
+
+  add("float2rgbe", [colors](const size_t n) {
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    unsigned char out[4];
+    unsigned int sum = 0;
+    size_t j;
+
+    for (size_t i = 0; i < n; i++) {
+      j = 3 * (i & (N_INPUTS - 1));
+      float2rgbe(out, colors[j], colors[j + 1], colors[j + 2]);
+      sum += out[0] + out[3];
+    }
+
+    g_sink = g_sink + sum;
+    return seconds_since(start);
+  });
+
+  add("rgbe2float", [rgbe](const size_t n) {
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    float r, g, b, sum = 0.0f;
+
+    for (size_t i = 0; i < n; i++) {
+      rgbe2float(r, g, b, &rgbe[4 * (i & (N_INPUTS - 1))]);
+      sum += r + g + b;
+    }
+
+    g_sink = g_sink + sum;
+    return seconds_since(start);
+  });
+}
+
+static void add_photon_map_benchmarks() {
+  const int sizes[] = { 10000, 100000, 1000000 };
+  const int gathers[] = { 50, 200, 500 };
+  const float radii[] = { 0.01f, 0.05f, 0.1f };
+  ostringstream name;
+
+  // One iteration stores one photon, in maps of a bounded size.
+  vector<float> photons(9 * N_INPUTS);
+
+  for (size_t i = 0; i < N_INPUTS; i++)
+    random_photon(&photons[9 * i], &photons[(9 * i) + 3], &photons[(9 * i) + 6]);
+
+  add("PhotonMap::store", [photons](const size_t n) {
+    double time = 0.0;
+    size_t done = 0, batch, j;
+
+    while (done < n) {
+      batch = n - done < STORE_BATCH ? n - done : STORE_BATCH;
+      PhotonMap map(static_cast<int>(batch));
+      chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+
+      for (size_t i = 0; i < batch; i++) {
+	j = 9 * (i & (N_INPUTS - 1));
+	map.store(&photons[j + 6], &photons[j], &photons[j + 3], 1.0f);
+      }
+
+      time += seconds_since(start);
+      done += batch;
+    }
+
+    return time;
+  });
+
+  // One iteration balances a whole map, filling it is not timed.
+  for (int s = 0; s < 3; s++) {
+    const int n_photons = sizes[s];
+
+    name.str("");
+    name << "PhotonMap::balance/" << n_photons;
+    add(name.str(), [n_photons](const size_t n) {
+      double time = 0.0;
+      PhotonMap * map;
+
+      for (size_t i = 0; i < n; i++) {
+	map = random_photon_map(n_photons);
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	map->balance();
+	time += seconds_since(start);
+	delete map;
+      }
+
+      return time;
+    });
+  }
+
+  // Queries on the walls of the box, the map is built on first use.
+  for (int g = 0; g < 3; g++) {
+    for (int r = 0; r < 3; r++) {
+      const int nphotons = gathers[g];
+      const float radius = radii[r];
+      vector<float> points(3 * N_INPUTS), normals(3 * N_INPUTS);
+
+      for (size_t i = 0; i < N_INPUTS; i++)
+	random_surface_point(&points[3 * i], &normals[3 * i]);
+
+      name.str("");
+      name << "PhotonMap::irradiance_estimate/" << nphotons << "/" << radius;
+      add(name.str(), [nphotons, radius, points, normals](const size_t n) {
+	const PhotonMap & map = balanced_photon_map(IRRAD_PHOTONS);
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	float irrad[3], sum = 0.0f;
+	size_t j;
+
+	for (size_t i = 0; i < n; i++) {
+	  j = 3 * (i & (N_INPUTS - 1));
+	  map.irradiance_estimate(irrad, &points[j], &normals[j], radius, nphotons);
+	  sum += irrad[0] + irrad[1] + irrad[2];
+	}
+
+	g_sink = g_sink + sum;
+	return seconds_since(start);
+      });
+    }
+  }
+}
+
+////////////////////////////////////////////
+// Main function.
+////////////////////////////////////////////
+
+// Grows the iteration count until a run takes at least min_time.
+static void run_benchmark(const benchmark_t & b, const double min_time) {
+  size_t n = 1;
+  double time, factor;
+
+  for (;;) {
+    time = b.run(n);
+    if (time >= min_time || n >= (size_t(1) << 40))
+      break;
+    // Aim a bit past the minimum, but never more than 100 times longer.
+    factor = time > 0.0 ? 1.4 * min_time / time : 100.0;
+    factor = factor < 2.0 ? 2.0 : (factor > 100.0 ? 100.0 : factor);
+    n = static_cast<size_t>(n * factor);
+  }
+
+  cout << left << setw(48) << b.name << right << setw(14) << 1e9 * time / n << " ns"
+       << setw(14) << n << setw(14) << n / time << endl;
+}
+
+static void print_usage(char ** argv) {
+  cerr << "USAGE: " << argv[0] << " [OPTIONS] [FILTER]" << endl;
+  cerr << "Runs the benchmarks whose names contain FILTER, all of them by default." << endl;
+  cerr << "OPTIONS:" << endl;
+  cerr << "  -t\tMinimum time per benchmark in seconds. Defaults to 0.5" << endl;
+  cerr << "  -l\tList the benchmarks and exit." << endl;
+}
+
+int main(int argc, char ** argv) {
+  double min_time = 0.5;
+  bool list = false;
+  string filter, texture;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:lh")) != -1) {
+    switch (opt) {
+    case 't':
+      min_time = atof(optarg);
+      if (min_time <= 0.0) {
+	cerr << "Minimum time must be positive." << endl;
+	print_usage(argv);
+	return EXIT_FAILURE;
+      }
+      break;
+
+    case 'l':
+      list = true;
+      break;
+
+    default:
+      print_usage(argv);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc)
+    filter = argv[optind];
+
+  texture = write_environment_texture();
+
+  add_intersection_benchmarks();
+  add_sampling_benchmarks();
+  add_environment_benchmarks(texture);
+  add_rgbe_benchmarks();
+  add_photon_map_benchmarks();
+
+  if (!texture.empty())
+    unlink(texture.c_str());
+
+  if (list) {
+    for (size_t i = 0; i < g_benchmarks.size(); i++)
+      cout << g_benchmarks[i].name << endl;
+    return EXIT_SUCCESS;
+  }
+
+  cout << fixed << setprecision(1);
+  cout << "Irradiance estimates on " << IRRAD_PHOTONS << " photons, gathering nphotons within the radius." << endl;
+  cout << left << setw(48) << "Benchmark" << right << setw(17) << "Time" << setw(14) << "Iterations" << setw(14) << "Items/s" << endl;
+  cout << string(93, '-') << endl;
+
+  for (size_t i = 0; i < g_benchmarks.size(); i++)
+    if (filter.empty() || g_benchmarks[i].name.find(filter) != string::npos)
+      run_benchmark(g_benchmarks[i], min_time);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+#include <omp.h>
+
+#include "photonmap.hpp"
+
+using namespace std;
+
+////////////////////////////////////////////
+// Photon map build and query benchmark.
+////////////////////////////////////////////
+// Times balancing the photon map with one thread and with all of
+// them, then checks the radius and k nearest neighbour queries
+// against a linear scan over all photons, which is what the old
+// kdTree::find_by_distance did, and compares their speed.
+
+static const int N_PHOTONS = 1000000;
+static const int N_QUERIES = 2000;
+static const int N_NEAREST = 100;
+static const float RADIUS = 0.02f;
+static const float MAX_DIST = 0.25f;
+
+static mt19937 engine(12345);
+static uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+static double seconds_since(chrono::high_resolution_clock::time_point start) {
+  return chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+}
+
+static void fill(PhotonMap & map, vector<float> & positions) {
+  float pos[3], dir[3] {0.0f, 0.0f, -1.0f}, power[3] {1.0f, 1.0f, 1.0f};
+
+  engine.seed(12345);
+  positions.clear();
+  for (int i = 0; i < N_PHOTONS; i++) {
+    // Photons on the faces of a unit box.
+    int axis = static_cast<int>(dist(engine) * 3.0f) % 3;
+    pos[0] = dist(engine);
+    pos[1] = dist(engine);
+    pos[2] = dist(engine);
+    pos[axis] = dist(engine) < 0.5f ? 0.0f : 1.0f;
+    map.store(power, pos, dir, 1.0f);
+    positions.insert(positions.end(), pos, pos + 3);
+  }
+}
+
+static float dist2(const float * a, const float * b) {
+  float d = 0.0f;
+  for (int k = 0; k < 3; k++)
+    d += (a[k] - b[k]) * (a[k] - b[k]);
+  return d;
+}
+
+int main() {
+  PhotonMap serial(N_PHOTONS), parallel(N_PHOTONS);
+  vector<float> positions, queries;
+  vector<int> found;
+  vector<float> scan;
+  int * nearest = new int[N_NEAREST];
+  float * nearest_d2 = new float[N_NEAREST];
+  chrono::high_resolution_clock::time_point start;
+  double t_serial, t_parallel, t_radius, t_radius_scan, t_knn, t_knn_scan;
+  size_t n_radius = 0, n_radius_serial = 0, n_radius_scan = 0;
+  int threads = omp_get_max_threads(), bad = 0;
+
+  fill(serial, positions);
+  fill(parallel, positions);
+
+  omp_set_num_threads(1);
+  start = chrono::high_resolution_clock::now();
+  serial.balance();
+  t_serial = seconds_since(start);
+
+  omp_set_num_threads(threads);
+  start = chrono::high_resolution_clock::now();
+  parallel.balance();
+  t_parallel = seconds_since(start);
+
+  for (int i = 0; i < 3 * N_QUERIES; i++)
+    queries.push_back(dist(engine));
+
+  // Radius queries.
+  start = chrono::high_resolution_clock::now();
+  for (int q = 0; q < N_QUERIES; q++) {
+    parallel.find_in_radius(found, &queries[3 * q], RADIUS);
+    n_radius += found.size();
+  }
+  t_radius = seconds_since(start);
+
+  // Both balanced maps must be the same tree.
+  for (int q = 0; q < N_QUERIES; q++) {
+    serial.find_in_radius(found, &queries[3 * q], RADIUS);
+    n_radius_serial += found.size();
+  }
+
+  start = chrono::high_resolution_clock::now();
+  for (int q = 0; q < N_QUERIES; q++) {
+    for (int i = 0; i < N_PHOTONS; i++)
+      if (dist2(&positions[3 * i], &queries[3 * q]) < RADIUS * RADIUS)
+	n_radius_scan++;
+  }
+  t_radius_scan = seconds_since(start);
+
+  // k nearest neighbour queries, checked against a partial sort.
+  t_knn = t_knn_scan = 0.0;
+  for (int q = 0; q < N_QUERIES; q++) {
+    int n;
+
+    start = chrono::high_resolution_clock::now();
+    n = parallel.find_nearest(nearest, nearest_d2, &queries[3 * q], MAX_DIST, N_NEAREST);
+    t_knn += seconds_since(start);
+
+    start = chrono::high_resolution_clock::now();
+    scan.clear();
+    for (int i = 0; i < N_PHOTONS; i++) {
+      float d = dist2(&positions[3 * i], &queries[3 * q]);
+      if (d < MAX_DIST * MAX_DIST)
+	scan.push_back(d);
+    }
+    partial_sort(scan.begin(), scan.begin() + min(static_cast<size_t>(N_NEAREST), scan.size()), scan.end());
+    t_knn_scan += seconds_since(start);
+
+    if (static_cast<size_t>(n) != min(static_cast<size_t>(N_NEAREST), scan.size()) || (n > 0 && nearest_d2[n - 1] != scan[n - 1]))
+      bad++;
+  }
+
+  cout << fixed << setprecision(4);
+  cout << N_PHOTONS << " photons, " << N_QUERIES << " queries." << endl;
+  cout << "Balance with 1 thread:      " << t_serial << " s" << endl;
+  cout << "Balance with " << setw(2) << threads << " threads:    " << t_parallel << " s" << endl;
+  cout << "Radius query, kd-tree:      " << 1e6 * t_radius / N_QUERIES << " us (" << n_radius << " photons)" << endl;
+  cout << "Radius query, linear scan:  " << 1e6 * t_radius_scan / N_QUERIES << " us (" << n_radius_scan << " photons)" << endl;
+  cout << "k = " << N_NEAREST << " query, kd-tree:     " << 1e6 * t_knn / N_QUERIES << " us" << endl;
+  cout << "k = " << N_NEAREST << " query, linear scan: " << 1e6 * t_knn_scan / N_QUERIES << " us" << endl;
+  cout << "Mismatched k nearest queries: " << bad << endl;
+
+  delete[] nearest;
+  delete[] nearest_d2;
+
+  return n_radius == n_radius_scan && n_radius == n_radius_serial && bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
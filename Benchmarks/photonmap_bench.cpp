@@ -0,0 +1,112 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+
+#include "photonmap.hpp"
+
+using namespace std;
+
+////////////////////////////////////////////
+// Photon map memory and query benchmark.
+////////////////////////////////////////////
+// Stores photons on the faces of a unit box, like the ones of
+// a Cornell box scene, and compares the uncompressed photon map
+// with the compact one in memory use, time per irradiance
+// estimate and error of the estimates. Queries run on all cores,
+// where memory bandwidth matters the most.
+
+static const int N_PHOTONS = 2000000;
+static const int N_QUERIES = 100000;
+static const int N_GATHER = 500;
+static const float RADIUS = 0.05f;
+
+static mt19937 engine(12345);
+static uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+static void random_surface_point(float pos[3], float normal[3]) {
+  int face = static_cast<int>(dist(engine) * 6.0f) % 6;
+  int axis = face / 2;
+
+  pos[0] = dist(engine);
+  pos[1] = dist(engine);
+  pos[2] = dist(engine);
+  pos[axis] = face % 2 == 0 ? 0.0f : 1.0f;
+  normal[0] = normal[1] = normal[2] = 0.0f;
+  normal[axis] = face % 2 == 0 ? 1.0f : -1.0f;
+}
+
+static double run_queries(const PhotonMap & map, const float * points, const float * normals, float * irrad_out) {
+  chrono::high_resolution_clock::time_point start;
+
+  start = chrono::high_resolution_clock::now();
+#pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < N_QUERIES; i++)
+    map.irradiance_estimate(&irrad_out[3 * i], &points[3 * i], &normals[3 * i], RADIUS, N_GATHER);
+
+  return chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+}
+
+int main() {
+  PhotonMap map(N_PHOTONS);
+  float pos[3], normal[3], dir[3], power[3];
+  float * points = new float[3 * N_QUERIES];
+  float * normals = new float[3 * N_QUERIES];
+  float * ref = new float[3 * N_QUERIES];
+  float * cmp = new float[3 * N_QUERIES];
+  double t_ref, t_cmp, err, max_err = 0.0, sum_err = 0.0;
+  size_t m_ref, m_cmp;
+  int n = 0;
+
+  for (int i = 0; i < N_PHOTONS; i++) {
+    random_surface_point(pos, normal);
+    // Incoming directions point into the surface.
+    dir[0] = -normal[0] + (dist(engine) - 0.5f);
+    dir[1] = -normal[1] + (dist(engine) - 0.5f);
+    dir[2] = -normal[2] + (dist(engine) - 0.5f);
+    float len = sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+    dir[0] /= len; dir[1] /= len; dir[2] /= len;
+    power[0] = dist(engine);
+    power[1] = dist(engine);
+    power[2] = dist(engine);
+    map.store(power, pos, dir, 1.0f);
+  }
+  map.scale_photon_power(1.0f / N_PHOTONS);
+  map.balance();
+
+  for (int i = 0; i < N_QUERIES; i++)
+    random_surface_point(&points[3 * i], &normals[3 * i]);
+
+  m_ref = map.memory_usage();
+  t_ref = run_queries(map, points, normals, ref);
+
+  map.compress();
+  m_cmp = map.memory_usage();
+  t_cmp = run_queries(map, points, normals, cmp);
+
+  for (int i = 0; i < 3 * N_QUERIES; i++) {
+    if (ref[i] <= 0.0f)
+      continue;
+    err = fabs(cmp[i] - ref[i]) / ref[i];
+    max_err = err > max_err ? err : max_err;
+    sum_err += err;
+    n++;
+  }
+
+  cout << fixed << setprecision(3);
+  cout << N_PHOTONS << " photons, " << N_QUERIES << " queries of " << N_GATHER << " photons." << endl;
+  cout << "            memory (MiB)   time (s)   us/query" << endl;
+  cout << "photons     " << setw(12) << m_ref / (1024.0 * 1024.0) << setw(11) << t_ref << setw(11) << 1e6 * t_ref / N_QUERIES << endl;
+  cout << "compact     " << setw(12) << m_cmp / (1024.0 * 1024.0) << setw(11) << t_cmp << setw(11) << 1e6 * t_cmp / N_QUERIES << endl;
+  cout << setprecision(6);
+  cout << "Irradiance relative error: mean " << (n > 0 ? sum_err / n : 0.0) << ", max " << max_err << endl;
+
+  delete[] points;
+  delete[] normals;
+  delete[] ref;
+  delete[] cmp;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+#!/bin/sh
+# Renders every scene in scenes/ with every tracer using the Sobol sampler
+# and a fixed sample count and resolution, so runs are reproducible, and
+# records the wall time, Mrays/s and peak RSS reported by --stats and the
+# RMSE against stored reference images. Run from the top of the tree,
+# usually through "make bench". Settings are taken from the environment:
+#
+#   SPP                Samples per pixel (16).
+#   SIZE               Image resolution (320x240).
+#   PHOTONS            Primary photons per light source for jensen (100000).
+#   TRACERS            Tracers to run ("whitted monte_carlo jensen").
+#   SCENES             Directory of scene files (scenes).
+#   OUT                Directory for images, stats and results (bench_results).
+#   REFERENCES         Directory of reference images (Benchmarks/references).
+#   BASELINE           results.csv of an earlier run to compare against.
+#   TOLERANCE          Slowdown in percent reported as a regression (10).
+#   RMSE_TOLERANCE     RMSE increase reported as a regression (0.5).
+#   UPDATE_REFERENCES  If not empty, the renders become the references.
+#
+# Results are written to OUT/results.csv and OUT/results.json. The exit
+# status is 1 if a render failed or a regression was found.
+
+SPP=${SPP:-16}
+SIZE=${SIZE:-320x240}
+PHOTONS=${PHOTONS:-100000}
+TRACERS=${TRACERS:-"whitted monte_carlo jensen"}
+SCENES=${SCENES:-scenes}
+OUT=${OUT:-bench_results}
+REFERENCES=${REFERENCES:-Benchmarks/references}
+TOLERANCE=${TOLERANCE:-10}
+RMSE_TOLERANCE=${RMSE_TOLERANCE:-0.5}
+RAY=./ray
+RMSE=Benchmarks/image_rmse
+
+# Number after "key": on the first line holding it.
+json_value() {
+    sed -n "s/^ *\"$1\": *\([-0-9.eE+]*\).*/\1/p" "$2" | head -n 1
+}
+
+if [ ! -x "$RAY" ] || [ ! -x "$RMSE" ]; then
+    echo "Build $RAY and $RMSE first, or run \"make bench\"." >&2
+    exit 1
+fi
+
+mkdir -p "$OUT" || exit 1
+[ -n "$UPDATE_REFERENCES" ] && { mkdir -p "$REFERENCES" || exit 1; }
+
+csv="$OUT/results.csv"
+json="$OUT/results.json"
+failed=0
+
+echo "scene,tracer,status,wall_s,mrays_per_s,peak_rss_kb,rmse" > "$csv"
+
+for scene in "$SCENES"/*.json; do
+    name=$(basename "$scene" .json)
+
+    for tracer in $TRACERS; do
+	run="$OUT/${name}_$tracer"
+	ref="$REFERENCES/${name}_$tracer.png"
+	wall= mrays= rss= rmse=
+	rm -f "$run.png" "$run.stats.json"
+
+	printf '%-12s %-12s ' "$name" "$tracer"
+
+	if "$RAY" -t "$tracer" -s "$SPP" -S sobol -w "$SIZE" -p "$PHOTONS" -o "$run.png" \
+	   --stats "$run.stats.json" "$scene" > "$run.log" 2>&1 && [ -f "$run.stats.json" ]; then
+	    status=ok
+	    wall=$(json_value total "$run.stats.json")
+	    mrays=$(json_value rays_per_second "$run.stats.json" | awk '{ printf "%.3f", $1 / 1e6 }')
+	    rss=$(json_value peak_rss_kb "$run.stats.json")
+
+	    if [ -n "$UPDATE_REFERENCES" ]; then
+		cp "$run.png" "$ref"
+	    elif [ -f "$ref" ]; then
+		rmse=$("$RMSE" "$run.png" "$ref")
+	    fi
+	else
+	    status=failed
+	    failed=1
+	fi
+
+	echo "$status ${wall:--} s ${mrays:--} Mrays/s ${rss:--} KB rmse ${rmse:--}"
+	echo "$name,$tracer,$status,$wall,$mrays,$rss,$rmse" >> "$csv"
+    done
+done
+
+# The same table as a JSON array, with empty fields as null.
+awk -F, 'NR > 1 {
+    printf "%s  {\"scene\": \"%s\", \"tracer\": \"%s\", \"status\": \"%s\"", (NR > 2 ? ",\n" : "[\n"), $1, $2, $3
+    split("wall_s mrays_per_s peak_rss_kb rmse", keys, " ")
+    for (i = 1; i <= 4; i++)
+        printf ", \"%s\": %s", keys[i], ($(i + 3) == "" ? "null" : $(i + 3))
+    printf "}"
+} END { print (NR > 1 ? "\n]" : "[]") }' "$csv" > "$json"
+
+echo "Results written to $csv and $json."
+
+[ -z "$BASELINE" ] && exit $failed
+
+if [ ! -f "$BASELINE" ]; then
+    echo "Baseline $BASELINE not found." >&2
+    exit 1
+fi
+
+# Flag renders slower than the baseline by more than TOLERANCE percent or
+# further from the reference by more than RMSE_TOLERANCE.
+awk -F, -v tol="$TOLERANCE" -v rmse_tol="$RMSE_TOLERANCE" '
+FNR == 1 { next }
+NR == FNR { wall[$1 "," $2] = $4; rmse[$1 "," $2] = $7; next }
+{
+    key = $1 "," $2
+    if (!(key in wall) || wall[key] == "" || $4 == "")
+        next
+    change = 100 * ($4 - wall[key]) / wall[key]
+    flag = change > tol ? "REGRESSION" : ""
+    if (rmse[key] != "" && $7 != "" && $7 - rmse[key] > rmse_tol)
+        flag = "REGRESSION (rmse " rmse[key] " -> " $7 ")"
+    printf "%-12s %-12s %9.3f s -> %9.3f s %+7.1f%% %s\n", $1, $2, wall[key], $4, change, flag
+    if (flag != "")
+        bad = 1
+}
+END { exit bad }' "$BASELINE" "$csv" || failed=1
+
+exit $failed
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Checks that photon shards are deterministic on scenes with area lights,
+# whose projection maps are built from points sampled on the lights: the
+# image rendered from SHARDS merged shards must be the image rendered from
+# a single shard holding every photon. Run from the top of the tree,
+# usually through "make check". Settings are taken from the environment:
+#
+#   SHARDS   Number of shards to split the photons in (3).
+#   SCENES   Scene files with area lights ("scenes/scene5.json scenes/scene7.json").
+#   PHOTONS  Primary photons per light source (20000).
+#   OUT      Directory for the shards and images (shard_check).
+#
+# The exit status is 1 if a render failed or the images differ.
+
+SHARDS=${SHARDS:-3}
+SCENES=${SCENES:-"scenes/scene5.json scenes/scene7.json"}
+PHOTONS=${PHOTONS:-20000}
+OUT=${OUT:-shard_check}
+RAY=./ray
+
+if [ ! -x "$RAY" ]; then
+    echo "Build $RAY first, or run \"make check\"." >&2
+    exit 1
+fi
+
+mkdir -p "$OUT" || exit 1
+
+failed=0
+
+for scene in $SCENES; do
+    name=$(basename "$scene" .json)
+    run="$RAY -t jensen -s 4 -S sobol -w 96x72 -p $PHOTONS"
+    merge=
+    status=ok
+
+    printf '%-12s ' "$name"
+
+    k=0
+    while [ $k -lt "$SHARDS" ]; do
+	$run --photon-shard "$k/$SHARDS" -o "$OUT/$name.$k.shard" "$scene" > "$OUT/$name.log" 2>&1 || status=failed
+	merge="$merge --merge-shard $OUT/$name.$k.shard"
+	k=$((k + 1))
+    done
+
+    $run --photon-shard 0/1 -o "$OUT/$name.all.shard" "$scene" > "$OUT/$name.log" 2>&1 || status=failed
+    $run $merge -o "$OUT/$name.shards.png" "$scene" > "$OUT/$name.log" 2>&1 || status=failed
+    $run --merge-shard "$OUT/$name.all.shard" -o "$OUT/$name.all.png" "$scene" > "$OUT/$name.log" 2>&1 || status=failed
+
+    if [ $status = ok ] && ! cmp -s "$OUT/$name.shards.png" "$OUT/$name.all.png"; then
+	status="differs from a single shard"
+    fi
+    [ "$status" != ok ] && failed=1
+
+    echo "$status"
+done
+
+exit $failed
@@ -0,0 +1,447 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+
+#include <glm/glm.hpp>
+#include <json_spirit_reader.h>
+
+#include "animation.hpp"
+#include "sphere.hpp"
+#include "disk.hpp"
+#include "photon_tracer.hpp"
+#include "stats.hpp"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::ostringstream;
+using std::ifstream;
+using std::ios;
+using std::istreambuf_iterator;
+using std::thread;
+using glm::normalize;
+using glm::cross;
+using glm::length;
+using json_spirit::Error_position;
+using json_spirit::Object;
+using json_spirit::Array;
+
+#define ANSI_BOLD_YELLOW "\x1b[1;33m"
+#define ANSI_RESET_STYLE "\x1b[m"
+
+static const string FRM_KEY = "frames";
+static const string INT_KEY = "interpolation";
+static const string KEY_KEY = "keyframes";
+static const string FIG_KEY = "figures";
+static const string IDX_KEY = "figure";
+static const string TIM_KEY = "time";
+static const string EYE_KEY = "eye";
+static const string CNT_KEY = "look";
+static const string LFT_KEY = "left";
+static const string UPV_KEY = "up";
+static const string TRN_KEY = "translation";
+static const string RLL_KEY = "roll";
+static const string PTC_KEY = "pitch";
+static const string YAW_KEY = "yaw";
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+static void read_vector(const Value & val, vec3 & vec) {
+  Array a = val.get_value<Array>();
+
+  if (a.size() < 3)
+    throw SceneError("Vector value must have 3 elements.");
+
+  vec = vec3(a[0].get_value<double>(), a[1].get_value<double>(), a[2].get_value<double>());
+}
+
+// Uniform Catmull-Rom spline through p1 and p2, at t in [0, 1].
+static inline vec3 catmull_rom(const vec3 & p0, const vec3 & p1, const vec3 & p2, const vec3 & p3, const float t) {
+  const float t2 = t * t, t3 = t2 * t;
+
+  return 0.5f * ((2.0f * p1) + ((p2 - p0) * t) + (((2.0f * p0) - (5.0f * p1) + (4.0f * p2) - p3) * t2) + (((3.0f * p1) - p0 - (3.0f * p2) + p3) * t3));
+}
+
+// Keyframes [k, k + 1] around time, and where time is between them. Times
+// outside of the keyframes stay at the first or last one.
+template<class K>
+static void find_segment(const vector<K> & keys, const float time, size_t & k, float & t) {
+  for (k = 0; k + 2 < keys.size() && keys[k + 1].time < time; k++)
+    ;
+  t = glm::clamp((time - keys[k].time) / (keys[k + 1].time - keys[k].time), 0.0f, 1.0f);
+}
+
+// Value of a member of the keyframes between the keyframes k and k + 1.
+// The end keyframes are repeated to close the spline.
+template<class K>
+static vec3 interpolate(const vector<K> & keys, const size_t k, const float t, const bool linear, vec3 K::* member) {
+  if (linear)
+    return keys[k].*member + ((keys[k + 1].*member - keys[k].*member) * t);
+
+  return catmull_rom(keys[k > 0 ? k - 1 : k].*member, keys[k].*member, keys[k + 1].*member, keys[k + 2 < keys.size() ? k + 2 : k + 1].*member, t);
+}
+
+////////////////////////////////////////////
+// Camera path.
+////////////////////////////////////////////
+
+CameraPath::CameraPath(const char * file_name, const Scene * s): m_frames(0), m_linear(false) {
+  ifstream ifs(file_name, ios::in | ios::binary);
+  ostringstream oss;
+  string contents;
+  Value val;
+  Object top_level, key_obj;
+  Array keys, figures;
+  keyframe_t key;
+  bool has_eye, has_look, has_up, has_left, has_time;
+  vec3 up = s->m_cam != NULL ? s->m_cam->m_up : vec3(0.0f, 1.0f, 0.0f), left, translation;
+  float pitch, yaw, roll;
+
+  if (!ifs.is_open())
+    throw SceneError("Could not open the camera path " + string(file_name) + ".");
+  contents.assign(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+  ifs.close();
+
+  try {
+    read_or_throw(contents, val);
+  } catch (Error_position & e) {
+    oss << "Failed to parse the camera path: " << endl << "Reason: " << e.reason_ << endl << "Line: " << e.line_ << endl << "Column: " << e.column_;
+    throw SceneError(oss.str());
+  }
+
+  try {
+    top_level = val.get_value<Object>();
+    for (Object::iterator it = top_level.begin(); it != top_level.end(); it++) {
+      if ((*it).name_ == FRM_KEY)
+	m_frames = (*it).value_.get_value<int>();
+
+      else if ((*it).name_ == INT_KEY) {
+	if ((*it).value_.get_value<string>() == "linear")
+	  m_linear = true;
+	else if ((*it).value_.get_value<string>() != "catmull_rom")
+	  throw SceneError("Interpolation must be \"linear\" or \"catmull_rom\".");
+
+      } else if ((*it).name_ == KEY_KEY)
+	keys = (*it).value_.get_value<Array>();
+
+      else if ((*it).name_ == FIG_KEY)
+	figures = (*it).value_.get_value<Array>();
+
+      else
+	cerr << "Unrecognized key \"" << (*it).name_ << "\" in the camera path." << endl;
+    }
+
+    for (size_t k = 0; k < keys.size(); k++) {
+      has_eye = has_look = has_up = has_left = has_time = false;
+      pitch = yaw = roll = 0.0f;
+      translation = vec3(0.0f);
+      key_obj = keys[k].get_value<Object>();
+
+      for (Object::iterator it = key_obj.begin(); it != key_obj.end(); it++) {
+	if ((*it).name_ == TIM_KEY) {
+	  key.time = static_cast<float>((*it).value_.get_value<double>());
+	  has_time = true;
+
+	} else if ((*it).name_ == EYE_KEY) {
+	  read_vector((*it).value_, key.eye);
+	  has_eye = true;
+
+	} else if ((*it).name_ == CNT_KEY) {
+	  read_vector((*it).value_, key.look);
+	  has_look = true;
+
+	} else if ((*it).name_ == LFT_KEY) {
+	  read_vector((*it).value_, left);
+	  has_left = true;
+
+	} else if ((*it).name_ == UPV_KEY) {
+	  read_vector((*it).value_, up);
+	  has_up = true;
+
+	} else if ((*it).name_ == TRN_KEY)
+	  read_vector((*it).value_, translation);
+
+	else if ((*it).name_ == RLL_KEY)
+	  roll = static_cast<float>((*it).value_.get_value<double>());
+
+	else if ((*it).name_ == PTC_KEY)
+	  pitch = static_cast<float>((*it).value_.get_value<double>());
+
+	else if ((*it).name_ == YAW_KEY)
+	  yaw = static_cast<float>((*it).value_.get_value<double>());
+
+	else
+	  cerr << "Unrecognized key \"" << (*it).name_ << "\" in a keyframe." << endl;
+      }
+
+      if (!has_eye || !has_look)
+	throw SceneError("Every keyframe must specify an eye and look position.");
+      if (!has_up && has_left)
+	up = cross(normalize(key.look - key.eye), left);
+      if (!has_time)
+	key.time = static_cast<float>(k);
+      if (!m_keys.empty() && key.time <= m_keys.back().time)
+	throw SceneError("Keyframe times must increase.");
+
+      // Same order as the scene camera. Rotations move the look position to
+      // one unit from the eye, so they are left out when not asked for.
+      Camera cam(key.eye, key.look, up);
+      if (pitch != 0.0f)
+	cam.pitch(pitch);
+      if (yaw != 0.0f)
+	cam.yaw(yaw);
+      if (roll != 0.0f)
+	cam.roll(roll);
+      cam.translate(translation);
+      key.eye = cam.m_eye;
+      key.look = cam.m_look;
+      key.up = up = cam.m_up;
+      m_keys.push_back(key);
+    }
+
+    for (size_t f = 0; f < figures.size(); f++)
+      read_figure_path(figures[f], s);
+  } catch (SceneError & e) {
+    throw e;
+  } catch (runtime_error & r) {
+    throw SceneError("Type error in the camera path.");
+  }
+
+  if (m_keys.empty())
+    throw SceneError("The camera path has no keyframes.");
+  if (m_frames <= 0)
+    throw SceneError("The camera path must have a positive number of frames.");
+}
+
+void CameraPath::read_figure_path(const Value & v, const Scene * s) {
+  Object path_obj = v.get_value<Object>(), key_obj;
+  Array keys;
+  figure_path_t path;
+  figure_keyframe_t key;
+  bool has_figure = false, has_time;
+  int index;
+
+  for (Object::iterator it = path_obj.begin(); it != path_obj.end(); it++) {
+    if ((*it).name_ == IDX_KEY) {
+      index = (*it).value_.get_value<int>();
+      if (index < 0 || static_cast<size_t>(index) >= s->m_figures.size())
+	throw SceneError("The scene has no figure " + std::to_string(index) + ".");
+      path.figure = static_cast<size_t>(index);
+      has_figure = true;
+
+    } else if ((*it).name_ == KEY_KEY)
+      keys = (*it).value_.get_value<Array>();
+
+    else
+      cerr << "Unrecognized key \"" << (*it).name_ << "\" in a figure path." << endl;
+  }
+
+  if (!has_figure || keys.empty())
+    throw SceneError("Every figure path must have a figure and keyframes.");
+
+  // Disks are planes, so they are checked first.
+  if (dynamic_cast<const Disk *>(s->m_figures[path.figure]) != NULL)
+    path.origin = static_cast<const Disk *>(s->m_figures[path.figure])->m_point;
+  else if (dynamic_cast<const Sphere *>(s->m_figures[path.figure]) != NULL)
+    path.origin = static_cast<const Sphere *>(s->m_figures[path.figure])->m_center;
+  else
+    throw SceneError("Only spheres and disks can move, figure " + std::to_string(path.figure) + " is neither.");
+
+  for (size_t k = 0; k < keys.size(); k++) {
+    key_obj = keys[k].get_value<Object>();
+    key.translation = vec3(0.0f);
+    has_time = false;
+
+    for (Object::iterator it = key_obj.begin(); it != key_obj.end(); it++) {
+      if ((*it).name_ == TIM_KEY) {
+	key.time = static_cast<float>((*it).value_.get_value<double>());
+	has_time = true;
+
+      } else if ((*it).name_ == TRN_KEY)
+	read_vector((*it).value_, key.translation);
+
+      else
+	cerr << "Unrecognized key \"" << (*it).name_ << "\" in a figure keyframe." << endl;
+    }
+
+    if (!has_time)
+      key.time = static_cast<float>(k);
+    if (!path.keys.empty() && key.time <= path.keys.back().time)
+      throw SceneError("Keyframe times must increase.");
+    path.keys.push_back(key);
+  }
+
+  m_figures.push_back(path);
+}
+
+// Time of a frame, with the frames spread evenly over the camera keyframes.
+float CameraPath::frame_time(const int frame) const {
+  if (m_frames == 1)
+    return m_keys.front().time;
+
+  return m_keys.front().time + ((m_keys.back().time - m_keys.front().time) * static_cast<float>(frame) / static_cast<float>(m_frames - 1));
+}
+
+Camera CameraPath::camera(const int frame) const {
+  float t;
+  size_t k;
+  vec3 eye, look, up;
+
+  if (m_keys.size() == 1 || m_frames == 1)
+    return Camera(m_keys[0].eye, m_keys[0].look, m_keys[0].up);
+
+  find_segment(m_keys, frame_time(frame), k, t);
+  eye = interpolate(m_keys, k, t, m_linear, &keyframe_t::eye);
+  look = interpolate(m_keys, k, t, m_linear, &keyframe_t::look);
+  up = interpolate(m_keys, k, t, m_linear, &keyframe_t::up);
+
+  // Opposite up vectors can cancel out in between.
+  if (length(up) < 1e-4f)
+    up = t < 0.5f ? m_keys[k].up : m_keys[k + 1].up;
+
+  return Camera(eye, look, up);
+}
+
+void CameraPath::move_figures(Scene * s, const int frame, vector<Figure *> & moved) const {
+  float t;
+  size_t k;
+  vec3 position, * place;
+  Figure * f;
+
+  for (const figure_path_t & path : m_figures) {
+    if (path.keys.size() == 1)
+      position = path.origin + path.keys[0].translation;
+    else {
+      find_segment(path.keys, frame_time(frame), k, t);
+      position = path.origin + interpolate(path.keys, k, t, m_linear, &figure_keyframe_t::translation);
+    }
+
+    f = s->m_figures[path.figure];
+    place = dynamic_cast<Disk *>(f) != NULL ? &static_cast<Disk *>(f)->m_point : &static_cast<Sphere *>(f)->m_center;
+    if (*place != position) {
+      *place = position;
+      moved.push_back(f);
+    }
+  }
+}
+
+////////////////////////////////////////////
+// Animation.
+////////////////////////////////////////////
+
+string frame_file_name(const char * out_file_name, const int frame) {
+  string name, conversion;
+  size_t dot, slash, flags, width;
+  bool numbered = false;
+  char number[32];
+
+  // The name is never a printf format. The first %d, with its flags and
+  // width, and every %% are expanded here, any other % is kept as it is.
+  for (size_t i = 0; out_file_name[i] != '\0'; i++) {
+    if (out_file_name[i] != '%') {
+      name += out_file_name[i];
+      continue;
+    }
+
+    flags = strspn(out_file_name + i + 1, "-+ 0");
+    width = strspn(out_file_name + i + 1 + flags, "0123456789");
+    if (out_file_name[i + 1] == '%') {
+      name += '%';
+      i++;
+    } else if (!numbered && width <= 3 && out_file_name[i + 1 + flags + width] == 'd') {
+      conversion.assign(out_file_name + i, flags + width + 2);
+      snprintf(number, sizeof(number), conversion.c_str(), frame);
+      name += number;
+      numbered = true;
+      i += flags + width + 1;
+    } else
+      name += '%';
+  }
+
+  if (numbered)
+    return name;
+
+  dot = name.rfind('.');
+  slash = name.rfind('/');
+  snprintf(number, sizeof(number), ".%04d", frame);
+  if (dot == string::npos || (slash != string::npos && dot < slash))
+    return name + number;
+
+  return name.substr(0, dot) + number + name.substr(dot);
+}
+
+bool render_animation(Scene * s, Tracer * tracer, const CameraPath & path, const render_settings_t & rs, const bool tone_map,
+		      const char * out_file_name) {
+  Camera * scene_cam = s->m_cam;
+  PhotonTracer * p_tracer = dynamic_cast<PhotonTracer *>(tracer);
+  Framebuffer fb[2];
+  render_settings_t frame_rs = rs;
+  thread saver;
+  bool saved = true, ok = true;
+  string file_name;
+  vector<Figure *> moved;
+  size_t rebuilt;
+  double start;
+
+  cout << "Rendering " << ANSI_BOLD_YELLOW << path.frames() << ANSI_RESET_STYLE << " frames." << endl;
+  if (path.moves_figures() && p_tracer != NULL && !p_tracer->tracks_photon_paths())
+    cerr << "The photon maps were not traced here, they stay as they are while figures move." << endl;
+
+  for (int f = 0; f < path.frames(); f++) {
+    Camera cam = path.camera(f);
+
+    start = stat_time();
+    moved.clear();
+    path.move_figures(s, f, moved);
+    if (!moved.empty()) {
+      rebuilt = s->m_bvh.refit(s->m_figures);
+      cout << "Moved " << ANSI_BOLD_YELLOW << moved.size() << ANSI_RESET_STYLE << (moved.size() != 1 ? " figures" : " figure")
+	   << ", refit the BVH and rebuilt " << ANSI_BOLD_YELLOW << rebuilt << ANSI_RESET_STYLE << " of its subtrees." << endl;
+
+      if (p_tracer != NULL && p_tracer->tracks_photon_paths()) {
+	phase_begin(PHASE_PHOTON_TRACING);
+	p_tracer->update_photon_paths(s, moved);
+	phase_end(PHASE_PHOTON_TRACING);
+	phase_begin(PHASE_BALANCE);
+	p_tracer->build_photon_map();
+	phase_end(PHASE_BALANCE);
+      }
+    }
+
+    s->m_cam = &cam;
+    frame_rs.first_sample = rs.first_sample + (f * rs.samples);
+    phase_begin(PHASE_RENDER);
+    render(s, tracer, frame_rs, fb[f % 2], NULL, false);
+    phase_end(PHASE_RENDER);
+    s->m_cam = scene_cam;
+
+    // The saver of the frame before is done with the other buffer after this.
+    if (saver.joinable()) {
+      saver.join();
+      ok = ok && saved;
+    }
+
+    file_name = frame_file_name(out_file_name, f);
+    cout << "Frame " << ANSI_BOLD_YELLOW << f + 1 << ANSI_RESET_STYLE << " of " << ANSI_BOLD_YELLOW << path.frames() << ANSI_RESET_STYLE
+	 << " rendered in " << ANSI_BOLD_YELLOW << stat_time() - start << ANSI_RESET_STYLE << " seconds, saving " << file_name << "." << endl;
+
+    const Framebuffer & frame = fb[f % 2];
+    saver = thread([&frame, &rs, tone_map, file_name, &saved]() {
+	saved = save_image(frame, rs, tone_map, file_name.c_str());
+	if (!saved)
+	  cerr << "Could not write " << file_name << "." << endl;
+      });
+  }
+
+  if (saver.joinable()) {
+    saver.join();
+    ok = ok && saved;
+  }
+
+  return ok;
+}
@@ -0,0 +1,106 @@
+#pragma once
+#ifndef ANIMATION_HPP
+#define ANIMATION_HPP
+
+#include <string>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "camera.hpp"
+#include "scene.hpp"
+#include "tracer.hpp"
+#include "render.hpp"
+
+using std::string;
+using std::vector;
+using glm::vec3;
+
+/* A camera path read from a JSON file like
+ *
+ *   {
+ *     "frames": 120,
+ *     "interpolation": "catmull_rom",
+ *     "keyframes": [
+ *       {"time": 0.0, "eye": [0, 1, 5], "look": [0, 1, 0]},
+ *       {"time": 2.0, "eye": [5, 1, 0], "look": [0, 1, 0], "up": [0, 1, 0]},
+ *       ...
+ *     ]
+ *   }
+ *
+ * Keyframes take the camera keys of scene files, so "up" or "left",
+ * "translation", "pitch", "yaw" and "roll" work as there. Without "up" or
+ * "left" a keyframe keeps the up vector of the one before, or of the
+ * scene camera. Times default to the index of the keyframe. The frames
+ * are spread evenly from the first keyframe to the last, with the eye,
+ * look and up of the keyframes interpolated along a Catmull-Rom spline
+ * through them, or along straight lines with "linear".
+ *
+ * Spheres and disks of the scene, area lights included, can move too:
+ *
+ *     "figures": [
+ *       {"figure": 2, "keyframes": [{"time": 0.0, "translation": [0, 0, 0]},
+ *                                   {"time": 2.0, "translation": [1, 0, 0]}]}
+ *     ]
+ *
+ * where "figure" counts the spheres, planes, disks, instances and area
+ * lights of the scene file from 0, in the order they appear there. The
+ * translations are from the place of the figure in the scene file, along
+ * the same timeline and with the same interpolation as the camera. */
+class CameraPath {
+public:
+  // Throws SceneError if the file can not be read or is not a camera path of the scene.
+  CameraPath(const char * file_name, const Scene * s);
+
+  int frames() const { return m_frames; }
+  Camera camera(const int frame) const;
+
+  bool moves_figures() const { return !m_figures.empty(); }
+  // Puts the moving figures where they are in the frame, adding those that moved to moved.
+  void move_figures(Scene * s, const int frame, vector<Figure *> & moved) const;
+
+private:
+  typedef struct KEYFRAME {
+    float time;
+    vec3 eye;
+    vec3 look;
+    vec3 up;
+  } keyframe_t;
+
+  typedef struct FIGURE_KEYFRAME {
+    float time;
+    vec3 translation;
+  } figure_keyframe_t;
+
+  typedef struct FIGURE_PATH {
+    size_t figure;
+    // Center of spheres, point of disks, in the scene file.
+    vec3 origin;
+    vector<figure_keyframe_t> keys;
+  } figure_path_t;
+
+  int m_frames;
+  bool m_linear;
+  vector<keyframe_t> m_keys;
+  vector<figure_path_t> m_figures;
+
+  float frame_time(const int frame) const;
+  void read_figure_path(const Value & v, const Scene * s);
+};
+
+/* Output file of a frame. The first %d of the name, with printf flags
+ * and a width of up to three digits as in "frames/%04d.png", becomes the
+ * frame number, and every %% a single %. Names without a %d get the
+ * frame number before the extension, as in "output.0001.png". */
+extern string frame_file_name(const char * out_file_name, const int frame);
+
+/* Renders every frame of the path with the same scene and tracer, so the
+ * BVH, the textures and the photon maps are built once. When figures move
+ * the BVH is refit and, if the tracer tracks its photon paths, only the
+ * photons that the moves change are traced again. Each frame takes the
+ * next rs.samples samples of every pixel. The previous frame is tone
+ * mapped and saved while the next one renders. */
+extern bool render_animation(Scene * s, Tracer * tracer, const CameraPath & path, const render_settings_t & rs, const bool tone_map,
+			     const char * out_file_name);
+
+#endif
@@ -0,0 +1,35 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "brdf.hpp"
+#include "sampling.hpp"
+
+using glm::max;
+using glm::dot;
+using glm::pi;
+
+brdf_sample_t BRDF::sample(const vec3 & wo, const vec3 & n, const vec2 & u) const {
+  brdf_sample_t s;
+  Ray r(-wo, vec3(0.0f));
+  float n_dot_l;
+
+  s.wi = sample_cosine_hemisphere(u.x, u.y);
+  rotate_sample(s.wi, n);
+  n_dot_l = max(dot(n, s.wi), 0.0f);
+  s.pdf = n_dot_l / pi<float>();
+  s.f = diffuse(s.wi, n, r, vec3(0.0f), vec3(1.0f));
+
+  return s;
+}
+
+brdf_sample_t BRDF::sample_lobe(const vec3 & wo, const vec3 & n, const vec2 & u, const float shininess) const {
+  brdf_sample_t s;
+  Ray r(-wo, vec3(0.0f));
+
+  s.wi = sample_cosine_hemisphere(u.x, u.y);
+  rotate_sample(s.wi, n);
+  s.pdf = max(dot(n, s.wi), 0.0f) / pi<float>();
+  s.f = specular(s.wi, n, r, vec3(0.0f), vec3(1.0f), shininess);
+
+  return s;
+}
@@ -2,18 +2,37 @@
 #ifndef BRDF_HPP
 #define BRDF_HPP
 
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
 #include "ray.hpp"
 
+using glm::vec2;
 using glm::vec3;
 
+/* A sampled incoming direction. The reflected radiance is estimated as
+ * f * L(wi) / pdf, so f includes the cosine factor when the shading
+ * model applies one. */
+typedef struct BRDF_SAMPLE {
+  vec3 wi;
+  float pdf;
+  vec3 f;
+} brdf_sample_t;
+
 class BRDF {
 public:
   virtual ~BRDF() { }
   
   virtual vec3 diffuse(vec3 light_dir, vec3 surface_normal, Ray & incident_ray, vec3 intersection_point, vec3 light_diff_color) const = 0;
   virtual vec3 specular(vec3 light_dir, vec3 surface_normal, Ray & incident_ray, vec3 intersection_point, vec3 light_spec_color, float shininess) const = 0;
+
+  // Samples the diffuse term with a cosine-weighted distribution. wo points
+  // from the surface towards the viewer and u holds two uniform numbers.
+  virtual brdf_sample_t sample(const vec3 & wo, const vec3 & n, const vec2 & u) const;
+
+  // Samples the specular term for the given shininess. Models sample their
+  // own lobe, this default samples it with a cosine-weighted distribution.
+  virtual brdf_sample_t sample_lobe(const vec3 & wo, const vec3 & n, const vec2 & u, const float shininess) const;
 };
 
 #endif
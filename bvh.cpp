@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "bvh.hpp"
+#include "stats.hpp"
+
+using std::numeric_limits;
+using std::nth_element;
+using std::partition;
+using std::stable_sort;
+using std::sort;
+using std::pair;
+using std::make_pair;
+
+// Leaves are made of at most this many figures, and of at least this many
+// whenever the surface area heuristic finds no better split.
+static const uint32_t MAX_LEAF_SIZE = 8;
+static const uint32_t MIN_LEAF_SIZE = 2;
+static const uint32_t N_BINS = 16;
+// Past this depth nodes are split in half, which bounds the traversal stack.
+static const uint32_t MAX_SAH_DEPTH = 64;
+static const uint32_t STACK_SIZE = 128;
+// Refitting keeps subtrees until they cost this many times what they cost when built.
+static const float REBUILD_FACTOR = 1.5f;
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+static inline float half_area(const vec3 & b_min, const vec3 & b_max) {
+  vec3 e = b_max - b_min;
+
+  return (e.x * e.y) + (e.y * e.z) + (e.z * e.x);
+}
+
+static inline void grow(vec3 & b_min, vec3 & b_max, const vec3 & p_min, const vec3 & p_max) {
+  b_min = vec3(p_min.x < b_min.x ? p_min.x : b_min.x, p_min.y < b_min.y ? p_min.y : b_min.y, p_min.z < b_min.z ? p_min.z : b_min.z);
+  b_max = vec3(p_max.x > b_max.x ? p_max.x : b_max.x, p_max.y > b_max.y ? p_max.y : b_max.y, p_max.z > b_max.z ? p_max.z : b_max.z);
+}
+
+static inline void grow(vec3 & b_min, vec3 & b_max, const bvh_node_t & n) {
+  grow(b_min, b_max, vec3(n.b_min[0], n.b_min[1], n.b_min[2]), vec3(n.b_max[0], n.b_max[1], n.b_max[2]));
+}
+
+// Slab test of the ray against the box of a node, up to t_max.
+static inline bool hit_box(const bvh_node_t & n, const vec3 & o, const vec3 & inv_dir, const float t_max) {
+  float t0, t1, t_near = 0.0f, t_far = t_max;
+
+  t0 = (n.b_min[0] - o.x) * inv_dir.x;
+  t1 = (n.b_max[0] - o.x) * inv_dir.x;
+  t_near = t0 < t1 ? (t0 > t_near ? t0 : t_near) : (t1 > t_near ? t1 : t_near);
+  t_far = t0 < t1 ? (t1 < t_far ? t1 : t_far) : (t0 < t_far ? t0 : t_far);
+
+  t0 = (n.b_min[1] - o.y) * inv_dir.y;
+  t1 = (n.b_max[1] - o.y) * inv_dir.y;
+  t_near = t0 < t1 ? (t0 > t_near ? t0 : t_near) : (t1 > t_near ? t1 : t_near);
+  t_far = t0 < t1 ? (t1 < t_far ? t1 : t_far) : (t0 < t_far ? t0 : t_far);
+
+  t0 = (n.b_min[2] - o.z) * inv_dir.z;
+  t1 = (n.b_max[2] - o.z) * inv_dir.z;
+  t_near = t0 < t1 ? (t0 > t_near ? t0 : t_near) : (t1 > t_near ? t1 : t_near);
+  t_far = t0 < t1 ? (t1 < t_far ? t1 : t_far) : (t0 < t_far ? t0 : t_far);
+
+  return t_near <= t_far;
+}
+
+////////////////////////////////////////////
+// BVH.
+////////////////////////////////////////////
+
+void BVH::build(const vector<Figure *> & figures) {
+  vector<uint32_t> refs;
+  vector<vec3> b_mins(figures.size()), b_maxs(figures.size()), centroids(figures.size());
+
+  m_nodes.clear();
+  m_order.clear();
+
+  for (size_t i = 0; i < figures.size(); i++) {
+    if (figures[i]->bounding_box(b_mins[i], b_maxs[i])) {
+      refs.push_back(i);
+      centroids[i] = (b_mins[i] + b_maxs[i]) * 0.5f;
+    }
+  }
+
+  if (!refs.empty()) {
+    m_nodes.reserve(2 * refs.size());
+    build_node(refs, b_mins, b_maxs, centroids, 0, refs.size(), 0);
+    m_order = refs;
+  }
+
+  flatten(figures);
+  node_costs(m_costs);
+}
+
+// Sorts the figures of every leaf by type and copies them to the store,
+// followed by the figures without bounds.
+void BVH::flatten(const vector<Figure *> & figures) {
+  vector<uint32_t> types(figures.size());
+  vec3 b_min, b_max;
+
+  for (size_t i = 0; i < figures.size(); i++)
+    types[i] = PrimitiveStore::type_of(figures[i]);
+
+  for (size_t i = 0; i < m_nodes.size(); i++)
+    if (m_nodes[i].count > 0)
+      stable_sort(m_order.begin() + m_nodes[i].offset, m_order.begin() + m_nodes[i].offset + m_nodes[i].count, [&](const uint32_t a, const uint32_t b) {
+	  return types[a] < types[b];
+	});
+
+  m_store.clear();
+  for (size_t i = 0; i < m_order.size(); i++)
+    m_store.add(figures[m_order[i]]);
+  m_n_bounded = m_order.size();
+
+  for (size_t i = 0; i < figures.size(); i++)
+    if (!figures[i]->bounding_box(b_min, b_max))
+      m_store.add(figures[i]);
+}
+
+uint32_t BVH::build_node(vector<uint32_t> & refs, const vector<vec3> & b_mins, const vector<vec3> & b_maxs,
+			 const vector<vec3> & centroids, const uint32_t begin, const uint32_t end, const uint32_t depth) {
+  const uint32_t index = m_nodes.size();
+  const uint32_t n = end - begin;
+  const float inf = numeric_limits<float>::max();
+  vec3 b_min(inf), b_max(-inf), c_min(inf), c_max(-inf), extent;
+  vec3 bin_min[N_BINS], bin_max[N_BINS], l_min, l_max, r_min, r_max;
+  uint32_t bin_count[N_BINS], l_count, r_count, axis, best_bin, mid, second;
+  float l_area[N_BINS], best_cost, cost, scale;
+  bvh_node_t node;
+
+  for (uint32_t i = begin; i < end; i++) {
+    grow(b_min, b_max, b_mins[refs[i]], b_maxs[refs[i]]);
+    grow(c_min, c_max, centroids[refs[i]], centroids[refs[i]]);
+  }
+
+  node.b_min[0] = b_min.x; node.b_min[1] = b_min.y; node.b_min[2] = b_min.z;
+  node.b_max[0] = b_max.x; node.b_max[1] = b_max.y; node.b_max[2] = b_max.z;
+  node.offset = begin;
+  node.count = n;
+  node.axis = 0;
+  m_nodes.push_back(node);
+
+  if (n <= MIN_LEAF_SIZE)
+    return index;
+
+  extent = c_max - c_min;
+  axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+  mid = begin;
+
+  if (extent[axis] > 0.0f && depth < MAX_SAH_DEPTH) {
+    // Bin the centroids along the widest axis and sweep the bins to find the
+    // split with the lowest surface area heuristic cost.
+    scale = N_BINS / extent[axis];
+    for (uint32_t b = 0; b < N_BINS; b++) {
+      bin_count[b] = 0;
+      bin_min[b] = vec3(inf);
+      bin_max[b] = vec3(-inf);
+    }
+
+    for (uint32_t i = begin; i < end; i++) {
+      uint32_t b = std::min(static_cast<uint32_t>((centroids[refs[i]][axis] - c_min[axis]) * scale), N_BINS - 1);
+      bin_count[b]++;
+      grow(bin_min[b], bin_max[b], b_mins[refs[i]], b_maxs[refs[i]]);
+    }
+
+    l_min = vec3(inf);
+    l_max = vec3(-inf);
+    for (uint32_t b = 0; b < N_BINS - 1; b++) {
+      grow(l_min, l_max, bin_min[b], bin_max[b]);
+      l_area[b] = half_area(l_min, l_max);
+    }
+
+    best_cost = inf;
+    best_bin = 0;
+    r_min = vec3(inf);
+    r_max = vec3(-inf);
+    r_count = 0;
+    l_count = n;
+    for (uint32_t b = N_BINS - 1; b > 0; b--) {
+      grow(r_min, r_max, bin_min[b], bin_max[b]);
+      r_count += bin_count[b];
+      l_count -= bin_count[b];
+      if (l_count == 0 || r_count == 0)
+	continue;
+      cost = (l_count * l_area[b - 1]) + (r_count * half_area(r_min, r_max));
+      if (cost < best_cost) {
+	best_cost = cost;
+	best_bin = b - 1;
+      }
+    }
+
+    // Splitting must be cheaper than intersecting every figure in a leaf.
+    if (n <= MAX_LEAF_SIZE && best_cost >= n * half_area(b_min, b_max))
+      return index;
+
+    if (best_cost < inf)
+      mid = partition(refs.begin() + begin, refs.begin() + end, [&](const uint32_t r) {
+	  return std::min(static_cast<uint32_t>((centroids[r][axis] - c_min[axis]) * scale), N_BINS - 1) <= best_bin;
+	}) - refs.begin();
+  } else if (n <= MAX_LEAF_SIZE)
+    return index;
+
+  // Split in half when the heuristic can not separate the figures.
+  if (mid == begin || mid == end) {
+    mid = begin + (n / 2);
+    nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end, [&](const uint32_t a, const uint32_t b) {
+	return centroids[a][axis] < centroids[b][axis];
+      });
+  }
+
+  build_node(refs, b_mins, b_maxs, centroids, begin, mid, depth + 1);
+  second = build_node(refs, b_mins, b_maxs, centroids, mid, end, depth + 1);
+
+  m_nodes[index].offset = second;
+  m_nodes[index].count = 0;
+  m_nodes[index].axis = axis;
+
+  return index;
+}
+
+bool BVH::assign(const vector<Figure *> & figures, const bvh_node_t * nodes, const size_t n_nodes, const uint32_t * order, const size_t n_order) {
+  vec3 b_min, b_max;
+  size_t n_unbounded = 0;
+
+  m_nodes.clear();
+  m_order.clear();
+  m_costs.clear();
+  m_store.clear();
+  m_n_bounded = 0;
+
+  for (size_t i = 0; i < figures.size(); i++)
+    if (!figures[i]->bounding_box(b_min, b_max))
+      n_unbounded++;
+
+  if (figures.size() - n_unbounded != n_order || (n_order == 0) != (n_nodes == 0))
+    return false;
+
+  // Every child must come after its parent and every leaf must be in range.
+  for (size_t i = 0; i < n_nodes; i++) {
+    if ((nodes[i].count == 0 && (i + 1 >= n_nodes || nodes[i].offset <= i || nodes[i].offset >= n_nodes)) ||
+	(nodes[i].count > 0 && static_cast<size_t>(nodes[i].offset) + nodes[i].count > n_order))
+      return false;
+  }
+
+  for (size_t i = 0; i < n_order; i++)
+    if (order[i] >= figures.size() || !figures[order[i]]->bounding_box(b_min, b_max))
+      return false;
+
+  m_nodes.assign(nodes, nodes + n_nodes);
+  m_order.assign(order, order + n_order);
+  flatten(figures);
+  node_costs(m_costs);
+
+  return true;
+}
+
+size_t BVH::refit(const vector<Figure *> & figures) {
+  const float inf = numeric_limits<float>::max();
+  vector<vec3> b_mins(figures.size()), b_maxs(figures.size()), centroids(figures.size());
+  vector<pair<uint32_t, uint32_t> > stack, rebuilt;
+  vector<float> costs;
+  vec3 b_min, b_max;
+  uint32_t node, depth;
+
+  for (size_t i = 0; i < figures.size(); i++)
+    if (figures[i]->bounding_box(b_mins[i], b_maxs[i]))
+      centroids[i] = (b_mins[i] + b_maxs[i]) * 0.5f;
+
+  // Children come after their parents, so going backwards refits them first.
+  for (size_t i = m_nodes.size(); i-- > 0; ) {
+    bvh_node_t & n = m_nodes[i];
+
+    b_min = vec3(inf);
+    b_max = vec3(-inf);
+    if (n.count > 0) {
+      for (uint32_t k = n.offset; k < n.offset + n.count; k++)
+	grow(b_min, b_max, b_mins[m_order[k]], b_maxs[m_order[k]]);
+    } else {
+      grow(b_min, b_max, m_nodes[i + 1]);
+      grow(b_min, b_max, m_nodes[n.offset]);
+    }
+
+    n.b_min[0] = b_min.x; n.b_min[1] = b_min.y; n.b_min[2] = b_min.z;
+    n.b_max[0] = b_max.x; n.b_max[1] = b_max.y; n.b_max[2] = b_max.z;
+  }
+
+  // Find the topmost subtrees that got too expensive. Leaves always cost
+  // their number of figures, so only inner nodes are rebuilt.
+  node_costs(costs);
+  if (!m_nodes.empty())
+    stack.push_back(make_pair(0u, 0u));
+  while (!stack.empty()) {
+    node = stack.back().first;
+    depth = stack.back().second;
+    stack.pop_back();
+
+    if (m_nodes[node].count > 0)
+      continue;
+    if (costs[node] > REBUILD_FACTOR * m_costs[node])
+      rebuilt.push_back(make_pair(node, depth));
+    else {
+      stack.push_back(make_pair(m_nodes[node].offset, depth + 1));
+      stack.push_back(make_pair(node + 1, depth + 1));
+    }
+  }
+
+  if (rebuilt.empty()) {
+    for (size_t i = 0; i < m_store.size(); i++)
+      m_store.update(i);
+    return 0;
+  }
+
+  // From the last subtree back, so that rebuilding one never moves the nodes of the next.
+  sort(rebuilt.begin(), rebuilt.end());
+  for (size_t i = rebuilt.size(); i-- > 0; )
+    rebuild_node(b_mins, b_maxs, centroids, rebuilt[i].first, rebuilt[i].second);
+
+  node_costs(costs);
+  for (size_t i = 0; i < m_nodes.size(); i++)
+    if (m_costs[i] < 0.0f)
+      m_costs[i] = costs[i];
+  flatten(figures);
+
+  return rebuilt.size();
+}
+
+// Builds the subtree of node again in the same place of the node array.
+// Its nodes are contiguous and its leaves hold a contiguous range of the
+// figures, so the nodes after it only move by the difference in size.
+void BVH::rebuild_node(const vector<vec3> & b_mins, const vector<vec3> & b_maxs, const vector<vec3> & centroids, const uint32_t node,
+		       const uint32_t depth) {
+  uint32_t first = node, last = node, end, begin_ref, end_ref;
+  vector<bvh_node_t> tail;
+  vector<float> tail_costs;
+  int64_t shift;
+
+  while (m_nodes[first].count == 0)
+    first++;
+  while (m_nodes[last].count == 0)
+    last = m_nodes[last].offset;
+  end = last + 1;
+  begin_ref = m_nodes[first].offset;
+  end_ref = m_nodes[last].offset + m_nodes[last].count;
+
+  tail.assign(m_nodes.begin() + end, m_nodes.end());
+  tail_costs.assign(m_costs.begin() + end, m_costs.end());
+  m_nodes.resize(node);
+  build_node(m_order, b_mins, b_maxs, centroids, begin_ref, end_ref, depth);
+  shift = static_cast<int64_t>(m_nodes.size()) - end;
+
+  // New nodes get their costs once the whole tree is rebuilt.
+  m_costs.resize(node);
+  m_costs.resize(m_nodes.size(), -1.0f);
+
+  for (uint32_t i = 0; i < node; i++)
+    if (m_nodes[i].count == 0 && m_nodes[i].offset >= end)
+      m_nodes[i].offset += shift;
+  for (bvh_node_t & n : tail) {
+    if (n.count == 0)
+      n.offset += shift;
+    m_nodes.push_back(n);
+  }
+  m_costs.insert(m_costs.end(), tail_costs.begin(), tail_costs.end());
+}
+
+/* Cost of every subtree by the surface area heuristic, relative to the
+ * area of its root: the number of boxes and figures that a ray through
+ * the box of the root is expected to test. */
+void BVH::node_costs(vector<float> & costs) const {
+  vector<float> sah(m_nodes.size());
+  float area;
+
+  costs.resize(m_nodes.size());
+  for (size_t i = m_nodes.size(); i-- > 0; ) {
+    const bvh_node_t & n = m_nodes[i];
+
+    area = std::max(half_area(vec3(n.b_min[0], n.b_min[1], n.b_min[2]), vec3(n.b_max[0], n.b_max[1], n.b_max[2])), numeric_limits<float>::min());
+    sah[i] = n.count > 0 ? area * n.count : area + sah[i + 1] + sah[n.offset];
+    costs[i] = sah[i] / area;
+  }
+}
+
+Figure * BVH::intersect(Ray & r, float & t, const Figure * ignore) const {
+  uint32_t stack[STACK_SIZE], sp = 0, node = 0, n_boxes = 0;
+  const vec3 inv_dir = 1.0f / r.m_direction;
+  Figure * hit, * f;
+
+  t = numeric_limits<float>::max();
+  hit = m_store.intersect(r, m_n_bounded, m_store.size(), t, ignore);
+
+  if (m_nodes.empty())
+    return hit;
+
+  while (true) {
+    const bvh_node_t & n = m_nodes[node];
+
+    n_boxes++;
+    if (hit_box(n, r.m_origin, inv_dir, t)) {
+      if (n.count > 0) {
+	if ((f = m_store.intersect(r, n.offset, n.offset + n.count, t, ignore)) != NULL)
+	  hit = f;
+      } else {
+	// Visit the child closest to the ray origin first.
+	if (inv_dir[n.axis] < 0.0f) {
+	  stack[sp++] = node + 1;
+	  node = n.offset;
+	} else {
+	  stack[sp++] = n.offset;
+	  node = node + 1;
+	}
+	continue;
+      }
+    }
+
+    if (sp == 0)
+      break;
+    node = stack[--sp];
+  }
+
+  stat_add(STAT_BOX_TESTS, n_boxes);
+
+  return hit;
+}
+
+bool BVH::occluded(Ray & r, const float max_t, const Figure * ignore) const {
+  uint32_t stack[STACK_SIZE], sp = 0, node = 0, n_boxes = 0;
+  const vec3 inv_dir = 1.0f / r.m_direction;
+
+  if (m_store.occluded(r, m_n_bounded, m_store.size(), max_t, ignore))
+    return true;
+
+  if (m_nodes.empty())
+    return false;
+
+  while (true) {
+    const bvh_node_t & n = m_nodes[node];
+
+    n_boxes++;
+    if (hit_box(n, r.m_origin, inv_dir, max_t)) {
+      if (n.count > 0) {
+	if (m_store.occluded(r, n.offset, n.offset + n.count, max_t, ignore)) {
+	  stat_add(STAT_BOX_TESTS, n_boxes);
+	  return true;
+	}
+      } else {
+	stack[sp++] = n.offset;
+	node = node + 1;
+	continue;
+      }
+    }
+
+    if (sp == 0)
+      break;
+    node = stack[--sp];
+  }
+
+  stat_add(STAT_BOX_TESTS, n_boxes);
+
+  return false;
+}
+
+bool BVH::bounding_box(vec3 & b_min, vec3 & b_max) const {
+  if (m_nodes.empty() || m_store.size() > m_n_bounded)
+    return false;
+
+  b_min = vec3(m_nodes[0].b_min[0], m_nodes[0].b_min[1], m_nodes[0].b_min[2]);
+  b_max = vec3(m_nodes[0].b_max[0], m_nodes[0].b_max[1], m_nodes[0].b_max[2]);
+
+  return true;
+}
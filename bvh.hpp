@@ -0,0 +1,82 @@
+#pragma once
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "ray.hpp"
+#include "figure.hpp"
+#include "primitive_store.hpp"
+
+using std::vector;
+using glm::vec3;
+
+/* Node of a bounding volume hierarchy, 32 bytes. The first child of an
+ * inner node follows it in the node array and offset is the index of the
+ * second one. Leaves hold count figures starting at offset. */
+typedef struct BVH_NODE {
+  float b_min[3];
+  uint32_t offset;
+  float b_max[3];
+  uint16_t count;
+  uint16_t axis;
+} bvh_node_t;
+
+/* Bounding volume hierarchy over a set of figures, stored as a flat array
+ * of nodes in depth first order and built with the binned surface area
+ * heuristic. Figures without a bounding box, like planes, are kept aside
+ * and tested against every ray. The geometry of the figures is copied to a
+ * primitive store in leaf order, with the figures of every leaf sorted by
+ * type. The figures are not owned by the tree. */
+class BVH {
+public:
+  BVH(): m_n_bounded(0) { }
+  ~BVH() { }
+
+  void build(const vector<Figure *> & figures);
+
+  /* Uses a tree built earlier over the same figures, as returned by nodes()
+   * and order(). Returns false, leaving the tree empty, if the tree does
+   * not fit the figures. */
+  bool assign(const vector<Figure *> & figures, const bvh_node_t * nodes, const size_t n_nodes, const uint32_t * order, const size_t n_order);
+
+  /* Updates the tree after some of the figures given to build() moved,
+   * keeping its topology. The boxes are refit bottom up and the geometry
+   * in the store is copied again. Subtrees that the moves made much more
+   * expensive to traverse than when they were built, by the surface area
+   * heuristic, are built again in place. Returns how many were. */
+  size_t refit(const vector<Figure *> & figures);
+
+  // Closest figure hit by r, or NULL. The ignored figure is never hit.
+  Figure * intersect(Ray & r, float & t, const Figure * ignore = NULL) const;
+  // Whether any figure is hit by r closer than max_t.
+  bool occluded(Ray & r, const float max_t, const Figure * ignore = NULL) const;
+
+  // Returns false if some figure is unbounded or there are no figures.
+  bool bounding_box(vec3 & b_min, vec3 & b_max) const;
+
+  const vector<bvh_node_t> & nodes() const { return m_nodes; }
+  // Index in the figures given to build() of every figure in leaf order.
+  const vector<uint32_t> & order() const { return m_order; }
+
+private:
+  void flatten(const vector<Figure *> & figures);
+  uint32_t build_node(vector<uint32_t> & refs, const vector<vec3> & b_mins, const vector<vec3> & b_maxs,
+		      const vector<vec3> & centroids, const uint32_t begin, const uint32_t end, const uint32_t depth);
+  void rebuild_node(const vector<vec3> & b_mins, const vector<vec3> & b_maxs, const vector<vec3> & centroids, const uint32_t node,
+		    const uint32_t depth);
+  void node_costs(vector<float> & costs) const;
+
+  vector<bvh_node_t> m_nodes;
+  vector<uint32_t> m_order;
+  // Cost of every node when it was built, see node_costs().
+  vector<float> m_costs;
+  // Slots of the bounded figures in leaf order, then of the unbounded ones.
+  PrimitiveStore m_store;
+  uint32_t m_n_bounded;
+};
+
+#endif
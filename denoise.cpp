@@ -0,0 +1,104 @@
+#include <cmath>
+#include <utility>
+
+#include <glm/glm.hpp>
+
+#include "denoise.hpp"
+
+using std::swap;
+using glm::dot;
+using glm::abs;
+
+// B3 spline kernel, the 5 taps of every row and column.
+static const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+// Gaussian kernel for the variances, the 3 taps of every row and column.
+static const float BLUR[3] = { 1.0f / 4.0f, 1.0f / 2.0f, 1.0f / 4.0f };
+
+/* Edge stopping constants. A tap gets a weight of 1/e when its luminance
+ * differs in PHI_COLOR standard deviations of the noise of the pixel,
+ * when its normal or albedo differ in squared distance by PHI_NORMAL or
+ * PHI_ALBEDO, or when its depth differs in PHI_DEPTH of the depth of the
+ * pixel for every pixel between them. */
+static const float PHI_COLOR = 4.0f;
+static const float PHI_NORMAL = 0.1f;
+static const float PHI_ALBEDO = 0.01f;
+static const float PHI_DEPTH = 0.05f;
+static const float EPSILON = 1e-6f;
+
+static inline float distance2(const vec3 & a, const vec3 & b) {
+  vec3 d = a - b;
+
+  return dot(d, d);
+}
+
+// One pass with taps step pixels apart, from the colors and variances in c and v to c_out and v_out.
+static void filter_pass(const Framebuffer & fb, const int step, const vector<vec3> & c, const vector<float> & v,
+			vector<vec3> & c_out, vector<float> & v_out) {
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < fb.m_h; i++) {
+    for (int j = 0; j < fb.m_w; j++) {
+      size_t p = (static_cast<size_t>(i) * fb.m_w) + j, q;
+      float l_p, v_p, sigma, z_scale, h, w, e, sum_w = 0.0f, sum_v = 0.0f;
+      vec3 sum_c(0.0f);
+
+      // The variance of a few samples is noisy itself, so the noise is measured over the 3x3 pixels around.
+      v_p = 0.0f;
+      for (int y = -1; y <= 1; y++) {
+	for (int x = -1; x <= 1; x++) {
+	  q = (static_cast<size_t>(glm::clamp(i + y, 0, fb.m_h - 1)) * fb.m_w) + glm::clamp(j + x, 0, fb.m_w - 1);
+	  v_p += BLUR[y + 1] * BLUR[x + 1] * v[q];
+	}
+      }
+
+      if (v_p <= 0.0f) {
+	c_out[p] = c[p];
+	v_out[p] = v[p];
+	continue;
+      }
+
+      l_p = luminance(c[p]);
+      sigma = (PHI_COLOR * std::sqrt(v_p)) + EPSILON;
+      z_scale = (PHI_DEPTH * step * fb.m_depths[p]) + EPSILON;
+
+      for (int y = -2; y <= 2; y++) {
+	if (i + (y * step) < 0 || i + (y * step) >= fb.m_h)
+	  continue;
+	for (int x = -2; x <= 2; x++) {
+	  if (j + (x * step) < 0 || j + (x * step) >= fb.m_w)
+	    continue;
+	  q = (static_cast<size_t>(i + (y * step)) * fb.m_w) + (j + (x * step));
+	  h = KERNEL[y + 2] * KERNEL[x + 2];
+
+	  // The edge stopping functions are all exponentials, so their product takes a single one.
+	  e = (abs(l_p - luminance(c[q])) / sigma) +
+	    (distance2(fb.m_normals[p], fb.m_normals[q]) / PHI_NORMAL) +
+	    (distance2(fb.m_albedos[p], fb.m_albedos[q]) / PHI_ALBEDO) +
+	    (abs(fb.m_depths[p] - fb.m_depths[q]) / z_scale);
+	  w = h * std::exp(-e);
+
+	  sum_c += w * c[q];
+	  sum_w += w;
+	  sum_v += w * w * v[q];
+	}
+      }
+
+      // The center tap always has a weight of at least KERNEL[2]^2.
+      c_out[p] = sum_c / sum_w;
+      v_out[p] = sum_v / (sum_w * sum_w);
+    }
+  }
+}
+
+void denoise(const Framebuffer & fb, const int passes, Framebuffer & out) {
+  vector<vec3> c(fb.m_pixels), c_out(fb.m_pixels.size());
+  vector<float> v(fb.m_variances), v_out(fb.m_variances.size());
+
+  for (int k = 0; k < passes; k++) {
+    filter_pass(fb, 1 << k, c, v, c_out, v_out);
+    swap(c, c_out);
+    swap(v, v_out);
+  }
+
+  out.resize(fb.m_w, fb.m_h);
+  out.m_pixels.swap(c);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef DENOISE_HPP
+#define DENOISE_HPP
+
+#include <glm/glm.hpp>
+
+#include "render.hpp"
+
+// Taps of the last of the most passes are 512 pixels apart.
+#define MAX_DENOISE_PASSES 10
+
+// Rec. 709 luminance, what the denoiser measures noise in.
+inline float luminance(const vec3 & c) {
+  return glm::dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+/* Edge-avoiding a-trous wavelet filter, after Dammertz et al. 2010 and
+ * the variance guided weights of Schied et al. 2017. Every pass blurs
+ * the image with a 5x5 B3 spline kernel whose taps are 2^pass pixels
+ * apart, so a few passes reach far for the cost of 25 taps each. Taps are
+ * weighted down across edges of the first hit albedo, normal and depth
+ * kept by the render, and across color differences larger than the
+ * noise of the pixel, estimated from the variance of its samples and
+ * filtered along with the colors. Pixels without noise, like those of a
+ * single sample, are left alone. fb must have its first hits, see
+ * Framebuffer::has_aovs(). The filtered pixels go to out. */
+extern void denoise(const Framebuffer & fb, const int passes, Framebuffer & out);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "disk.hpp"
 #include "sampling.hpp"
+#include "sampler.hpp"
 
 using glm::vec2;
 using glm::cos;
@@ -26,9 +27,19 @@ bool Disk::intersect(Ray & r, float & t) const {
    return false;
 }
 
+bool Disk::bounding_box(vec3 & b_min, vec3 & b_max) const {
+  // Extent of the disk along each axis is the radius times the sine of the
+  // angle between the axis and the normal.
+  vec3 e = m_radius * glm::sqrt(glm::max(vec3(0.0f), vec3(1.0f) - (m_normal * m_normal)));
+
+  b_min = m_point - e;
+  b_max = m_point + e;
+  return true;
+}
+
 vec3 Disk::sample_at_surface() const {
-  float theta = random01() * pi2;
-  float r = random01() * m_radius;
+  float theta = next_sample() * pi2;
+  float r = next_sample() * m_radius;
   vec3 nt, nb;
   create_coords_system(m_normal, nt, nb);
   float x = m_point.x + (r * cos(theta) * nt.x) + (r * sin(theta) * nb.x);
@@ -34,6 +34,7 @@ public:
 
   virtual bool intersect(Ray & r, float & t) const;
   virtual vec3 sample_at_surface() const;
+  virtual bool bounding_box(vec3 & b_min, vec3 & b_max) const;
 
 protected:
   virtual void calculate_inv_area();
@@ -0,0 +1,373 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "distributed.hpp"
+#include "net.hpp"
+#include "sampler.hpp"
+#include "stats.hpp"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::ostringstream;
+using std::min;
+
+#define ANSI_BOLD_YELLOW "\x1b[1;33m"
+#define ANSI_RESET_STYLE "\x1b[m"
+
+static const int TILE_SIZE = 64;
+static const size_t MAX_LINE = 4096;
+// Leases of the same tile at once, counting the first one.
+static const int MAX_LEASES = 2;
+// A tile is slow when it takes this many times the mean tile time.
+static const double SLOW_TILE = 3.0;
+
+typedef enum TILE_STATES { PENDING, LEASED, FINISHED } tile_state_t;
+
+typedef struct TILE_LEASE {
+  tile_t tile;
+  tile_state_t state;
+  int leases;
+  double leased_at;
+} tile_lease_t;
+
+typedef struct WORKER {
+  int fd;
+  string buffer;
+  bool ready;
+  // Tile leased to the worker, or -1.
+  int tile;
+  // Tile of the pixels being read, or -1 while reading a line.
+  int result;
+  size_t result_size;
+} worker_t;
+
+////////////////////////////////////////////
+// Coordinator.
+////////////////////////////////////////////
+
+static void release_tile(vector<tile_lease_t> & tiles, worker_t & w) {
+  if (w.tile < 0)
+    return;
+
+  tile_lease_t & t = tiles[w.tile];
+  t.leases--;
+  if (t.state == LEASED && t.leases == 0)
+    t.state = PENDING;
+  w.tile = -1;
+}
+
+// Next tile for an idle worker, or -1 if there is nothing worth leasing.
+static int next_tile(const vector<tile_lease_t> & tiles, const double now, const double mean_time) {
+  int slowest = -1;
+
+  for (size_t i = 0; i < tiles.size(); i++) {
+    if (tiles[i].state == PENDING)
+      return static_cast<int>(i);
+    if (tiles[i].state == LEASED && tiles[i].leases < MAX_LEASES && (slowest < 0 || tiles[i].leased_at < tiles[slowest].leased_at))
+      slowest = static_cast<int>(i);
+  }
+
+  // Lease the oldest tile again, if it is late.
+  if (slowest >= 0 && mean_time > 0.0 && now - tiles[slowest].leased_at > SLOW_TILE * mean_time)
+    return slowest;
+
+  return -1;
+}
+
+// Handles what a worker sent. Returns false if the worker must be dropped.
+static bool read_worker(worker_t & w, vector<tile_lease_t> & tiles, Framebuffer & fb, int & finished, double & total_time) {
+  vector<vec3> pixels;
+  string line;
+  int id, y;
+  size_t n, tw;
+
+  for (;;) {
+    if (w.result < 0) {
+      if (!take_line(w.buffer, line))
+	return w.buffer.size() <= MAX_LINE;
+
+      if (line == "READY") {
+	w.ready = true;
+      } else if (sscanf(line.c_str(), "PIXELS %d %zu", &id, &n) == 2 && id == w.tile) {
+	const tile_t & t = tiles[id].tile;
+	if (n != static_cast<size_t>(t.x1 - t.x0) * (t.y1 - t.y0))
+	  return false;
+	w.result = id;
+	w.result_size = n * sizeof(vec3);
+      } else {
+	cerr << endl << "Unexpected message from a worker: " << line << endl;
+	return false;
+      }
+
+    } else {
+      if (w.buffer.size() < w.result_size)
+	return true;
+
+      tile_lease_t & t = tiles[w.result];
+      if (t.state != FINISHED) {
+	// First result wins, copies leased elsewhere are thrown away.
+	pixels.resize(w.result_size / sizeof(vec3));
+	memcpy(&pixels[0], w.buffer.data(), w.result_size);
+	tw = static_cast<size_t>(t.tile.x1 - t.tile.x0);
+	for (y = t.tile.y0; y < t.tile.y1; y++)
+	  std::copy(pixels.begin() + (y - t.tile.y0) * tw, pixels.begin() + (y - t.tile.y0 + 1) * tw, &fb.pixel(y, t.tile.x0));
+	t.state = FINISHED;
+	total_time += stat_time() - t.leased_at;
+	finished++;
+      }
+      w.buffer.erase(0, w.result_size);
+      release_tile(tiles, w);
+      w.result = -1;
+    }
+  }
+}
+
+bool run_coordinator(const int port, const tracer_t tracer, const render_settings_t & rs, const tracer_options_t & opts,
+		     const char * sampler_name, const char * out_file_name) {
+  vector<tile_lease_t> tiles;
+  vector<worker_t> workers;
+  vector<struct pollfd> fds;
+  tile_lease_t t;
+  worker_t w;
+  Framebuffer fb(rs.w, rs.h);
+  ostringstream job;
+  int listener, fd, id, finished = 0, on = 1;
+  double now, total_time = 0.0;
+  bool ok;
+
+  if ((listener = tcp_listen(port)) < 0)
+    return false;
+
+  for (int y = 0; y < rs.h; y += TILE_SIZE) {
+    for (int x = 0; x < rs.w; x += TILE_SIZE) {
+      t.tile.x0 = x;
+      t.tile.y0 = y;
+      t.tile.x1 = min(x + TILE_SIZE, rs.w);
+      t.tile.y1 = min(y + TILE_SIZE, rs.h);
+      t.state = PENDING;
+      t.leases = 0;
+      t.leased_at = 0.0;
+      tiles.push_back(t);
+    }
+  }
+
+  // Photons take their samples from their index, so the workers need a
+  // sampler to trace the same photon maps and put together a seamless image.
+  if (sampler_name == NULL && tracer == JENSEN)
+    sampler_name = "independent";
+
+  job << "JOB " << tracer_name(tracer) << " " << rs.w << " " << rs.h << " " << rs.samples << " " << rs.first_sample << " "
+      << std::setprecision(9) << rs.fov << " "
+      << opts.max_depth << " " << opts.photons << " " << (sampler_name != NULL ? sampler_name : "-");
+
+  cout << "Leasing " << ANSI_BOLD_YELLOW << tiles.size() << ANSI_RESET_STYLE << " tiles to the workers on port "
+       << ANSI_BOLD_YELLOW << port << ANSI_RESET_STYLE << "." << endl;
+
+  phase_begin(PHASE_RENDER);
+  while (finished < static_cast<int>(tiles.size())) {
+    fds.resize(workers.size() + 1);
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < workers.size(); i++) {
+      fds[i + 1].fd = workers[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+
+    // Wake up now and then to look for slow tiles.
+    if (poll(&fds[0], fds.size(), 1000) < 0) {
+      if (errno == EINTR)
+	continue;
+      cerr << "Could not wait for the workers: " << strerror(errno) << endl;
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if ((fd = accept(listener, NULL, NULL)) >= 0) {
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	w.fd = fd;
+	w.buffer.clear();
+	w.ready = false;
+	w.tile = w.result = -1;
+	w.result_size = 0;
+	if (write_line(fd, job.str()))
+	  workers.push_back(w);
+	else
+	  close(fd);
+      }
+    }
+
+    // Read the workers, dropping the ones that went away or misbehave.
+    for (size_t i = workers.size(); i-- > 0; ) {
+      if (i + 1 >= fds.size() || fds[i + 1].revents == 0)
+	continue;
+      if (!read_some(workers[i].fd, workers[i].buffer) || !read_worker(workers[i], tiles, fb, finished, total_time)) {
+	if (workers[i].tile >= 0)
+	  cout << endl << "Lost a worker, leasing tile " << ANSI_BOLD_YELLOW << workers[i].tile << ANSI_RESET_STYLE << " again." << endl;
+	release_tile(tiles, workers[i]);
+	close(workers[i].fd);
+	workers.erase(workers.begin() + i);
+      }
+    }
+
+    // Lease tiles to the idle workers.
+    now = stat_time();
+    for (size_t i = 0; i < workers.size(); i++) {
+      if (!workers[i].ready || workers[i].tile >= 0)
+	continue;
+      if ((id = next_tile(tiles, now, finished > 0 ? total_time / finished : 0.0)) < 0)
+	break;
+
+      ostringstream lease;
+      const tile_t & l = tiles[id].tile;
+      lease << "TILE " << id << " " << l.x0 << " " << l.y0 << " " << l.x1 << " " << l.y1;
+      if (!write_line(workers[i].fd, lease.str()))
+	continue;
+      if (tiles[id].state == PENDING) {
+	tiles[id].state = LEASED;
+	tiles[id].leased_at = now;
+      }
+      tiles[id].leases++;
+      workers[i].tile = id;
+    }
+
+    cout << "\r" << ANSI_BOLD_YELLOW << finished << ANSI_RESET_STYLE << " of " << ANSI_BOLD_YELLOW << tiles.size()
+	 << ANSI_RESET_STYLE << " tiles rendered by " << ANSI_BOLD_YELLOW << workers.size() << ANSI_RESET_STYLE
+	 << (workers.size() != 1 ? " workers.  " : " worker.   ") << std::flush;
+  }
+  cout << endl;
+  phase_end(PHASE_RENDER);
+
+  for (size_t i = 0; i < workers.size(); i++) {
+    write_line(workers[i].fd, "DONE");
+    close(workers[i].fd);
+  }
+  close(listener);
+
+  if (finished < static_cast<int>(tiles.size()))
+    return false;
+
+  if (tracer == MONTE_CARLO || tracer == JENSEN)
+    cout << "Saving output image." << endl;
+  if (!(ok = save_image(fb, rs, tracer != WHITTED, out_file_name)))
+    cerr << "Could not write the output image." << endl;
+
+  return ok;
+}
+
+////////////////////////////////////////////
+// Worker.
+////////////////////////////////////////////
+
+/* True if the coordinator said DONE before hanging up. It does not wait
+ * for copies of finished tiles, so a worker rendering one finds the
+ * connection gone when it sends the pixels, with DONE still unread. */
+static bool coordinator_done(const int fd, string & buffer) {
+  string line;
+
+  while (read_line(fd, buffer, line))
+    if (line == "DONE")
+      return true;
+
+  return false;
+}
+
+bool run_worker(const char * host_port, Scene * s, const tracer_options_t & opts) {
+  tracer_options_t job_opts = opts;
+  render_settings_t rs;
+  Sampler * sampler = NULL;
+  Tracer * tracer = NULL;
+  vector<vec3> pixels;
+  tile_t tile;
+  string buffer, line;
+  char tracer_str[32], sampler_name[64];
+  unsigned int depth;
+  size_t photons;
+  int fd, id, tiles = 0;
+  bool ok = false;
+
+  if ((fd = tcp_connect(host_port)) < 0)
+    return false;
+
+  if (!read_line(fd, buffer, line) ||
+      sscanf(line.c_str(), "JOB %31s %d %d %d %d %f %u %zu %63s", tracer_str, &rs.w, &rs.h, &rs.samples, &rs.first_sample, &rs.fov, &depth, &photons, sampler_name) != 9) {
+    cerr << "Expected a job from " << host_port << "." << endl;
+    close(fd);
+    return false;
+  }
+  rs.gamma = 2.2f;
+  rs.exposure = 0.0f;
+  rs.denoise = 0;
+  job_opts.max_depth = depth;
+  job_opts.photons = photons;
+
+  cout << "Rendering " << ANSI_BOLD_YELLOW << rs.w << "x" << rs.h << ANSI_RESET_STYLE << " pixels at " << ANSI_BOLD_YELLOW
+       << rs.samples << ANSI_RESET_STYLE << " samples per pixel for " << ANSI_BOLD_YELLOW << host_port << ANSI_RESET_STYLE << "." << endl;
+
+  if (strcmp(sampler_name, "-") != 0 && (sampler = create_sampler(sampler_name, static_cast<uint32_t>(rs.samples))) == NULL) {
+    cerr << "Invalid sampler: " << sampler_name << endl;
+    close(fd);
+    return false;
+  }
+  set_sampler(sampler);
+
+  if ((tracer = create_tracer(tracer_by_name(tracer_str), s, job_opts, rs)) == NULL) {
+    set_sampler(NULL);
+    delete sampler;
+    close(fd);
+    return false;
+  }
+
+  if (write_line(fd, "READY")) {
+    phase_begin(PHASE_RENDER);
+    while (read_line(fd, buffer, line)) {
+      if (line == "DONE") {
+	ok = true;
+	break;
+      }
+      if (sscanf(line.c_str(), "TILE %d %d %d %d %d", &id, &tile.x0, &tile.y0, &tile.x1, &tile.y1) != 5 ||
+	  tile.x0 < 0 || tile.y0 < 0 || tile.x1 > rs.w || tile.y1 > rs.h || tile.x0 >= tile.x1 || tile.y0 >= tile.y1) {
+	cerr << "Unexpected message from the coordinator: " << line << endl;
+	break;
+      }
+
+      render_tile(s, tracer, rs, tile, pixels);
+
+      ostringstream oss;
+      oss << "PIXELS " << id << " " << pixels.size();
+      if (!write_line(fd, oss.str()) || !write_all(fd, &pixels[0], pixels.size() * sizeof(vec3))) {
+	ok = coordinator_done(fd, buffer);
+	break;
+      }
+      cout << "\r" << ANSI_BOLD_YELLOW << ++tiles << ANSI_RESET_STYLE << " tiles rendered." << std::flush;
+    }
+    cout << endl;
+    phase_end(PHASE_RENDER);
+  }
+
+  if (!ok)
+    cerr << "Lost the coordinator." << endl;
+
+  set_sampler(NULL);
+  delete sampler;
+  delete tracer;
+  close(fd);
+
+  return ok;
+}
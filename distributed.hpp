@@ -0,0 +1,38 @@
+#pragma once
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+#include "scene.hpp"
+#include "render.hpp"
+
+/* Distributed rendering. A coordinator splits the image in tiles and
+ * leases them to the workers that connect to it over TCP, one tile at a
+ * time. Workers load the scene and create their tracer once, then render
+ * every tile they are leased with render_tile, so the assembled image is
+ * the one a single process would render with the same sampler. The
+ * protocol is line based:
+ *
+ *   coordinator: JOB tracer w h spp first_sample fov depth photons sampler
+ *   worker:      READY
+ *   coordinator: TILE id x0 y0 x1 y1   (or DONE when the image is done)
+ *   worker:      PIXELS id n           followed by n * 3 floats
+ *
+ * The sampler is "-" for plain pseudo-random numbers, which photon
+ * mapping jobs never use. The tiles of a worker that goes away are
+ * leased again, and once no tile is waiting the tiles that take much
+ * longer than usual are leased to an idle worker as well; the first
+ * result that comes back is kept. With photon mapping every worker
+ * traces its own photon maps unless they are all given the same photon
+ * files; with the sampler of the job they are the same maps. */
+
+/* Renders the image described by rs on the workers that connect to port
+ * and saves it to out_file_name. The coordinator does not load the scene. */
+extern bool run_coordinator(const int port, const tracer_t tracer, const render_settings_t & rs, const tracer_options_t & opts,
+			    const char * sampler_name, const char * out_file_name);
+
+/* Connects to the coordinator at HOST:PORT and renders the tiles it
+ * leases until the image is done. opts gives the photon map options
+ * that are not part of the job. */
+extern bool run_worker(const char * host_port, Scene * s, const tracer_options_t & opts);
+
+#endif
@@ -1,38 +1,261 @@
+#include <algorithm>
 #include <cmath>
 
+#include <FreeImage.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/constants.hpp>
 
 #include "environment.hpp"
 
-using glm::vec2;
+using std::upper_bound;
 using glm::acos;
 using glm::pi;
 
+// Texels per side of a tile, as a power of two.
+static const unsigned int TILE_LOG2 = 3;
+static const unsigned int TILE_SIZE = 1 << TILE_LOG2;
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+static void init_texture(env_texture_t & tex, const unsigned int width, const unsigned int height) {
+  unsigned int tiles_y = (height + TILE_SIZE - 1) >> TILE_LOG2;
+
+  tex.width = width;
+  tex.height = height;
+  tex.tiles_x = (width + TILE_SIZE - 1) >> TILE_LOG2;
+  tex.scale = vec2(width - 1, height - 1);
+  tex.texels.assign(tex.tiles_x * tiles_y * TILE_SIZE * TILE_SIZE * 3, 0.0f);
+}
+
+static inline size_t texel_index(const env_texture_t & tex, const unsigned int x, const unsigned int y) {
+  size_t tile = ((y >> TILE_LOG2) * tex.tiles_x) + (x >> TILE_LOG2);
+
+  return ((tile << (2 * TILE_LOG2)) + ((y & (TILE_SIZE - 1)) << TILE_LOG2) + (x & (TILE_SIZE - 1))) * 3;
+}
+
+static inline float luminance(const vec3 & c) {
+  return (0.2126f * c.r) + (0.7152f * c.g) + (0.0722f * c.b);
+}
+
+////////////////////////////////////////////
+// Environment.
+////////////////////////////////////////////
+
 vec3 Environment::get_color(Ray & r) {
+  if (m_texture.texels.empty())
+    return m_bckg_color;
+  else
+    return bilinear(m_texture, direction_to_uv(r.m_direction));
+}
+
+env_sample_t Environment::sample(const vec2 & u) const {
+  env_sample_t s;
+  unsigned int row, col;
+  const float * cdf;
+  float d, jacobian;
+  vec2 uv;
+
+  // Choose a row from the marginal distribution and a column from the
+  // conditional distribution of that row, then a point inside the cell.
+  row = upper_bound(m_marginal_cdf.begin(), m_marginal_cdf.end(), u.y) - m_marginal_cdf.begin();
+  row = std::min(std::max(row, 1u), m_rows) - 1;
+  d = m_marginal_cdf[row + 1] - m_marginal_cdf[row];
+  uv.y = (static_cast<float>(row) + (d > 0.0f ? (u.y - m_marginal_cdf[row]) / d : 0.5f)) / m_rows;
+
+  cdf = &m_conditional_cdf[row * (m_cols + 1)];
+  col = upper_bound(cdf, cdf + m_cols + 1, u.x) - cdf;
+  col = std::min(std::max(col, 1u), m_cols) - 1;
+  d = cdf[col + 1] - cdf[col];
+  uv.x = (static_cast<float>(col) + (d > 0.0f ? (u.x - cdf[col]) / d : 0.5f)) / m_cols;
+
+  s.dir = uv_to_direction(uv, jacobian);
+  s.radiance = bilinear(m_texture, uv);
+  s.pdf = jacobian > 0.0f ? m_func[(row * m_cols) + col] / (m_func_avg * jacobian) : 0.0f;
+
+  return s;
+}
+
+float Environment::pdf(const vec3 & dir) const {
+  unsigned int row, col;
+  float jacobian;
+  vec2 uv;
+
+  if (!can_sample())
+    return 0.0f;
+
+  uv = direction_to_uv(dir);
+  col = std::min(static_cast<unsigned int>(uv.x * m_cols), m_cols - 1);
+  row = std::min(static_cast<unsigned int>(uv.y * m_rows), m_rows - 1);
+  uv_to_direction(uv, jacobian);
+
+  return jacobian > 0.0f ? m_func[(row * m_cols) + col] / (m_func_avg * jacobian) : 0.0f;
+}
+
+void Environment::load_texture(const char * tex_file) {
+  FREE_IMAGE_FORMAT fif;
+  FIBITMAP * bitmap, * rgbf;
+  FIRGBF * line;
+  float * t;
+
+  fif = FreeImage_GetFIFFromFilename(tex_file);
+  bitmap = FreeImage_Load(fif, tex_file, 0);
+
+  if (bitmap == NULL)
+    return;
+
+  if (FreeImage_GetImageType(bitmap) != FIT_RGBF) {
+    rgbf = FreeImage_ConvertToRGBF(bitmap);
+    FreeImage_Unload(bitmap);
+    if ((bitmap = rgbf) == NULL)
+      return;
+  }
+
+  // Copy the bitmap into the tiled layout.
+  init_texture(m_texture, FreeImage_GetWidth(bitmap), FreeImage_GetHeight(bitmap));
+
+  for (unsigned int y = 0; y < m_texture.height; y++) {
+    line = (FIRGBF *)FreeImage_GetScanLine(bitmap, y);
+    for (unsigned int x = 0; x < m_texture.width; x++) {
+      t = &m_texture.texels[texel_index(m_texture, x, y)];
+      t[0] = line[x].red;
+      t[1] = line[x].green;
+      t[2] = line[x].blue;
+    }
+  }
+
+  FreeImage_Unload(bitmap);
+}
+
+void Environment::build_distribution() {
+  vector<float> marginal_func;
+  float jacobian, * cdf;
+  float lum;
+  vec2 uv;
+
+  m_cols = m_rows = 0;
+  m_func_avg = 0.0f;
+
+  if (m_texture.texels.empty() || m_texture.width < 2 || m_texture.height < 2)
+    return;
+
+  // Texel centers sit at the corners of the cells, so every cell is the
+  // area interpolated between four texels.
+  const env_texture_t & tex = m_texture;
+  m_cols = tex.width - 1;
+  m_rows = tex.height - 1;
+  m_func.resize(m_cols * m_rows);
+  m_conditional_cdf.resize(m_rows * (m_cols + 1));
+  m_marginal_cdf.resize(m_rows + 1);
+  marginal_func.resize(m_rows);
+
+  for (unsigned int i = 0; i < m_rows; i++) {
+    cdf = &m_conditional_cdf[i * (m_cols + 1)];
+    cdf[0] = 0.0f;
+
+    for (unsigned int j = 0; j < m_cols; j++) {
+      uv = vec2((j + 0.5f) / m_cols, (i + 0.5f) / m_rows);
+      uv_to_direction(uv, jacobian);
+      // The integral of the bilinear interpolation over the cell.
+      lum = (luminance(texel(tex, j, i)) + luminance(texel(tex, j + 1, i)) +
+	     luminance(texel(tex, j, i + 1)) + luminance(texel(tex, j + 1, i + 1))) / 4.0f;
+      m_func[(i * m_cols) + j] = glm::max(0.0f, lum) * jacobian;
+      cdf[j + 1] = cdf[j] + (m_func[(i * m_cols) + j] / m_cols);
+    }
+
+    marginal_func[i] = cdf[m_cols];
+    for (unsigned int j = 1; j <= m_cols; j++)
+      cdf[j] = marginal_func[i] > 0.0f ? cdf[j] / marginal_func[i] : static_cast<float>(j) / m_cols;
+  }
+
+  m_marginal_cdf[0] = 0.0f;
+  for (unsigned int i = 0; i < m_rows; i++)
+    m_marginal_cdf[i + 1] = m_marginal_cdf[i] + (marginal_func[i] / m_rows);
+  m_func_avg = m_marginal_cdf[m_rows];
+
+  // A black texture can not be importance sampled.
+  if (m_func_avg <= 0.0f) {
+    m_func.clear();
+    m_conditional_cdf.clear();
+    m_marginal_cdf.clear();
+    return;
+  }
+
+  for (unsigned int i = 1; i <= m_rows; i++)
+    m_marginal_cdf[i] /= m_func_avg;
+}
+
+vec2 Environment::direction_to_uv(const vec3 & dir) const {
   float _r;
   vec2 tex_coord;
-  BYTE * bits;
-  FIRGBF * pixel;
-  unsigned int pitch;
 
-  if (m_texture == NULL)
-    return m_bckg_color;
-  else {
-    if (!m_probe) {
-      tex_coord = vec2((1.0f + atan2(r.m_direction.x, -r.m_direction.z) / pi<float>()) / 2.0f, acos(r.m_direction.y) / pi<float>());
-      tex_coord = vec2(tex_coord.x, 1.0f - tex_coord.y);
-    } else {
-      _r = (1.0f / pi<float>()) * acos(r.m_direction.z) / glm::sqrt((r.m_direction.x * r.m_direction.x) + (r.m_direction.y * r.m_direction.y));
-      tex_coord = vec2(r.m_direction.x * _r, r.m_direction.y * _r);
-      tex_coord += vec2(1.0f, 1.0f);
-      tex_coord /= 2.0f;
+  if (!m_probe) {
+    tex_coord = vec2((1.0f + atan2(dir.x, -dir.z) / pi<float>()) / 2.0f, acos(dir.y) / pi<float>());
+    tex_coord = vec2(tex_coord.x, 1.0f - tex_coord.y);
+  } else {
+    _r = (1.0f / pi<float>()) * acos(dir.z) / glm::sqrt((dir.x * dir.x) + (dir.y * dir.y));
+    tex_coord = vec2(dir.x * _r, dir.y * _r);
+    tex_coord += vec2(1.0f, 1.0f);
+    tex_coord /= 2.0f;
+  }
+
+  return tex_coord;
+}
+
+/* Inverse of direction_to_uv. The jacobian is the solid angle covered by a
+ * unit of texture coordinate area at uv: 2 pi^2 sin(theta) for lat-long
+ * maps and 4 pi^2 sin(theta) / theta for angular light probes. Texture
+ * coordinates outside of the light probe circle get a jacobian of zero. */
+vec3 Environment::uv_to_direction(const vec2 & uv, float & jacobian) const {
+  float theta, phi, sin_t, s, t, rho;
+
+  if (!m_probe) {
+    theta = pi<float>() * (1.0f - uv.y);
+    phi = pi<float>() * ((2.0f * uv.x) - 1.0f);
+    sin_t = glm::sin(theta);
+    jacobian = 2.0f * pi<float>() * pi<float>() * sin_t;
+    return vec3(sin_t * glm::sin(phi), glm::cos(theta), -sin_t * glm::cos(phi));
+  } else {
+    s = (2.0f * uv.x) - 1.0f;
+    t = (2.0f * uv.y) - 1.0f;
+    rho = glm::sqrt((s * s) + (t * t));
+
+    if (rho > 1.0f) {
+      jacobian = 0.0f;
+      return vec3(0.0f, 0.0f, -1.0f);
+    } else if (rho <= 0.0f) {
+      jacobian = 4.0f * pi<float>() * pi<float>();
+      return vec3(0.0f, 0.0f, 1.0f);
     }
 
-    tex_coord *= vec2(FreeImage_GetWidth(m_texture) - 1, FreeImage_GetHeight(m_texture) - 1);
-    pitch = FreeImage_GetPitch(m_texture);
-    bits = ((BYTE *)FreeImage_GetBits(m_texture)) + (static_cast<unsigned int>(tex_coord.y) * pitch);
-    pixel = (FIRGBF *)bits;
-    return vec3(pixel[static_cast<unsigned int>(tex_coord.x)].red, pixel[static_cast<unsigned int>(tex_coord.x)].green, pixel[static_cast<unsigned int>(tex_coord.x)].blue);
+    theta = pi<float>() * rho;
+    sin_t = glm::sin(theta);
+    jacobian = 4.0f * pi<float>() * pi<float>() * sin_t / theta;
+    return vec3(s * sin_t / rho, t * sin_t / rho, glm::cos(theta));
   }
 }
+
+vec3 Environment::texel(const env_texture_t & tex, const unsigned int x, const unsigned int y) const {
+  const float * t = &tex.texels[texel_index(tex, x, y)];
+
+  return vec3(t[0], t[1], t[2]);
+}
+
+vec3 Environment::bilinear(const env_texture_t & tex, const vec2 & uv) const {
+  unsigned int x0, y0, x1, y1;
+  float x, y, fx, fy;
+
+  // Texture coordinates that are out of range or not a number are clamped.
+  x = (uv.x > 0.0f ? (uv.x < 1.0f ? uv.x : 1.0f) : 0.0f) * tex.scale.x;
+  y = (uv.y > 0.0f ? (uv.y < 1.0f ? uv.y : 1.0f) : 0.0f) * tex.scale.y;
+  x0 = static_cast<unsigned int>(x);
+  y0 = static_cast<unsigned int>(y);
+  x1 = x0 + 1 < tex.width ? x0 + 1 : x0;
+  y1 = y0 + 1 < tex.height ? y0 + 1 : y0;
+  fx = x - x0;
+  fy = y - y0;
+
+  return glm::mix(glm::mix(texel(tex, x0, y0), texel(tex, x1, y0), fx),
+		  glm::mix(texel(tex, x0, y1), texel(tex, x1, y1), fx), fy);
+}
@@ -2,36 +2,91 @@
 #ifndef ENVIRONMENT_HPP
 #define ENVIRONMENT_HPP
 
-#include <FreeImage.h>
+#include <string>
+#include <vector>
+
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
 #include "ray.hpp"
 
+using std::string;
+using std::vector;
+using glm::vec2;
 using glm::vec3;
 
+typedef struct ENV_SAMPLE {
+  vec3 dir;
+  vec3 radiance;
+  float pdf;
+} env_sample_t;
+
+/* The environment texture as packed RGB floats. The texels
+ * are stored in square tiles of eight texels per side, row by row inside
+ * every tile, so that the four texels of a bilinear lookup are
+ * almost always in the same few cache lines. */
+typedef struct ENV_TEXTURE {
+  unsigned int width;
+  unsigned int height;
+  unsigned int tiles_x;
+  // Scale from texture coordinates to texel coordinates.
+  vec2 scale;
+  vector<float> texels;
+} env_texture_t;
+
 class Environment {
 public:
-  Environment(const char * tex_file = NULL, bool light_probe = false, vec3 bckg = vec3(1.0f)): m_bckg_color(bckg), m_probe(light_probe) {
-    FREE_IMAGE_FORMAT fif;
-
-    if (tex_file != NULL) {
-      fif = FreeImage_GetFIFFromFilename(tex_file);
-      m_texture = FreeImage_Load(fif, tex_file, 0);
-    } else
-      m_texture = NULL;
-  }
+  Environment(const char * tex_file = NULL, bool light_probe = false, vec3 bckg = vec3(1.0f)):
+    m_tex_file(tex_file != NULL ? tex_file : ""),
+    m_bckg_color(bckg),
+    m_probe(light_probe)
+  {
+    if (tex_file != NULL)
+      load_texture(tex_file);
 
-  ~Environment() {
-    if (m_texture != NULL)
-      FreeImage_Unload(m_texture);
+    build_distribution();
   }
 
+  ~Environment() { }
+
+  // The parameters the environment was created with.
+  const string & texture_file() const { return m_tex_file; }
+  vec3 background_color() const { return m_bckg_color; }
+  bool light_probe() const { return m_probe; }
+
   vec3 get_color(Ray & r);
 
+  /* Importance sampling of the environment texture. Directions are drawn
+   * from a piecewise-constant distribution over the texels, proportional
+   * to their luminance times the solid angle they cover. The pdf is with
+   * respect to solid angle. Only available when can_sample() is true, a
+   * constant background is better sampled with the BRDF alone. */
+  bool can_sample() const { return !m_marginal_cdf.empty(); }
+  env_sample_t sample(const vec2 & u) const;
+  float pdf(const vec3 & dir) const;
+
 private:
+  void load_texture(const char * tex_file);
+  void build_distribution();
+  vec2 direction_to_uv(const vec3 & dir) const;
+  vec3 uv_to_direction(const vec2 & uv, float & jacobian) const;
+  vec3 texel(const env_texture_t & tex, const unsigned int x, const unsigned int y) const;
+  vec3 bilinear(const env_texture_t & tex, const vec2 & uv) const;
+
+  string m_tex_file;
   vec3 m_bckg_color;
-  FIBITMAP * m_texture;
   bool m_probe;
+
+  // Empty when there is no texture.
+  env_texture_t m_texture;
+
+  // Cells of the distribution, one between every four adjacent texels.
+  unsigned int m_cols;
+  unsigned int m_rows;
+  float m_func_avg;
+  vector<float> m_func;
+  vector<float> m_conditional_cdf;
+  vector<float> m_marginal_cdf;
 };
 
 #endif
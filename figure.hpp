@@ -29,6 +29,23 @@ public:
   virtual vec3 normal_at_int(Ray & r, float & t) const = 0;
   virtual vec3 sample_at_surface() const = 0;
 
+  // Axis aligned bounds of the figure. Returns false for unbounded figures.
+  virtual bool bounding_box(vec3 & b_min, vec3 & b_max) const {
+    return false;
+  }
+
+  /* Figure whose material shades a hit at distance t along r, along with
+   * the normal there. Figures made of other figures return the part hit. */
+  virtual Figure * shading_figure(Ray & r, float & t, vec3 & n) {
+    n = normal_at_int(r, t);
+    return this;
+  }
+
+  // Whether the figure has any reflective or refractive material.
+  virtual bool is_specular() const {
+    return m_mat->m_refract || m_mat->m_rho > 0.0f;
+  }
+
 protected:
   float m_inv_area;
 
@@ -0,0 +1,125 @@
+#include <algorithm>
+
+#include <FreeImage.h>
+#include <glm/glm.hpp>
+
+#include "heatmap.hpp"
+#include "stats.hpp"
+
+using std::nth_element;
+using glm::vec3;
+using glm::mix;
+
+static const char * METRIC_NAMES[HEAT_N_METRICS] = { "time", "rays", "tests", "photons" };
+
+// Key colors of the false color scale, evenly spaced from 0 to 1.
+static const int N_KEYS = 6;
+static const vec3 KEYS[N_KEYS] = {
+  vec3(0.0f, 0.0f, 0.0f),
+  vec3(0.2f, 0.05f, 0.5f),
+  vec3(0.65f, 0.1f, 0.55f),
+  vec3(0.95f, 0.35f, 0.15f),
+  vec3(1.0f, 0.8f, 0.1f),
+  vec3(1.0f, 1.0f, 1.0f)
+};
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+static inline vec3 false_color(float v) {
+  int k;
+
+  v = glm::clamp(v, 0.0f, 1.0f) * (N_KEYS - 1);
+  k = glm::min(static_cast<int>(v), N_KEYS - 2);
+
+  return mix(KEYS[k], KEYS[k + 1], v - k);
+}
+
+static float percentile_99(vector<float> v) {
+  vector<float>::iterator p = v.begin() + ((v.size() - 1) * 99) / 100;
+
+  nth_element(v.begin(), p, v.end());
+
+  return *p;
+}
+
+static bool save_metric(const vector<float> & values, const int w, const int h, const string & base) {
+  FIBITMAP * raw, * colors;
+  float * line, scale;
+  BYTE * bits;
+  vec3 c;
+  bool ok;
+
+  raw = FreeImage_AllocateT(FIT_FLOAT, w, h);
+  colors = FreeImage_Allocate(w, h, 24, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+  if (raw == NULL || colors == NULL) {
+    FreeImage_Unload(raw);
+    FreeImage_Unload(colors);
+    return false;
+  }
+
+  scale = percentile_99(values);
+  scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+
+  // FreeImage stores the bottom row first.
+  for (int y = 0; y < h; y++) {
+    line = (float *)FreeImage_GetScanLine(raw, y);
+    bits = FreeImage_GetScanLine(colors, y);
+    for (int x = 0; x < w; x++) {
+      line[x] = values[((h - 1 - y) * w) + x];
+      c = false_color(line[x] * scale);
+      bits[FI_RGBA_RED] = static_cast<BYTE>(c.r * 255.0f);
+      bits[FI_RGBA_GREEN] = static_cast<BYTE>(c.g * 255.0f);
+      bits[FI_RGBA_BLUE] = static_cast<BYTE>(c.b * 255.0f);
+      bits += 3;
+    }
+  }
+
+  ok = FreeImage_Save(FIF_PFM, raw, (base + ".pfm").c_str(), 0) && FreeImage_Save(FIF_PNG, colors, (base + ".png").c_str(), 0);
+  FreeImage_Unload(raw);
+  FreeImage_Unload(colors);
+
+  return ok;
+}
+
+////////////////////////////////////////////
+// Heatmap.
+////////////////////////////////////////////
+
+Heatmap::Heatmap(const int w, const int h): m_w(w), m_h(h) {
+  for (int m = 0; m < HEAT_N_METRICS; m++)
+    m_values[m].assign(static_cast<size_t>(w) * h, 0.0f);
+}
+
+void Heatmap::begin_pixel(pixel_cost_t & cost) const {
+  cost.rays = t_stats.m_counters[STAT_PRIMARY_RAYS] + t_stats.m_counters[STAT_SECONDARY_RAYS] + t_stats.m_counters[STAT_SHADOW_RAYS];
+  cost.tests = t_stats.m_counters[STAT_INTERSECTION_TESTS];
+  cost.photons = t_stats.m_counters[STAT_PHOTONS_VISITED];
+  cost.start = stat_time();
+}
+
+void Heatmap::end_pixel(const pixel_cost_t & cost, const int i, const int j) {
+  size_t p = (static_cast<size_t>(i) * m_w) + j;
+  double end = stat_time();
+
+  m_values[HEAT_TIME][p] = static_cast<float>(1e9 * (end - cost.start));
+  m_values[HEAT_RAYS][p] = static_cast<float>(t_stats.m_counters[STAT_PRIMARY_RAYS] + t_stats.m_counters[STAT_SECONDARY_RAYS] +
+					       t_stats.m_counters[STAT_SHADOW_RAYS] - cost.rays);
+  m_values[HEAT_INTERSECTION_TESTS][p] = static_cast<float>(t_stats.m_counters[STAT_INTERSECTION_TESTS] - cost.tests);
+  m_values[HEAT_PHOTONS_VISITED][p] = static_cast<float>(t_stats.m_counters[STAT_PHOTONS_VISITED] - cost.photons);
+}
+
+bool Heatmap::save(const char * out_file_name) const {
+  string base(out_file_name);
+  size_t dot = base.find_last_of('.'), slash = base.find_last_of('/');
+  bool ok = true;
+
+  if (dot != string::npos && (slash == string::npos || dot > slash))
+    base.erase(dot);
+
+  for (int m = 0; m < HEAT_N_METRICS; m++)
+    ok = save_metric(m_values[m], m_w, m_h, base + "." + METRIC_NAMES[m]) && ok;
+
+  return ok;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#ifndef HEATMAP_HPP
+#define HEATMAP_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+using std::string;
+using std::vector;
+
+typedef enum HEAT_METRIC {
+  HEAT_TIME = 0,
+  HEAT_RAYS,
+  HEAT_INTERSECTION_TESTS,
+  HEAT_PHOTONS_VISITED,
+  HEAT_N_METRICS
+} heat_metric_t;
+
+// What the calling thread had done when the work on a pixel began.
+typedef struct PIXEL_COST {
+  double start;
+  uint64_t rays;
+  uint64_t tests;
+  uint64_t photons;
+} pixel_cost_t;
+
+/* Per pixel cost of a render: wall clock nanoseconds, rays traced,
+ * ray-primitive intersection tests and photons visited by the photon map
+ * searches. The counts are the differences of the thread statistics
+ * around every pixel, so they are zero when built with -DNO_STATS. Rows
+ * are stored top to bottom, like the image in main.cpp. */
+class Heatmap {
+public:
+  Heatmap(const int w, const int h);
+
+  void begin_pixel(pixel_cost_t & cost) const;
+  void end_pixel(const pixel_cost_t & cost, const int i, const int j);
+
+  /* Saves every metric next to the output image: the raw values as a
+   * single channel float PFM and a false color PNG, scaled so that the
+   * 99th percentile is white to keep a few outliers from hiding the
+   * rest. For "out.png" the files are "out.time.pfm", "out.time.png",
+   * "out.rays.pfm" and so on. Returns false if a file can not be written. */
+  bool save(const char * out_file_name) const;
+
+private:
+  int m_w;
+  int m_h;
+  vector<float> m_values[HEAT_N_METRICS];
+};
+
+#endif
@@ -1,11 +1,14 @@
 #include "glm/glm.hpp"
+#include "glm/gtc/constants.hpp"
 
 #include "hsa_brdf.hpp"
+#include "sampling.hpp"
 
 using glm::reflect;
 using glm::pow;
 using glm::max;
 using glm::dot;
+using glm::pi;
 
 vec3 HeidrichSeidelAnisotropicBRDF::diffuse(vec3 light_dir, vec3 surface_normal, Ray & incident_ray, vec3 intersection_point, vec3 light_diff_color) const {
   vec3 T = normalize(thread_dir + (dot(-thread_dir, surface_normal) * surface_normal));
@@ -22,3 +25,19 @@ vec3 HeidrichSeidelAnisotropicBRDF::specular(vec3 light_dir, vec3 surface_normal
   float k_spec = pow(glm::sqrt(1.0f - (l_dot_t * l_dot_t)) * glm::sqrt(1.0f - (v_dot_t * v_dot_t)) - (l_dot_t * v_dot_t), shininess);
   return n_dot_l * ((light_spec_color * k_spec) + PhongBRDF::specular(light_dir, surface_normal, incident_ray, intersection_point, light_spec_color, shininess));
 }
+
+brdf_sample_t HeidrichSeidelAnisotropicBRDF::sample_lobe(const vec3 & wo, const vec3 & n, const vec2 & u, const float shininess) const {
+  brdf_sample_t s;
+  Ray r(-wo, vec3(0.0f));
+
+  if (u.x < 0.5f) {
+    s.wi = lobe_direction(wo, n, vec2(2.0f * u.x, u.y), shininess);
+  } else {
+    s.wi = sample_cosine_hemisphere((2.0f * u.x) - 1.0f, u.y);
+    rotate_sample(s.wi, n);
+  }
+  s.pdf = 0.5f * (lobe_pdf(wo, n, s.wi, shininess) + (max(dot(n, s.wi), 0.0f) / pi<float>()));
+  s.f = dot(n, s.wi) > 0.0f ? specular(s.wi, n, r, vec3(0.0f), vec3(1.0f), shininess) : vec3(0.0f);
+
+  return s;
+}
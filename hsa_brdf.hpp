@@ -18,6 +18,10 @@ public:
   
   virtual vec3 diffuse(vec3 light_dir, vec3 surface_normal, Ray & incident_ray, vec3 intersection_point, vec3 light_diff_color) const;
   virtual vec3 specular(vec3 light_dir, vec3 surface_normal, Ray & incident_ray, vec3 intersection_point, vec3 light_spec_color, float shininess) const;
+
+  /* The Phong highlight is sampled with its lobe and the anisotropic one,
+   * which spreads along the thread, with the cosine, half of the time each. */
+  virtual brdf_sample_t sample_lobe(const vec3 & wo, const vec3 & n, const vec2 & u, const float shininess) const;
 };
 
 #endif
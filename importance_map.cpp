@@ -0,0 +1,106 @@
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "importance_map.hpp"
+
+using std::max;
+using std::min;
+using glm::floor;
+
+// Upper bound on the number of cells along each axis of the grid.
+static const int MAX_RES = 128;
+
+void ImportanceMap::store(const vector<vec3> & hits) {
+  m_importons.insert(m_importons.end(), hits.begin(), hits.end());
+}
+
+void ImportanceMap::build(const float cell_size, const float min_prob) {
+  vec3 mn(1e8f), mx(-1e8f), extent;
+  vector<float> counts;
+  float mean = 0.0f;
+  int c, nonzero = 0;
+
+  m_prob.clear();
+  m_min_prob = min_prob;
+
+  if (m_importons.empty())
+    return;
+
+  for (const vec3 & p : m_importons) {
+    mn = glm::min(mn, p);
+    mx = glm::max(mx, p);
+  }
+
+  // Pad the box by one cell so that photons around the border of the
+  // visible region, which still land inside radiance estimates, are kept.
+  extent = mx - mn;
+  m_cell_size = max(cell_size, max(extent.x, max(extent.y, extent.z)) / (MAX_RES - 2));
+  m_min = mn - vec3(m_cell_size);
+  for (int i = 0; i < 3; i++)
+    m_res[i] = min(MAX_RES, static_cast<int>(extent[i] / m_cell_size) + 3);
+
+  counts.assign(m_res[0] * m_res[1] * m_res[2], 0.0f);
+  for (const vec3 & p : m_importons)
+    counts[cell_index(p)] += 1.0f;
+
+  // Radiance estimates gather photons from neighbouring cells as well.
+  m_prob.assign(counts.size(), 0.0f);
+  for (int z = 0; z < m_res[2]; z++) {
+    for (int y = 0; y < m_res[1]; y++) {
+      for (int x = 0; x < m_res[0]; x++) {
+	c = x + (m_res[0] * (y + (m_res[1] * z)));
+	if (counts[c] == 0.0f)
+	  continue;
+
+	for (int k = max(z - 1, 0); k <= min(z + 1, m_res[2] - 1); k++)
+	  for (int j = max(y - 1, 0); j <= min(y + 1, m_res[1] - 1); j++)
+	    for (int i = max(x - 1, 0); i <= min(x + 1, m_res[0] - 1); i++)
+	      m_prob[i + (m_res[0] * (j + (m_res[1] * k)))] += counts[c];
+      }
+    }
+  }
+
+  for (float p : m_prob) {
+    if (p > 0.0f) {
+      mean += p;
+      nonzero++;
+    }
+  }
+  mean /= static_cast<float>(nonzero);
+
+  // Cells at least as important as the average one keep every photon.
+  for (float & p : m_prob)
+    p = max(m_min_prob, min(1.0f, p / mean));
+}
+
+float ImportanceMap::storage_probability(const vec3 & pos) const {
+  int c;
+
+  if (m_prob.empty())
+    return 1.0f;
+
+  c = cell_index(pos);
+
+  return c < 0 ? m_min_prob : m_prob[c];
+}
+
+bool ImportanceMap::empty() const {
+  return m_prob.empty();
+}
+
+size_t ImportanceMap::size() const {
+  return m_importons.size();
+}
+
+int ImportanceMap::cell_index(const vec3 & pos) const {
+  int c[3];
+
+  for (int i = 0; i < 3; i++) {
+    c[i] = static_cast<int>(floor((pos[i] - m_min[i]) / m_cell_size));
+    if (c[i] < 0 || c[i] >= m_res[i])
+      return -1;
+  }
+
+  return c[0] + (m_res[0] * (c[1] + (m_res[1] * c[2])));
+}
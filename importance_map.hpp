@@ -0,0 +1,44 @@
+#pragma once
+#ifndef IMPORTANCE_MAP_HPP
+#define IMPORTANCE_MAP_HPP
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+using std::vector;
+using glm::vec3;
+
+/* Visual importance of the scene, estimated from the hit points of
+ * importons traced from the camera. The hit points are binned in a
+ * uniform grid over their bounding box and every cell gets the probability
+ * with which photons landing in it are kept in the photon map. */
+class ImportanceMap {
+public:
+  ImportanceMap(): m_min_prob(1.0f), m_cell_size(1.0f) { }
+
+  // Adds importon hit points. Not thread safe.
+  void store(const vector<vec3> & hits);
+
+  // Bins the stored importons. Cells never hit by an importon, nor neighbours
+  // of one, keep photons with probability min_prob.
+  void build(const float cell_size, const float min_prob);
+
+  float storage_probability(const vec3 & pos) const;
+
+  bool empty() const;
+
+  size_t size() const;
+
+private:
+  vector<vec3> m_importons;
+  vector<float> m_prob;
+  float m_min_prob;
+  float m_cell_size;
+  vec3 m_min;
+  int m_res[3];
+
+  int cell_index(const vec3 & pos) const;
+};
+
+#endif
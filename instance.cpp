@@ -0,0 +1,138 @@
+#include <limits>
+
+#include "instance.hpp"
+
+using std::numeric_limits;
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+static inline vec3 transform_point(const float * m, const vec3 & p) {
+  return vec3((m[0] * p.x) + (m[1] * p.y) + (m[2] * p.z) + m[3],
+	      (m[4] * p.x) + (m[5] * p.y) + (m[6] * p.z) + m[7],
+	      (m[8] * p.x) + (m[9] * p.y) + (m[10] * p.z) + m[11]);
+}
+
+static inline vec3 transform_vector(const float * m, const vec3 & v) {
+  return vec3((m[0] * v.x) + (m[1] * v.y) + (m[2] * v.z),
+	      (m[4] * v.x) + (m[5] * v.y) + (m[6] * v.z),
+	      (m[8] * v.x) + (m[9] * v.y) + (m[10] * v.z));
+}
+
+////////////////////////////////////////////
+// Instance.
+////////////////////////////////////////////
+
+Instance::Instance(Group * group, const mat4 & xform, Material * mat): Figure(mat), m_group(group), m_own_mat(mat != NULL) {
+  mat4 inv = glm::inverse(xform);
+
+  // glm matrices are stored by columns.
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 4; j++) {
+      m_xform[(i * 4) + j] = xform[j][i];
+      m_inv[(i * 4) + j] = inv[j][i];
+    }
+  }
+
+  calculate_inv_area();
+}
+
+mat4 Instance::transform() const {
+  mat4 xform(1.0f);
+
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 4; j++)
+      xform[j][i] = m_xform[(i * 4) + j];
+
+  return xform;
+}
+
+/* The direction is not normalized in object space, so distances along the
+ * ray are the same in both spaces. */
+Ray Instance::to_object(const Ray & r) const {
+  return Ray(transform_vector(m_inv, r.m_direction), transform_point(m_inv, r.m_origin), r.m_ref_index);
+}
+
+bool Instance::intersect(Ray & r, float & t) const {
+  Ray o_r = to_object(r);
+
+  return m_group->m_bvh.intersect(o_r, t) != NULL;
+}
+
+Figure * Instance::hit_part(Ray & r, const float t, vec3 & n) const {
+  Ray o_r = to_object(r);
+  Figure * part;
+  float _t;
+  vec3 o_n;
+
+  if ((part = m_group->m_bvh.intersect(o_r, _t)) == NULL) {
+    n = vec3(0.0f, 1.0f, 0.0f);
+    return NULL;
+  }
+
+  part = part->shading_figure(o_r, _t, o_n);
+
+  // Normals are transformed by the inverse transpose.
+  n = glm::normalize(vec3((m_inv[0] * o_n.x) + (m_inv[4] * o_n.y) + (m_inv[8] * o_n.z),
+			  (m_inv[1] * o_n.x) + (m_inv[5] * o_n.y) + (m_inv[9] * o_n.z),
+			  (m_inv[2] * o_n.x) + (m_inv[6] * o_n.y) + (m_inv[10] * o_n.z)));
+
+  return part;
+}
+
+vec3 Instance::normal_at_int(Ray & r, float & t) const {
+  vec3 n;
+
+  hit_part(r, t, n);
+
+  return n;
+}
+
+Figure * Instance::shading_figure(Ray & r, float & t, vec3 & n) {
+  Figure * part = hit_part(r, t, n);
+
+  return m_own_mat || part == NULL ? this : part;
+}
+
+bool Instance::is_specular() const {
+  if (m_own_mat)
+    return Figure::is_specular();
+
+  for (size_t i = 0; i < m_group->m_figures.size(); i++)
+    if (m_group->m_figures[i]->is_specular())
+      return true;
+
+  return false;
+}
+
+vec3 Instance::sample_at_surface() const {
+  if (m_group->m_figures.empty())
+    return transform_point(m_xform, vec3(0.0f));
+
+  return transform_point(m_xform, m_group->m_figures[0]->sample_at_surface());
+}
+
+bool Instance::bounding_box(vec3 & b_min, vec3 & b_max) const {
+  const float inf = numeric_limits<float>::max();
+  vec3 o_min, o_max, c;
+
+  if (!m_group->m_bvh.bounding_box(o_min, o_max))
+    return false;
+
+  b_min = vec3(inf);
+  b_max = vec3(-inf);
+
+  // Bounds of the transformed corners of the bounds of the group.
+  for (int i = 0; i < 8; i++) {
+    c = transform_point(m_xform, vec3(i & 1 ? o_max.x : o_min.x, i & 2 ? o_max.y : o_min.y, i & 4 ? o_max.z : o_min.z));
+    b_min = glm::min(b_min, c);
+    b_max = glm::max(b_max, c);
+  }
+
+  return true;
+}
+
+void Instance::calculate_inv_area() {
+  m_inv_area = 0.0f;
+}
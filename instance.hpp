@@ -0,0 +1,70 @@
+#pragma once
+#ifndef INSTANCE_HPP
+#define INSTANCE_HPP
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "figure.hpp"
+#include "bvh.hpp"
+
+using std::string;
+using std::vector;
+using glm::mat4;
+using glm::vec3;
+
+/* A named set of figures with its own BVH, defined once in the scene file
+ * and placed any number of times by instances. Owns its figures. */
+class Group {
+public:
+  string m_name;
+  vector<Figure *> m_figures;
+  BVH m_bvh;
+
+  Group(const string & name): m_name(name) { }
+
+  ~Group() {
+    for (size_t i = 0; i < m_figures.size(); i++)
+      delete m_figures[i];
+  }
+};
+
+/* A group placed in the scene with an affine transform. Rays are moved to
+ * the space of the group and traced through its BVH, so every instance
+ * only costs its transform. Without a material of its own an instance is
+ * shaded with the materials of the figures of the group. Instances can not
+ * be used as area lights. */
+class Instance : public Figure {
+public:
+  Instance(Group * group, const mat4 & xform, Material * mat = NULL);
+
+  virtual ~Instance() { }
+
+  virtual bool intersect(Ray & r, float & t) const;
+  virtual vec3 normal_at_int(Ray & r, float & t) const;
+  virtual vec3 sample_at_surface() const;
+  virtual bool bounding_box(vec3 & b_min, vec3 & b_max) const;
+  virtual Figure * shading_figure(Ray & r, float & t, vec3 & n);
+  virtual bool is_specular() const;
+
+  Group * group() const { return m_group; }
+  mat4 transform() const;
+  bool own_material() const { return m_own_mat; }
+
+protected:
+  virtual void calculate_inv_area();
+
+private:
+  Group * m_group;
+  // Rows of the object to world transform and of its inverse.
+  float m_xform[12];
+  float m_inv[12];
+  bool m_own_mat;
+
+  Ray to_object(const Ray & r) const;
+  Figure * hit_part(Ray & r, const float t, vec3 & n) const;
+};
+
+#endif
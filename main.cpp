@@ -1,11 +1,13 @@
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <vector>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cstdint>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <omp.h>
 #include <glm/glm.hpp>
@@ -16,9 +18,14 @@
 #include "scene.hpp"
 #include "ray.hpp"
 #include "tracer.hpp"
-#include "path_tracer.hpp"
-#include "whitted_tracer.hpp"
-#include "photon_tracer.hpp"
+#include "sampler.hpp"
+#include "stats.hpp"
+#include "heatmap.hpp"
+#include "render.hpp"
+#include "server.hpp"
+#include "distributed.hpp"
+#include "animation.hpp"
+#include "denoise.hpp"
 
 using namespace std;
 using namespace glm;
@@ -36,17 +43,49 @@ using namespace glm;
 ////////////////////////////////////////////
 static void print_usage(char ** const argv);
 static void parse_args(int argc, char ** const argv);
+static string json_escape(const char * s);
 
 ////////////////////////////////////////////
 // Constants.
 ////////////////////////////////////////////
 static const char * OUT_FILE = "output.png";
+static const int OPT_STATS = 256;
+static const int OPT_HEATMAP = 257;
+static const int OPT_TRACE = 258;
+static const int OPT_SERVE = 259;
+static const int OPT_COORDINATE = 260;
+static const int OPT_WORKER = 261;
+static const int OPT_PHOTON_SHARD = 262;
+static const int OPT_MERGE_SHARD = 263;
+static const int OPT_PUBLISH_PHOTONS = 264;
+static const int OPT_ATTACH_PHOTONS = 265;
+static const int OPT_FIRST_SAMPLE = 266;
+static const int OPT_SAVE_SUMS = 267;
+static const int OPT_MERGE_SUMS = 268;
+static const int OPT_CAMERA_PATH = 269;
+static const int OPT_DENOISE = 270;
+static const struct option LONG_OPTIONS[] = {
+  {"stats", required_argument, NULL, OPT_STATS},
+  {"heatmap", no_argument, NULL, OPT_HEATMAP},
+  {"trace", required_argument, NULL, OPT_TRACE},
+  {"serve", required_argument, NULL, OPT_SERVE},
+  {"coordinate", required_argument, NULL, OPT_COORDINATE},
+  {"worker", required_argument, NULL, OPT_WORKER},
+  {"photon-shard", required_argument, NULL, OPT_PHOTON_SHARD},
+  {"merge-shard", required_argument, NULL, OPT_MERGE_SHARD},
+  {"publish-photons", required_argument, NULL, OPT_PUBLISH_PHOTONS},
+  {"attach-photons", required_argument, NULL, OPT_ATTACH_PHOTONS},
+  {"first-sample", required_argument, NULL, OPT_FIRST_SAMPLE},
+  {"save-sums", required_argument, NULL, OPT_SAVE_SUMS},
+  {"merge-sums", required_argument, NULL, OPT_MERGE_SUMS},
+  {"camera-path", required_argument, NULL, OPT_CAMERA_PATH},
+  {"denoise", required_argument, NULL, OPT_DENOISE},
+  {NULL, 0, NULL, 0}
+};
 
 ////////////////////////////////////////////
 // Global variables.
 ////////////////////////////////////////////
-typedef enum TRACERS { NONE, WHITTED, MONTE_CARLO, JENSEN } tracer_t;
-
 static char * g_input_file = NULL;
 static char * g_photons_file = NULL;
 static char * g_caustics_file = NULL;
@@ -55,174 +94,290 @@ static int g_samples = 25;
 static float g_fov = 45.0f;
 static int g_w = 640;
 static int g_h = 480;
-static float g_a_ratio = 640.0f / 480.0f;
-static vec3 image[MAX_H][MAX_W];
 static tracer_t g_tracer = NONE;
 static unsigned int g_max_depth = 5;
 static float g_gamma = 2.2f;
 static float g_exposure = 0.0f;
 static size_t g_photons = 15000;
+static size_t g_importons = 0;
 static float g_p_sample_radius = 0.01f;
 static float g_cone_filter_k = 1.0f;
 static int g_max_photons = 7000000;
 static int g_max_search  = 5000;
+static bool g_compact = false;
+static bool g_scene_cache = false;
+static char * g_sampler_name = NULL;
+static char * g_stats_file = NULL;
+static bool g_heatmap = false;
+static char * g_trace_file = NULL;
+static char * g_socket_path = NULL;
+static int g_port = 0;
+static char * g_coordinator = NULL;
+static int g_shard = 0;
+static int g_shards = 0;
+static vector<char *> g_shard_files;
+static char * g_publish_photons = NULL;
+static char * g_attach_photons = NULL;
+static int g_first_sample = 0;
+static char * g_sums_file = NULL;
+static vector<char *> g_merge_sums;
+static char * g_camera_path = NULL;
+static int g_denoise = 0;
 
 ////////////////////////////////////////////
 // Main function.
 ////////////////////////////////////////////
 int main(int argc, char ** argv) {
-  Ray r;
-  vec2 sample;
-  Tracer * tracer;
-  PhotonTracer * p_tracer;
-  uint64_t total;
-  uint64_t current = 0;
-  FIBITMAP * input_bitmap;
-  FIBITMAP * output_bitmap;
-  FREE_IMAGE_FORMAT fif;
-  BYTE * bits;
-  FIRGBF *pixel;
-  int pitch;
-  Scene * scn;
+  Tracer * tracer = NULL;
+  Scene * scn = NULL;
+  Sampler * sampler = NULL;
+  ostringstream desc, shard_file;
+  Heatmap * heatmap = NULL;
+  Framebuffer * image;
+  render_settings_t rs;
+  tracer_options_t opts;
+  int status = EXIT_SUCCESS;
+  bool contiguous;
 
   parse_args(argc, argv);
-  
-  // Initialize everything.
-  FreeImage_Initialise();
-
-  try {
-    scn = new Scene(g_input_file);
-  } catch (SceneError & e) {
-    cout << e.what() << endl;
-    return EXIT_FAILURE;
-  }
 
-  cout << "Rendering the input file: " << ANSI_BOLD_YELLOW << g_input_file << ANSI_RESET_STYLE << endl;
-  cout << "The scene contains: " << endl;
-  cout << "  " << ANSI_BOLD_YELLOW << scn->m_figures.size() << ANSI_RESET_STYLE << (scn->m_figures.size() != 1 ? " figures." : " figure.") << endl;
-  cout << "  " << ANSI_BOLD_YELLOW << scn->m_lights.size() << ANSI_RESET_STYLE << " light "  << (scn->m_lights.size() != 1 ? "sources." : "source.") << endl;
-  cout << "Output image resolution is " << ANSI_BOLD_YELLOW << g_w << "x" << g_h << ANSI_RESET_STYLE << " pixels." << endl;
-  cout << "Using " << ANSI_BOLD_YELLOW << g_samples << ANSI_RESET_STYLE << " samples per pixel." << endl;
-  cout << "Maximum ray tree depth is " << ANSI_BOLD_YELLOW << g_max_depth << ANSI_RESET_STYLE << "." << endl;
-
-  // Create the tracer object.
-  switch (g_tracer) {
-    
-  case WHITTED:
-    cout << "Using " << ANSI_BOLD_YELLOW << "Whitted" << ANSI_RESET_STYLE << " ray tracing." << endl;
-    tracer = static_cast<Tracer *>(new WhittedTracer(g_max_depth));
-    break;
-
-  case MONTE_CARLO:
-    cout << "Using " << ANSI_BOLD_YELLOW << "Monte Carlo" << ANSI_RESET_STYLE << " path tracing." << endl;
-    tracer = static_cast<Tracer *>(new PathTracer(g_max_depth));
-    break;
-
-  case JENSEN:
-    cout << "Using " << ANSI_BOLD_YELLOW << "Jensen's photon mapping" << ANSI_RESET_STYLE << " with ray tracing." << endl;
-    p_tracer = new PhotonTracer(g_max_depth, g_p_sample_radius, g_cone_filter_k, g_max_photons, g_max_search);
-    if (g_photons_file == NULL && g_caustics_file == NULL) {
-      cout << "Building global photon map with " << ANSI_BOLD_YELLOW << g_photons / 2 << ANSI_RESET_STYLE << " primary photons per light source." << endl;
-      p_tracer->photon_tracing(scn, g_photons / 2);
-      cout << "Building caustics photon map with " << ANSI_BOLD_YELLOW << g_photons / 2 << ANSI_RESET_STYLE << " primary photons per light source." << endl;
-      p_tracer->photon_tracing(scn, g_photons / 2, true);
-      p_tracer->build_photon_map();
+  if (g_trace_file != NULL)
+    trace_start();
 
-    } else {
-      if (g_photons_file != g_caustics_file) {
-	cerr << "Must specify both a photon map file and a caustics file." << endl;
-	return EXIT_FAILURE;
-      }
-      p_tracer->build_photon_map(g_photons_file);
-      p_tracer->build_photon_map(g_caustics_file, true);
+  if (g_sampler_name != NULL) {
+    sampler = create_sampler(g_sampler_name, static_cast<uint32_t>(g_samples));
+    if (sampler == NULL) {
+      cerr << "Invalid sampler: " << g_sampler_name << endl;
+      print_usage(argv);
+      return EXIT_FAILURE;
     }
-    
-    tracer = static_cast<Tracer *>(p_tracer);
-    break;
+    set_sampler(sampler);
+  }
 
-  default:
+  if (g_tracer == NONE && g_socket_path == NULL && g_coordinator == NULL) {
     cerr << "Must specify a ray tracer with \"-t\"." << endl;
     print_usage(argv);
     return EXIT_FAILURE;
   }
-  
-  // Generate the image.
-  total = static_cast<uint64_t>(g_h) * static_cast<uint64_t>(g_w) * static_cast<uint64_t>(g_samples);
-  cout << "Tracing a total of " << ANSI_BOLD_YELLOW << total << ANSI_RESET_STYLE << " primary rays:" << endl;
-#pragma omp parallel for schedule(dynamic, 1) private(r, sample) shared(current)
-  for (int i = 0; i < g_h; i++) {
-    for (int j = 0; j < g_w; j++) {
-      for (int k = 0; k < g_samples; k++) {
-	sample = sample_pixel(i, j, g_w, g_h, g_a_ratio, g_fov);
-	r = Ray(normalize(vec3(sample, -0.5f) - vec3(0.0f)), vec3(0.0f));
-	scn->m_cam->view_to_world(r);
-	image[i][j] += tracer->trace_ray(r, scn, 0);
-#pragma omp atomic
-	current++;
-      }
-      image[i][j] /= g_samples;
+
+  rs.w = g_w;
+  rs.h = g_h;
+  rs.samples = g_samples;
+  rs.first_sample = g_first_sample;
+  rs.fov = g_fov;
+  rs.gamma = g_gamma;
+  rs.exposure = g_exposure;
+  rs.denoise = g_denoise;
+
+  opts.max_depth = g_max_depth;
+  opts.photons = g_photons;
+  opts.importons = g_importons;
+  opts.p_sample_radius = g_p_sample_radius;
+  opts.cone_filter_k = g_cone_filter_k;
+  opts.max_photons = g_max_photons;
+  opts.max_search = g_max_search;
+  opts.compact = g_compact;
+  opts.photons_file = g_photons_file;
+  opts.caustics_file = g_caustics_file;
+  opts.shard_files.assign(g_shard_files.begin(), g_shard_files.end());
+  opts.publish_photons = g_publish_photons;
+  opts.attach_photons = g_attach_photons;
+  opts.track_photon_paths = false;
+
+  // Initialize everything.
+  FreeImage_Initialise();
+
+  // The workers load the scene, the coordinator only puts the image together,
+  // and merging sample sums needs no scene either.
+  if (g_port == 0 && g_merge_sums.empty()) {
+    phase_begin(PHASE_SCENE_LOAD);
+    try {
+      scn = new Scene(g_input_file, g_h, g_w, g_fov, g_scene_cache);
+    } catch (SceneError & e) {
+      cout << e.what() << endl;
+      return EXIT_FAILURE;
     }
-#pragma omp critical
-    cout << "\r" << ANSI_BOLD_YELLOW << current << ANSI_RESET_STYLE << " of " << ANSI_BOLD_YELLOW << total << ANSI_RESET_STYLE << " primary rays traced.";
+    phase_end(PHASE_SCENE_LOAD);
+
+    cout << "Rendering the input file: " << ANSI_BOLD_YELLOW << g_input_file << ANSI_RESET_STYLE << endl;
+    cout << "The scene contains: " << endl;
+    cout << "  " << ANSI_BOLD_YELLOW << scn->m_figures.size() << ANSI_RESET_STYLE << (scn->m_figures.size() != 1 ? " figures." : " figure.") << endl;
+    cout << "  " << ANSI_BOLD_YELLOW << scn->m_lights.size() << ANSI_RESET_STYLE << " light "  << (scn->m_lights.size() != 1 ? "sources." : "source.") << endl;
   }
-  cout << endl;
-
-  // Copy the pixels to the output bitmap.
-  if (g_tracer == MONTE_CARLO || g_tracer == JENSEN) {
-    cout << "Saving output image." << endl;
-    input_bitmap = FreeImage_AllocateT(FIT_RGBF, g_w, g_h, 96);
-    pitch = FreeImage_GetPitch(input_bitmap);
-    bits = (BYTE *)FreeImage_GetBits(input_bitmap);
-    for (unsigned int y = 0; y < FreeImage_GetHeight(input_bitmap); y++) {
-      pixel = (FIRGBF *)bits;
-      for (unsigned int x = 0; x < FreeImage_GetWidth(input_bitmap); x++) {
-	pixel[x].red = image[g_h - 1 - y][x].r;
-	pixel[x].green = image[g_h - 1 - y][x].g;
-	pixel[x].blue = image[g_h - 1 - y][x].b;
+
+  if (g_port > 0) {
+    cout << "Output image resolution is " << ANSI_BOLD_YELLOW << g_w << "x" << g_h << ANSI_RESET_STYLE << " pixels." << endl;
+    cout << "Using " << ANSI_BOLD_YELLOW << g_samples << ANSI_RESET_STYLE << " samples per pixel." << endl;
+    if (g_denoise > 0)
+      cerr << "Tiles keep no first hits, the distributed render will not be denoised." << endl;
+    if (!run_coordinator(g_port, g_tracer, rs, opts, g_sampler_name, g_out_file_name != NULL ? g_out_file_name : OUT_FILE))
+      status = EXIT_FAILURE;
+
+  } else if (!g_merge_sums.empty()) {
+    if (g_denoise > 0)
+      cerr << "Sample sums keep no first hits, the merged image will not be denoised." << endl;
+    image = new Framebuffer();
+    if (!merge_sample_sums(vector<const char *>(g_merge_sums.begin(), g_merge_sums.end()), *image, rs, contiguous)) {
+      status = EXIT_FAILURE;
+    } else {
+      // A sums file only records one range of samples.
+      if (g_sums_file != NULL && !contiguous) {
+	cerr << "The merged samples are not one range without gaps or repeats, not writing the sample sums: " << g_sums_file << endl;
+	status = EXIT_FAILURE;
+      } else if (g_sums_file != NULL && !save_sample_sums(*image, rs, g_sums_file)) {
+	cerr << "Could not write the sample sums: " << g_sums_file << endl;
+	status = EXIT_FAILURE;
+      }
+      if (!save_image(*image, rs, g_tracer != WHITTED, g_out_file_name != NULL ? g_out_file_name : OUT_FILE)) {
+	cerr << "Could not write the output image." << endl;
+	status = EXIT_FAILURE;
       }
-      bits += pitch;
     }
+    delete image;
 
-    output_bitmap = FreeImage_ToneMapping(input_bitmap, FITMO_DRAGO03, g_gamma, g_exposure);
+  } else if (g_shards > 0) {
+    if (g_tracer != JENSEN) {
+      cerr << "Photon shards are only traced for the \"jensen\" tracer." << endl;
+      status = EXIT_FAILURE;
+    } else {
+      // Photons take their samples from their index, so shards need a sampler to be deterministic.
+      if (sampler == NULL) {
+	sampler = create_sampler("independent", static_cast<uint32_t>(g_samples));
+	set_sampler(sampler);
+      }
+      shard_file << "photons." << g_shard << ".shard";
+      if (!trace_photon_shard(scn, opts, rs, g_shard, g_shards, g_out_file_name != NULL ? g_out_file_name : shard_file.str().c_str()))
+	status = EXIT_FAILURE;
+    }
 
-    // Save the output image.
-    fif = FreeImage_GetFIFFromFilename(g_out_file_name != NULL ? g_out_file_name : OUT_FILE);
-    FreeImage_Save(fif, output_bitmap, g_out_file_name != NULL ? g_out_file_name : OUT_FILE);
-    FreeImage_Unload(input_bitmap);
-    FreeImage_Unload(output_bitmap);
-    
-  } else {
-    input_bitmap = FreeImage_Allocate(g_w, g_h, 24, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
-    pitch = FreeImage_GetLine(input_bitmap) / FreeImage_GetWidth(input_bitmap);
-    bits = (BYTE *)FreeImage_GetBits(input_bitmap);
-    for (unsigned int y = 0; y < FreeImage_GetHeight(input_bitmap); y++) {
-      bits = FreeImage_GetScanLine(input_bitmap, y);
-      for (unsigned int x = 0; x < FreeImage_GetWidth(input_bitmap); x++) {
-	bits[FI_RGBA_RED] = static_cast<BYTE>(image[g_h - 1 - y][x].r * 255.0f);
-	bits[FI_RGBA_GREEN] = static_cast<BYTE>(image[g_h - 1 - y][x].g * 255.0f);
-	bits[FI_RGBA_BLUE] = static_cast<BYTE>(image[g_h - 1 - y][x].b * 255.0f);
-	bits += pitch;
+  } else if (g_coordinator != NULL) {
+    // The job chooses the sampler, for its own number of samples.
+    set_sampler(NULL);
+    if (!run_worker(g_coordinator, scn, opts))
+      status = EXIT_FAILURE;
+    free(g_coordinator);
+
+  } else if (g_socket_path != NULL) {
+    // Jobs choose their own sampler, for their own number of samples.
+    set_sampler(NULL);
+    if (!serve(g_socket_path, scn, g_tracer, opts, rs, g_sampler_name))
+      status = EXIT_FAILURE;
+    free(g_socket_path);
+
+  } else if (g_camera_path != NULL) {
+    cout << "Output image resolution is " << ANSI_BOLD_YELLOW << g_w << "x" << g_h << ANSI_RESET_STYLE << " pixels." << endl;
+    cout << "Using " << ANSI_BOLD_YELLOW << g_samples << ANSI_RESET_STYLE << " samples per pixel." << endl;
+    cout << "Maximum ray tree depth is " << ANSI_BOLD_YELLOW << g_max_depth << ANSI_RESET_STYLE << "." << endl;
+
+    try {
+      CameraPath path(g_camera_path, scn);
+
+      // The tracer, with its photon maps, is shared by every frame.
+      opts.track_photon_paths = path.moves_figures();
+      if ((tracer = create_tracer(g_tracer, scn, opts, rs)) == NULL) {
+	delete scn;
+	return EXIT_FAILURE;
       }
+      if (!render_animation(scn, tracer, path, rs, g_tracer != WHITTED, g_out_file_name != NULL ? g_out_file_name : OUT_FILE))
+	status = EXIT_FAILURE;
+    } catch (SceneError & e) {
+      cerr << e.what() << endl;
+      status = EXIT_FAILURE;
     }
+    free(g_camera_path);
 
-    FreeImage_AdjustGamma(input_bitmap, g_gamma);
+  } else {
+    cout << "Output image resolution is " << ANSI_BOLD_YELLOW << g_w << "x" << g_h << ANSI_RESET_STYLE << " pixels." << endl;
+    cout << "Using " << ANSI_BOLD_YELLOW << g_samples << ANSI_RESET_STYLE << " samples per pixel";
+    if (g_first_sample > 0)
+      cout << ", from sample " << ANSI_BOLD_YELLOW << g_first_sample << ANSI_RESET_STYLE;
+    cout << "." << endl;
+    if (g_sampler_name != NULL)
+      cout << "Using the " << ANSI_BOLD_YELLOW << g_sampler_name << ANSI_RESET_STYLE << " sampler." << endl;
+    if (g_denoise > 0)
+      cout << "Denoising with " << ANSI_BOLD_YELLOW << g_denoise << ANSI_RESET_STYLE << (g_denoise != 1 ? " passes." : " pass.") << endl;
+    cout << "Maximum ray tree depth is " << ANSI_BOLD_YELLOW << g_max_depth << ANSI_RESET_STYLE << "." << endl;
+
+    // Create the tracer object.
+    if ((tracer = create_tracer(g_tracer, scn, opts, rs)) == NULL) {
+      delete scn;
+      return EXIT_FAILURE;
+    }
+
+    // Generate the image.
+    if (g_heatmap)
+      heatmap = new Heatmap(g_w, g_h);
+    image = new Framebuffer();
+    phase_begin(PHASE_RENDER);
+    render(scn, tracer, rs, *image, heatmap);
+    phase_end(PHASE_RENDER);
 
     // Save the output image.
-    fif = FreeImage_GetFIFFromFilename(g_out_file_name != NULL ? g_out_file_name : OUT_FILE);
-    FreeImage_Save(fif, input_bitmap, g_out_file_name != NULL ? g_out_file_name : OUT_FILE);
-    FreeImage_Unload(input_bitmap);
+    if (g_tracer == MONTE_CARLO || g_tracer == JENSEN)
+      cout << "Saving output image." << endl;
+    if (!save_image(*image, rs, g_tracer != WHITTED, g_out_file_name != NULL ? g_out_file_name : OUT_FILE)) {
+      cerr << "Could not write the output image." << endl;
+      status = EXIT_FAILURE;
+    }
+    if (g_sums_file != NULL && !save_sample_sums(*image, rs, g_sums_file)) {
+      cerr << "Could not write the sample sums: " << g_sums_file << endl;
+      status = EXIT_FAILURE;
+    }
+    delete image;
+
+    if (heatmap != NULL) {
+      cout << "Saving per pixel cost heatmaps." << endl;
+      if (!heatmap->save(g_out_file_name != NULL ? g_out_file_name : OUT_FILE))
+	cerr << "Could not write the heatmaps." << endl;
+      delete heatmap;
+    }
+  }
+
+  if (g_stats_file != NULL) {
+    desc << "\"scene\": \"" << (g_input_file != NULL ? json_escape(g_input_file) : "") << "\", \"tracer\": \"" << tracer_name(g_tracer) << "\", "
+	 << "\"width\": " << g_w << ", \"height\": " << g_h << ", \"samples\": " << g_samples << ", "
+	 << "\"sampler\": \"" << (g_sampler_name != NULL ? json_escape(g_sampler_name) : "random") << "\"";
+    if (!write_stats(g_stats_file, desc.str().c_str(), omp_get_max_threads()))
+      cerr << "Could not write the statistics file: " << g_stats_file << endl;
+    free(g_stats_file);
+  }
+
+  if (g_trace_file != NULL) {
+    if (!write_trace(g_trace_file))
+      cerr << "Could not write the timeline file: " << g_trace_file << endl;
+    free(g_trace_file);
   }
 
   // Clean up.
   if (g_out_file_name != NULL)
     free(g_out_file_name);
 
+  if (g_sampler_name != NULL)
+    free(g_sampler_name);
+
+  for (char * f : g_shard_files)
+    free(f);
+
+  for (char * f : g_merge_sums)
+    free(f);
+
+  if (g_sums_file != NULL)
+    free(g_sums_file);
+
+  if (g_publish_photons != NULL)
+    free(g_publish_photons);
+
+  if (g_attach_photons != NULL)
+    free(g_attach_photons);
+
+  delete sampler;
+
   delete scn;
   delete tracer;
 
   FreeImage_DeInitialise();
   
-  return EXIT_SUCCESS;
+  return status;
 }
 
 ////////////////////////////////////////////
@@ -243,6 +398,9 @@ void print_usage(char ** const argv) {
   cerr << "    \tDefaults to 45.0 degrees." << endl;
   cerr << "  -s\tNumber of samples per pixel." << endl;
   cerr << "    \tDefaults to 25 samples." << endl;
+  cerr << "  -S\tSampler to use for all random decisions." << endl;
+  cerr << "    \tValid values are \"independent\", \"stratified\", \"halton\" and \"sobol\"." << endl;
+  cerr << "    \tDefaults to plain pseudo-random numbers." << endl;
   cerr << "  -w\tImage size in pixels as \"WIDTHxHEIGHT\"." << endl;
   cerr << "    \tDefaults to 640x480 pixels." << endl;
   cerr << "    \tMinimum resolution is 1x1 pixels." << endl;
@@ -255,6 +413,9 @@ void print_usage(char ** const argv) {
   cerr << "    \tDefaults to 0.0 (no correction)." << endl;
   cerr << "  -p\tNumber of primary photons per light source." << endl;
   cerr << "    \tDefaults to 15000." << endl;
+  cerr << "  -i\tNumber of importons traced from the camera." << endl;
+  cerr << "    \tPhotons are stored less often where few importons land." << endl;
+  cerr << "    \tDefaults to 0 (disabled)." << endl;
   cerr << "  -h\tHemisphere radius for photon map sampling (> 0)." << endl;
   cerr << "    \tDefaults to 0.01f." << endl;
   cerr << "  -k\tFile with photon definitions." << endl;
@@ -266,6 +427,81 @@ void print_usage(char ** const argv) {
   cerr << "    \tDefaults to 7000000." << endl;
   cerr << "  -z\tMax number of photons for radiance estimate." << endl;
   cerr << "    \tDefaults to 5000." << endl;
+  cerr << "  -q\tStore the photon map with compact 16 byte photons." << endl;
+  cerr << "    \tDisabled by default." << endl;
+  cerr << "  -C\tCache the compiled scene next to FILE as FILE.cache" << endl;
+  cerr << "    \tand load it instead of FILE while FILE is unchanged." << endl;
+  cerr << "    \tDisabled by default." << endl;
+  cerr << "  --stats OUT" << endl;
+  cerr << "    \tWrite the time of every phase, ray, photon and intersection" << endl;
+  cerr << "    \tcounts, rays per second, thread utilization and peak memory" << endl;
+  cerr << "    \tuse to OUT as JSON." << endl;
+  cerr << "  --serve SOCKET" << endl;
+  cerr << "    \tKeep the scene and photon maps loaded and render the jobs sent" << endl;
+  cerr << "    \tto the UNIX socket SOCKET, one per line as key=value pairs," << endl;
+  cerr << "    \tsee server.hpp. \"-t\" is then optional and sets the default tracer." << endl;
+  cerr << "  --coordinate PORT" << endl;
+  cerr << "    \tRender on the workers that connect to the TCP port PORT, leasing" << endl;
+  cerr << "    \tthem tiles of the image, and save it. FILE is not needed." << endl;
+  cerr << "  --worker HOST:PORT" << endl;
+  cerr << "    \tLoad FILE and render the tiles leased by the coordinator at" << endl;
+  cerr << "    \tHOST:PORT, with the tracer, size, samples, FoV, depth, photons" << endl;
+  cerr << "    \tand sampler of its job. See distributed.hpp." << endl;
+  cerr << "  --photon-shard K/N" << endl;
+  cerr << "    \tTrace only shard K of N of the photons of \"-p\", from 0, and" << endl;
+  cerr << "    \twrite them to the \"-o\" file, \"photons.K.shard\" by default," << endl;
+  cerr << "    \tinstead of rendering. Shards can be traced on other machines." << endl;
+  cerr << "  --merge-shard FILE" << endl;
+  cerr << "    \tRender with the photons of the photon shard FILE instead of" << endl;
+  cerr << "    \ttracing photons. Give it once for every shard to merge." << endl;
+  cerr << "  --publish-photons NAME" << endl;
+  cerr << "    \tCopy the balanced photon map to the POSIX shared memory object" << endl;
+  cerr << "    \tNAME, where it stays for other processes until removed from" << endl;
+  cerr << "    \t/dev/shm." << endl;
+  cerr << "  --attach-photons NAME" << endl;
+  cerr << "    \tRender with the photon map published as NAME instead of tracing" << endl;
+  cerr << "    \tphotons. Its memory is shared by every process that attaches it." << endl;
+  cerr << "  --first-sample N" << endl;
+  cerr << "    \tRender the samples N to N + \"-s\" - 1 of every pixel, to split a" << endl;
+  cerr << "    \trender by samples. Defaults to 0." << endl;
+  cerr << "  --save-sums FILE" << endl;
+  cerr << "    \tAlso write the float sums of the samples of every pixel and the" << endl;
+  cerr << "    \tnumber of samples to FILE, to be merged later." << endl;
+  cerr << "  --merge-sums FILE" << endl;
+  cerr << "    \tInstead of rendering, add up the sample sums FILE, given once per" << endl;
+  cerr << "    \tfile, and save the image of their mean. FILE is not needed. With" << endl;
+  cerr << "    \t\"--save-sums\" the files must hold one range of samples together." << endl;
+  cerr << "  --camera-path PATH" << endl;
+  cerr << "    \tRender every frame of the camera path in the JSON file PATH," << endl;
+  cerr << "    \treusing the scene, BVH and photon maps, to the \"-o\" file with" << endl;
+  cerr << "    \tthe frame number, see animation.hpp. Importons are traced from" << endl;
+  cerr << "    \tthe scene camera." << endl;
+  cerr << "  --denoise N" << endl;
+  cerr << "    \tFilter the image before tone mapping with N passes, at most " << MAX_DENOISE_PASSES << "," << endl;
+  cerr << "    \tof an a-trous wavelet filter guided by the albedo, normal and" << endl;
+  cerr << "    \tdepth of the first hits and the noise of every pixel, see" << endl;
+  cerr << "    \tdenoise.hpp." << endl;
+  cerr << "    \tDefaults to 0 (disabled)." << endl;
+  cerr << "  --trace OUT" << endl;
+  cerr << "    \tRecord a timeline of the phases, photon blocks and image rows" << endl;
+  cerr << "    \tof every thread to OUT in the Chrome trace event format, which" << endl;
+  cerr << "    \tchrome://tracing and ui.perfetto.dev can open." << endl;
+  cerr << "  --heatmap" << endl;
+  cerr << "    \tWrite the time, rays, intersection tests and photons visited" << endl;
+  cerr << "    \tper pixel next to the output image, as float PFM files and" << endl;
+  cerr << "    \tfalse color PNG files named like \"output.time.png\"." << endl;
+}
+
+string json_escape(const char * s) {
+  string e;
+
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\')
+      e += '\\';
+    e += *s;
+  }
+
+  return e;
 }
 
 void parse_args(int argc, char ** const argv) {
@@ -279,7 +515,7 @@ void parse_args(int argc, char ** const argv) {
     exit(EXIT_FAILURE);
   }
 
-  while((opt = getopt(argc, argv, "-:t:s:w:f:o:r:g:e:p:h:k:c:l:m:z:")) != -1) {
+  while((opt = getopt_long(argc, argv, "-:t:s:S:w:f:o:r:g:e:p:i:h:k:c:l:m:z:qC", LONG_OPTIONS, NULL)) != -1) {
     switch (opt) {
     case 1:
       g_input_file = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
@@ -297,13 +533,7 @@ void parse_args(int argc, char ** const argv) {
       break;
       
     case 't':
-      if (strcmp("whitted", optarg) == 0 )
-	g_tracer = WHITTED;
-      else if(strcmp("monte_carlo", optarg) == 0 || strcmp("montecarlo", optarg) == 0)
-	g_tracer = MONTE_CARLO;
-      else if(strcmp("jensen", optarg) == 0)
-	g_tracer = JENSEN;
-      else {
+      if ((g_tracer = tracer_by_name(optarg)) == NONE) {
 	cerr << "Invalid ray tracer: " << optarg << endl;
 	print_usage(argv);
 	exit(EXIT_FAILURE);
@@ -329,7 +559,6 @@ void parse_args(int argc, char ** const argv) {
 	  print_usage(argv);
 	  exit(EXIT_FAILURE);
 	}
-	g_a_ratio = static_cast<float>(g_w) / static_cast<float>(g_h);
       }
 
       break;
@@ -344,6 +573,11 @@ void parse_args(int argc, char ** const argv) {
 
       break;
 
+    case 'S':
+      g_sampler_name = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_sampler_name, optarg);
+      break;
+
     case 'o':
       g_out_file_name = (char*)malloc((strlen(optarg) + 1) * sizeof(char));
       strcpy(g_out_file_name, optarg);
@@ -381,6 +615,17 @@ void parse_args(int argc, char ** const argv) {
 
       break;
 
+    case 'i':
+      photons = atoi(optarg);
+      if (photons < 0) {
+	cerr << "The number of importons must be a non-negative integer." << endl;
+	print_usage(argv);
+	exit(EXIT_FAILURE);
+      }
+      g_importons = (size_t)photons;
+
+      break;
+
     case 'h':
       g_p_sample_radius = atof(optarg);
       if (g_p_sample_radius <= 0.0f) {
@@ -429,6 +674,103 @@ void parse_args(int argc, char ** const argv) {
       }
 
       break;
+
+    case 'q':
+      g_compact = true;
+      break;
+
+    case 'C':
+      g_scene_cache = true;
+      break;
+
+    case OPT_STATS:
+      g_stats_file = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_stats_file, optarg);
+      break;
+
+    case OPT_HEATMAP:
+      g_heatmap = true;
+      break;
+
+    case OPT_TRACE:
+      g_trace_file = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_trace_file, optarg);
+      break;
+
+    case OPT_SERVE:
+      g_socket_path = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_socket_path, optarg);
+      break;
+
+    case OPT_COORDINATE:
+      g_port = atoi(optarg);
+      if (g_port <= 0 || g_port > 65535) {
+	cerr << "Invalid port: " << optarg << endl;
+	print_usage(argv);
+	exit(EXIT_FAILURE);
+      }
+      break;
+
+    case OPT_WORKER:
+      g_coordinator = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_coordinator, optarg);
+      break;
+
+    case OPT_PHOTON_SHARD:
+      if (sscanf(optarg, "%d/%d", &g_shard, &g_shards) != 2 || g_shards <= 0 || g_shard < 0 || g_shard >= g_shards) {
+	cerr << "Invalid photon shard: " << optarg << endl;
+	print_usage(argv);
+	exit(EXIT_FAILURE);
+      }
+      break;
+
+    case OPT_PUBLISH_PHOTONS:
+      g_publish_photons = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_publish_photons, optarg);
+      break;
+
+    case OPT_ATTACH_PHOTONS:
+      g_attach_photons = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_attach_photons, optarg);
+      break;
+
+    case OPT_FIRST_SAMPLE:
+      g_first_sample = atoi(optarg);
+      if (g_first_sample < 0) {
+	cerr << "The first sample must be a non-negative integer." << endl;
+	print_usage(argv);
+	exit(EXIT_FAILURE);
+      }
+      break;
+
+    case OPT_SAVE_SUMS:
+      g_sums_file = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_sums_file, optarg);
+      break;
+
+    case OPT_MERGE_SUMS:
+      g_merge_sums.push_back((char *)malloc((strlen(optarg) + 1) * sizeof(char)));
+      strcpy(g_merge_sums.back(), optarg);
+      break;
+
+    case OPT_DENOISE:
+      g_denoise = atoi(optarg);
+      if (g_denoise < 0 || g_denoise > MAX_DENOISE_PASSES) {
+	cerr << "The denoiser passes must be an integer in [0, " << MAX_DENOISE_PASSES << "]." << endl;
+	print_usage(argv);
+	exit(EXIT_FAILURE);
+      }
+      break;
+
+    case OPT_CAMERA_PATH:
+      g_camera_path = (char *)malloc((strlen(optarg) + 1) * sizeof(char));
+      strcpy(g_camera_path, optarg);
+      break;
+
+    case OPT_MERGE_SHARD:
+      g_shard_files.push_back((char *)malloc((strlen(optarg) + 1) * sizeof(char)));
+      strcpy(g_shard_files.back(), optarg);
+      break;
       
     case ':':
       cerr << "Option \"-" << static_cast<char>(optopt) << "\" requires an argument." << endl;
@@ -443,7 +785,7 @@ void parse_args(int argc, char ** const argv) {
     }
   }
 
-  if (g_input_file == NULL) {
+  if (g_input_file == NULL && g_port == 0 && g_merge_sums.empty()) {
     cerr << "Must specify an input file." << endl;
     print_usage(argv);
     exit(EXIT_FAILURE);
@@ -0,0 +1,154 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "net.hpp"
+
+using std::cerr;
+using std::endl;
+
+bool write_all(const int fd, const void * data, size_t size) {
+  const char * p = static_cast<const char *>(data);
+  ssize_t n;
+
+  while (size > 0) {
+    // No SIGPIPE if the other end went away.
+    if ((n = send(fd, p, size, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+	continue;
+      return false;
+    }
+    p += n;
+    size -= static_cast<size_t>(n);
+  }
+
+  return true;
+}
+
+bool write_line(const int fd, const string & line) {
+  string l = line + "\n";
+
+  return write_all(fd, l.data(), l.size());
+}
+
+bool read_some(const int fd, string & buffer) {
+  char chunk[65536];
+  ssize_t n;
+
+  do
+    n = read(fd, chunk, sizeof(chunk));
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0)
+    return false;
+  buffer.append(chunk, static_cast<size_t>(n));
+
+  return true;
+}
+
+bool take_line(string & buffer, string & line) {
+  size_t nl = buffer.find('\n');
+
+  if (nl == string::npos)
+    return false;
+
+  line = buffer.substr(0, nl);
+  buffer.erase(0, nl + 1);
+  if (!line.empty() && line[line.size() - 1] == '\r')
+    line.erase(line.size() - 1);
+
+  return true;
+}
+
+bool read_line(const int fd, string & buffer, string & line, const size_t max_size) {
+  while (!take_line(buffer, line)) {
+    if (buffer.size() > max_size || !read_some(fd, buffer))
+      return false;
+  }
+
+  return true;
+}
+
+bool read_exact(const int fd, string & buffer, void * data, const size_t size) {
+  while (buffer.size() < size) {
+    if (!read_some(fd, buffer))
+      return false;
+  }
+
+  memcpy(data, buffer.data(), size);
+  buffer.erase(0, size);
+
+  return true;
+}
+
+int tcp_listen(const int port) {
+  struct sockaddr_in addr;
+  int fd, on = 1;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    cerr << "Could not create a socket: " << strerror(errno) << endl;
+    return -1;
+  }
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+    cerr << "Could not listen on port " << port << ": " << strerror(errno) << endl;
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int tcp_connect(const char * host_port) {
+  struct addrinfo hints, * res, * a;
+  string host(host_port), port;
+  size_t colon = host.rfind(':');
+  int fd = -1, on = 1, error;
+
+  if (colon == string::npos) {
+    cerr << "Expected HOST:PORT, got " << host_port << endl;
+    return -1;
+  }
+  port = host.substr(colon + 1);
+  host.erase(colon);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((error = getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) != 0) {
+    cerr << "Could not resolve " << host_port << ": " << gai_strerror(error) << endl;
+    return -1;
+  }
+
+  for (a = res; a != NULL; a = a->ai_next) {
+    if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+      continue;
+    if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd < 0)
+    cerr << "Could not connect to " << host_port << ": " << strerror(errno) << endl;
+  else
+    // Tile requests are small and latency bound.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  return fd;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#ifndef NET_HPP
+#define NET_HPP
+
+#include <string>
+#include <cstddef>
+
+using std::string;
+
+/* Blocking socket helpers for the line based protocols of the render
+ * server and of distributed rendering. Lines end with '\n'. Reads go
+ * through a buffer owned by the caller, which keeps whatever was read
+ * past the end of a line for the next call. */
+
+extern bool write_all(const int fd, const void * data, size_t size);
+extern bool write_line(const int fd, const string & line);
+
+// False on end of file, error, or a line longer than max_size.
+extern bool read_line(const int fd, string & buffer, string & line, const size_t max_size = 4096);
+extern bool read_exact(const int fd, string & buffer, void * data, const size_t size);
+
+// Appends what can be read right now to buffer. False on end of file or error.
+extern bool read_some(const int fd, string & buffer);
+
+// Takes a complete line out of buffer, if there is one.
+extern bool take_line(string & buffer, string & line);
+
+// Listening socket on every interface, or -1 after printing why.
+extern int tcp_listen(const int port);
+// Socket connected to HOST:PORT, or -1 after printing why.
+extern int tcp_connect(const char * host_port);
+
+#endif
@@ -4,38 +4,50 @@
 
 #include "path_tracer.hpp"
 #include "sampling.hpp"
+#include "sampler.hpp"
 #include "area_light.hpp"
+#include "stats.hpp"
 
 using std::numeric_limits;
 using namespace glm;
 
 PathTracer::~PathTracer() { }
 
-vec3 PathTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
-  float t, _t;
+/* Probability of following the specular lobe of a material instead of
+ * the diffuse one, in proportion to what each reflects. The Phong lobe
+ * reflects about 2 pi / (shininess + 2) of what comes from the normal. */
+static inline float specular_probability(const Material & m) {
+  float w_diff = (m.m_diffuse.r + m.m_diffuse.g + m.m_diffuse.b) / 3.0f;
+  float w_spec = ((m.m_specular.r + m.m_specular.g + m.m_specular.b) / 3.0f) * (2.0f * pi<float>() / (m.m_shininess + 2.0f));
+
+  return w_spec > 0.0f ? w_spec / (w_diff + w_spec) : 0.0f;
+}
+
+vec3 PathTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level, first_hit_t * hit) const {
+  float t;
   Figure * _f;
-  vec3 n, color, i_pos, ref, sample, dir_diff_color, dir_spec_color, ind_color, amb_color;
+  vec3 n, color, i_pos, ref, sample, dir_diff_color, dir_spec_color, ind_color, ind_spec_color, amb_color;
   Ray mv_r, sr, rr;
   bool vis, is_area_light = false;
-  float kr, r1, r2;
+  float kr, r1, r2, cos_t, p_spec;
   AreaLight * al;
+  brdf_sample_t b_sample;
+  env_sample_t e_sample;
 
   t = numeric_limits<float>::max();
   _f = NULL;
 
-  // Find the closest intersecting surface.
-  for (size_t f = 0; f < s->m_figures.size(); f++) {
-    if (s->m_figures[f]->intersect(r, _t) && _t < t) {
-      t = _t;
-      _f = s->m_figures[f];
-    }
-  }
+  if (rec_level > 0)
+    stat_add(STAT_SECONDARY_RAYS);
+
+  // Find the closest intersecting surface and its normal.
+  _f = s->intersect(r, t, n);
+  first_hit(hit, _f, r, t, n);
 
   // If this ray intersects something:
   if (_f != NULL) {
-    // Take the intersection point and the normal of the surface at that point.
+    // Take the intersection point.
     i_pos = r.m_origin + (t * r.m_direction);
-    n = _f->normal_at_int(r, t);
 
     is_area_light = false;
     // Check if the object is an area light;
@@ -59,12 +71,7 @@ vec3 PathTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
 	  // Cast a shadow ray to determine visibility.
 	  sr = Ray(s->m_lights[l]->direction(i_pos), i_pos + (n * BIAS));
 
-	  for (size_t f = 0; f < s->m_figures.size(); f++) {
-	    if (s->m_figures[f]->intersect(sr, _t) && _t < s->m_lights[l]->distance(i_pos)) {
-	      vis = false;
-	      break;
-	    }
-	  }
+	  vis = !s->occluded(sr, s->m_lights[l]->distance(i_pos));
 
 	// Evaluate the shading model accounting for visibility.
 	dir_diff_color += vis ? s->m_lights[l]->diffuse(n, r, i_pos, *_f->m_mat) : vec3(0.0f);
@@ -76,15 +83,8 @@ vec3 PathTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
 	  al->sample_at_surface();
 	  sr = Ray(al->direction(i_pos), i_pos + (n * BIAS));
 
-	  for (size_t f = 0; f < s->m_figures.size(); f++) {
-	    // Avoid self-intersection with the light source.
-	    if (al->m_figure != s->m_figures[f]) {
-	      if (s->m_figures[f]->intersect(sr, _t) && _t < al->distance(i_pos)) {
-		vis = false;
-		break;
-	      }
-	    }
-	  }
+	  // Avoid self-intersection with the light source.
+	  vis = !s->occluded(sr, al->distance(i_pos), al->m_figure);
 
 	  // Evaluate the shading model accounting for visibility.
 	  dir_diff_color += vis ? s->m_lights[l]->diffuse(n, r, i_pos, *_f->m_mat) : vec3(0.0f);
@@ -92,37 +92,69 @@ vec3 PathTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
 	}
       }
 
-      // Calculate indirect lighting contribution.
+      // Calculate indirect lighting contribution, following either the
+      // diffuse or the specular lobe of the material.
       if (rec_level < m_max_depth) {
-	r1 = random01();
-	r2 = random01();
-	sample = sample_hemisphere(r1, r2);
-	rotate_sample(sample, n);
-	rr = Ray(normalize(sample), i_pos + (sample * BIAS));
-	ind_color += r1 * trace_ray(rr, s, rec_level + 1) / PDF;
+	p_spec = specular_probability(*_f->m_mat);
+	r1 = next_sample();
+	r2 = next_sample();
+	if (p_spec > 0.0f && next_sample() < p_spec) {
+	  b_sample = _f->m_mat->m_brdf->sample_lobe(-r.m_direction, n, vec2(r1, r2), _f->m_mat->m_shininess);
+	  if (b_sample.pdf > 0.0f && dot(n, b_sample.wi) > 0.0f) {
+	    rr = Ray(b_sample.wi, i_pos + (b_sample.wi * BIAS));
+	    ind_spec_color += b_sample.f * trace_ray(rr, s, rec_level + 1) / (b_sample.pdf * p_spec);
+	  }
+	} else {
+	  b_sample = _f->m_mat->m_brdf->sample(-r.m_direction, n, vec2(r1, r2));
+	  if (b_sample.pdf > 0.0f) {
+	    rr = Ray(b_sample.wi, i_pos + (b_sample.wi * BIAS));
+	    ind_color += b_sample.f * trace_ray(rr, s, rec_level + 1) / (b_sample.pdf * (1.0f - p_spec));
+	  }
+	}
       }
 
       // Calculate environment light contribution
+      amb_color = vec3(0.0f);
+
+      // Sample the environment map by importance, weighted against the cosine
+      // sample below with multiple importance sampling.
+      if (s->m_env->can_sample()) {
+	vis = true;
+
+	r1 = next_sample();
+	r2 = next_sample();
+	e_sample = s->m_env->sample(vec2(r1, r2));
+	cos_t = dot(n, e_sample.dir);
+
+	if (e_sample.pdf > 0.0f && cos_t > 0.0f) {
+	  rr = Ray(e_sample.dir, i_pos + (e_sample.dir * BIAS));
+
+	  // Cast a shadow ray to determine visibility.
+	  vis = !s->occluded(rr);
+
+	  if (vis)
+	    amb_color += e_sample.radiance * cos_t * power_heuristic(e_sample.pdf, cos_t / pi<float>()) / e_sample.pdf;
+	}
+      }
+
       vis = true;
 
-      r1 = random01();
-      r2 = random01();
-      sample = sample_hemisphere(r1, r2);
+      r1 = next_sample();
+      r2 = next_sample();
+      sample = sample_cosine_hemisphere(r1, r2);
+      cos_t = sample.y;
       rotate_sample(sample, n);
-      rr = Ray(normalize(sample), i_pos + (sample * BIAS));
+      rr = Ray(sample, i_pos + (sample * BIAS));
 
       // Cast a shadow ray to determine visibility.
-      for (size_t f = 0; f < s->m_figures.size(); f++) {
-	if (s->m_figures[f]->intersect(rr, _t)) {
-	  vis = false;
-	  break;
-	}
-      }
+      vis = !s->occluded(rr);
 
-      amb_color = vis ? s->m_env->get_color(rr) * max(dot(n, rr.m_direction), 0.0f) / PDF : vec3(0.0f);
+      // The cosine factor cancels out with the sampling pdf.
+      if (vis)
+	amb_color += s->m_env->get_color(rr) * pi<float>() * (s->m_env->can_sample() ? power_heuristic(cos_t / pi<float>(), s->m_env->pdf(sample)) : 1.0f);
 
       // Add lighting.
-      color += ((dir_diff_color + ind_color + amb_color) * (_f->m_mat->m_diffuse / pi<float>())) + (_f->m_mat->m_specular * dir_spec_color);
+      color += ((dir_diff_color + ind_color + amb_color) * (_f->m_mat->m_diffuse / pi<float>())) + (_f->m_mat->m_specular * (dir_spec_color + ind_spec_color));
 
       // Determine the specular reflection color.
       if (_f->m_mat->m_rho > 0.0f && rec_level < m_max_depth) {
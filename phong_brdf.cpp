@@ -1,11 +1,17 @@
 #include "glm/glm.hpp"
+#include "glm/gtc/constants.hpp"
 
 #include "phong_brdf.hpp"
+#include "sampling.hpp"
 
 using glm::reflect;
 using glm::pow;
 using glm::max;
 using glm::dot;
+using glm::sqrt;
+using glm::cos;
+using glm::sin;
+using glm::pi;
 
 vec3 PhongBRDF::diffuse(vec3 light_dir, vec3 surface_normal, Ray & incident_ray, vec3 intersection_point, vec3 light_diff_color) const {
   float n_dot_l = max(dot(surface_normal, light_dir), 0.0f);
@@ -17,3 +23,30 @@ vec3 PhongBRDF::specular(vec3 light_dir, vec3 surface_normal, Ray & incident_ray
   float r_dot_l = pow(max(dot(ref, incident_ray.m_direction), 0.0f), shininess);
   return light_spec_color * r_dot_l;
 }
+
+brdf_sample_t PhongBRDF::sample_lobe(const vec3 & wo, const vec3 & n, const vec2 & u, const float shininess) const {
+  brdf_sample_t s;
+  Ray r(-wo, vec3(0.0f));
+
+  s.wi = lobe_direction(wo, n, u, shininess);
+  s.pdf = lobe_pdf(wo, n, s.wi, shininess);
+  s.f = dot(n, s.wi) > 0.0f ? specular(s.wi, n, r, vec3(0.0f), vec3(1.0f), shininess) : vec3(0.0f);
+
+  return s;
+}
+
+vec3 PhongBRDF::lobe_direction(const vec3 & wo, const vec3 & n, const vec2 & u, const float shininess) {
+  float cos_a = pow(u.x, 1.0f / (shininess + 1.0f));
+  float sin_a = sqrt(max(0.0f, 1.0f - (cos_a * cos_a)));
+  float phi = 2.0f * pi<float>() * u.y;
+  vec3 wi(sin_a * cos(phi), cos_a, sin_a * sin(phi));
+
+  // Distribute cos^shininess around the mirror direction.
+  rotate_sample(wi, reflect(-wo, n));
+
+  return wi;
+}
+
+float PhongBRDF::lobe_pdf(const vec3 & wo, const vec3 & n, const vec3 & wi, const float shininess) {
+  return ((shininess + 1.0f) / (2.0f * pi<float>())) * pow(max(dot(wi, reflect(-wo, n)), 0.0f), shininess);
+}
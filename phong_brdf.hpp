@@ -11,6 +11,13 @@ public:
   
   virtual vec3 diffuse(vec3 light_dir, vec3 surface_normal, Ray & incident_ray, vec3 intersection_point, vec3 light_diff_color) const;
   virtual vec3 specular(vec3 light_dir, vec3 surface_normal, Ray & incident_ray, vec3 intersection_point, vec3 light_spec_color, float shininess) const;
+
+  // Samples the normalized Phong lobe around the mirror direction of wo.
+  virtual brdf_sample_t sample_lobe(const vec3 & wo, const vec3 & n, const vec2 & u, const float shininess) const;
+
+protected:
+  static vec3 lobe_direction(const vec3 & wo, const vec3 & n, const vec2 & u, const float shininess);
+  static float lobe_pdf(const vec3 & wo, const vec3 & n, const vec3 & wi, const float shininess);
 };
 
 #endif
@@ -4,6 +4,9 @@
 #include <limits>
 #include <vector>
 #include <utility>
+#include <algorithm>
+#include <map>
+#include <cstring>
 #include <cstdint>
 #include <cstdlib>
 
@@ -11,9 +14,13 @@
 
 #include "photon_tracer.hpp"
 #include "sampling.hpp"
+#include "sampler.hpp"
 #include "area_light.hpp"
 #include "directional_light.hpp"
 #include "spot_light.hpp"
+#include "sphere_area_light.hpp"
+#include "projection_map.hpp"
+#include "stats.hpp"
 
 using std::cout;
 using std::cerr;
@@ -24,42 +31,85 @@ using std::ios;
 using std::setw;
 using std::vector;
 using std::pair;
+using std::map;
+using std::make_pair;
+using std::min;
 using std::numeric_limits;
 using namespace glm;
 
 #define ANSI_BOLD_YELLOW "\x1b[1;33m"
 #define ANSI_RESET_STYLE "\x1b[m"
 
+// Storage probability of photons in regions no importon reached.
+static const float IMPORTANCE_MIN_PROB = 0.05f;
+
+// Sample streams of the importon and photon passes, past any pixel index.
+static const uint32_t IMPORTON_STREAM = 0xff000000u;
+static const uint32_t PHOTON_STREAM = 0xff000001u;
+// Sample streams of the points of area lights the projection maps are built from, one per light.
+static const uint32_t PROJECTION_STREAM = 0xfe000000u;
+
+// Photons emitted per scheduling block, which is also one event of the timeline.
+static const size_t PHOTON_BLOCK = 256;
+
+static const char PHOTON_SHARD_MAGIC[8] = {'P', 'H', 'S', 'H', 'A', 'R', 'D', '1'};
+
 PhotonTracer::~PhotonTracer() { }
 
-vec3 PhotonTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
+// Photons are only emitted into the active cells of the projection map, so their
+// power is scaled by the fraction of the emission domain that those cells cover.
+// Area lights emit over a hemisphere, point lights over the whole sphere. Sphere
+// lights always have a facing half for any direction, which halves the density
+// of the surface samples instead.
+static float emission_weight(Light * l, const ProjectionMap & p_map) {
+  return p_map.active_fraction() * (l->light_type() == Light::AREA && dynamic_cast<SphereAreaLight *>(l) == NULL ? 2.0f : 1.0f);
+}
+
+// Whether the segment from origin along dir up to t crosses the box.
+static inline bool segment_hits_box(const path_segment_t & g, const vec3 & b_min, const vec3 & b_max) {
+  float t0, t1, t_near = 0.0f, t_far = g.t;
+
+  for (int i = 0; i < 3; i++) {
+    // A segment parallel to the slab is either always or never inside it.
+    if (g.dir[i] == 0.0f) {
+      if (g.origin[i] < b_min[i] || g.origin[i] > b_max[i])
+	return false;
+      continue;
+    }
+
+    t0 = (b_min[i] - g.origin[i]) / g.dir[i];
+    t1 = (b_max[i] - g.origin[i]) / g.dir[i];
+    t_near = std::max(t_near, std::min(t0, t1));
+    t_far = std::min(t_far, std::max(t0, t1));
+  }
+
+  return t_near <= t_far;
+}
+
+vec3 PhotonTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level, first_hit_t * hit) const {
   const float radius = m_h_radius * m_h_radius;
-  float t, _t, /*red, green, blue,*/ kr, r1, r2;
+  float t, /*red, green, blue,*/ kr, r1, r2, cos_t;
   Figure * _f;
   vec3 n, color, i_pos, ref, dir_spec_color, p_contrib, c_contrib, sample, amb_color;
   Ray mv_r, sr, rr;
   bool vis, is_area_light;
   AreaLight * al;
-  Vec3 mn, mx;
-  vector<PhotonAux> photons;
-  vector<PhotonAux> caustics;
+  env_sample_t e_sample;
 
   t = numeric_limits<float>::max();
   _f = NULL;
 
-  // Find the closest intersecting surface.
-  for (size_t f = 0; f < s->m_figures.size(); f++) {
-    if (s->m_figures[f]->intersect(r, _t) && _t < t) {
-      t = _t;
-      _f = s->m_figures[f];
-    }
-  }
+  if (rec_level > 0)
+    stat_add(STAT_SECONDARY_RAYS);
+
+  // Find the closest intersecting surface and its normal.
+  _f = s->intersect(r, t, n);
+  first_hit(hit, _f, r, t, n);
 
   // If this ray intersects something:
   if (_f != NULL) {
-    // Take the intersection point and the normal of the surface at that point.
+    // Take the intersection point.
     i_pos = r.m_origin + (t * r.m_direction);
-    n = _f->normal_at_int(r, t);
     
     is_area_light = false;
     // Check if the object is an area light;
@@ -83,12 +133,7 @@ vec3 PhotonTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
 	if (s->m_lights[l]->light_type() == Light::INFINITESIMAL) {
 	  // Cast a shadow ray to determine visibility.
 	  sr = Ray(s->m_lights[l]->direction(i_pos), i_pos + n * BIAS);
-	  for (size_t f = 0; f < s->m_figures.size(); f++) {
-	    if (s->m_figures[f]->intersect(sr, _t) && _t < s->m_lights[l]->distance(i_pos)) {
-	      vis = false;
-	      break;
-	    }
-	  }
+	  vis = !s->occluded(sr, s->m_lights[l]->distance(i_pos));
 
 	} else if (s->m_lights[l]->light_type() == Light::AREA) {
 	  // Cast a shadow ray towards a sample point on the surface of the light source.
@@ -96,15 +141,8 @@ vec3 PhotonTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
 	  al->sample_at_surface();
 	  sr = Ray(al->direction(i_pos), i_pos + (n * BIAS));
 
-	  for (size_t f = 0; f < s->m_figures.size(); f++) {
-	    // Avoid self-intersection with the light source.
-	    if (al->m_figure != s->m_figures[f]) {
-	      if (s->m_figures[f]->intersect(sr, _t) && _t < al->distance(i_pos)) {
-		vis = false;
-		break;
-	      }
-	    }
-	  }
+	  // Avoid self-intersection with the light source.
+	  vis = !s->occluded(sr, al->distance(i_pos), al->m_figure);
 	}
 
 	// Evaluate the shading model accounting for visibility.
@@ -112,56 +150,6 @@ vec3 PhotonTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
       }
 
       // Calculate photon map contribution
-      /*      radius = m_h_radius;
-#ifdef ENABLE_KD_TREE
-      Vec3 vmin(i_pos.x - m_h_radius, i_pos.y - m_h_radius, i_pos.z - m_h_radius);
-      Vec3 vmax(i_pos.x + m_h_radius, i_pos.y + m_h_radius, i_pos.z + m_h_radius);
-      photons = m_photon_map.findInRange(vmin, vmax);
-#else
-      m_photon_map.find_by_distance(photons, i_pos, n, m_h_radius, 1000);
-#endif
-
-      while(photons.size() == 0 && radius < 5.0) {
-	radius *= 2;
-#ifdef ENABLE_KD_TREE
-	vmin = Vec3(i_pos.x - m_h_radius, i_pos.y - m_h_radius, i_pos.z - m_h_radius);
-	vmax = Vec3(i_pos.x + m_h_radius, i_pos.y + m_h_radius, i_pos.z + m_h_radius);
-	photons = m_photon_map.findInRange(vmin, vmax);
-#else
-	m_photon_map.find_by_distance(photons, i_pos, n, m_h_radius, 1000);
-#endif
-      }
-
-      radius = m_h_radius;
-#ifdef ENABLE_KD_TREE
-      caustics = m_photon_map.findInRange(vmin, vmax);
-#else
-      m_caustics_map.find_by_distance(caustics, i_pos, n, m_h_radius, 1000);
-#endif
-
-      while(caustics.size() == 0 && radius < 5.0) {
-	radius *= 2;
-#ifdef ENABLE_KD_TREE
-	vmin = Vec3(i_pos.x - m_h_radius, i_pos.y - m_h_radius, i_pos.z - m_h_radius);
-	vmax = Vec3(i_pos.x + m_h_radius, i_pos.y + m_h_radius, i_pos.z + m_h_radius);
-	photons = m_caustics_map.findInRange(vmin, vmax);
-#else
-	m_caustics_map.find_by_distance(caustics, i_pos, n, m_h_radius, 1000);
-#endif
-}
-
-      for (Photon p : photons) {
-	p.getColor(red, green, blue);
-	p_contrib += vec3(red, green, blue);
-      }
-      p_contrib /= (1.0f - (2.0f / (3.0f * m_cone_filter_k))) * pi<float>() * (radius * radius);
-
-      for (PhotonAux p : caustics) {
-	p.getColor(red, green, blue);
-	c_contrib += vec3(red, green, blue);
-      }
-      c_contrib /= (1.0f - (2.0f / (3.0f * m_cone_filter_k))) * pi<float>() * (radius * radius); */
-
       float irrad[3];
       float pos[3] {i_pos.x, i_pos.y, i_pos.z};
       float normal[3] {n.x, n.y, n.z};
@@ -171,23 +159,44 @@ vec3 PhotonTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
       c_contrib /= (1.0f - (2.0f / (3.0f * m_cone_filter_k))) * pi<float>() * (radius);
       
       // Calculate environment light contribution
+      amb_color = vec3(0.0f);
+
+      // Sample the environment map by importance, weighted against the cosine
+      // sample below with multiple importance sampling.
+      if (s->m_env->can_sample()) {
+	vis = true;
+
+	r1 = next_sample();
+	r2 = next_sample();
+	e_sample = s->m_env->sample(vec2(r1, r2));
+	cos_t = dot(n, e_sample.dir);
+
+	if (e_sample.pdf > 0.0f && cos_t > 0.0f) {
+	  rr = Ray(e_sample.dir, i_pos + (e_sample.dir * BIAS));
+
+	  // Cast a shadow ray to determine visibility.
+	  vis = !s->occluded(rr);
+
+	  if (vis)
+	    amb_color += e_sample.radiance * cos_t * power_heuristic(e_sample.pdf, cos_t / pi<float>()) / e_sample.pdf;
+	}
+      }
+
       vis = true;
 
-      r1 = random01();
-      r2 = random01();
-      sample = sample_hemisphere(r1, r2);
+      r1 = next_sample();
+      r2 = next_sample();
+      sample = sample_cosine_hemisphere(r1, r2);
+      cos_t = sample.y;
       rotate_sample(sample, n);
-      rr = Ray(normalize(sample), i_pos + (sample * BIAS));
+      rr = Ray(sample, i_pos + (sample * BIAS));
 
       // Cast a shadow ray to determine visibility.
-      for (size_t f = 0; f < s->m_figures.size(); f++) {
-	if (s->m_figures[f]->intersect(rr, _t)) {
-	  vis = false;
-	  break;
-	}
-      }
+      vis = !s->occluded(rr);
 
-      amb_color = vis ? s->m_env->get_color(rr) * max(dot(n, rr.m_direction), 0.0f) / PDF : vec3(0.0f);
+      // The cosine factor cancels out with the sampling pdf.
+      if (vis)
+	amb_color += s->m_env->get_color(rr) * pi<float>() * (s->m_env->can_sample() ? power_heuristic(cos_t / pi<float>(), s->m_env->pdf(sample)) : 1.0f);
       
       color += (1.0f - _f->m_mat->m_rho) * (((p_contrib + c_contrib + amb_color) * (_f->m_mat->m_diffuse / pi<float>())) +
       					    (_f->m_mat->m_specular * dir_spec_color));
@@ -225,27 +234,66 @@ vec3 PhotonTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
     return s->m_env->get_color(r);
 }
 
-void PhotonTracer::photon_tracing(Scene * s, const size_t n_photons_per_ligth, const bool specular) {
-  AreaLight * al = NULL;
-  PointLight * pl = NULL;
-  vec3 l_sample, s_normal, h_sample, power;
-  Vec3 ls, dir;
-  float r1, r2;
-  PhotonAux ph;
+void PhotonTracer::importon_tracing(Scene * s, const size_t n_importons, const int w, const int h, const float a_ratio, const float fov) {
+  vec2 sample;
+  Ray r;
+  vector<vec3> hits;
+
+  cout << "Tracing " << ANSI_BOLD_YELLOW << n_importons << ANSI_RESET_STYLE << " importons from the camera." << endl;
+
+#pragma omp parallel for schedule(dynamic, 64) private(sample, r, hits)
+  for (size_t i = 0; i < n_importons; i++) {
+    // Importons leave the camera like primary rays through random pixels.
+    start_sample(IMPORTON_STREAM, static_cast<uint32_t>(i));
+    sample = sample_pixel(static_cast<int>(next_sample() * h), static_cast<int>(next_sample() * w), w, h, a_ratio, fov);
+    r = Ray(normalize(vec3(sample, -0.5f) - vec3(0.0f)), vec3(0.0f));
+    s->m_cam->view_to_world(r);
+
+    hits.clear();
+    trace_importon(r, s, 0, hits);
+
+#pragma omp critical
+    m_importance_map.store(hits);
+  }
+
+  // Photons further than the search radius from a visible point never contribute.
+  m_importance_map.build(m_h_radius, IMPORTANCE_MIN_PROB);
+  cout << "Stored " << ANSI_BOLD_YELLOW << m_importance_map.size() << ANSI_RESET_STYLE << " importon hits." << endl;
+}
+
+void PhotonTracer::photon_tracing(Scene * s, const size_t n_photons_per_ligth, const bool specular, const size_t shard, const size_t shards) {
   uint64_t total = 0, current = 0;
   vector<Figure *> spec_figures;
+  ProjectionMap p_map;
+  uint32_t l_index = 0;
+  float p_weight;
+  // The photons of this shard, all of them when not sharding.
+  size_t first = shards > 0 ? (n_photons_per_ligth * shard) / shards : 0;
+  size_t last = shards > 0 ? (n_photons_per_ligth * (shard + 1)) / shards : n_photons_per_ligth;
+  size_t n_blocks = (last - first + PHOTON_BLOCK - 1) / PHOTON_BLOCK;
+  size_t block_end;
+  double light_start, block_start;
+  int light_photons;
+  photon_group_t group;
+  photon_pass_t * pass;
+  // Sharded photons are merged elsewhere, so their paths can not be updated.
+  const bool track = m_track_paths && shards == 0;
 
   for (Light * light : s->m_lights) {
     total += light->light_type() == Light::AREA ||
       (light->light_type() == Light::INFINITESIMAL &&
        (dynamic_cast<SpotLight *>(light) == NULL || dynamic_cast<DirectionalLight *>(light) == NULL)) ? 1 : 0;
   }
-  total *= static_cast<uint64_t>(n_photons_per_ligth);
+  total *= static_cast<uint64_t>(last - first);
+
+  if (track && m_figure_ids.empty())
+    for (size_t i = 0; i < s->m_figures.size(); i++)
+      m_figure_ids[s->m_figures[i]] = static_cast<uint32_t>(i);
 
   // Separate specular objects to build the caustics photon map.
   if (specular) {
     for (Figure * sf : s->m_figures)
-      if (sf->m_mat->m_refract || sf->m_mat->m_rho > 0.0f)
+      if (sf->is_specular())
 	spec_figures.push_back(sf);
 
     if (spec_figures.size() == 0) {
@@ -259,65 +307,69 @@ void PhotonTracer::photon_tracing(Scene * s, const size_t n_photons_per_ligth, c
 
   cout << "Tracing a total of " << ANSI_BOLD_YELLOW << total << ANSI_RESET_STYLE << " primary photons:" << endl;
   for (Light * l : s->m_lights) {
+    l_index++;
+    light_start = trace_now();
+
     /* Only area lights and point lights supported right now. */
     if (l->light_type() == Light::INFINITESIMAL && (dynamic_cast<SpotLight *>(l) != NULL || dynamic_cast<DirectionalLight *>(l) != NULL))
       continue;
 
-    if (l->light_type() == Light::AREA)
-      al = static_cast<AreaLight *>(l);
-    else
-      pl = static_cast<PointLight *>(l);
-
-    assert(pl != NULL || al != NULL);
-    
-#pragma omp parallel for schedule(dynamic, 1) private(l_sample, s_normal, h_sample, r1, r2, power, ls, dir, ph) shared(al, pl, current)
-    for (size_t p = 0; p < n_photons_per_ligth; p++) {
-      if (al != NULL) {
-#pragma omp critical
-	{
-	  l_sample = al->sample_at_surface();
-	  s_normal = al->normal_at_last_sample();
-	}
-	l_sample = l_sample + (BIAS * s_normal);
-	
-	if (!specular || (specular && spec_figures.size() == 0)) {
-	  // Generate photon from light source in random direction.
-	  r1 = random01();
-	  r2 = random01();
-	  h_sample = normalize(sample_hemisphere(r1, r2));
-	  rotate_sample(h_sample, s_normal);
-	} else {
-	  // Generate photon from light source in the direction of specular reflective objects.
-	  h_sample = normalize(spec_figures[p % spec_figures.size()]->sample_at_surface() - l_sample);
-	}
-
-	// Create the primary photon.
-	power = (al->m_figure->m_mat->m_emission /* / static_cast<float>(n_photons_per_ligth) */);
-	
-      } else if (pl != NULL) {
-	l_sample = glm::vec3(pl->m_position.x, pl->m_position.y, pl->m_position.z);
+    // Find the directions that reach the specular objects, or any object at all.
+    p_map.build(s, l, specular ? spec_figures : s->m_figures, PROJECTION_STREAM + l_index);
+    p_weight = emission_weight(l, p_map);
+
+    pass = NULL;
+    if (track) {
+      // Kept even when the light reaches nothing, in case a figure moves in front of it.
+      m_passes.push_back(photon_pass_t());
+      pass = &m_passes.back();
+      pass->light = l_index;
+      pass->caustics = specular;
+      pass->emitted = n_photons_per_ligth;
+      pass->p_weight = p_weight;
+      pass->p_map = p_map;
+      pass->blocks.resize(p_map.empty() ? 0 : n_blocks);
+    }
 
-	if (!specular || (specular && spec_figures.size() == 0)) {
-	  h_sample = normalize(sample_sphere(l_sample, 1.0f) - l_sample);
-	} else {
-	  // Generate photon from light source in the direction of specular reflective objects.
-	  h_sample = normalize(spec_figures[p % spec_figures.size()]->sample_at_surface() - l_sample);
-	}
+    if (p_map.empty()) {
+      cout << "\r" << ANSI_BOLD_YELLOW << "Light source reaches no " << (specular ? "specular " : "") << "objects, skipping it." << ANSI_RESET_STYLE << endl;
+      current += last - first;
+      trace_event("emit light", light_start, "light", l_index);
+      continue;
+    }
 
-	power = (pl->m_diffuse /* / static_cast<float>(n_photons_per_ligth)*/ );
-      }
+    light_photons = m_photon_map.stored_photons;
 
-      ls = Vec3(l_sample.x, l_sample.y, l_sample.z);
-      dir = Vec3(h_sample.x, h_sample.y, h_sample.z);
-      ph = PhotonAux(ls, dir, power.r, power.g, power.b, 1.0f);
-      
-      trace_photon(ph, s, 0);
+#pragma omp parallel for schedule(dynamic, 1) private(block_start, block_end) shared(current, p_map, p_weight, l_index, pass)
+    for (size_t b = 0; b < n_blocks; b++) {
+      block_start = trace_now();
+      block_end = min(last, first + ((b + 1) * PHOTON_BLOCK));
+      for (size_t p = first + (b * PHOTON_BLOCK); p < block_end; p++)
+	emit_photon(s, l, l_index, specular, p_map, p_weight, p, pass != NULL ? &pass->blocks[b] : NULL);
 
 #pragma omp atomic
-	current++;
+      current += block_end - (first + (b * PHOTON_BLOCK));
+      trace_event("photons", block_start, "light", l_index);
     }
 
-    m_photon_map.scale_photon_power(1.0f / n_photons_per_ligth);
+    if (shards > 0) {
+      // Scaled when merged with the photons of the other shards.
+      group.light = l_index;
+      group.caustics = specular ? 1 : 0;
+      group.emitted = last - first;
+      group.photons = static_cast<uint64_t>(m_photon_map.stored_photons - light_photons);
+      m_groups.push_back(group);
+
+    } else if (pass != NULL) {
+      // Tracked photons stay in their paths until the whole pass is done.
+      store_pass(*pass);
+
+    } else {
+      block_start = trace_now();
+      m_photon_map.scale_photon_power(1.0f / n_photons_per_ligth);
+      trace_event("PhotonMap::scale_photon_power", block_start);
+    }
+    trace_event("emit light", light_start, "light", l_index);
 
     cout << "\r" << setw(3) << static_cast<size_t>((static_cast<double>(current) / static_cast<double>(total)) * 100.0) << "% done.";
   }
@@ -344,6 +396,204 @@ void PhotonTracer::photon_tracing(Scene * s, const size_t n_photons_per_ligth, c
 #endif
 }
 
+// Emits the photon p of the light, recording its path in block if not NULL.
+void PhotonTracer::emit_photon(Scene * s, Light * l, const uint32_t l_index, const bool specular, const ProjectionMap & p_map, const float p_weight,
+			       const size_t p, photon_block_t * block) {
+  AreaLight * al = l->light_type() == Light::AREA ? static_cast<AreaLight *>(l) : NULL;
+  PointLight * pl = al == NULL ? static_cast<PointLight *>(l) : NULL;
+  const bool sphere_light = al != NULL && dynamic_cast<SphereAreaLight *>(l) != NULL;
+  vec3 l_sample, s_normal, h_sample, power;
+  float r1, r2, r3;
+  PhotonAux ph;
+  photon_path_t path;
+
+  if (block != NULL) {
+    path.index = static_cast<uint32_t>(p);
+    path.photons = block->photons.size();
+    path.segments = block->segments.size();
+    path.figures = block->figures.size();
+  }
+
+  start_sample(PHOTON_STREAM + (2 * l_index) + (specular ? 1 : 0), static_cast<uint32_t>(p));
+  r1 = next_sample();
+  r2 = next_sample();
+  r3 = next_sample();
+  h_sample = p_map.sample(r1, r2, r3);
+
+  if (al != NULL) {
+#pragma omp critical
+    {
+      l_sample = al->sample_at_surface();
+      s_normal = al->normal_at_last_sample();
+    }
+
+    if (sphere_light && dot(h_sample, s_normal) <= 0.0f) {
+      // Mirror the sample to the half of the sphere that faces the photon direction.
+      l_sample = (2.0f * static_cast<Sphere *>(al->m_figure)->m_center) - l_sample;
+      s_normal = -s_normal;
+    }
+    l_sample = l_sample + (BIAS * s_normal);
+
+    // Create the primary photon. Directions behind the light's surface carry no power.
+    power = dot(h_sample, s_normal) > 0.0f ? al->m_figure->m_mat->m_emission * p_weight : vec3(0.0f);
+
+  } else {
+    l_sample = glm::vec3(pl->m_position.x, pl->m_position.y, pl->m_position.z);
+    power = pl->m_diffuse * p_weight;
+  }
+
+  if (power != vec3(0.0f)) {
+    ph = PhotonAux(Vec3(l_sample.x, l_sample.y, l_sample.z), Vec3(h_sample.x, h_sample.y, h_sample.z), power.r, power.g, power.b, 1.0f);
+    trace_photon(ph, s, 0, block);
+  }
+
+  if (block != NULL) {
+    path.photons = block->photons.size() - path.photons;
+    path.segments = block->segments.size() - path.segments;
+    path.figures = block->figures.size() - path.figures;
+    block->paths.push_back(path);
+  }
+}
+
+// Stores the photons of the paths of a pass in the photon map, scaled by the photons emitted.
+void PhotonTracer::store_pass(const photon_pass_t & pass) {
+  int first = m_photon_map.stored_photons + 1, stored;
+  size_t n_photons = 0;
+
+  for (const photon_block_t & block : pass.blocks) {
+    if (block.photons.empty())
+      continue;
+    n_photons += block.photons.size();
+    stored = m_photon_map.store(&block.photons[0], static_cast<int>(block.photons.size()));
+    if (static_cast<size_t>(stored) < block.photons.size()) {
+      cerr << "The photon map is full, dropped " << n_photons - stored << " photons." << endl;
+      break;
+    }
+  }
+
+  m_photon_map.scale_photon_power(1.0f / pass.emitted, first, m_photon_map.stored_photons);
+}
+
+size_t PhotonTracer::update_photon_paths(Scene * s, const vector<Figure *> & moved) {
+  const float inf = numeric_limits<float>::max();
+  vector<Figure *> spec_figures;
+  vector<vec3> b_mins, b_maxs;
+  vector<char> is_moved(s->m_figures.size(), 0), retrace;
+  unordered_map<const Figure *, uint32_t>::const_iterator id;
+  ProjectionMap p_map;
+  vec3 b_min, b_max;
+  size_t n_traced = 0, n_paths = 0, n_blocks, block_end, k;
+  uint32_t photons, segments, figures;
+  bool all, changed;
+  Light * l;
+  AreaLight * al;
+  photon_block_t traced;
+
+  if (!tracks_photon_paths())
+    return 0;
+
+  for (Figure * f : moved) {
+    if ((id = m_figure_ids.find(f)) != m_figure_ids.end())
+      is_moved[id->second] = 1;
+    if (!f->bounding_box(b_min, b_max)) {
+      b_min = vec3(-inf);
+      b_max = vec3(inf);
+    }
+    b_mins.push_back(b_min);
+    b_maxs.push_back(b_max);
+  }
+
+  for (Figure * sf : s->m_figures)
+    if (sf->is_specular())
+      spec_figures.push_back(sf);
+
+  for (photon_pass_t & pass : m_passes) {
+    l = s->m_lights[pass.light - 1];
+    al = l->light_type() == Light::AREA ? static_cast<AreaLight *>(l) : NULL;
+
+    // Photons leave from the surface of area lights, so all of them change when it moves.
+    all = al != NULL && find(moved.begin(), moved.end(), al->m_figure) != moved.end();
+
+    // Photons emitted into the old projection map are still weighted right as
+    // long as it covers every direction that reaches the targets now. The map
+    // of a light that stayed is tested from the same points, so only cells
+    // that moved figures block or uncover change.
+    p_map = pass.p_map;
+    if (all)
+      p_map.build(s, l, pass.caustics ? spec_figures : s->m_figures, PROJECTION_STREAM + pass.light);
+    else
+      p_map.rebuild(s, l, pass.caustics ? spec_figures : s->m_figures);
+    if (all || !pass.p_map.covers(p_map)) {
+      all = true;
+      pass.p_map = p_map;
+      pass.p_weight = emission_weight(l, p_map);
+    }
+
+    n_blocks = pass.p_map.empty() ? 0 : (pass.emitted + PHOTON_BLOCK - 1) / PHOTON_BLOCK;
+    pass.blocks.resize(n_blocks);
+    n_paths += pass.emitted;
+
+#pragma omp parallel for schedule(dynamic, 1) private(block_end, k, photons, segments, figures, changed, retrace, traced) reduction(+:n_traced)
+    for (size_t b = 0; b < n_blocks; b++) {
+      photon_block_t & block = pass.blocks[b];
+
+      block_end = min(pass.emitted, (b + 1) * PHOTON_BLOCK);
+      retrace.assign(block_end - (b * PHOTON_BLOCK), all || block.paths.size() != block_end - (b * PHOTON_BLOCK) ? 1 : 0);
+      changed = retrace[0] != 0;
+
+      // A path changes if it hit a moved figure, or if it crosses where one is now.
+      photons = segments = figures = 0;
+      for (k = 0; !changed && k < block.paths.size(); k++) {
+	const photon_path_t & path = block.paths[k];
+
+	for (uint32_t f = figures; f < figures + path.figures && !retrace[k]; f++)
+	  retrace[k] = is_moved[block.figures[f]];
+	for (uint32_t g = segments; g < segments + path.segments && !retrace[k]; g++)
+	  for (size_t m = 0; m < b_mins.size() && !retrace[k]; m++)
+	    retrace[k] = segment_hits_box(block.segments[g], b_mins[m], b_maxs[m]) ? 1 : 0;
+	photons += path.photons;
+	segments += path.segments;
+	figures += path.figures;
+      }
+      for (k = 0; k < retrace.size() && !changed; k++)
+	changed = retrace[k] != 0;
+      if (!changed)
+	continue;
+
+      traced = photon_block_t();
+      photons = segments = figures = 0;
+      for (k = 0; k < retrace.size(); k++) {
+	if (retrace[k]) {
+	  emit_photon(s, l, pass.light, pass.caustics, pass.p_map, pass.p_weight, (b * PHOTON_BLOCK) + k, &traced);
+	  n_traced++;
+	} else {
+	  const photon_path_t & path = block.paths[k];
+
+	  traced.photons.insert(traced.photons.end(), block.photons.begin() + photons, block.photons.begin() + photons + path.photons);
+	  traced.segments.insert(traced.segments.end(), block.segments.begin() + segments, block.segments.begin() + segments + path.segments);
+	  traced.figures.insert(traced.figures.end(), block.figures.begin() + figures, block.figures.begin() + figures + path.figures);
+	  traced.paths.push_back(path);
+	}
+	if (k < block.paths.size()) {
+	  photons += block.paths[k].photons;
+	  segments += block.paths[k].segments;
+	  figures += block.paths[k].figures;
+	}
+      }
+      std::swap(block, traced);
+    }
+  }
+
+  m_photon_map.clear();
+  for (const photon_pass_t & pass : m_passes)
+    store_pass(pass);
+
+  cout << "Traced " << ANSI_BOLD_YELLOW << n_traced << ANSI_RESET_STYLE << " of " << ANSI_BOLD_YELLOW << n_paths << ANSI_RESET_STYLE
+       << " photon paths again, for " << ANSI_BOLD_YELLOW << m_photon_map.stored_photons << ANSI_RESET_STYLE << " photons." << endl;
+
+  return n_traced;
+}
+
 void PhotonTracer::build_photon_map(const char * photons_file, const bool caustics) {
   PhotonAux ph;
   float x, y, z, dx, dy, dz, r, g, b, rc;
@@ -378,66 +628,215 @@ void PhotonTracer::build_photon_map(const char * photons_file, const bool causti
   build_photon_map(caustics);
 }
 
+bool PhotonTracer::save_photon_shard(const char * file_name, const Scene * s, const size_t n_photons_per_ligth, const size_t shard, const size_t shards) const {
+  photon_shard_header_t header;
+  ofstream ofs(file_name, ios::out | ios::binary);
+
+  if (!ofs.is_open()) {
+    cerr << "Failed to open the file " << file_name << " for writing." << endl;
+    return false;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PHOTON_SHARD_MAGIC, sizeof(header.magic));
+  header.photon_size = sizeof(Photon);
+  header.shard = static_cast<uint32_t>(shard);
+  header.shards = static_cast<uint32_t>(shards);
+  header.lights = static_cast<uint32_t>(s->m_lights.size());
+  header.groups = static_cast<uint32_t>(m_groups.size());
+  header.photons_per_light = n_photons_per_ligth;
+  header.photons = static_cast<uint64_t>(m_photon_map.stored_photons);
+
+  ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  if (!m_groups.empty())
+    ofs.write(reinterpret_cast<const char *>(&m_groups[0]), m_groups.size() * sizeof(photon_group_t));
+  // The photon array starts at index 1.
+  ofs.write(reinterpret_cast<const char *>(&m_photon_map.photons[1]), m_photon_map.stored_photons * sizeof(Photon));
+  ofs.close();
+
+  if (!ofs) {
+    cerr << "Failed to write the photon shard " << file_name << "." << endl;
+    return false;
+  }
+  cout << "Wrote " << ANSI_BOLD_YELLOW << m_photon_map.stored_photons << ANSI_RESET_STYLE << " photons to " << ANSI_BOLD_YELLOW << file_name << ANSI_RESET_STYLE << "." << endl;
+
+  return true;
+}
+
+bool PhotonTracer::load_photon_shards(const vector<const char *> & file_names, const Scene * s) {
+  typedef pair<uint32_t, uint32_t> group_key_t;
+  photon_shard_header_t header;
+  vector<photon_group_t> groups;
+  vector<Photon> photons;
+  vector<pair<group_key_t, pair<int, int> > > ranges;
+  map<group_key_t, uint64_t> emitted;
+  vector<bool> merged;
+  uint64_t photons_per_light = 0;
+  size_t offset;
+  int first, stored, n_merged = 0;
+  ifstream ifs;
+
+  for (const char * file_name : file_names) {
+    ifs.open(file_name, ios::in | ios::binary);
+    if (!ifs.is_open()) {
+      cerr << "Failed to open the file " << file_name << " for reading." << endl;
+      return false;
+    }
+
+    if (!ifs.read(reinterpret_cast<char *>(&header), sizeof(header)) || memcmp(header.magic, PHOTON_SHARD_MAGIC, sizeof(header.magic)) != 0 ||
+	header.photon_size != sizeof(Photon) || header.shards == 0 || header.shard >= header.shards) {
+      cerr << file_name << " is not a photon shard written by this program." << endl;
+      return false;
+    }
+    if (header.lights != s->m_lights.size() || (photons_per_light != 0 && (header.photons_per_light != photons_per_light || header.shards != merged.size()))) {
+      cerr << "The photon shard " << file_name << " was traced for another scene or photon count." << endl;
+      return false;
+    }
+    photons_per_light = header.photons_per_light;
+    merged.resize(header.shards, false);
+    if (merged[header.shard]) {
+      cerr << "Skipping the photon shard " << file_name << ", shard " << header.shard << " was merged already." << endl;
+      ifs.close();
+      continue;
+    }
+
+    groups.resize(header.groups);
+    photons.resize(header.photons);
+    if ((header.groups > 0 && !ifs.read(reinterpret_cast<char *>(&groups[0]), header.groups * sizeof(photon_group_t))) ||
+	(header.photons > 0 && !ifs.read(reinterpret_cast<char *>(&photons[0]), header.photons * sizeof(Photon)))) {
+      cerr << "The photon shard " << file_name << " is truncated." << endl;
+      return false;
+    }
+    ifs.close();
+
+    // Store every group and remember where it went, to scale it once the emitted photons are known.
+    offset = 0;
+    for (const photon_group_t & g : groups) {
+      first = m_photon_map.stored_photons + 1;
+      stored = g.photons > 0 ? m_photon_map.store(&photons[offset], static_cast<int>(g.photons)) : 0;
+      offset += g.photons;
+      emitted[make_pair(g.light, g.caustics)] += g.emitted;
+      ranges.push_back(make_pair(make_pair(g.light, g.caustics), make_pair(first, first + stored - 1)));
+      if (static_cast<uint64_t>(stored) < g.photons)
+	cerr << "The photon map is full, dropped photons of " << file_name << "." << endl;
+    }
+    merged[header.shard] = true;
+    n_merged++;
+  }
+
+  for (const pair<group_key_t, pair<int, int> > & r : ranges)
+    m_photon_map.scale_photon_power(1.0f / emitted[r.first], r.second.first, r.second.second);
+
+  cout << "Merged " << ANSI_BOLD_YELLOW << n_merged << ANSI_RESET_STYLE << " of " << ANSI_BOLD_YELLOW << merged.size() << ANSI_RESET_STYLE
+       << " photon shards with " << ANSI_BOLD_YELLOW << m_photon_map.stored_photons << ANSI_RESET_STYLE << " photons." << endl;
+
+  return true;
+}
+
+// POSIX shared memory object names start with a slash.
+static string shm_name(const char * name) {
+  return name[0] == '/' ? string(name) : "/" + string(name);
+}
+
+bool PhotonTracer::publish_photon_map(const char * name) const {
+  if (!m_photon_map.publish(shm_name(name).c_str())) {
+    cerr << "Failed to publish the photon map as " << name << "." << endl;
+    return false;
+  }
+  cout << "Published the photon map as " << ANSI_BOLD_YELLOW << shm_name(name) << ANSI_RESET_STYLE << "." << endl;
+
+  return true;
+}
+
+bool PhotonTracer::attach_photon_map(const char * name) {
+  if (!m_photon_map.attach(shm_name(name).c_str())) {
+    cerr << "Failed to attach the photon map " << name << "." << endl;
+    return false;
+  }
+  cout << "Attached the shared photon map " << ANSI_BOLD_YELLOW << shm_name(name) << ANSI_RESET_STYLE << " with " << ANSI_BOLD_YELLOW
+       << m_photon_map.stored_photons << ANSI_RESET_STYLE << " photons." << endl;
+
+  return true;
+}
+
 void PhotonTracer::build_photon_map(const bool caustics) {
-  cout << "Building photon map Kd-tree." << endl;
-#ifdef ENABLE_KD_TREE
-  if (!caustics)
-    m_photon_map.buildKdTree();
-  else
-  m_caustics_map.buildKdTree();
-#endif
+  double start;
 
+  cout << "Building photon map Kd-tree." << endl;
+  start = trace_now();
   m_photon_map.balance();
+  trace_event("PhotonMap::balance", start);
+
+  if (m_compact) {
+    start = trace_now();
+    m_photon_map.compress();
+    trace_event("PhotonMap::compress", start);
+  }
+  cout << "Photon map uses " << ANSI_BOLD_YELLOW << m_photon_map.memory_usage() / (1024 * 1024) << ANSI_RESET_STYLE << " MiB." << endl;
 }
 
-void PhotonTracer::trace_photon(PhotonAux & ph, Scene * s, const unsigned int rec_level) {
+void PhotonTracer::trace_photon(PhotonAux & ph, Scene * s, const unsigned int rec_level, photon_block_t * block) {
+  unordered_map<const Figure *, uint32_t>::const_iterator id;
+  path_segment_t segment;
+  Photon stored;
   PhotonAux photon;
-  float t, _t, red, green, blue;
+  float t, red, green, blue;
   Figure * _f;
   vec3 n, color, i_pos, sample, ph_dir, ph_pos;
   Vec3 p_pos, p_dir;
   Ray r;
-  float kr, r1, r2;
+  float kr, r1, r2, p_store;
 
   t = numeric_limits<float>::max();
   _f = NULL;
   ph.getColor(red, green, blue);
 
-  // Find the closest intersecting surface.
+  // Find the closest intersecting surface and its normal.
   r = Ray(ph.direction.x, ph.direction.y, ph.direction.z, ph.position.x, ph.position.y, ph.position.z);
-  for (size_t f = 0; f < s->m_figures.size(); f++) {
-    if (s->m_figures[f]->intersect(r, _t) && _t < t) {
-      t = _t;
-      _f = s->m_figures[f];
-    }
+  _f = s->intersect(r, t, n);
+  stat_add(STAT_PHOTON_RAYS);
+
+  if (block != NULL) {
+    segment.origin[0] = r.m_origin.x; segment.origin[1] = r.m_origin.y; segment.origin[2] = r.m_origin.z;
+    segment.dir[0] = r.m_direction.x; segment.dir[1] = r.m_direction.y; segment.dir[2] = r.m_direction.z;
+    segment.t = _f != NULL ? t : numeric_limits<float>::max();
+    block->segments.push_back(segment);
+    if (_f != NULL && (id = m_figure_ids.find(_f)) != m_figure_ids.end())
+      block->figures.push_back(id->second);
   }
 
   // If this ray intersects something:
   if (_f != NULL) {
-    // Take the intersection point and the normal of the surface at that point.
+    // Take the intersection point.
     i_pos = r.m_origin + (t * r.m_direction);
-    n = _f->normal_at_int(r, t);
 
     // Store the diffuse photon and trace.
     if (!_f->m_mat->m_refract){
-#pragma omp critical
-      {
+      // Photons in regions of low visual importance are stored with a lower
+      // probability, and the survivors carry the power of the discarded ones.
+      p_store = m_importance_map.storage_probability(i_pos);
+      if (p_store >= 1.0f || next_sample() < p_store) {
 	p_pos = Vec3(i_pos.x, i_pos.y, i_pos.z);
 	p_dir = Vec3(-ph.direction.x, -ph.direction.y, -ph.direction.z);
-	photon = PhotonAux(p_pos, p_dir, red, green, blue, ph.ref_index);
-	//m_photon_map.addPhoton(photon);
-	float power[3] {red, green, blue};
+	float power[3] {red / p_store, green / p_store, blue / p_store};
 	float pos[3] {p_pos.x, p_pos.y, p_pos.z};
 	float dir[3] {p_dir.x, p_dir.y, p_dir.z};
-	m_photon_map.store(power, pos, dir, ph.ref_index);
+
+	// Tracked photons are kept with their path, which only this thread writes.
+	if (block != NULL) {
+	  m_photon_map.make_photon(&stored, power, pos, dir, ph.ref_index);
+	  block->photons.push_back(stored);
+	} else {
+#pragma omp critical
+	  m_photon_map.store(power, pos, dir, ph.ref_index);
+	}
       }
 
       // Generate a photon for diffuse reflection.
-      r1 = random01();
-      r2 = random01();
-      sample = sample_hemisphere(r1, r2);
+      r1 = next_sample();
+      r2 = next_sample();
+      sample = sample_cosine_hemisphere(r1, r2);
       rotate_sample(sample, n);
-      normalize(sample);
       color = (1.0f - _f->m_mat->m_rho) * (vec3(red, green, blue) * (_f->m_mat->m_diffuse / pi<float>()));
       p_pos = Vec3(i_pos.x, i_pos.y, i_pos.z);
       p_dir = Vec3(sample.x, sample.y, sample.z);
@@ -445,7 +844,7 @@ void PhotonTracer::trace_photon(PhotonAux & ph, Scene * s, const unsigned int re
 
       // Trace diffuse-reflected photon.
       if (rec_level < m_max_depth)
-      	trace_photon(photon, s, rec_level + 1);
+      	trace_photon(photon, s, rec_level + 1, block);
 
       // Trace specular reflected photon.
       if (_f->m_mat->m_rho > 0.0f && rec_level < m_max_depth) {
@@ -455,7 +854,7 @@ void PhotonTracer::trace_photon(PhotonAux & ph, Scene * s, const unsigned int re
       	ph_dir = normalize(reflect(vec3(ph.direction.x, ph.direction.y, ph.direction.z), n));
       	p_dir = Vec3(ph_dir.x, ph_dir.y, ph_dir.z);
       	photon = PhotonAux(p_pos, p_dir, color.r, color.g, color.b, ph.ref_index);
-      	trace_photon(photon, s, rec_level + 1);
+      	trace_photon(photon, s, rec_level + 1, block);
       }
 
     } else if (_f->m_mat->m_refract && rec_level < m_max_depth) {
@@ -471,7 +870,7 @@ void PhotonTracer::trace_photon(PhotonAux & ph, Scene * s, const unsigned int re
       	ph_dir = normalize(reflect(vec3(ph.direction.x, ph.direction.y, ph.direction.z), n));
       	p_dir = Vec3(ph_dir.x, ph_dir.y, ph_dir.z);
       	photon = PhotonAux(p_pos, p_dir, color.r, color.g, color.b, ph.ref_index);
-      	trace_photon(photon, s, rec_level + 1);
+      	trace_photon(photon, s, rec_level + 1, block);
       }
 
       // Trace the transmitted photon.
@@ -482,8 +881,50 @@ void PhotonTracer::trace_photon(PhotonAux & ph, Scene * s, const unsigned int re
       	ph_dir = normalize(refract(vec3(ph.direction.x, ph.direction.y, ph.direction.z), n, ph.ref_index / _f->m_mat->m_ref_index));
       	p_dir = Vec3(ph_dir.x, ph_dir.y, ph_dir.z);
       	photon = PhotonAux(p_pos, p_dir, color.r, color.g, color.b, _f->m_mat->m_ref_index);
-      	trace_photon(photon, s, rec_level + 1);
+      	trace_photon(photon, s, rec_level + 1, block);
       }
     }
   }
 }
+
+void PhotonTracer::trace_importon(Ray & r, Scene * s, const unsigned int rec_level, vector<vec3> & hits) const {
+  float t, kr;
+  Figure * _f;
+  vec3 n, i_pos;
+  Ray rr;
+
+  t = numeric_limits<float>::max();
+  _f = NULL;
+
+  // Find the closest intersecting surface and its normal.
+  _f = s->intersect(r, t, n);
+
+  if (_f == NULL)
+    return;
+
+  i_pos = r.m_origin + (t * r.m_direction);
+
+  // Follow the same specular paths as trace_ray, recording every point where
+  // the photon map gets queried.
+  if (!_f->m_mat->m_refract) {
+    hits.push_back(i_pos);
+
+    if (_f->m_mat->m_rho > 0.0f && rec_level < m_max_depth) {
+      rr = Ray(normalize(reflect(r.m_direction, n)), i_pos + n * BIAS);
+      trace_importon(rr, s, rec_level + 1, hits);
+    }
+
+  } else if (rec_level < m_max_depth) {
+    kr = fresnel(r.m_direction, n, r.m_ref_index, _f->m_mat->m_ref_index);
+
+    if (kr > 0.0f) {
+      rr = Ray(normalize(reflect(r.m_direction, n)), i_pos + n * BIAS);
+      trace_importon(rr, s, rec_level + 1, hits);
+    }
+
+    if (kr < 1.0f) {
+      rr = Ray(normalize(refract(r.m_direction, n, r.m_ref_index / _f->m_mat->m_ref_index)), i_pos - n * BIAS, _f->m_mat->m_ref_index);
+      trace_importon(rr, s, rec_level + 1, hits);
+    }
+  }
+}
@@ -2,11 +2,19 @@
 #ifndef PHOTON_TRACER_HPP
 #define PHOTON_TRACER_HPP
 
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
 #include "tracer.hpp"
-//#include "kd_tree.hpp"
 #include "photonmap.hpp"
+#include "importance_map.hpp"
+#include "projection_map.hpp"
 #include "rgbe.hpp"
 
+using std::vector;
+using std::unordered_map;
+
 struct Vec3
 {
   float x;
@@ -66,38 +74,139 @@ struct PhotonAux
   }
 };
 
+/* Photon shards hold the photons of a slice of the emission of every
+ * light, traced by a separate process, to be merged by the process that
+ * renders. Shard k of n emits the photons [k * N / n, (k + 1) * N / n) of
+ * the N per light and pass, with the same sample streams as a single
+ * process, so with a sampler the merged shards are the photons of one
+ * process whatever n is. Powers are left unscaled, since scaling needs
+ * the photons emitted by every shard. A shard file is, in native byte
+ * order, a photon_shard_header_t, then its groups, then the photons of
+ * every group one after another. */
+typedef struct PHOTON_SHARD_HEADER {
+  char magic[8];
+  uint32_t photon_size;
+  uint32_t shard;
+  uint32_t shards;
+  uint32_t lights;
+  uint32_t groups;
+  uint32_t pad;
+  uint64_t photons_per_light;
+  uint64_t photons;
+} photon_shard_header_t;
+
+// The photons stored for the photons emitted from a light in one pass.
+typedef struct PHOTON_GROUP {
+  uint32_t light;
+  uint32_t caustics;
+  uint64_t emitted;
+  uint64_t photons;
+} photon_group_t;
+
+/* Photon paths are kept, when tracked, to trace again only the photons
+ * that moved figures change. A path is everything a photon emitted from a
+ * light did: the photons it stored, the straight segments it flew along
+ * and the figures it hit, by their index in the scene. Segments of photons
+ * that left the scene are infinitely long. */
+typedef struct PATH_SEGMENT {
+  float origin[3];
+  float dir[3];
+  float t;
+} path_segment_t;
+
+typedef struct PHOTON_PATH {
+  uint32_t index;
+  uint32_t photons;
+  uint32_t segments;
+  uint32_t figures;
+} photon_path_t;
+
+// The paths of the photons of one emission block, in emission order.
+typedef struct PHOTON_BLOCK {
+  vector<photon_path_t> paths;
+  vector<Photon> photons;
+  vector<path_segment_t> segments;
+  vector<uint32_t> figures;
+} photon_block_t;
+
+// The photons emitted from a light in one pass, and how they were emitted.
+typedef struct PHOTON_PASS {
+  uint32_t light;
+  bool caustics;
+  size_t emitted;
+  float p_weight;
+  ProjectionMap p_map;
+  vector<photon_block_t> blocks;
+} photon_pass_t;
+
 class PhotonTracer: public Tracer {  
 public:
   PhotonTracer():
     Tracer(), m_h_radius(0.5f),
     m_cone_filter_k(1.0f),
     m_photon_map(7000000),
-    m_max_s_photons(5000)
+    m_max_s_photons(5000),
+    m_compact(false),
+    m_track_paths(false)
   { }
   
-  PhotonTracer(unsigned int max_depth, float _r = 0.5f, float _k = 1.0f, const int max_photons = 7000000, const int max_search = 5000):
+  PhotonTracer(unsigned int max_depth, float _r = 0.5f, float _k = 1.0f, const int max_photons = 7000000, const int max_search = 5000, const bool compact = false):
     Tracer(max_depth),
     m_h_radius(_r),
     m_cone_filter_k(_k < 1.0f ? 1.0f : _k),
     m_photon_map(max_photons),
-    m_max_s_photons(max_search)
+    m_max_s_photons(max_search),
+    m_compact(compact),
+    m_track_paths(false)
   { };
 
   virtual ~PhotonTracer();
-  virtual vec3 trace_ray(Ray & r, Scene * s, unsigned int rec_level) const;
+  virtual vec3 trace_ray(Ray & r, Scene * s, unsigned int rec_level, first_hit_t * hit = NULL) const;
 
-  void photon_tracing(Scene * s, const size_t n_photons_per_ligth = 10000, const bool specular = false);
+  void importon_tracing(Scene * s, const size_t n_importons, const int w, const int h, const float a_ratio, const float fov);
+  // With shards > 0 only traces the given shard, see photon_shard_header_t.
+  void photon_tracing(Scene * s, const size_t n_photons_per_ligth = 10000, const bool specular = false, const size_t shard = 0, const size_t shards = 0);
   void build_photon_map(const char * photons_file, const bool caustics = false);
   void build_photon_map(const bool caustics = false);
 
+  bool save_photon_shard(const char * file_name, const Scene * s, const size_t n_photons_per_ligth, const size_t shard, const size_t shards) const;
+  // Stores the photons of the shards with their powers scaled, without balancing.
+  bool load_photon_shards(const vector<const char *> & file_names, const Scene * s);
+
+  // Share the balanced photon map with other processes through POSIX shared memory.
+  bool publish_photon_map(const char * name) const;
+  bool attach_photon_map(const char * name);
+
+  /* Keeps the path of every photon traced from then on, see photon_path_t.
+   * This takes about twice the memory of the photon map. */
+  void track_photon_paths(const bool track) { m_track_paths = track; }
+  bool tracks_photon_paths() const { return m_track_paths && !m_passes.empty(); }
+
+  /* After the figures in moved changed places, traces again the tracked
+   * paths that hit one of them or now cross their bounding boxes, and
+   * stores all the photons again, to be balanced by build_photon_map().
+   * The photons of a light are all traced again when its figure moved or
+   * when its projection map reaches new directions. Returns how many
+   * paths were traced again. */
+  size_t update_photon_paths(Scene * s, const vector<Figure *> & moved);
+
 private:
   float m_h_radius;
   float m_cone_filter_k;
-  /*kdTree m_photon_map;
-    kdTree m_caustics_map;*/
   PhotonMap m_photon_map;
   int m_max_s_photons;
-  void trace_photon(PhotonAux & ph, Scene * s, const unsigned int rec_level);
+  bool m_compact;
+  ImportanceMap m_importance_map;
+  vector<photon_group_t> m_groups;
+  bool m_track_paths;
+  vector<photon_pass_t> m_passes;
+  // Index in the scene of every figure, for the paths.
+  unordered_map<const Figure *, uint32_t> m_figure_ids;
+  void emit_photon(Scene * s, Light * l, const uint32_t l_index, const bool specular, const ProjectionMap & p_map, const float p_weight,
+		   const size_t p, photon_block_t * block);
+  void trace_photon(PhotonAux & ph, Scene * s, const unsigned int rec_level, photon_block_t * block = NULL);
+  void store_pass(const photon_pass_t & pass);
+  void trace_importon(Ray & r, Scene * s, const unsigned int rec_level, vector<vec3> & hits) const;
 };
 
 #endif
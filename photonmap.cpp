@@ -10,9 +10,21 @@
 #include <alloca.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "photonmap.hpp"
 #include "rgbe.hpp"
+#include "stats.hpp"
+
+// Segments smaller than this are balanced in the calling task
+#ifndef BALANCE_TASK_SIZE
+#define BALANCE_TASK_SIZE 65536
+#endif
+
+static const char SHARED_MAGIC[8] = {'P', 'H', 'O', 'T', 'O', 'N', 'S', '1'};
 
 /* This is the constructor for the photon map.
  * To create the photon map it is necessary to specify the
@@ -23,10 +35,14 @@ PhotonMap :: PhotonMap( const int max_phot )
 //************************************************
 {
   stored_photons = 0;
+  half_stored_photons = 0;
   prev_scale = 1;
   max_photons = max_phot;
 
   photons = (Photon*)malloc( sizeof( Photon ) * ( max_photons+1 ) );
+  cphotons = NULL;
+  shared = NULL;
+  shared_size = 0;
 
   if (photons == NULL) {
     fprintf(stderr,"Out of memory initializing photon map\n");
@@ -54,7 +70,13 @@ PhotonMap :: PhotonMap( const int max_phot )
 PhotonMap :: ~PhotonMap()
 //*************************
 {
+  if (shared != NULL) {
+    munmap( shared, shared_size );
+    return;
+  }
+
   free( photons );
+  free( cphotons );
 }
 
 
@@ -70,6 +92,65 @@ void PhotonMap :: photon_dir( float *dir, const Photon *p ) const
 }
 
 
+/* octahedral_dir undoes the octahedral mapping done in
+ * compress. The result is not normalized, which is enough
+ * to tell which side of a surface the photon came from.
+ */
+//*****************************************************************************
+inline void PhotonMap :: octahedral_dir( float *dir, const CompactPhoton *p ) const
+//*****************************************************************************
+{
+  // no libm calls here, the renderer is built with -fno-builtin
+  const float u = p->dir[0]*(2.0f/65535.0f) - 1.0f;
+  const float v = p->dir[1]*(2.0f/65535.0f) - 1.0f;
+  const float z = 1.0f - (u < 0.0f ? -u : u) - (v < 0.0f ? -v : v);
+
+  // fold the lower hemisphere back without branching
+  const float t = z < 0.0f ? -z : 0.0f;
+  dir[0] = u < 0.0f ? u + t : u - t;
+  dir[1] = v < 0.0f ? v + t : v - t;
+  dir[2] = z;
+}
+
+
+/* photon_dir returns the direction of a compact photon
+ */
+//************************************************************************
+void PhotonMap :: photon_dir( float *dir, const CompactPhoton *p ) const
+//************************************************************************
+{
+  octahedral_dir( dir, p );
+
+  float inv_len = 1.0f/sqrtf(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+  dir[0] *= inv_len;
+  dir[1] *= inv_len;
+  dir[2] *= inv_len;
+}
+
+
+/* photon_pos returns the position of a photon, dequantizing
+ * it for compact photons
+ */
+//*****************************************************************
+inline void PhotonMap :: photon_pos( float *pos, const Photon *p ) const
+//*****************************************************************
+{
+  pos[0] = p->pos[0];
+  pos[1] = p->pos[1];
+  pos[2] = p->pos[2];
+}
+
+
+//************************************************************************
+inline void PhotonMap :: photon_pos( float *pos, const CompactPhoton *p ) const
+//************************************************************************
+{
+  pos[0] = bbox_min[0] + p->pos[0]*qscale[0];
+  pos[1] = bbox_min[1] + p->pos[1]*qscale[1];
+  pos[2] = bbox_min[2] + p->pos[2]*qscale[2];
+}
+
+
 /* irradiance_estimate computes an irradiance estimate
  * at a given surface position
 */
@@ -86,16 +167,19 @@ void PhotonMap :: irradiance_estimate(
 
   NearestPhotons np;
   np.dist2 = (float*)alloca( sizeof(float)*(nphotons+1) );
-  np.index = (const Photon**)alloca( sizeof(Photon*)*(nphotons+1) );
+  np.index = (int*)alloca( sizeof(int)*(nphotons+1) );
 
   np.pos[0] = pos[0]; np.pos[1] = pos[1]; np.pos[2] = pos[2];
   np.max = nphotons;
   np.found = 0;
   np.got_heap = 0;
+  np.visited = 0;
   np.dist2[0] = max_dist*max_dist;
 
   // locate the nearest photons
   locate_photons( &np, 1 );
+  stat_add( STAT_KNN_QUERIES );
+  stat_add( STAT_PHOTONS_VISITED, np.visited );
 
   // if less than 8 photons return
   if (np.found<8)
@@ -105,14 +189,20 @@ void PhotonMap :: irradiance_estimate(
 
   // sum irradiance from all photons
   for (int i=1; i<=np.found; i++) {
-    const Photon *p = np.index[i];
+    const unsigned char *power;
     // the photon_dir call and following if can be omitted (for speed)
     // if the scene does not have any thin surfaces
-    photon_dir( pdir, p );
+    if (cphotons != NULL) {
+      octahedral_dir( pdir, &cphotons[np.index[i]] );
+      power = cphotons[np.index[i]].power;
+    } else {
+      photon_dir( pdir, &photons[np.index[i]] );
+      power = photons[np.index[i]].power;
+    }
     if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) < 0.0f ) {
       float red, green, blue;
 
-      rgbe2float(red, green, blue, p->power);
+      rgbe2float(red, green, blue, power);
       
       irrad[0] += red;
       irrad[1] += green;
@@ -137,30 +227,56 @@ void PhotonMap :: locate_photons(
   const int index ) const
 //******************************************
 {
-  const Photon *p = &photons[index];
+  if (cphotons != NULL)
+    locate_photons( np, cphotons, index );
+  else
+    locate_photons( np, photons, index );
+}
+
+
+/* the search itself, instantiated for the uncompressed
+ * and the compact photon arrays
+*/
+//******************************************
+template <class P>
+void PhotonMap :: locate_photons(
+  NearestPhotons *const np,
+  const P *array,
+  const int index ) const
+//******************************************
+{
+  // the last internal node may only have a left child
+  if (index>stored_photons)
+    return;
+
+  const P *p = &array[index];
+  float pos[3];
   float dist1;
 
-  if (index<half_stored_photons) {
-    dist1 = np->pos[ p->plane ] - p->pos[ p->plane ];
+  np->visited++;
+  photon_pos( pos, p );
+
+  if (index<=half_stored_photons) {
+    dist1 = np->pos[ p->plane ] - pos[ p->plane ];
 
     if (dist1>0.0) { // if dist1 is positive search right plane
-      locate_photons( np, 2*index+1 );
+      locate_photons( np, array, 2*index+1 );
       if ( dist1*dist1 < np->dist2[0] )
-        locate_photons( np, 2*index );
+        locate_photons( np, array, 2*index );
     } else {         // dist1 is negative search left first
-      locate_photons( np, 2*index );
+      locate_photons( np, array, 2*index );
       if ( dist1*dist1 < np->dist2[0] )
-        locate_photons( np, 2*index+1 );
+        locate_photons( np, array, 2*index+1 );
     }
   }
 
   // compute squared distance between current photon and np->pos
 
-  dist1 = p->pos[0] - np->pos[0];
+  dist1 = pos[0] - np->pos[0];
   float dist2 = dist1*dist1;
-  dist1 = p->pos[1] - np->pos[1];
+  dist1 = pos[1] - np->pos[1];
   dist2 += dist1*dist1;
-  dist1 = p->pos[2] - np->pos[2];
+  dist1 = pos[2] - np->pos[2];
   dist2 += dist1*dist1;
   
   if ( dist2 < np->dist2[0] ) {
@@ -170,14 +286,14 @@ void PhotonMap :: locate_photons(
       // heap is not full; use array
       np->found++;
       np->dist2[np->found] = dist2;
-      np->index[np->found] = p;
+      np->index[np->found] = index;
     } else {
       int j,parent;
 
       if (np->got_heap==0) { // Do we need to build the heap?
         // Build heap
         float dst2;
-        const Photon *phot;
+        int phot;
         int half_found = np->found>>1;
         for ( int k=half_found; k>=1; k--) {
           parent=k;
@@ -214,7 +330,7 @@ void PhotonMap :: locate_photons(
         parent = j;
         j += j;
       }
-      np->index[parent] = p;
+      np->index[parent] = index;
       np->dist2[parent] = dist2;
 
       np->dist2[0] = np->dist2[1];
@@ -223,6 +339,139 @@ void PhotonMap :: locate_photons(
 }
 
 
+/* find_nearest finds the k photons nearest to pos within
+ * max_dist. Their indices and squared distances are returned
+ * sorted by increasing distance, along with their number
+*/
+//******************************************
+int PhotonMap :: find_nearest(
+  int *found,
+  float *dist2,
+  const float pos[3],
+  const float max_dist,
+  const int k ) const
+//******************************************
+{
+  NearestPhotons np;
+  np.dist2 = (float*)alloca( sizeof(float)*(k+1) );
+  np.index = (int*)alloca( sizeof(int)*(k+1) );
+
+  np.pos[0] = pos[0]; np.pos[1] = pos[1]; np.pos[2] = pos[2];
+  np.max = k;
+  np.found = 0;
+  np.got_heap = 0;
+  np.visited = 0;
+  np.dist2[0] = max_dist*max_dist;
+
+  if (stored_photons>0)
+    locate_photons( &np, 1 );
+  stat_add( STAT_KNN_QUERIES );
+  stat_add( STAT_PHOTONS_VISITED, np.visited );
+
+  // insertion sort, the candidate list is mostly a max heap
+  for (int i=1; i<=np.found; i++) {
+    const float d = np.dist2[i];
+    const int idx = np.index[i];
+    int j = i-2;
+    while ( j>=0 && dist2[j]>d ) {
+      dist2[j+1] = dist2[j];
+      found[j+1] = found[j];
+      j--;
+    }
+    dist2[j+1] = d;
+    found[j+1] = idx;
+  }
+
+  return np.found;
+}
+
+
+/* find_in_radius finds all photons within max_dist of pos.
+ * Unlike locate_photons the number of photons is not bounded
+*/
+//******************************************
+void PhotonMap :: find_in_radius(
+  std::vector<int> &found,
+  const float pos[3],
+  const float max_dist ) const
+//******************************************
+{
+  found.clear();
+
+  if (stored_photons<1)
+    return;
+
+  if (cphotons != NULL)
+    gather_photons( found, pos, max_dist*max_dist, cphotons, 1 );
+  else
+    gather_photons( found, pos, max_dist*max_dist, photons, 1 );
+}
+
+
+//******************************************
+template <class P>
+void PhotonMap :: gather_photons(
+  std::vector<int> &found,
+  const float pos[3],
+  const float max_dist2,
+  const P *array,
+  const int index ) const
+//******************************************
+{
+  if (index>stored_photons)
+    return;
+
+  const P *p = &array[index];
+  float ppos[3];
+  float dist1;
+
+  photon_pos( ppos, p );
+
+  if (index<=half_stored_photons) {
+    dist1 = pos[ p->plane ] - ppos[ p->plane ];
+
+    // the side of the plane containing pos is always searched
+    if ( dist1>0.0 || dist1*dist1 < max_dist2 )
+      gather_photons( found, pos, max_dist2, array, 2*index+1 );
+    if ( dist1<=0.0 || dist1*dist1 < max_dist2 )
+      gather_photons( found, pos, max_dist2, array, 2*index );
+  }
+
+  dist1 = ppos[0] - pos[0];
+  float dist2 = dist1*dist1;
+  dist1 = ppos[1] - pos[1];
+  dist2 += dist1*dist1;
+  dist1 = ppos[2] - pos[2];
+  dist2 += dist1*dist1;
+
+  if ( dist2 < max_dist2 )
+    found.push_back( index );
+}
+
+
+/* photon_position and photon_power return the data of
+ * the photon at index, as given by the search functions
+*/
+//************************************************************
+void PhotonMap :: photon_position( float pos[3], const int index ) const
+//************************************************************
+{
+  if (cphotons != NULL)
+    photon_pos( pos, &cphotons[index] );
+  else
+    photon_pos( pos, &photons[index] );
+}
+
+
+//************************************************************
+void PhotonMap :: photon_power( float power[3], const int index ) const
+//************************************************************
+{
+  rgbe2float( power[0], power[1], power[2],
+              cphotons != NULL ? cphotons[index].power : photons[index].power );
+}
+
+
 /* store puts a photon into the flat array that will form
  * the final kd-tree.
  *
@@ -236,24 +485,43 @@ void PhotonMap :: store(
   const float ref_index)
 //***************************
 {
-  if (stored_photons>=max_photons)
+  if (stored_photons>=max_photons || shared != NULL)
     return;
 
+  if (cphotons != NULL)
+    decompress();
+
   stored_photons++;
   Photon *const node = &photons[stored_photons];
 
-  node->ref_index = ref_index;
-  
-  for (int i=0; i<3; i++) {
-    node->pos[i] = pos[i];
+  make_photon( node, power, pos, dir, ref_index );
 
+  for (int i=0; i<3; i++) {
     if (node->pos[i] < bbox_min[i])
       bbox_min[i] = node->pos[i];
     if (node->pos[i] > bbox_max[i])
       bbox_max[i] = node->pos[i];
-
-    //node->power[i] = power[i];
   }
+}
+
+
+/* make_photon encodes a photon the way store does, for
+ * photons kept outside of the map until they are stored
+*/
+//***************************
+void PhotonMap :: make_photon(
+  Photon *node,
+  const float power[3],
+  const float pos[3],
+  const float dir[3],
+  const float ref_index ) const
+//***************************
+{
+  node->ref_index = ref_index;
+  node->plane = 0;
+
+  for (int i=0; i<3; i++)
+    node->pos[i] = pos[i];
 
   float2rgbe(node->power, power[0], power[1], power[2]);
 
@@ -273,6 +541,36 @@ void PhotonMap :: store(
 }
 
 
+/* clear drops every photon so that the map can be stored
+ * and balanced again, like when the scene changed
+*/
+//******************************
+void PhotonMap :: clear(void)
+//******************************
+{
+  if (shared != NULL)
+    return;
+
+  if (cphotons != NULL) {
+    free( cphotons );
+    cphotons = NULL;
+    photons = (Photon*)malloc( sizeof( Photon ) * ( max_photons+1 ) );
+
+    if (photons == NULL) {
+      fprintf(stderr,"Out of memory initializing photon map\n");
+      exit(-1);
+    }
+  }
+
+  stored_photons = 0;
+  half_stored_photons = 0;
+  prev_scale = 1;
+
+  bbox_min[0] = bbox_min[1] = bbox_min[2] = 1e8f;
+  bbox_max[0] = bbox_max[1] = bbox_max[2] = -1e8f;
+}
+
+
 /* scale_photon_power is used to scale the power of all
  * photons once they have been emitted from the light
  * source. scale = 1/(#emitted photons).
@@ -282,6 +580,12 @@ void PhotonMap :: store(
 void PhotonMap :: scale_photon_power( const float scale )
 //********************************************************
 {
+  if (shared != NULL)
+    return;
+
+  if (cphotons != NULL)
+    decompress();
+
   for (int i=prev_scale; i<=stored_photons; i++) {
     float red, green, blue;
     rgbe2float(red, green, blue, photons[i].power);
@@ -296,6 +600,70 @@ void PhotonMap :: scale_photon_power( const float scale )
 }
 
 
+/* store appends photons that were stored by another photon map,
+ * like the shards of a photon map traced by separate processes.
+ * Their powers are kept as they are. Returns how many fit.
+*/
+//***************************
+int PhotonMap :: store(
+  const Photon *p,
+  const int n )
+//***************************
+{
+  int count = n < max_photons-stored_photons ? n : max_photons-stored_photons;
+
+  if (shared != NULL)
+    return 0;
+
+  if (cphotons != NULL)
+    decompress();
+
+  for (int k=0; k<count; k++) {
+    photons[stored_photons+1+k] = p[k];
+
+    for (int i=0; i<3; i++) {
+      if (p[k].pos[i] < bbox_min[i])
+        bbox_min[i] = p[k].pos[i];
+      if (p[k].pos[i] > bbox_max[i])
+        bbox_max[i] = p[k].pos[i];
+    }
+  }
+  stored_photons += count;
+
+  return count;
+}
+
+
+/* This scale_photon_power scales the photons first to last,
+ * both included, for photons that were not emitted in order
+ * light by light.
+*/
+//********************************************************
+void PhotonMap :: scale_photon_power(
+  const float scale,
+  const int first,
+  const int last )
+//********************************************************
+{
+  if (shared != NULL)
+    return;
+
+  if (cphotons != NULL)
+    decompress();
+
+  for (int i=first; i<=last && i<=stored_photons; i++) {
+    float red, green, blue;
+    rgbe2float(red, green, blue, photons[i].power);
+
+    red *= scale;
+    green *= scale;
+    blue *= scale;
+
+    float2rgbe(photons[i].power, red, green, blue);
+  }
+}
+
+
 /* balance creates a left balanced kd-tree from the flat photon array.
  * This function should be called before the photon map
  * is used for rendering.
@@ -304,6 +672,12 @@ void PhotonMap :: scale_photon_power( const float scale )
 void PhotonMap :: balance(void)
 //******************************
 {
+  if (shared != NULL)
+    return;
+
+  if (cphotons != NULL)
+    decompress();
+
   if (stored_photons>1) {
     // allocate two temporary arrays for the balancing procedure
     Photon **pa1 = (Photon**)malloc(sizeof(Photon*)*(stored_photons+1));
@@ -312,7 +686,10 @@ void PhotonMap :: balance(void)
     for (int i=0; i<=stored_photons; i++)
       pa2[i] = &photons[i];
 
-    balance_segment( pa1, pa2, 1, 1, stored_photons );
+    // the two halves of every segment are balanced in parallel
+    #pragma omp parallel
+    #pragma omp single
+    balance_segment( pa1, pa2, 1, 1, stored_photons, bbox_min, bbox_max );
     free(pa2);
 
     // reorganize balanced kd-tree (make a heap)
@@ -341,7 +718,246 @@ void PhotonMap :: balance(void)
     free(pa1);
   }
 
-  half_stored_photons = stored_photons/2-1;
+  // nodes up to stored_photons/2 have at least one child
+  half_stored_photons = stored_photons/2;
+}
+
+
+/* compress replaces the balanced photon array with compact
+ * photons, see photonmap.hpp for the error bounds. The photons
+ * are expanded back if more of them are stored later.
+*/
+//*******************************
+void PhotonMap :: compress(void)
+//*******************************
+{
+  if (cphotons != NULL || stored_photons<1 || shared != NULL)
+    return;
+
+  cphotons = (CompactPhoton*)malloc( sizeof( CompactPhoton ) * ( stored_photons+1 ) );
+
+  if (cphotons == NULL) {
+    fprintf(stderr,"Out of memory compressing photon map\n");
+    exit(-1);
+  }
+
+  for (int i=0; i<3; i++) {
+    const float extent = bbox_max[i]-bbox_min[i];
+    qscale[i] = extent > 0.0f ? extent/65535.0f : 0.0f;
+  }
+
+  for (int i=1; i<=stored_photons; i++) {
+    const Photon *p = &photons[i];
+    CompactPhoton *c = &cphotons[i];
+    float dir[3];
+
+    for (int k=0; k<3; k++) {
+      const float q = qscale[k] > 0.0f ? (p->pos[k]-bbox_min[k])/qscale[k] + 0.5f : 0.0f;
+      c->pos[k] = (unsigned short)(q > 65535.0f ? 65535.0f : q);
+    }
+
+    // octahedral mapping of the unit direction to the unit square
+    photon_dir( dir, p );
+    const float l1 = fabsf(dir[0]) + fabsf(dir[1]) + fabsf(dir[2]);
+    float u = dir[0]/l1;
+    float v = dir[1]/l1;
+    if (dir[2] < 0.0f) {
+      const float tu = u;
+      u = (1.0f - fabsf(v))*(tu >= 0.0f ? 1.0f : -1.0f);
+      v = (1.0f - fabsf(tu))*(v >= 0.0f ? 1.0f : -1.0f);
+    }
+    c->dir[0] = (unsigned short)((u*0.5f + 0.5f)*65535.0f + 0.5f);
+    c->dir[1] = (unsigned short)((v*0.5f + 0.5f)*65535.0f + 0.5f);
+
+    memcpy( c->power, p->power, 4 );
+    c->plane = (unsigned char)p->plane;
+    c->pad = 0;
+  }
+
+  free( photons );
+  photons = NULL;
+}
+
+
+/* decompress expands compact photons back into the
+ * full photon array so that more photons can be stored
+*/
+//*********************************
+void PhotonMap :: decompress(void)
+//*********************************
+{
+  photons = (Photon*)malloc( sizeof( Photon ) * ( max_photons+1 ) );
+
+  if (photons == NULL) {
+    fprintf(stderr,"Out of memory initializing photon map\n");
+    exit(-1);
+  }
+
+  for (int i=1; i<=stored_photons; i++) {
+    const CompactPhoton *c = &cphotons[i];
+    Photon *p = &photons[i];
+    float dir[3];
+
+    photon_pos( p->pos, c );
+    photon_dir( dir, c );
+    memcpy( p->power, c->power, 4 );
+    p->plane = c->plane;
+    p->ref_index = 1.0f;
+
+    int theta = int( acos(dir[2])*(256.0/M_PI) );
+    p->theta = (unsigned char)(theta>255 ? 255 : theta);
+    int phi = int( atan2(dir[1],dir[0])*(256.0/(2.0*M_PI)) );
+    p->phi = (unsigned char)(phi>255 ? 255 : (phi<0 ? phi+256 : phi));
+  }
+
+  free( cphotons );
+  cphotons = NULL;
+}
+
+
+/* memory_usage returns the size in bytes of the photon array
+*/
+//***************************************************
+size_t PhotonMap :: memory_usage(void) const
+//***************************************************
+{
+  if (cphotons != NULL)
+    return sizeof( CompactPhoton ) * ( stored_photons+1 );
+  return sizeof( Photon ) * ( max_photons+1 );
+}
+
+
+/* publish copies the balanced photon map to the POSIX shared
+ * memory object name, replacing any map published there before.
+ * Processes that attached the old map keep it until they exit.
+ * The object stays until it is unlinked, by removing it from
+ * /dev/shm on Linux.
+*/
+//***************************************************
+bool PhotonMap :: publish( const char *name ) const
+//***************************************************
+{
+  SharedPhotonMap header;
+  const int photon_size = cphotons != NULL ? sizeof( CompactPhoton ) : sizeof( Photon );
+  const int data_offset = (sizeof( SharedPhotonMap )+63) & ~63;
+  const size_t size = data_offset + (size_t)photon_size*(stored_photons+1);
+  void *mem;
+  int fd;
+
+  shm_unlink( name );
+  fd = shm_open( name, O_CREAT | O_EXCL | O_RDWR, 0644 );
+  if (fd < 0 || ftruncate( fd, size ) < 0) {
+    perror( name );
+    if (fd >= 0) {
+      close( fd );
+      shm_unlink( name );
+    }
+    return false;
+  }
+
+  mem = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if (mem == MAP_FAILED) {
+    perror( name );
+    shm_unlink( name );
+    return false;
+  }
+
+  memset( &header, 0, sizeof( header ) );
+  header.photon_size = photon_size;
+  header.compact = cphotons != NULL;
+  header.stored_photons = stored_photons;
+  header.half_stored_photons = half_stored_photons;
+  header.data_offset = data_offset;
+  for (int i=0; i<3; i++) {
+    header.bbox_min[i] = bbox_min[i];
+    header.bbox_max[i] = bbox_max[i];
+    header.qscale[i] = qscale[i];
+  }
+
+  memcpy( (char*)mem+data_offset, cphotons != NULL ? (void*)cphotons : (void*)photons, size-data_offset );
+  memcpy( mem, &header, sizeof( header ) );
+  // readers check the magic, so it goes in last
+  __sync_synchronize();
+  memcpy( ((SharedPhotonMap*)mem)->magic, SHARED_MAGIC, sizeof( SHARED_MAGIC ) );
+
+  munmap( mem, size );
+
+  return true;
+}
+
+
+/* attach replaces the photons with the balanced photon map
+ * published in the POSIX shared memory object name. The map
+ * is mapped read only, so the pages are shared by every
+ * process that attaches it, and can not store more photons.
+*/
+//***************************************************
+bool PhotonMap :: attach( const char *name )
+//***************************************************
+{
+  const SharedPhotonMap *header;
+  struct stat st;
+  void *mem;
+  int fd;
+
+  if (shared != NULL)
+    return false;
+
+  fd = shm_open( name, O_RDONLY, 0 );
+  if (fd < 0 || fstat( fd, &st ) < 0) {
+    perror( name );
+    if (fd >= 0)
+      close( fd );
+    return false;
+  }
+
+  if ((size_t)st.st_size < sizeof( SharedPhotonMap )) {
+    fprintf(stderr,"%s is not a published photon map\n", name);
+    close( fd );
+    return false;
+  }
+
+  mem = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if (mem == MAP_FAILED) {
+    perror( name );
+    return false;
+  }
+
+  header = (const SharedPhotonMap*)mem;
+  if (memcmp( header->magic, SHARED_MAGIC, sizeof( SHARED_MAGIC ) ) != 0 ||
+      header->photon_size != (header->compact ? (int)sizeof( CompactPhoton ) : (int)sizeof( Photon )) ||
+      header->stored_photons < 0 ||
+      (size_t)st.st_size < header->data_offset + (size_t)header->photon_size*(header->stored_photons+1)) {
+    fprintf(stderr,"%s is not a published photon map\n", name);
+    munmap( mem, st.st_size );
+    return false;
+  }
+
+  free( photons );
+  free( cphotons );
+  photons = NULL;
+  cphotons = NULL;
+
+  if (header->compact)
+    cphotons = (CompactPhoton*)((char*)mem+header->data_offset);
+  else
+    photons = (Photon*)((char*)mem+header->data_offset);
+
+  stored_photons = header->stored_photons;
+  half_stored_photons = header->half_stored_photons;
+  max_photons = stored_photons;
+  for (int i=0; i<3; i++) {
+    bbox_min[i] = header->bbox_min[i];
+    bbox_max[i] = header->bbox_max[i];
+    qscale[i] = header->qscale[i];
+  }
+
+  shared = mem;
+  shared_size = st.st_size;
+
+  return true;
 }
 
 
@@ -390,13 +1006,19 @@ void PhotonMap :: median_split(
   
 // See "Realistic image synthesis using Photon Mapping" chapter 6
 // for an explanation of this function
+//
+// The bounding box of the segment is passed down instead of
+// being kept in bbox_min and bbox_max, so that segments can
+// be balanced as independent OpenMP tasks
 //****************************
 void PhotonMap :: balance_segment(
   Photon **pbal,
   Photon **porg,
   const int index,
   const int start,
-  const int end )
+  const int end,
+  const float bmin[3],
+  const float bmax[3] )
 //****************************
 {
   //--------------------
@@ -418,10 +1040,10 @@ void PhotonMap :: balance_segment(
   //--------------------------
 
   int axis=2;
-  if ((bbox_max[0]-bbox_min[0])>(bbox_max[1]-bbox_min[1]) &&
-      (bbox_max[0]-bbox_min[0])>(bbox_max[2]-bbox_min[2]))
+  if ((bmax[0]-bmin[0])>(bmax[1]-bmin[1]) &&
+      (bmax[0]-bmin[0])>(bmax[2]-bmin[2]))
     axis=0;
-  else if ((bbox_max[1]-bbox_min[1])>(bbox_max[2]-bbox_min[2]))
+  else if ((bmax[1]-bmin[1])>(bmax[2]-bmin[2]))
     axis=1;
 
   //------------------------------------------
@@ -440,10 +1062,16 @@ void PhotonMap :: balance_segment(
   if ( median > start ) {
     // balance left segment
     if ( start < median-1 ) {
-      const float tmp=bbox_max[axis];
-      bbox_max[axis] = pbal[index]->pos[axis];
-      balance_segment( pbal, porg, 2*index, start, median-1 );
-      bbox_max[axis] = tmp;
+      // the task may run after this call returns, so it gets
+      // its own copies of both corners of the bounding box
+      float left_min[3] = { bmin[0], bmin[1], bmin[2] };
+      float left_max[3] = { bmax[0], bmax[1], bmax[2] };
+      left_max[axis] = pbal[index]->pos[axis];
+      if ( median-start > BALANCE_TASK_SIZE ) {
+        #pragma omp task firstprivate(left_min, left_max)
+        balance_segment( pbal, porg, 2*index, start, median-1, left_min, left_max );
+      } else
+        balance_segment( pbal, porg, 2*index, start, median-1, left_min, left_max );
     } else {
       pbal[ 2*index ] = porg[start];
     }
@@ -452,10 +1080,9 @@ void PhotonMap :: balance_segment(
   if ( median < end ) {
     // balance right segment
     if ( median+1 < end ) {
-      const float tmp = bbox_min[axis];		
-      bbox_min[axis] = pbal[index]->pos[axis];
-      balance_segment( pbal, porg, 2*index+1, median+1, end );
-      bbox_min[axis] = tmp;
+      float right_min[3] = { bmin[0], bmin[1], bmin[2] };
+      right_min[axis] = pbal[index]->pos[axis];
+      balance_segment( pbal, porg, 2*index+1, median+1, end, right_min, bmax );
     } else {
       pbal[ 2*index+1 ] = porg[end];
     }
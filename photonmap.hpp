@@ -1,6 +1,9 @@
 #ifndef PHOTONMAP_H
 #define PHOTONMAP_H
 
+#include <stddef.h>
+#include <vector>
+
 /* This is the photon
  * The power is not compressed so the
  * size is 28 bytes
@@ -17,6 +20,56 @@ typedef struct Photon {
 } Photon;
 
 
+/* This is the compact photon used once the kd-tree
+ * is balanced. The size is 16 bytes.
+ *
+ * - The position is quantized to 16 bits per axis over
+ *   the bounding box of the map, so the error is at most
+ *   half a step, (bbox_max - bbox_min) / 131070, per axis.
+ *   Quantization is monotonic, so the balanced kd-tree
+ *   stays valid on the quantized positions.
+ * - The direction is stored with an octahedral mapping at
+ *   16 bits per coordinate, which adds less than 1e-4
+ *   radians to the error of the 8 bit theta and phi of
+ *   the uncompressed photon it is built from.
+ * - The power is kept in the shared exponent RGBE format,
+ *   with a relative error below 1/256 for the brightest
+ *   channel, same as the uncompressed photon.
+ * - The index of refraction is dropped.
+*/
+//**********************
+typedef struct CompactPhoton {
+//**********************
+  unsigned short pos[3];         // quantized photon position
+  unsigned short dir[2];         // octahedral incoming direction
+  unsigned char power[4];        // RGBE photon power
+  unsigned char plane;           // splitting plane for kd-tree
+  unsigned char pad;
+} CompactPhoton;
+
+
+/* This is the header of a balanced photon map published in
+ * POSIX shared memory. The photon array follows it at offset
+ * data_offset, with stored_photons+1 photons of photon_size
+ * bytes since the array starts at index 1. The magic is
+ * written last, once the photons are in place.
+*/
+//**********************
+typedef struct SharedPhotonMap {
+//**********************
+  char magic[8];
+  int photon_size;               // sizeof of the Photon or CompactPhoton
+  int compact;                   // the photons are CompactPhotons
+  int stored_photons;
+  int half_stored_photons;
+  int data_offset;               // bytes from the header to the photons
+  int pad;
+  float bbox_min[3];
+  float bbox_max[3];
+  float qscale[3];
+} SharedPhotonMap;
+
+
 /* This structure is used only to locate the
  * nearest photons
 */
@@ -26,9 +79,10 @@ typedef struct NearestPhotons {
     int max; 
     int found; 
     int got_heap; 
+    int visited;                 // photons looked at by the search
     float pos[3]; 
     float *dist2; 
-    const Photon **index; 
+    int *index;                  // indices into the photon array
 } NearestPhotons;
 
 
@@ -50,8 +104,36 @@ class PhotonMap {
     void scale_photon_power(
       const float scale);          // 1/(number of emitted photons)
 
+    int store(
+      const Photon *p,             // photons stored elsewhere
+      const int n );               // returns how many fit
+
+    void make_photon(
+      Photon *p,                   // photon to fill in (returned)
+      const float power[3],        // photon power
+      const float pos[3],          // photon position
+      const float dir[3],          // photon direction
+      const float ref_index ) const;
+
+    void clear(void);              // drop every photon to store them again
+
+    void scale_photon_power(
+      const float scale,           // 1/(number of emitted photons)
+      const int first,             // first photon to scale
+      const int last );            // last photon to scale
+
     void balance(void);            // balance the kd-tree (before use!)
 
+    void compress(void);           // switch to compact photons (after balance)
+
+    size_t memory_usage(void) const; // bytes used by the photon array
+
+    bool publish(                  // copy to shared memory (after balance)
+      const char *name ) const;    // POSIX shared memory object name
+
+    bool attach(                   // use a published map, read only
+      const char *name );          // POSIX shared memory object name
+
     void irradiance_estimate(
       float irrad[3],              // returned irradiance
       const float pos[3],          // surface position
@@ -63,10 +145,34 @@ class PhotonMap {
       NearestPhotons *const np,    // np is used to locate the photons
       const int index) const;      // call with index = 1
 
+    int find_nearest(
+      int *found,                  // indices of the photons (returned)
+      float *dist2,                // squared distances (returned)
+      const float pos[3],          // search position
+      const float max_dist,        // max distance to look for photons
+      const int k ) const;         // max number of photons to find
+
+    void find_in_radius(
+      std::vector<int> &found,     // indices of the photons (returned)
+      const float pos[3],          // search position
+      const float max_dist ) const; // max distance to look for photons
+
+    void photon_position(
+      float pos[3],                // position of photon (returned)
+      const int index ) const;     // index of the photon
+
+    void photon_power(
+      float power[3],              // power of photon (returned)
+      const int index ) const;     // index of the photon
+
     void photon_dir(
       float *dir,                  // direction of photon (returned)
       const Photon *p) const;      // the photon
 
+    void photon_dir(
+      float *dir,                  // direction of photon (returned)
+      const CompactPhoton *p) const; // the compact photon
+
  private:
     friend class PhotonTracer;
 
@@ -75,7 +181,37 @@ class PhotonMap {
       Photon **porg, 
       const int index,
       const int start, 
-      const int end );
+      const int end,
+      const float bmin[3],         // bounding box of the segment
+      const float bmax[3] );
+
+    void decompress(void);
+
+    void octahedral_dir(
+      float *dir,                  // unnormalized direction (returned)
+      const CompactPhoton *p) const;
+
+    template <class P>
+    void gather_photons(
+      std::vector<int> &found,
+      const float pos[3],
+      const float max_dist2,
+      const P *array,
+      const int index) const;
+
+    template <class P>
+    void locate_photons(
+      NearestPhotons *const np,
+      const P *array,              // photons or cphotons
+      const int index) const;
+
+    void photon_pos(
+      float *pos,                  // position of photon (returned)
+      const Photon *p) const;
+
+    void photon_pos(
+      float *pos,                  // position of photon (returned)
+      const CompactPhoton *p) const;
 
     void median_split(
       Photon **p, 
@@ -85,6 +221,10 @@ class PhotonMap {
       const int axis );
   
     Photon *photons; 
+    CompactPhoton *cphotons;       // replaces photons after compress()
+
+    void *shared;                  // attached shared memory, or NULL
+    size_t shared_size;
 
     int stored_photons; 
     int half_stored_photons; 
@@ -98,6 +238,7 @@ class PhotonMap {
   
     float bbox_min[3];     // use bbox_min
     float bbox_max[3];     // use bbox_max
+    float qscale[3];       // quantization step of compact photons
 };
 
 #endif
@@ -0,0 +1,403 @@
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "primitive_store.hpp"
+#include "stats.hpp"
+#include "sphere.hpp"
+#include "plane.hpp"
+#include "disk.hpp"
+
+static const float TOL = 1e-6f;
+static const uint32_t TYPE_SHIFT = 30;
+static const uint32_t INDEX_MASK = (1u << TYPE_SHIFT) - 1;
+
+////////////////////////////////////////////
+// Vector operations.
+////////////////////////////////////////////
+
+#if defined(__AVX__)
+
+#define SIMD_WIDTH 8
+typedef __m256 vfloat;
+
+static inline vfloat v_set(const float a) { return _mm256_set1_ps(a); }
+static inline vfloat v_load(const float * p) { return _mm256_loadu_ps(p); }
+static inline void v_store(float * p, const vfloat a) { _mm256_storeu_ps(p, a); }
+static inline vfloat v_add(const vfloat a, const vfloat b) { return _mm256_add_ps(a, b); }
+static inline vfloat v_sub(const vfloat a, const vfloat b) { return _mm256_sub_ps(a, b); }
+static inline vfloat v_mul(const vfloat a, const vfloat b) { return _mm256_mul_ps(a, b); }
+static inline vfloat v_div(const vfloat a, const vfloat b) { return _mm256_div_ps(a, b); }
+static inline vfloat v_sqrt(const vfloat a) { return _mm256_sqrt_ps(a); }
+static inline vfloat v_and(const vfloat a, const vfloat b) { return _mm256_and_ps(a, b); }
+static inline vfloat v_or(const vfloat a, const vfloat b) { return _mm256_or_ps(a, b); }
+static inline vfloat v_ge(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline vfloat v_gt(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline vfloat v_lt(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline vfloat v_le(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline int v_mask(const vfloat a) { return _mm256_movemask_ps(a); }
+
+#elif defined(__SSE2__)
+
+#define SIMD_WIDTH 4
+typedef __m128 vfloat;
+
+static inline vfloat v_set(const float a) { return _mm_set1_ps(a); }
+static inline vfloat v_load(const float * p) { return _mm_loadu_ps(p); }
+static inline void v_store(float * p, const vfloat a) { _mm_storeu_ps(p, a); }
+static inline vfloat v_add(const vfloat a, const vfloat b) { return _mm_add_ps(a, b); }
+static inline vfloat v_sub(const vfloat a, const vfloat b) { return _mm_sub_ps(a, b); }
+static inline vfloat v_mul(const vfloat a, const vfloat b) { return _mm_mul_ps(a, b); }
+static inline vfloat v_div(const vfloat a, const vfloat b) { return _mm_div_ps(a, b); }
+static inline vfloat v_sqrt(const vfloat a) { return _mm_sqrt_ps(a); }
+static inline vfloat v_and(const vfloat a, const vfloat b) { return _mm_and_ps(a, b); }
+static inline vfloat v_or(const vfloat a, const vfloat b) { return _mm_or_ps(a, b); }
+static inline vfloat v_ge(const vfloat a, const vfloat b) { return _mm_cmpge_ps(a, b); }
+static inline vfloat v_gt(const vfloat a, const vfloat b) { return _mm_cmpgt_ps(a, b); }
+static inline vfloat v_lt(const vfloat a, const vfloat b) { return _mm_cmplt_ps(a, b); }
+static inline vfloat v_le(const vfloat a, const vfloat b) { return _mm_cmple_ps(a, b); }
+static inline int v_mask(const vfloat a) { return _mm_movemask_ps(a); }
+
+#else
+
+#define SIMD_WIDTH 1
+
+#endif
+
+////////////////////////////////////////////
+// Intersection kernels.
+////////////////////////////////////////////
+
+/* Spheres use the half b form of the quadratic on the vector from the
+ * center to the origin, which avoids the cancellation of expanding it.
+ * The nearest root must be in front of the origin, as in
+ * Sphere::intersect(). */
+int32_t closest_sphere(const sphere_array_t & s, const uint32_t first, const uint32_t last, const Ray & r, float & t,
+		       const Figure * ignore, const bool simd) {
+  const float dx = r.m_direction.x, dy = r.m_direction.y, dz = r.m_direction.z;
+  const float ox = r.m_origin.x, oy = r.m_origin.y, oz = r.m_origin.z;
+  const float a = (dx * dx) + (dy * dy) + (dz * dz);
+  float ocx, ocy, ocz, b, c, disc, _t;
+  uint32_t i = first;
+  int32_t hit = -1;
+
+#if SIMD_WIDTH > 1
+  if (simd) {
+    const vfloat v_dx = v_set(dx), v_dy = v_set(dy), v_dz = v_set(dz);
+    const vfloat v_ox = v_set(ox), v_oy = v_set(oy), v_oz = v_set(oz);
+    const vfloat v_a = v_set(a), zero = v_set(0.0f);
+    vfloat v_ocx, v_ocy, v_ocz, v_r, v_b, v_c, v_disc, v_t;
+    float ts[SIMD_WIDTH];
+    int mask;
+
+    for (; i + SIMD_WIDTH <= last; i += SIMD_WIDTH) {
+      v_ocx = v_sub(v_ox, v_load(&s.x[i]));
+      v_ocy = v_sub(v_oy, v_load(&s.y[i]));
+      v_ocz = v_sub(v_oz, v_load(&s.z[i]));
+      v_r = v_load(&s.r[i]);
+      v_b = v_add(v_add(v_mul(v_ocx, v_dx), v_mul(v_ocy, v_dy)), v_mul(v_ocz, v_dz));
+      v_c = v_sub(v_add(v_add(v_mul(v_ocx, v_ocx), v_mul(v_ocy, v_ocy)), v_mul(v_ocz, v_ocz)), v_mul(v_r, v_r));
+      v_disc = v_sub(v_mul(v_b, v_b), v_mul(v_a, v_c));
+      v_t = v_div(v_sub(v_sub(zero, v_b), v_sqrt(v_disc)), v_a);
+
+      mask = v_mask(v_and(v_and(v_ge(v_disc, zero), v_ge(v_t, zero)), v_lt(v_t, v_set(t))));
+      if (mask != 0) {
+	v_store(ts, v_t);
+	for (int k = 0; k < SIMD_WIDTH; k++) {
+	  if ((mask & (1 << k)) && ts[k] < t && s.figs[i + k] != ignore) {
+	    t = ts[k];
+	    hit = i + k;
+	  }
+	}
+      }
+    }
+  }
+#endif
+
+  for (; i < last; i++) {
+    ocx = ox - s.x[i];
+    ocy = oy - s.y[i];
+    ocz = oz - s.z[i];
+    b = (ocx * dx) + (ocy * dy) + (ocz * dz);
+    c = (ocx * ocx) + (ocy * ocy) + (ocz * ocz) - (s.r[i] * s.r[i]);
+    disc = (b * b) - (a * c);
+
+    if (disc >= 0.0f) {
+      _t = (0.0f - b - std::sqrt(disc)) / a;
+      if (_t >= 0.0f && _t < t && s.figs[i] != ignore) {
+	t = _t;
+	hit = i;
+      }
+    }
+  }
+
+  return hit;
+}
+
+// Planes are disks without radii.
+int32_t closest_disk(const disk_array_t & d, const uint32_t first, const uint32_t last, const Ray & r, float & t,
+		     const Figure * ignore, const bool simd) {
+  const float dx = r.m_direction.x, dy = r.m_direction.y, dz = r.m_direction.z;
+  const float ox = r.m_origin.x, oy = r.m_origin.y, oz = r.m_origin.z;
+  const bool bounded = !d.r.empty();
+  float dn, _t, ix, iy, iz;
+  uint32_t i = first;
+  int32_t hit = -1;
+
+#if SIMD_WIDTH > 1
+  if (simd) {
+    const vfloat v_dx = v_set(dx), v_dy = v_set(dy), v_dz = v_set(dz);
+    const vfloat v_ox = v_set(ox), v_oy = v_set(oy), v_oz = v_set(oz);
+    const vfloat zero = v_set(0.0f), tol = v_set(TOL), m_tol = v_set(-TOL);
+    vfloat v_px, v_py, v_pz, v_nx, v_ny, v_nz, v_dn, v_t, v_ix, v_iy, v_iz, v_r, valid;
+    float ts[SIMD_WIDTH];
+    int mask;
+
+    for (; i + SIMD_WIDTH <= last; i += SIMD_WIDTH) {
+      v_px = v_load(&d.px[i]);
+      v_py = v_load(&d.py[i]);
+      v_pz = v_load(&d.pz[i]);
+      v_nx = v_load(&d.nx[i]);
+      v_ny = v_load(&d.ny[i]);
+      v_nz = v_load(&d.nz[i]);
+      v_dn = v_add(v_add(v_mul(v_dx, v_nx), v_mul(v_dy, v_ny)), v_mul(v_dz, v_nz));
+      v_t = v_div(v_add(v_add(v_mul(v_nx, v_sub(v_px, v_ox)), v_mul(v_ny, v_sub(v_py, v_oy))), v_mul(v_nz, v_sub(v_pz, v_oz))), v_dn);
+      valid = v_and(v_and(v_or(v_gt(v_dn, tol), v_lt(v_dn, m_tol)), v_ge(v_t, zero)), v_lt(v_t, v_set(t)));
+
+      if (bounded) {
+	v_ix = v_sub(v_add(v_ox, v_mul(v_t, v_dx)), v_px);
+	v_iy = v_sub(v_add(v_oy, v_mul(v_t, v_dy)), v_py);
+	v_iz = v_sub(v_add(v_oz, v_mul(v_t, v_dz)), v_pz);
+	v_r = v_load(&d.r[i]);
+	valid = v_and(valid, v_le(v_add(v_add(v_mul(v_ix, v_ix), v_mul(v_iy, v_iy)), v_mul(v_iz, v_iz)), v_mul(v_r, v_r)));
+      }
+
+      mask = v_mask(valid);
+      if (mask != 0) {
+	v_store(ts, v_t);
+	for (int k = 0; k < SIMD_WIDTH; k++) {
+	  if ((mask & (1 << k)) && ts[k] < t && d.figs[i + k] != ignore) {
+	    t = ts[k];
+	    hit = i + k;
+	  }
+	}
+      }
+    }
+  }
+#endif
+
+  for (; i < last; i++) {
+    dn = (dx * d.nx[i]) + (dy * d.ny[i]) + (dz * d.nz[i]);
+    if (!(dn > TOL || dn < -TOL))
+      continue;
+
+    _t = ((d.nx[i] * (d.px[i] - ox)) + (d.ny[i] * (d.py[i] - oy)) + (d.nz[i] * (d.pz[i] - oz))) / dn;
+    if (!(_t >= 0.0f && _t < t))
+      continue;
+
+    if (bounded) {
+      ix = (ox + (_t * dx)) - d.px[i];
+      iy = (oy + (_t * dy)) - d.py[i];
+      iz = (oz + (_t * dz)) - d.pz[i];
+      if (!((ix * ix) + (iy * iy) + (iz * iz) <= (d.r[i] * d.r[i])))
+	continue;
+    }
+
+    if (d.figs[i] != ignore) {
+      t = _t;
+      hit = i;
+    }
+  }
+
+  return hit;
+}
+
+////////////////////////////////////////////
+// Primitive store.
+////////////////////////////////////////////
+
+primitive_type_t PrimitiveStore::type_of(const Figure * f) {
+  // Disks are planes, so they are checked first.
+  if (dynamic_cast<const Disk *>(f) != NULL)
+    return PRIM_DISK;
+  else if (dynamic_cast<const Plane *>(f) != NULL)
+    return PRIM_PLANE;
+  else if (dynamic_cast<const Sphere *>(f) != NULL)
+    return PRIM_SPHERE;
+  else
+    return PRIM_OTHER;
+}
+
+void PrimitiveStore::clear() {
+  m_slots.clear();
+  m_spheres = sphere_array_t();
+  m_disks = disk_array_t();
+  m_planes = disk_array_t();
+  m_others.clear();
+}
+
+void PrimitiveStore::add(Figure * f) {
+  primitive_type_t type = type_of(f);
+  Sphere * s;
+  Plane * p;
+  disk_array_t * d;
+
+  if (type == PRIM_SPHERE) {
+    s = static_cast<Sphere *>(f);
+    m_slots.push_back((type << TYPE_SHIFT) | m_spheres.figs.size());
+    m_spheres.x.push_back(s->m_center.x);
+    m_spheres.y.push_back(s->m_center.y);
+    m_spheres.z.push_back(s->m_center.z);
+    m_spheres.r.push_back(s->m_radius);
+    m_spheres.figs.push_back(f);
+
+  } else if (type == PRIM_DISK || type == PRIM_PLANE) {
+    p = static_cast<Plane *>(f);
+    d = type == PRIM_DISK ? &m_disks : &m_planes;
+    m_slots.push_back((type << TYPE_SHIFT) | d->figs.size());
+    d->px.push_back(p->m_point.x);
+    d->py.push_back(p->m_point.y);
+    d->pz.push_back(p->m_point.z);
+    d->nx.push_back(p->m_normal.x);
+    d->ny.push_back(p->m_normal.y);
+    d->nz.push_back(p->m_normal.z);
+    if (type == PRIM_DISK)
+      d->r.push_back(static_cast<Disk *>(f)->m_radius);
+    d->figs.push_back(f);
+
+  } else {
+    m_slots.push_back((type << TYPE_SHIFT) | m_others.size());
+    m_others.push_back(f);
+  }
+}
+
+void PrimitiveStore::update(const size_t slot) {
+  const uint32_t type = m_slots[slot] >> TYPE_SHIFT, index = m_slots[slot] & INDEX_MASK;
+  Sphere * s;
+  Plane * p;
+  disk_array_t * d;
+
+  if (type == PRIM_SPHERE) {
+    s = static_cast<Sphere *>(m_spheres.figs[index]);
+    m_spheres.x[index] = s->m_center.x;
+    m_spheres.y[index] = s->m_center.y;
+    m_spheres.z[index] = s->m_center.z;
+    m_spheres.r[index] = s->m_radius;
+
+  } else if (type == PRIM_DISK || type == PRIM_PLANE) {
+    d = type == PRIM_DISK ? &m_disks : &m_planes;
+    p = static_cast<Plane *>(d->figs[index]);
+    d->px[index] = p->m_point.x;
+    d->py[index] = p->m_point.y;
+    d->pz[index] = p->m_point.z;
+    d->nx[index] = p->m_normal.x;
+    d->ny[index] = p->m_normal.y;
+    d->nz[index] = p->m_normal.z;
+    if (type == PRIM_DISK)
+      d->r[index] = static_cast<Disk *>(p)->m_radius;
+  }
+}
+
+Figure * PrimitiveStore::figure(const size_t slot) const {
+  const uint32_t type = m_slots[slot] >> TYPE_SHIFT, index = m_slots[slot] & INDEX_MASK;
+
+  if (type == PRIM_SPHERE)
+    return m_spheres.figs[index];
+  else if (type == PRIM_DISK)
+    return m_disks.figs[index];
+  else if (type == PRIM_PLANE)
+    return m_planes.figs[index];
+  else
+    return m_others[index];
+}
+
+// Number of slots from begin on holding figures of the same type, which
+// also have consecutive indices.
+uint32_t PrimitiveStore::run(const uint32_t begin, const uint32_t end) const {
+  const uint32_t type = m_slots[begin] >> TYPE_SHIFT;
+  uint32_t n = 1;
+
+  while (begin + n < end && (m_slots[begin + n] >> TYPE_SHIFT) == type && (m_slots[begin + n] & INDEX_MASK) == (m_slots[begin] & INDEX_MASK) + n)
+    n++;
+
+  return n;
+}
+
+Figure * PrimitiveStore::intersect(Ray & r, const uint32_t begin, const uint32_t end, float & t, const Figure * ignore) const {
+  uint32_t slot = begin, n, type, first;
+  int32_t i;
+  Figure * hit = NULL;
+  float _t;
+
+  stat_add(STAT_INTERSECTION_TESTS, end - begin);
+
+  while (slot < end) {
+    n = run(slot, end);
+    type = m_slots[slot] >> TYPE_SHIFT;
+    first = m_slots[slot] & INDEX_MASK;
+
+    if (type == PRIM_SPHERE) {
+      if ((i = closest_sphere(m_spheres, first, first + n, r, t, ignore)) >= 0)
+	hit = m_spheres.figs[i];
+
+    } else if (type == PRIM_DISK) {
+      if ((i = closest_disk(m_disks, first, first + n, r, t, ignore)) >= 0)
+	hit = m_disks.figs[i];
+
+    } else if (type == PRIM_PLANE) {
+      if ((i = closest_disk(m_planes, first, first + n, r, t, ignore)) >= 0)
+	hit = m_planes.figs[i];
+
+    } else {
+      for (uint32_t f = first; f < first + n; f++) {
+	if (m_others[f] != ignore && m_others[f]->intersect(r, _t) && _t < t) {
+	  t = _t;
+	  hit = m_others[f];
+	}
+      }
+    }
+
+    slot += n;
+  }
+
+  return hit;
+}
+
+bool PrimitiveStore::occluded(Ray & r, const uint32_t begin, const uint32_t end, const float max_t, const Figure * ignore) const {
+  uint32_t slot = begin, n, type, first;
+  float t = max_t, _t;
+
+  stat_add(STAT_INTERSECTION_TESTS, end - begin);
+
+  while (slot < end) {
+    n = run(slot, end);
+    type = m_slots[slot] >> TYPE_SHIFT;
+    first = m_slots[slot] & INDEX_MASK;
+
+    if (type == PRIM_SPHERE) {
+      if (closest_sphere(m_spheres, first, first + n, r, t, ignore) >= 0)
+	return true;
+
+    } else if (type == PRIM_DISK) {
+      if (closest_disk(m_disks, first, first + n, r, t, ignore) >= 0)
+	return true;
+
+    } else if (type == PRIM_PLANE) {
+      if (closest_disk(m_planes, first, first + n, r, t, ignore) >= 0)
+	return true;
+
+    } else {
+      for (uint32_t f = first; f < first + n; f++)
+	if (m_others[f] != ignore && m_others[f]->intersect(r, _t) && _t < max_t)
+	  return true;
+    }
+
+    slot += n;
+  }
+
+  return false;
+}
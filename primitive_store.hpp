@@ -0,0 +1,77 @@
+#pragma once
+#ifndef PRIMITIVE_STORE_HPP
+#define PRIMITIVE_STORE_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "ray.hpp"
+#include "figure.hpp"
+
+using std::vector;
+
+typedef enum PRIMITIVE_TYPE { PRIM_SPHERE = 0, PRIM_DISK, PRIM_PLANE, PRIM_OTHER } primitive_type_t;
+
+// Centers and radii of spheres.
+typedef struct SPHERE_ARRAY {
+  vector<float> x, y, z, r;
+  vector<Figure *> figs;
+} sphere_array_t;
+
+// Points, normals and radii of disks. Planes leave the radii empty.
+typedef struct DISK_ARRAY {
+  vector<float> px, py, pz, nx, ny, nz, r;
+  vector<Figure *> figs;
+} disk_array_t;
+
+/* Index of the closest sphere or disk in [first, last) hit by r closer
+ * than t, updating t, or -1. Unless simd is false, 8 primitives are tested
+ * at once with AVX or 4 with SSE, with scalar code for the rest and on
+ * machines without either. Both paths give the same results. */
+extern int32_t closest_sphere(const sphere_array_t & s, const uint32_t first, const uint32_t last, const Ray & r, float & t,
+			      const Figure * ignore, const bool simd = true);
+extern int32_t closest_disk(const disk_array_t & d, const uint32_t first, const uint32_t last, const Ray & r, float & t,
+			    const Figure * ignore, const bool simd = true);
+
+/* Flat copy of the geometry of a list of figures, kept by type in separate
+ * arrays of coordinates so that intersection runs as a loop over plain
+ * floats instead of a virtual call per figure. Slots keep the order in
+ * which figures are added and every slot refers to a primitive by its type
+ * and its index among the primitives of that type. Figures of other types,
+ * like instances, are still intersected through their virtual functions.
+ * The figures are not owned by the store and are returned for shading. */
+class PrimitiveStore {
+public:
+  PrimitiveStore() { }
+  ~PrimitiveStore() { }
+
+  static primitive_type_t type_of(const Figure * f);
+
+  void clear();
+  void add(Figure * f);
+  // Copies the geometry of the figure in a slot again, after it moved.
+  void update(const size_t slot);
+
+  size_t size() const { return m_slots.size(); }
+  Figure * figure(const size_t slot) const;
+
+  /* Closest figure in the slots [begin, end) hit by r closer than t, or
+   * NULL. Updates t on a hit. Runs of figures of the same type are tested
+   * together, so slots should be sorted by type wherever possible. */
+  Figure * intersect(Ray & r, const uint32_t begin, const uint32_t end, float & t, const Figure * ignore) const;
+  // Whether any figure in the slots [begin, end) is hit by r closer than max_t.
+  bool occluded(Ray & r, const uint32_t begin, const uint32_t end, const float max_t, const Figure * ignore) const;
+
+private:
+  // Type in the two high bits and index in the rest.
+  vector<uint32_t> m_slots;
+
+  sphere_array_t m_spheres;
+  disk_array_t m_disks;
+  disk_array_t m_planes;
+  vector<Figure *> m_others;
+
+  uint32_t run(const uint32_t begin, const uint32_t end) const;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include <limits>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "projection_map.hpp"
+#include "area_light.hpp"
+#include "point_light.hpp"
+#include "tracer.hpp"
+#include "sampler.hpp"
+
+using std::numeric_limits;
+using std::find;
+using glm::pi;
+using glm::dot;
+using glm::sqrt;
+using glm::cos;
+using glm::sin;
+
+// Number of test rays per cell side and number of points sampled on area lights.
+static const unsigned int CELL_RAYS = 3;
+static const unsigned int AREA_ORIGINS = 16;
+
+ProjectionMap::ProjectionMap(unsigned int theta_res, unsigned int phi_res):
+  m_theta_res(theta_res),
+  m_phi_res(phi_res),
+  m_cells(theta_res * phi_res, 0)
+{ }
+
+void ProjectionMap::build(Scene * s, Light * l, const vector<Figure *> & targets, const uint32_t stream) {
+  AreaLight * al;
+
+  m_origins.clear();
+  m_normals.clear();
+
+  if (l->light_type() == Light::AREA) {
+    al = static_cast<AreaLight *>(l);
+    for (unsigned int k = 0; k < AREA_ORIGINS; k++) {
+      start_sample(stream, k);
+      m_origins.push_back(al->sample_at_surface());
+      m_normals.push_back(al->normal_at_last_sample());
+      m_origins.back() += BIAS * m_normals.back();
+    }
+  } else {
+    m_origins.push_back(static_cast<PointLight *>(l)->m_position);
+    m_normals.push_back(vec3(0.0f));
+  }
+
+  rebuild(s, l, targets);
+}
+
+void ProjectionMap::rebuild(Scene * s, Light * l, const vector<Figure *> & targets) {
+  const bool area = l->light_type() == Light::AREA;
+  const Figure * ignore = area ? static_cast<AreaLight *>(l)->m_figure : NULL;
+  vec3 dir;
+  float u, v;
+  bool hit;
+
+  m_active.clear();
+  m_cells.assign(m_theta_res * m_phi_res, 0);
+
+#pragma omp parallel for schedule(dynamic, 1) private(dir, u, v, hit)
+  for (unsigned int i = 0; i < m_theta_res; i++) {
+    for (unsigned int j = 0; j < m_phi_res; j++) {
+      hit = false;
+      for (unsigned int a = 0; a < CELL_RAYS && !hit; a++) {
+	for (unsigned int b = 0; b < CELL_RAYS && !hit; b++) {
+	  u = (static_cast<float>(a) + 0.5f) / CELL_RAYS;
+	  v = (static_cast<float>(b) + 0.5f) / CELL_RAYS;
+	  dir = cell_direction(i, j, u, v);
+
+	  for (size_t o = 0; o < m_origins.size() && !hit; o++) {
+	    // Area lights only emit to the side their normal points at.
+	    if (area && dot(dir, m_normals[o]) <= 0.0f)
+	      continue;
+	    hit = hits_target(s, ignore, targets, m_origins[o], dir);
+	  }
+	}
+      }
+      m_cells[(i * m_phi_res) + j] = hit ? 1 : 0;
+    }
+  }
+
+  dilate();
+
+  for (unsigned int c = 0; c < m_cells.size(); c++)
+    if (m_cells[c])
+      m_active.push_back(c);
+}
+
+vec3 ProjectionMap::sample(const float r1, const float r2, const float r3) const {
+  unsigned int c;
+
+  if (m_active.empty())
+    return vec3(0.0f, 1.0f, 0.0f);
+
+  c = std::min(static_cast<unsigned int>(r1 * m_active.size()), static_cast<unsigned int>(m_active.size() - 1));
+  c = m_active[c];
+
+  return cell_direction(c / m_phi_res, c % m_phi_res, r2, r3);
+}
+
+bool ProjectionMap::empty() const {
+  return m_active.empty();
+}
+
+float ProjectionMap::active_fraction() const {
+  return static_cast<float>(m_active.size()) / static_cast<float>(m_cells.size());
+}
+
+bool ProjectionMap::covers(const ProjectionMap & other) const {
+  if (other.m_cells.size() != m_cells.size())
+    return false;
+
+  for (unsigned int c : other.m_active)
+    if (!m_cells[c])
+      return false;
+
+  return true;
+}
+
+vec3 ProjectionMap::cell_direction(unsigned int i, unsigned int j, const float u, const float v) const {
+  float z = 1.0f - (2.0f * ((static_cast<float>(i) + u) / m_theta_res));
+  float phi = 2.0f * pi<float>() * ((static_cast<float>(j) + v) / m_phi_res);
+  float sin_t = sqrt(std::max(0.0f, 1.0f - (z * z)));
+
+  return vec3(sin_t * cos(phi), sin_t * sin(phi), z);
+}
+
+bool ProjectionMap::hits_target(Scene * s, const Figure * ignore, const vector<Figure *> & targets, const vec3 & origin, const vec3 & dir) const {
+  float t;
+  Figure * _f;
+  Ray r(dir, origin);
+
+  _f = s->closest(r, t, ignore);
+
+  return _f != NULL && find(targets.begin(), targets.end(), _f) != targets.end();
+}
+
+void ProjectionMap::dilate() {
+  vector<char> marked = m_cells;
+  unsigned int ni, nj;
+
+  // Test rays can slip past small objects, so neighbours of active cells are active too.
+  for (unsigned int i = 0; i < m_theta_res; i++) {
+    for (unsigned int j = 0; j < m_phi_res; j++) {
+      if (!marked[(i * m_phi_res) + j])
+	continue;
+
+      for (int di = -1; di <= 1; di++) {
+	for (int dj = -1; dj <= 1; dj++) {
+	  if ((di < 0 && i == 0) || (di > 0 && i == m_theta_res - 1))
+	    continue;
+	  ni = i + di;
+	  nj = (j + m_phi_res + dj) % m_phi_res;
+	  m_cells[(ni * m_phi_res) + nj] = 1;
+	}
+      }
+    }
+  }
+}
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef PROJECTION_MAP_HPP
+#define PROJECTION_MAP_HPP
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/vec3.hpp>
+
+#include "scene.hpp"
+#include "light.hpp"
+#include "figure.hpp"
+
+using std::vector;
+using glm::vec3;
+
+/* Angular bitmap of the directions around a light source that reach
+ * interesting geometry, as described in Jensen's "Realistic Image
+ * Synthesis Using Photon Mapping", section 5.3. The sphere of directions
+ * is split in cells of equal solid angle (uniform in cos(theta) and phi)
+ * so that sampling a cell uniformly samples its solid angle uniformly. */
+class ProjectionMap {
+public:
+  ProjectionMap(unsigned int theta_res = 64, unsigned int phi_res = 128);
+
+  /* Marks the cells whose directions hit one of the target figures first.
+   * The points tested on area lights are the samples of the sample stream
+   * stream, one index per point, so that every build of the same light
+   * gives the same map when a sampler is set. */
+  void build(Scene * s, Light * l, const vector<Figure *> & targets, const uint32_t stream);
+
+  /* Marks the cells again from the points of the last build, after other
+   * figures moved. The light must be the one of the last build and must
+   * not have moved, so that only the cells reaching other targets change. */
+  void rebuild(Scene * s, Light * l, const vector<Figure *> & targets);
+
+  // Maps three uniform random numbers to a direction inside an active cell.
+  vec3 sample(const float r1, const float r2, const float r3) const;
+
+  bool empty() const;
+
+  // Fraction of the sphere of directions covered by active cells.
+  float active_fraction() const;
+
+  // Whether every cell active in other is active here too.
+  bool covers(const ProjectionMap & other) const;
+
+private:
+  unsigned int m_theta_res;
+  unsigned int m_phi_res;
+  vector<char> m_cells;
+  vector<unsigned int> m_active;
+  // Points on the light the cells are tested from, with the normal of the light there.
+  vector<vec3> m_origins;
+  vector<vec3> m_normals;
+
+  vec3 cell_direction(unsigned int i, unsigned int j, const float u, const float v) const;
+  bool hits_target(Scene * s, const Figure * ignore, const vector<Figure *> & targets, const vec3 & origin, const vec3 & dir) const;
+  void dilate();
+};
+
+#endif
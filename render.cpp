@@ -0,0 +1,412 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+
+#include <FreeImage.h>
+#include <glm/glm.hpp>
+
+#include "render.hpp"
+#include "sampling.hpp"
+#include "sampler.hpp"
+#include "path_tracer.hpp"
+#include "whitted_tracer.hpp"
+#include "photon_tracer.hpp"
+#include "stats.hpp"
+#include "denoise.hpp"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::ifstream;
+using std::ofstream;
+using std::ios;
+using std::pair;
+using std::make_pair;
+using std::sort;
+using glm::normalize;
+using glm::dot;
+
+#define ANSI_BOLD_YELLOW "\x1b[1;33m"
+#define ANSI_RESET_STYLE "\x1b[m"
+
+static const char SAMPLE_SUMS_MAGIC[8] = {'R', 'A', 'Y', 'S', 'U', 'M', 'S', '1'};
+
+////////////////////////////////////////////
+// Tracers.
+////////////////////////////////////////////
+
+tracer_t tracer_by_name(const char * name) {
+  if (strcmp("whitted", name) == 0)
+    return WHITTED;
+  else if (strcmp("monte_carlo", name) == 0 || strcmp("montecarlo", name) == 0)
+    return MONTE_CARLO;
+  else if (strcmp("jensen", name) == 0)
+    return JENSEN;
+  else
+    return NONE;
+}
+
+const char * tracer_name(const tracer_t t) {
+  return t == WHITTED ? "whitted" : (t == MONTE_CARLO ? "monte_carlo" : (t == JENSEN ? "jensen" : "none"));
+}
+
+Tracer * create_tracer(const tracer_t t, Scene * s, const tracer_options_t & opts, const render_settings_t & rs) {
+  PhotonTracer * p_tracer;
+
+  switch (t) {
+  case WHITTED:
+    cout << "Using " << ANSI_BOLD_YELLOW << "Whitted" << ANSI_RESET_STYLE << " ray tracing." << endl;
+    return static_cast<Tracer *>(new WhittedTracer(opts.max_depth));
+
+  case MONTE_CARLO:
+    cout << "Using " << ANSI_BOLD_YELLOW << "Monte Carlo" << ANSI_RESET_STYLE << " path tracing." << endl;
+    return static_cast<Tracer *>(new PathTracer(opts.max_depth));
+
+  case JENSEN:
+    cout << "Using " << ANSI_BOLD_YELLOW << "Jensen's photon mapping" << ANSI_RESET_STYLE << " with ray tracing." << endl;
+    if (opts.attach_photons != NULL) {
+      // Traced and balanced by another process.
+      p_tracer = new PhotonTracer(opts.max_depth, opts.p_sample_radius, opts.cone_filter_k, opts.max_photons, opts.max_search, opts.compact);
+      if (!p_tracer->attach_photon_map(opts.attach_photons)) {
+	delete p_tracer;
+	return NULL;
+      }
+      return static_cast<Tracer *>(p_tracer);
+
+    } else if (!opts.shard_files.empty()) {
+      p_tracer = new PhotonTracer(opts.max_depth, opts.p_sample_radius, opts.cone_filter_k, opts.max_photons, opts.max_search, opts.compact);
+      phase_begin(PHASE_BALANCE);
+      if (!p_tracer->load_photon_shards(opts.shard_files, s)) {
+	delete p_tracer;
+	return NULL;
+      }
+      p_tracer->build_photon_map();
+      phase_end(PHASE_BALANCE);
+
+    } else if (opts.photons_file == NULL && opts.caustics_file == NULL) {
+      p_tracer = new PhotonTracer(opts.max_depth, opts.p_sample_radius, opts.cone_filter_k, opts.max_photons, opts.max_search, opts.compact);
+      p_tracer->track_photon_paths(opts.track_photon_paths);
+      phase_begin(PHASE_PHOTON_TRACING);
+      if (opts.importons > 0)
+	p_tracer->importon_tracing(s, opts.importons, rs.w, rs.h, static_cast<float>(rs.w) / rs.h, rs.fov);
+      cout << "Building global photon map with " << ANSI_BOLD_YELLOW << opts.photons / 2 << ANSI_RESET_STYLE << " primary photons per light source." << endl;
+      p_tracer->photon_tracing(s, opts.photons / 2);
+      cout << "Building caustics photon map with " << ANSI_BOLD_YELLOW << opts.photons / 2 << ANSI_RESET_STYLE << " primary photons per light source." << endl;
+      p_tracer->photon_tracing(s, opts.photons / 2, true);
+      phase_end(PHASE_PHOTON_TRACING);
+      phase_begin(PHASE_BALANCE);
+      p_tracer->build_photon_map();
+      phase_end(PHASE_BALANCE);
+
+    } else {
+      if (opts.photons_file == NULL || opts.caustics_file == NULL) {
+	cerr << "Must specify both a photon map file and a caustics file." << endl;
+	return NULL;
+      }
+      p_tracer = new PhotonTracer(opts.max_depth, opts.p_sample_radius, opts.cone_filter_k, opts.max_photons, opts.max_search, opts.compact);
+      phase_begin(PHASE_BALANCE);
+      p_tracer->build_photon_map(opts.photons_file);
+      p_tracer->build_photon_map(opts.caustics_file, true);
+      phase_end(PHASE_BALANCE);
+    }
+
+    if (opts.publish_photons != NULL)
+      p_tracer->publish_photon_map(opts.publish_photons);
+
+    return static_cast<Tracer *>(p_tracer);
+
+  default:
+    return NULL;
+  }
+}
+
+bool trace_photon_shard(Scene * s, const tracer_options_t & opts, const render_settings_t & rs, const size_t shard, const size_t shards,
+			const char * file_name) {
+  PhotonTracer p_tracer(opts.max_depth, opts.p_sample_radius, opts.cone_filter_k, opts.max_photons, opts.max_search, opts.compact);
+  bool ok;
+
+  cout << "Tracing photon shard " << ANSI_BOLD_YELLOW << shard << ANSI_RESET_STYLE << " of " << ANSI_BOLD_YELLOW << shards << ANSI_RESET_STYLE << "." << endl;
+  phase_begin(PHASE_PHOTON_TRACING);
+  if (opts.importons > 0)
+    p_tracer.importon_tracing(s, opts.importons, rs.w, rs.h, static_cast<float>(rs.w) / rs.h, rs.fov);
+  p_tracer.photon_tracing(s, opts.photons / 2, false, shard, shards);
+  p_tracer.photon_tracing(s, opts.photons / 2, true, shard, shards);
+  phase_end(PHASE_PHOTON_TRACING);
+
+  phase_begin(PHASE_SAVE);
+  ok = p_tracer.save_photon_shard(file_name, s, opts.photons / 2, shard, shards);
+  phase_end(PHASE_SAVE);
+
+  return ok;
+}
+
+////////////////////////////////////////////
+// Rendering.
+////////////////////////////////////////////
+
+/* Renders a pixel, and when fb keeps first hits also stores those of the
+ * pixel, as found by the tracer, and the variance of its mean. */
+static inline vec3 render_pixel(Scene * s, Tracer * tracer, const render_settings_t & rs, const float a_ratio, const int i, const int j,
+				Framebuffer * fb = NULL) {
+  size_t p = (static_cast<size_t>(i) * rs.w) + j;
+  vec3 color(0.0f), sample_color, albedo(0.0f), normal(0.0f);
+  float depth = 0.0f, l_sum = 0.0f, l2_sum = 0.0f, l, l_mean;
+  bool aovs = fb != NULL && fb->has_aovs();
+  first_hit_t hit;
+  vec2 sample;
+  Ray r;
+
+  for (int k = 0; k < rs.samples; k++) {
+    start_sample(static_cast<uint32_t>((i * rs.w) + j), static_cast<uint32_t>(rs.first_sample + k));
+    sample = sample_pixel(i, j, rs.w, rs.h, a_ratio, rs.fov);
+    r = Ray(normalize(vec3(sample, -0.5f) - vec3(0.0f)), vec3(0.0f));
+    s->m_cam->view_to_world(r);
+    if (aovs) {
+      // Rays that escape the scene add nothing.
+      hit.albedo = hit.normal = vec3(0.0f);
+      hit.depth = 0.0f;
+    }
+    sample_color = tracer->trace_ray(r, s, 0, aovs ? &hit : NULL);
+    color += sample_color;
+    if (aovs) {
+      albedo += hit.albedo;
+      normal += hit.normal;
+      depth += hit.depth;
+      l = luminance(sample_color);
+      l_sum += l;
+      l2_sum += l * l;
+    }
+  }
+  stat_add(STAT_PRIMARY_RAYS, rs.samples);
+
+  if (aovs) {
+    fb->m_albedos[p] = albedo / static_cast<float>(rs.samples);
+    fb->m_normals[p] = normal / static_cast<float>(rs.samples);
+    fb->m_depths[p] = depth / static_cast<float>(rs.samples);
+    // Variance of the mean, from the unbiased variance of the samples.
+    l_mean = l_sum / rs.samples;
+    fb->m_variances[p] = rs.samples > 1 ? glm::max((l2_sum - (rs.samples * l_mean * l_mean)) / (rs.samples - 1), 0.0f) / rs.samples : 0.0f;
+  }
+
+  return color / static_cast<float>(rs.samples);
+}
+
+void render(Scene * s, Tracer * tracer, const render_settings_t & rs, Framebuffer & fb, Heatmap * heatmap, const bool verbose) {
+  uint64_t total = static_cast<uint64_t>(rs.h) * static_cast<uint64_t>(rs.w) * static_cast<uint64_t>(rs.samples);
+  uint64_t current = 0;
+  float a_ratio = static_cast<float>(rs.w) / static_cast<float>(rs.h);
+  double row_start;
+  pixel_cost_t cost;
+
+  fb.resize(rs.w, rs.h, rs.denoise > 0);
+
+  if (verbose)
+    cout << "Tracing a total of " << ANSI_BOLD_YELLOW << total << ANSI_RESET_STYLE << " primary rays:" << endl;
+
+#pragma omp parallel for schedule(dynamic, 1) private(row_start, cost) shared(current)
+  for (int i = 0; i < rs.h; i++) {
+    row_start = stat_time();
+    for (int j = 0; j < rs.w; j++) {
+      if (heatmap != NULL)
+	heatmap->begin_pixel(cost);
+      fb.pixel(i, j) = render_pixel(s, tracer, rs, a_ratio, i, j, &fb);
+      if (heatmap != NULL)
+	heatmap->end_pixel(cost, i, j);
+    }
+    stat_busy(stat_time() - row_start);
+    trace_event("row", row_start, "row", i);
+#pragma omp atomic
+    current += rs.w * rs.samples;
+    if (verbose) {
+#pragma omp critical
+      cout << "\r" << ANSI_BOLD_YELLOW << current << ANSI_RESET_STYLE << " of " << ANSI_BOLD_YELLOW << total << ANSI_RESET_STYLE << " primary rays traced.";
+    }
+  }
+  if (verbose)
+    cout << endl;
+}
+
+void render_tile(Scene * s, Tracer * tracer, const render_settings_t & rs, const tile_t & tile, vector<vec3> & pixels) {
+  float a_ratio = static_cast<float>(rs.w) / static_cast<float>(rs.h);
+  int w = tile.x1 - tile.x0;
+  double row_start;
+
+  pixels.resize(static_cast<size_t>(w) * (tile.y1 - tile.y0));
+
+#pragma omp parallel for schedule(dynamic, 1) private(row_start)
+  for (int i = tile.y0; i < tile.y1; i++) {
+    row_start = stat_time();
+    for (int j = tile.x0; j < tile.x1; j++)
+      pixels[(static_cast<size_t>(i - tile.y0) * w) + (j - tile.x0)] = render_pixel(s, tracer, rs, a_ratio, i, j);
+    stat_busy(stat_time() - row_start);
+    trace_event("row", row_start, "row", i);
+  }
+}
+
+////////////////////////////////////////////
+// Sample sums.
+////////////////////////////////////////////
+
+bool save_sample_sums(const Framebuffer & fb, const render_settings_t & rs, const char * file_name) {
+  sample_sums_header_t header;
+  vector<vec3> sums(fb.m_pixels.size());
+  ofstream ofs(file_name, ios::out | ios::binary);
+
+  if (!ofs.is_open())
+    return false;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SAMPLE_SUMS_MAGIC, sizeof(header.magic));
+  header.w = static_cast<uint32_t>(fb.m_w);
+  header.h = static_cast<uint32_t>(fb.m_h);
+  header.first_sample = static_cast<uint64_t>(rs.first_sample);
+  header.samples = static_cast<uint64_t>(rs.samples);
+
+  for (size_t i = 0; i < sums.size(); i++)
+    sums[i] = fb.m_pixels[i] * static_cast<float>(rs.samples);
+
+  ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  ofs.write(reinterpret_cast<const char *>(&sums[0]), sums.size() * sizeof(vec3));
+  ofs.close();
+
+  return static_cast<bool>(ofs);
+}
+
+bool merge_sample_sums(const vector<const char *> & file_names, Framebuffer & fb, render_settings_t & rs, bool & contiguous) {
+  sample_sums_header_t header;
+  vector<vec3> sums;
+  vector<pair<uint64_t, uint64_t> > ranges;
+  uint64_t samples = 0;
+  ifstream ifs;
+
+  for (const char * file_name : file_names) {
+    ifs.open(file_name, ios::in | ios::binary);
+    if (!ifs.is_open()) {
+      cerr << "Failed to open the file " << file_name << " for reading." << endl;
+      return false;
+    }
+
+    if (!ifs.read(reinterpret_cast<char *>(&header), sizeof(header)) || memcmp(header.magic, SAMPLE_SUMS_MAGIC, sizeof(header.magic)) != 0) {
+      cerr << file_name << " is not a sample sums file." << endl;
+      return false;
+    }
+    if (ranges.empty()) {
+      fb.resize(static_cast<int>(header.w), static_cast<int>(header.h));
+      sums.resize(fb.m_pixels.size());
+    } else if (header.w != static_cast<uint32_t>(fb.m_w) || header.h != static_cast<uint32_t>(fb.m_h)) {
+      cerr << "The sample sums " << file_name << " are for a " << header.w << "x" << header.h << " image, not "
+	   << fb.m_w << "x" << fb.m_h << "." << endl;
+      return false;
+    }
+
+    if (!ifs.read(reinterpret_cast<char *>(&sums[0]), sums.size() * sizeof(vec3))) {
+      cerr << "The sample sums " << file_name << " are truncated." << endl;
+      return false;
+    }
+    ifs.close();
+
+    for (size_t i = 0; i < sums.size(); i++)
+      fb.m_pixels[i] += sums[i];
+    samples += header.samples;
+    ranges.push_back(make_pair(header.first_sample, header.first_sample + header.samples));
+  }
+
+  if (samples == 0) {
+    cerr << "No samples to merge." << endl;
+    return false;
+  }
+
+  // Overlapping ranges repeat the same samples when rendered with a sampler.
+  sort(ranges.begin(), ranges.end());
+  contiguous = true;
+  for (size_t i = 1; i < ranges.size(); i++) {
+    if (ranges[i].first < ranges[i - 1].second)
+      cerr << "Samples " << ranges[i].first << " to " << std::min(ranges[i].second, ranges[i - 1].second) - 1 << " were merged more than once." << endl;
+    if (ranges[i].first != ranges[i - 1].second)
+      contiguous = false;
+  }
+
+  for (size_t i = 0; i < fb.m_pixels.size(); i++)
+    fb.m_pixels[i] /= static_cast<float>(samples);
+
+  rs.w = fb.m_w;
+  rs.h = fb.m_h;
+  rs.first_sample = static_cast<int>(ranges[0].first);
+  rs.samples = static_cast<int>(samples);
+
+  cout << "Merged " << ANSI_BOLD_YELLOW << samples << ANSI_RESET_STYLE << " samples per pixel from " << ANSI_BOLD_YELLOW
+       << file_names.size() << ANSI_RESET_STYLE << " sample sums files." << endl;
+
+  return true;
+}
+
+////////////////////////////////////////////
+// Images.
+////////////////////////////////////////////
+
+bool save_image(const Framebuffer & fb, const render_settings_t & rs, const bool tone_map, const char * file_name) {
+  FIBITMAP * input_bitmap;
+  FIBITMAP * output_bitmap;
+  FREE_IMAGE_FORMAT fif;
+  BYTE * bits;
+  FIRGBF * pixel;
+  int pitch;
+  bool ok;
+  Framebuffer denoised;
+  const Framebuffer * image = &fb;
+
+  if (rs.denoise > 0 && fb.has_aovs()) {
+    phase_begin(PHASE_DENOISE);
+    denoise(fb, rs.denoise, denoised);
+    image = &denoised;
+    phase_end(PHASE_DENOISE);
+  }
+
+  // Copy the pixels to the output bitmap, FreeImage stores the bottom row first.
+  phase_begin(PHASE_TONE_MAPPING);
+  if (tone_map) {
+    input_bitmap = FreeImage_AllocateT(FIT_RGBF, image->m_w, image->m_h, 96);
+    pitch = FreeImage_GetPitch(input_bitmap);
+    bits = (BYTE *)FreeImage_GetBits(input_bitmap);
+    for (unsigned int y = 0; y < FreeImage_GetHeight(input_bitmap); y++) {
+      pixel = (FIRGBF *)bits;
+      for (unsigned int x = 0; x < FreeImage_GetWidth(input_bitmap); x++) {
+	pixel[x].red = image->pixel(image->m_h - 1 - y, x).r;
+	pixel[x].green = image->pixel(image->m_h - 1 - y, x).g;
+	pixel[x].blue = image->pixel(image->m_h - 1 - y, x).b;
+      }
+      bits += pitch;
+    }
+
+    output_bitmap = FreeImage_ToneMapping(input_bitmap, FITMO_DRAGO03, rs.gamma, rs.exposure);
+    FreeImage_Unload(input_bitmap);
+
+  } else {
+    output_bitmap = FreeImage_Allocate(image->m_w, image->m_h, 24, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+    pitch = FreeImage_GetLine(output_bitmap) / FreeImage_GetWidth(output_bitmap);
+    for (unsigned int y = 0; y < FreeImage_GetHeight(output_bitmap); y++) {
+      bits = FreeImage_GetScanLine(output_bitmap, y);
+      for (unsigned int x = 0; x < FreeImage_GetWidth(output_bitmap); x++) {
+	bits[FI_RGBA_RED] = static_cast<BYTE>(image->pixel(image->m_h - 1 - y, x).r * 255.0f);
+	bits[FI_RGBA_GREEN] = static_cast<BYTE>(image->pixel(image->m_h - 1 - y, x).g * 255.0f);
+	bits[FI_RGBA_BLUE] = static_cast<BYTE>(image->pixel(image->m_h - 1 - y, x).b * 255.0f);
+	bits += pitch;
+      }
+    }
+
+    FreeImage_AdjustGamma(output_bitmap, rs.gamma);
+  }
+  phase_end(PHASE_TONE_MAPPING);
+
+  // Save the output image.
+  phase_begin(PHASE_SAVE);
+  fif = FreeImage_GetFIFFromFilename(file_name);
+  ok = output_bitmap != NULL && FreeImage_Save(fif, output_bitmap, file_name);
+  FreeImage_Unload(output_bitmap);
+  phase_end(PHASE_SAVE);
+
+  return ok;
+}
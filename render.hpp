@@ -0,0 +1,152 @@
+#pragma once
+#ifndef RENDER_HPP
+#define RENDER_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/vec3.hpp>
+
+#include "scene.hpp"
+#include "tracer.hpp"
+#include "heatmap.hpp"
+
+using std::vector;
+using glm::vec3;
+
+typedef enum TRACERS { NONE, WHITTED, MONTE_CARLO, JENSEN } tracer_t;
+
+// What to render, shared by a render from the command line and a render job.
+typedef struct RENDER_SETTINGS {
+  int w;
+  int h;
+  int samples;
+  // Index of the first sample of every pixel, to split a render by samples.
+  int first_sample;
+  float fov;
+  float gamma;
+  float exposure;
+  // Passes of the denoiser run before tone mapping, 0 to leave the image alone.
+  int denoise;
+} render_settings_t;
+
+// Everything the tracers are created with.
+typedef struct TRACER_OPTIONS {
+  unsigned int max_depth;
+  size_t photons;
+  size_t importons;
+  float p_sample_radius;
+  float cone_filter_k;
+  int max_photons;
+  int max_search;
+  bool compact;
+  const char * photons_file;
+  const char * caustics_file;
+  // Photon shards to merge instead of tracing photons.
+  vector<const char *> shard_files;
+  // Shared memory photon maps, see PhotonMap::publish.
+  const char * publish_photons;
+  const char * attach_photons;
+  // Keep the photon paths, to update the photon maps when figures move.
+  bool track_photon_paths;
+} tracer_options_t;
+
+// Columns [x0, x1) of the rows [y0, y1) of an image.
+typedef struct TILE {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+} tile_t;
+
+/* Float pixels, rows top to bottom. When asked for, the render also keeps
+ * the mean albedo, normal and depth of the first hits of the samples of
+ * every pixel, zero for samples that hit nothing, and the variance of the
+ * mean luminance of the pixel, to guide the denoiser. */
+class Framebuffer {
+public:
+  int m_w;
+  int m_h;
+  vector<vec3> m_pixels;
+  vector<vec3> m_albedos;
+  vector<vec3> m_normals;
+  vector<float> m_depths;
+  vector<float> m_variances;
+
+  Framebuffer(const int w = 0, const int h = 0): m_w(w), m_h(h), m_pixels(static_cast<size_t>(w) * h, vec3(0.0f)) { }
+
+  void resize(const int w, const int h, const bool aovs = false) {
+    size_t n = aovs ? static_cast<size_t>(w) * h : 0;
+
+    m_w = w;
+    m_h = h;
+    m_pixels.assign(static_cast<size_t>(w) * h, vec3(0.0f));
+    m_albedos.assign(n, vec3(0.0f));
+    m_normals.assign(n, vec3(0.0f));
+    m_depths.assign(n, 0.0f);
+    m_variances.assign(n, 0.0f);
+  }
+
+  bool has_aovs() const { return !m_pixels.empty() && m_depths.size() == m_pixels.size(); }
+
+  vec3 & pixel(const int i, const int j) { return m_pixels[(static_cast<size_t>(i) * m_w) + j]; }
+  const vec3 & pixel(const int i, const int j) const { return m_pixels[(static_cast<size_t>(i) * m_w) + j]; }
+};
+
+/* Sums of the samples of every pixel, written by renders of a range of
+ * the samples to be merged with the other ranges, or with more samples
+ * later. A sums file is this header followed by the w * h * 3 floats of
+ * the sums of every pixel, row by row from the top, in native byte order. */
+typedef struct SAMPLE_SUMS_HEADER {
+  char magic[8];
+  uint32_t w;
+  uint32_t h;
+  uint64_t first_sample;
+  uint64_t samples;
+} sample_sums_header_t;
+
+// Tracer by its command line name, NONE if unknown.
+extern tracer_t tracer_by_name(const char * name);
+extern const char * tracer_name(const tracer_t t);
+
+/* Creates a tracer. For photon mapping this traces and balances the photon
+ * maps, or reads them from the photon files, so it takes a while. Returns
+ * NULL if the tracer can not be created, after printing why. */
+extern Tracer * create_tracer(const tracer_t t, Scene * s, const tracer_options_t & opts, const render_settings_t & rs);
+
+/* Traces the photons of one shard of the photon maps of a photon mapping
+ * render with these options, and saves them to file_name to be merged
+ * later through opts.shard_files. See photon_shard_header_t. */
+extern bool trace_photon_shard(Scene * s, const tracer_options_t & opts, const render_settings_t & rs, const size_t shard, const size_t shards,
+			       const char * file_name);
+
+/* Renders the whole image into fb, which is resized to it, with the first
+ * hits for the denoiser when rs.denoise > 0. Costs per pixel go to
+ * heatmap, if any, and the progress is printed when verbose. */
+extern void render(Scene * s, Tracer * tracer, const render_settings_t & rs, Framebuffer & fb, Heatmap * heatmap = NULL, const bool verbose = true);
+
+/* Renders a tile of the image described by rs into pixels, row by row.
+ * Every pixel is sampled exactly as in a render of the whole image, so
+ * with a sampler set tiles rendered anywhere put together the same image,
+ * as long as photon maps are traced with the same sampler too. */
+extern void render_tile(Scene * s, Tracer * tracer, const render_settings_t & rs, const tile_t & tile, vector<vec3> & pixels);
+
+// Saves the pixels of a render with the settings rs as sample sums.
+extern bool save_sample_sums(const Framebuffer & fb, const render_settings_t & rs, const char * file_name);
+
+/* Adds up the sample sums files into fb, which then holds the mean of all
+ * their samples, and sets the size and number of samples of rs. Warns when
+ * the files have samples in common. contiguous tells whether the samples
+ * are the single range rs describes, each sample once, which is the only
+ * case where they can be saved as sample sums again. */
+extern bool merge_sample_sums(const vector<const char *> & file_names, Framebuffer & fb, render_settings_t & rs, bool & contiguous);
+
+/* Converts the pixels to 8 bits and saves them, with the format chosen by
+ * the extension of file_name. Images with first hits are denoised first
+ * when rs.denoise > 0, leaving fb as it was. High dynamic range images from the Monte
+ * Carlo and photon mapping tracers are tone mapped, Whitted images are
+ * clamped and gamma corrected. Returns false if the file can not be written. */
+extern bool save_image(const Framebuffer & fb, const render_settings_t & rs, const bool tone_map, const char * file_name);
+
+#endif
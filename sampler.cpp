@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+#include "sampler.hpp"
+#include "sampling.hpp"
+
+// Largest float below 1, so that samples never reach 1.
+static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+// Bases of the Halton sequence. Dimensions beyond these are padded with
+// independent random numbers.
+static const uint32_t PRIMES[] = {
+  2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+  59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+static const uint32_t N_PRIMES = sizeof(PRIMES) / sizeof(PRIMES[0]);
+
+static Sampler * g_sampler = NULL;
+
+static thread_local uint32_t t_pixel = 0;
+static thread_local uint32_t t_index = 0;
+static thread_local uint32_t t_dim = 0;
+static thread_local bool t_started = false;
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+// Integer hash with good avalanche, by Chris Wellons (lowbias32).
+static inline uint32_t hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+static inline uint32_t hash(const uint32_t a, const uint32_t b) {
+  return hash(a ^ (hash(b) + 0x9e3779b9u + (a << 6) + (a >> 2)));
+}
+
+static inline uint32_t hash(const uint32_t a, const uint32_t b, const uint32_t c) {
+  return hash(hash(a, b), c);
+}
+
+static inline float to_unit_float(const uint32_t x) {
+  // Keep the 24 most significant bits, which a float represents exactly.
+  return std::min(static_cast<float>(x >> 8) * (1.0f / 16777216.0f), ONE_MINUS_EPSILON);
+}
+
+static inline uint32_t reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+// Random permutation of the integers in [0, l), from Kensler's
+// "Correlated Multi-Jittered Sampling" (Pixar technical memo 13-01).
+static uint32_t permute(uint32_t i, const uint32_t l, const uint32_t p) {
+  uint32_t w = l - 1;
+
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+
+  do {
+    i ^= p;
+    i *= 0xe170893du;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8;
+    i *= 0x0929eb3fu;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1 | p >> 27;
+    i *= 0x6935fa69u;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303u;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3u;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3dfu;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= l);
+
+  return (i + p) % l;
+}
+
+// Owen scrambling of the bits of x, hashed from the most significant bit
+// down, from Burley's "Practical Hash-based Owen Scrambling".
+static inline uint32_t nested_uniform_scramble(uint32_t x, const uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+// First two dimensions of the Sobol sequence as 32 bit fractions.
+static inline uint32_t sobol(uint32_t index, const uint32_t dim) {
+  uint32_t v = 1u << 31, r = 0;
+
+  if (dim == 0)
+    return reverse_bits(index);
+
+  for (; index != 0; index >>= 1, v ^= v >> 1)
+    if (index & 1)
+      r ^= v;
+
+  return r;
+}
+
+static float radical_inverse(const uint32_t base, uint32_t index) {
+  const float inv_base = 1.0f / static_cast<float>(base);
+  float inv = inv_base, r = 0.0f;
+
+  while (index > 0) {
+    r += static_cast<float>(index % base) * inv;
+    index /= base;
+    inv *= inv_base;
+  }
+
+  return std::min(r, ONE_MINUS_EPSILON);
+}
+
+////////////////////////////////////////////
+// Samplers.
+////////////////////////////////////////////
+
+float IndependentSampler::sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const {
+  return to_unit_float(hash(pixel, index, dim));
+}
+
+StratifiedSampler::StratifiedSampler(const uint32_t spp): m_spp(spp > 0 ? spp : 1) {
+  m_x_strata = static_cast<uint32_t>(std::sqrt(static_cast<float>(m_spp)));
+  m_x_strata = m_x_strata > 0 ? m_x_strata : 1;
+  m_y_strata = (m_spp + m_x_strata - 1) / m_x_strata;
+}
+
+float StratifiedSampler::sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const {
+  const uint32_t n = m_x_strata * m_y_strata;
+  uint32_t stratum, seed;
+  float jitter;
+
+  // Samples past the sample count are not stratified.
+  if (index >= m_spp)
+    return to_unit_float(hash(pixel, index, dim));
+
+  seed = hash(pixel, dim / 2);
+  stratum = permute(index, n, seed);
+  jitter = to_unit_float(hash(pixel, index, dim));
+
+  if (dim % 2 == 0)
+    return std::min((static_cast<float>(stratum % m_x_strata) + jitter) / m_x_strata, ONE_MINUS_EPSILON);
+  else
+    return std::min((static_cast<float>(stratum / m_x_strata) + jitter) / m_y_strata, ONE_MINUS_EPSILON);
+}
+
+float HaltonSampler::sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const {
+  float r;
+
+  if (dim >= N_PRIMES)
+    return to_unit_float(hash(pixel, index, dim));
+
+  r = radical_inverse(PRIMES[dim], index) + to_unit_float(hash(pixel, dim));
+
+  return r >= 1.0f ? std::min(r - 1.0f, ONE_MINUS_EPSILON) : r;
+}
+
+float SobolSampler::sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const {
+  const uint32_t seed = hash(pixel, dim / 2);
+  const uint32_t shuffled = nested_uniform_scramble(index, hash(seed));
+
+  return to_unit_float(nested_uniform_scramble(sobol(shuffled, dim % 2), hash(seed, dim % 2)));
+}
+
+////////////////////////////////////////////
+// Sample streams.
+////////////////////////////////////////////
+
+Sampler * create_sampler(const char * name, const uint32_t spp) {
+  if (strcmp(name, "independent") == 0)
+    return new IndependentSampler();
+  else if (strcmp(name, "stratified") == 0)
+    return new StratifiedSampler(spp);
+  else if (strcmp(name, "halton") == 0)
+    return new HaltonSampler();
+  else if (strcmp(name, "sobol") == 0)
+    return new SobolSampler();
+
+  return NULL;
+}
+
+void set_sampler(Sampler * sampler) {
+  g_sampler = sampler;
+}
+
+void start_sample(const uint32_t pixel, const uint32_t index) {
+  t_pixel = pixel;
+  t_index = index;
+  t_dim = 0;
+  t_started = true;
+}
+
+float next_sample() {
+  if (g_sampler == NULL || !t_started)
+    return random01();
+
+  return g_sampler->sample(t_pixel, t_index, t_dim++);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <cstdint>
+
+/* Generators of sample coordinates in [0, 1). Samples are indexed by
+ * the pixel (or any other stream id, like a light source), the index of
+ * the sample in that pixel and the dimension of the coordinate, so any
+ * coordinate can be computed without keeping state between calls. */
+class Sampler {
+public:
+  virtual ~Sampler() { }
+
+  virtual float sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const = 0;
+};
+
+// Uncorrelated hash based random numbers.
+class IndependentSampler: public Sampler {
+public:
+  virtual float sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const;
+};
+
+// Jittered samples in a grid of strata for every pair of dimensions. The
+// strata are visited in a different random order per pixel and pair.
+class StratifiedSampler: public Sampler {
+public:
+  StratifiedSampler(const uint32_t spp);
+
+  virtual float sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const;
+
+private:
+  uint32_t m_spp;
+  uint32_t m_x_strata;
+  uint32_t m_y_strata;
+};
+
+// Halton sequence with a random toroidal shift per pixel and dimension.
+class HaltonSampler: public Sampler {
+public:
+  virtual float sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const;
+};
+
+// The first two dimensions of the Sobol sequence with hash based Owen
+// scrambling, padded to higher dimensions with an independent shuffle of
+// the sample indices for every pair of dimensions, as in Burley's
+// "Practical Hash-based Owen Scrambling" (JCGT, 2020).
+class SobolSampler: public Sampler {
+public:
+  virtual float sample(const uint32_t pixel, const uint32_t index, const uint32_t dim) const;
+};
+
+// Returns NULL for unknown sampler names.
+extern Sampler * create_sampler(const char * name, const uint32_t spp);
+
+// Sets the sampler used by next_sample(). NULL keeps plain random01() draws.
+extern void set_sampler(Sampler * sampler);
+
+// Starts the sample stream of the calling thread for the given pixel and
+// sample index. Each next_sample() call then returns the next dimension.
+extern void start_sample(const uint32_t pixel, const uint32_t index);
+extern float next_sample();
+
+#endif
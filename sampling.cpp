@@ -2,6 +2,7 @@
 #include <random>
 #include <chrono>
 #include <functional>
+#include <thread>
 #else
 #include <cstdlib>
 #include <ctime>
@@ -11,40 +12,38 @@
 #include <glm/gtc/constants.hpp>
 
 #include "sampling.hpp"
+#include "sampler.hpp"
 
 #ifdef USE_CPP11_RANDOM
 using std::uniform_real_distribution;
 using std::mt19937;
-using std::bind;
 #endif
-using glm::mat3;
-using glm::abs;
-using glm::normalize;
-using glm::cross;
 using glm::radians;
 using glm::pi;
 
 const float PDF = (1.0f / (2.0f * pi<float>()));
 
-static bool seeded = false;
-
 #ifdef USE_CPP11_RANDOM
-static uniform_real_distribution<float> dist(0, 1);
-static mt19937 engine;
-static auto generator = bind(dist, engine);
+// Every thread draws from its own engine.
+static thread_local bool seeded = false;
+static thread_local uniform_real_distribution<float> dist(0, 1);
+static thread_local mt19937 engine;
+#else
+static bool seeded = false;
 #endif
 
 float random01() {
   if (!seeded) {
 #ifdef USE_CPP11_RANDOM
-    engine.seed(std::chrono::system_clock::now().time_since_epoch().count());
+    engine.seed(std::chrono::system_clock::now().time_since_epoch().count() ^
+		std::hash<std::thread::id>()(std::this_thread::get_id()));
 #else
     srand(time(NULL));
 #endif
     seeded = true;
   }
 #ifdef USE_CPP11_RANDOM
-  return generator();
+  return dist(engine);
 #else
   return static_cast<float>(rand()) / RAND_MAX;
 #endif
@@ -55,24 +54,28 @@ vec2 sample_pixel(int i, int j, float w, float h, float a_ratio, float fov) {
   float pyNDC;
   float pxS;
   float pyS;
-  pyNDC = (static_cast<float>(i) + random01()) / h;
+  pyNDC = (static_cast<float>(i) + next_sample()) / h;
   pyS = (1.0f - (2.0f * pyNDC)) * glm::tan(radians(fov / 2.0f));
-  pxNDC = (static_cast<float>(j) + random01()) / w;
+  pxNDC = (static_cast<float>(j) + next_sample()) / w;
   pxS = (2.0f * pxNDC) - 1.0f;
   pxS *= a_ratio * glm::tan(radians(fov / 2.0f));
 
   return vec2(pxS, pyS);
 }
 
-/* Sampling functions pretty much taken from scratchapixel.com */
+/* Branchless orthonormal basis around the unit vector n, from Duff et al.
+ * "Building an Orthonormal Basis, Revisited" (JCGT, 2017). */
 void create_coords_system(const vec3 &n, vec3 &nt, vec3 &nb) {
-  if (abs(n.x) > abs(n.y))
-    nt = normalize(vec3(n.z, 0.0f, -n.x));
-  else
-    nt = normalize(vec3(0.0f, -n.z, n.y));
-  nb = normalize(cross(n, nt));
+  const float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+  const float a = -1.0f / (sign + n.z);
+  const float b = n.x * n.y * a;
+
+  nt = vec3(1.0f + (sign * n.x * n.x * a), sign * b, -sign * n.x);
+  nb = vec3(b, sign + (n.y * n.y * a), -n.y);
 }
 
+/* Sampling functions pretty much taken from scratchapixel.com */
+
 vec3 sample_hemisphere(const float r1, float r2) {
   float sin_t = glm::sqrt(1.0f - (r1 * r1));
   float phi = 2 * pi<float>() * r2;
@@ -81,9 +84,16 @@ vec3 sample_hemisphere(const float r1, float r2) {
   return vec3(x, r1, z);
 }
 
+vec3 sample_cosine_hemisphere(const float r1, const float r2) {
+  float r = glm::sqrt(r1);
+  float phi = 2 * pi<float>() * r2;
+  float x = r * glm::cos(phi);
+  float z = r * glm::sin(phi);
+  return vec3(x, glm::sqrt(glm::max(0.0f, 1.0f - r1)), z);
+}
+
 void rotate_sample(vec3 & sample, const vec3 & n) {
   vec3 nt, nb;
-  mat3 rot_m;
 
   create_coords_system(n, nt, nb);
   sample = vec3(sample.x * nb.x + sample.y * n.x + sample.z * nt.x,
@@ -97,8 +107,8 @@ vec3 sample_sphere(const vec3 center, const float radius) {
 
   // Sampling formula from Wolfram Mathworld:
   // http://mathworld.wolfram.com/SpherePointPicking.html
-  theta = random01()* (2.0f * pi<float>());
-  u = (random01() * 2.0f) - 1.0f;
+  theta = next_sample() * (2.0f * pi<float>());
+  u = (next_sample() * 2.0f) - 1.0f;
   sqrt1muu = glm::sqrt(1.0f - (u * u));
   x = radius * sqrt1muu * cos(theta);
   y = radius * sqrt1muu * sin(theta);
@@ -106,3 +116,10 @@ vec3 sample_sphere(const vec3 center, const float radius) {
 
   return vec3(vec3(x, y, z) + center);
 }
+
+// Veach's power heuristic with an exponent of two.
+float power_heuristic(const float f_pdf, const float g_pdf) {
+  float f2 = f_pdf * f_pdf, g2 = g_pdf * g_pdf;
+
+  return (f2 + g2) > 0.0f ? f2 / (f2 + g2) : 0.0f;
+}
@@ -14,7 +14,11 @@ extern float random01();
 extern vec2 sample_pixel(int i, int j, float w, float h, float a_ratio, float fov);
 extern void create_coords_system(const vec3 &n, vec3 &nt, vec3 &nb);
 extern vec3 sample_hemisphere(const float r1, float r2);
+// Samples with pdf cos(theta) / pi. The normal is the y axis, like sample_hemisphere.
+extern vec3 sample_cosine_hemisphere(const float r1, const float r2);
 extern void rotate_sample(vec3 & sample, const vec3 & n);
 extern vec3 sample_sphere(const vec3 center, const float radius);
+// Multiple importance sampling weight of a sample drawn with f_pdf, against g_pdf.
+extern float power_heuristic(const float f_pdf, const float g_pdf);
 
 #endif
@@ -6,9 +6,12 @@
 #include <cassert>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 #include <json_spirit_reader.h>
 
 #include "scene.hpp"
+#include "scene_cache.hpp"
+#include "stats.hpp"
 #include "brdf.hpp"
 #include "phong_brdf.hpp"
 #include "hsa_brdf.hpp"
@@ -28,7 +31,10 @@ using std::ostringstream;
 using std::ifstream;
 using std::ios;
 using std::streamsize;
+using std::istreambuf_iterator;
 using glm::vec3;
+using glm::mat4;
+using glm::radians;
 using glm::normalize;
 using glm::cross;
 using json_spirit::read;
@@ -36,6 +42,8 @@ using json_spirit::Error_position;
 using json_spirit::Object;
 using json_spirit::Array;
 
+static const string CACHE_EXT = ".cache";
+
 static const string ENV_KEY = "environment";
 static const string CAM_KEY = "camera";
 static const string SPH_KEY = "sphere";
@@ -48,6 +56,8 @@ static const string SLT_KEY = "spot_light";
 static const string SAL_KEY = "sphere_area_light";
 static const string DAL_KEY = "disk_area_light";
 static const string PAL_KEY = "planar_area_light";
+static const string OBJ_KEY = "object";
+static const string INS_KEY = "instance";
 
 static const string ENV_TEX_KEY = "texture";
 static const string ENV_LPB_KEY = "light_probe";
@@ -68,6 +78,8 @@ static const string FIG_NOR_KEY = "normal";
 
 static const string PLN_PNT_KEY = "point";
 
+static const string OBJ_NAM_KEY = "name";
+
 static const string MLT_EMS_KEY = "emission";
 static const string MLT_DIF_KEY = "diffuse";
 static const string MLT_SPC_KEY = "specular";
@@ -92,9 +104,11 @@ static const string LGT_SPD_KEY = "spot_direction";
 static const string LGT_SPC_KEY = "spot_cutoff";
 static const string LGT_SPE_KEY = "spot_exponent";
 
-Scene::Scene(const char * file_name, int h, int w, float fov) {
+Scene::Scene(const char * file_name, int h, int w, float fov, bool use_cache) {
   ostringstream oss;
-  ifstream ifs(file_name, ios::in);
+  ifstream ifs(file_name, ios::in | ios::binary);
+  string contents;
+  uint64_t hash;
   Value val;
   Object top_level;
 
@@ -102,21 +116,34 @@ Scene::Scene(const char * file_name, int h, int w, float fov) {
   m_env = NULL;
   
   if (ifs.is_open()) {
+    contents.assign(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+    ifs.close();
+    hash = scene_hash(contents.data(), contents.size());
+
+    if (use_cache && read_cache(string(file_name) + CACHE_EXT, hash))
+      return;
+
     try {
-      read_or_throw(ifs, val);
+      read_or_throw(contents, val);
     } catch (Error_position & e) {
-      ifs.close();
       oss << "Failed to parse the input file: " << endl << "Reason: " << e.reason_ << endl << "Line: " << e.line_ << endl << "Column: " << e.column_;
       throw SceneError(oss.str());
     }
 
-    ifs.close();
-
     top_level = val.get_value<Object>();
 
     try {
+      // Objects are read first so that instances can refer to any of them.
       for (Object::iterator it = top_level.begin(); it != top_level.end(); it++) {
-	if ((*it).name_ == ENV_KEY)
+	if ((*it).name_ == OBJ_KEY)
+	  m_groups.push_back(read_object((*it).value_));
+      }
+
+      for (Object::iterator it = top_level.begin(); it != top_level.end(); it++) {
+	if ((*it).name_ == OBJ_KEY)
+	  continue;
+
+	else if ((*it).name_ == ENV_KEY)
 	  read_environment((*it).value_);
 
 	else if ((*it).name_ == CAM_KEY)
@@ -131,6 +158,9 @@ Scene::Scene(const char * file_name, int h, int w, float fov) {
 	else if ((*it).name_ == DSK_KEY)
 	  m_figures.push_back(read_disk((*it).value_));
 
+	else if ((*it).name_ == INS_KEY)
+	  m_figures.push_back(read_instance((*it).value_));
+
 	else if ((*it).name_ == DLT_KEY)
 	  m_lights.push_back(read_light((*it).value_, DIRECTIONAL));
 
@@ -160,6 +190,11 @@ Scene::Scene(const char * file_name, int h, int w, float fov) {
       m_cam = new Camera();
     if (m_env == NULL)
       m_env = new Environment();
+
+    m_bvh.build(m_figures);
+
+    if (use_cache)
+      write_cache(string(file_name) + CACHE_EXT, hash);
     
   } else
     throw SceneError("Could not open the input file.");
@@ -178,6 +213,27 @@ Scene::~Scene() {
     delete m_lights[i];
   }
   m_lights.clear();
+
+  for (size_t i = 0; i < m_groups.size(); i++) {
+    delete m_groups[i];
+  }
+  m_groups.clear();
+}
+
+Figure * Scene::intersect(Ray & r, float & t, vec3 & n) const {
+  Figure * f = m_bvh.intersect(r, t);
+
+  return f != NULL ? f->shading_figure(r, t, n) : NULL;
+}
+
+Figure * Scene::closest(Ray & r, float & t, const Figure * ignore) const {
+  return m_bvh.intersect(r, t, ignore);
+}
+
+bool Scene::occluded(Ray & r, const float max_t, const Figure * ignore) const {
+  stat_add(STAT_SHADOW_RAYS);
+
+  return m_bvh.occluded(r, max_t, ignore);
 }
 
 void Scene::read_vector(Value & val, vec3 & vec) {
@@ -442,6 +498,102 @@ Figure * Scene::read_disk(Value &v) {
   return static_cast<Figure *>(new Disk(position, normal, radius, mat));
 }
 
+Group * Scene::read_object(Value & v) {
+  Group * g = new Group("");
+  Object obj_obj = v.get_value<Object>();
+
+  try {
+    for (Object::iterator it = obj_obj.begin(); it != obj_obj.end(); it++) {
+      if ((*it).name_ == OBJ_NAM_KEY)
+	g->m_name = (*it).value_.get_value<string>();
+
+      else if ((*it).name_ == SPH_KEY)
+	g->m_figures.push_back(read_sphere((*it).value_));
+
+      else if ((*it).name_ == PLN_KEY)
+	g->m_figures.push_back(read_plane((*it).value_));
+
+      else if ((*it).name_ == DSK_KEY)
+	g->m_figures.push_back(read_disk((*it).value_));
+
+      else if ((*it).name_ == INS_KEY)
+	g->m_figures.push_back(read_instance((*it).value_));
+
+      else
+	cerr << "Unrecognized key \"" << (*it).name_ << "\" in object." << endl;
+    }
+
+    if (g->m_name.empty())
+      throw SceneError("Object must specify a name.");
+
+    for (size_t i = 0; i < m_groups.size(); i++)
+      if (m_groups[i]->m_name == g->m_name)
+	throw SceneError("Object \"" + g->m_name + "\" is defined more than once.");
+
+  } catch (...) {
+    delete g;
+    throw;
+  }
+
+  g->m_bvh.build(g->m_figures);
+
+  return g;
+}
+
+Figure * Scene::read_instance(Value & v) {
+  string name;
+  vec3 translation = vec3(0.0f), scaling = vec3(1.0f), rotation = vec3(0.0f);
+  Group * g = NULL;
+  Material * mat = NULL;
+  mat4 xform;
+  Object ins_obj = v.get_value<Object>();
+
+  for (Object::iterator it = ins_obj.begin(); it != ins_obj.end(); it++) {
+    if ((*it).name_ == OBJ_KEY) {
+      name = (*it).value_.get_value<string>();
+
+      // Only objects defined before can be used, which rules out cycles.
+      for (size_t i = 0; i < m_groups.size(); i++)
+	if (m_groups[i]->m_name == name)
+	  g = m_groups[i];
+
+    } else if ((*it).name_ == GEO_TRN_KEY)
+      read_vector((*it).value_, translation);
+
+    else if ((*it).name_ == GEO_SCL_KEY)
+      read_vector((*it).value_, scaling);
+
+    else if ((*it).name_ == GEO_ROT_KEY)
+      read_vector((*it).value_, rotation);
+
+    else if ((*it).name_ == FIG_MAT_KEY) {
+      delete mat;
+      mat = read_material((*it).value_);
+
+    } else
+      cerr << "Unrecognized key \"" << (*it).name_ << "\" in instance." << endl;
+  }
+
+  if (g == NULL) {
+    delete mat;
+    throw SceneError(name.empty() ? "Instance must specify an object." : "Unknown object \"" + name + "\" in instance.");
+  }
+
+  if (scaling.x == 0.0f || scaling.y == 0.0f || scaling.z == 0.0f) {
+    delete mat;
+    throw SceneError("Instance scaling must not be 0.");
+  }
+
+  // Scale, then rotate around the x, y and z axes in degrees, then translate.
+  xform = glm::translate(mat4(1.0f), translation);
+  xform = glm::rotate(xform, radians(rotation.z), vec3(0.0f, 0.0f, 1.0f));
+  xform = glm::rotate(xform, radians(rotation.y), vec3(0.0f, 1.0f, 0.0f));
+  xform = glm::rotate(xform, radians(rotation.x), vec3(1.0f, 0.0f, 0.0f));
+  xform = glm::scale(xform, scaling);
+
+  return static_cast<Figure *>(new Instance(g, xform, mat));
+}
+
 Light * Scene::read_light(Value & v, light_type_t t) {
   vec3 position, diffuse = vec3(1.0f), specular = vec3(1.0f), spot_dir = vec3(0.0f, -1.0f, 0.0f);
   float const_att = 1.0f, lin_att = 0.0f, quad_att = 0.0f, spot_cutoff = 45.0f, spot_exp = 0.0f;
@@ -5,6 +5,8 @@
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <cstdint>
+#include <limits>
 
 #include <json_spirit_value.h>
 
@@ -13,10 +15,13 @@
 #include "light.hpp"
 #include "material.hpp"
 #include "environment.hpp"
+#include "bvh.hpp"
+#include "instance.hpp"
 
 using std::string;
 using std::vector;
 using std::runtime_error;
+using std::numeric_limits;
 using json_spirit::Value;
 
 class SceneError: public runtime_error {
@@ -30,13 +35,30 @@ public:
 
   vector<Figure *> m_figures;
   vector<Light *> m_lights;
+  // Groups of figures placed by the instances among the figures.
+  vector<Group *> m_groups;
   Environment * m_env;
   Camera * m_cam;
+  BVH m_bvh;
 
-  Scene(const char * file_name, int h = 480, int w = 640, float fov = 90.0f);
+  /* If use_cache is true the scene is loaded from the binary cache next to
+   * the scene file when it is up to date, and the cache is (re)written
+   * after parsing the scene file otherwise. */
+  Scene(const char * file_name, int h = 480, int w = 640, float fov = 90.0f, bool use_cache = false);
   ~Scene();
 
+  /* Closest hit along r, or NULL. Returns the figure whose material shades
+   * the hit, which is a part of the hit figure for instances, and sets the
+   * normal there. */
+  Figure * intersect(Ray & r, float & t, vec3 & n) const;
+  // Closest figure of m_figures hit by r, or NULL.
+  Figure * closest(Ray & r, float & t, const Figure * ignore = NULL) const;
+  // Whether anything is hit by r closer than max_t.
+  bool occluded(Ray & r, const float max_t = numeric_limits<float>::max(), const Figure * ignore = NULL) const;
+
 private:
+  bool read_cache(const string & file_name, const uint64_t hash);
+  void write_cache(const string & file_name, const uint64_t hash) const;
   void read_vector(Value & val, vec3 & vec);
   void read_environment(Value & v);
   void read_camera(Value & v);
@@ -44,6 +66,8 @@ private:
   Figure * read_sphere(Value & v);
   Figure * read_plane(Value & v);
   Figure * read_disk(Value & v);
+  Group * read_object(Value & v);
+  Figure * read_instance(Value & v);
   Light * read_light(Value & v, light_type_t t);
   Light * read_area_light(Value & v, light_type_t t);
 };
@@ -0,0 +1,406 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scene.hpp"
+#include "scene_cache.hpp"
+#include "hsa_brdf.hpp"
+#include "instance.hpp"
+#include "sphere.hpp"
+#include "plane.hpp"
+#include "disk.hpp"
+#include "directional_light.hpp"
+#include "point_light.hpp"
+#include "spot_light.hpp"
+#include "sphere_area_light.hpp"
+#include "disk_area_light.hpp"
+
+static const char MAGIC[8] = {'R', 'A', 'Y', 'S', 'C', 'N', '\0', '\0'};
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+static inline void to_array(float * a, const vec3 & v) {
+  a[0] = v.x;
+  a[1] = v.y;
+  a[2] = v.z;
+}
+
+static inline vec3 to_vec3(const float * a) {
+  return vec3(a[0], a[1], a[2]);
+}
+
+static inline size_t padded(const size_t len) {
+  return (len + 3) & ~static_cast<size_t>(3);
+}
+
+// Takes count records of the given size from the cursor, or returns NULL if
+// the file is too short.
+static const void * take(const char *& cursor, const char * end, const size_t count, const size_t size) {
+  const void * p = cursor;
+
+  if (count > static_cast<size_t>(end - cursor) / size)
+    return NULL;
+
+  cursor += count * size;
+  return p;
+}
+
+static Material * load_material(const cache_figure_t & f) {
+  Material * mat;
+
+  if (f.brdf == CACHE_HSA)
+    mat = new Material(new HeidrichSeidelAnisotropicBRDF(vec3(0.0f, 1.0f, 0.0f)));
+  else
+    mat = new Material();
+  mat->m_emission = to_vec3(f.emission);
+  mat->m_diffuse = to_vec3(f.diffuse);
+  mat->m_specular = to_vec3(f.specular);
+  mat->m_rho = f.rho;
+  mat->m_ref_index = f.ref_index;
+  mat->m_shininess = f.shininess;
+  mat->m_refract = f.refract != 0;
+
+  return mat;
+}
+
+static void store_material(cache_figure_t & f, const Material * mat) {
+  f.brdf = dynamic_cast<HeidrichSeidelAnisotropicBRDF *>(mat->m_brdf) != NULL ? CACHE_HSA : CACHE_PHONG;
+  f.refract = mat->m_refract;
+  to_array(f.emission, mat->m_emission);
+  to_array(f.diffuse, mat->m_diffuse);
+  to_array(f.specular, mat->m_specular);
+  f.rho = mat->m_rho;
+  f.shininess = mat->m_shininess;
+  f.ref_index = mat->m_ref_index;
+}
+
+uint64_t scene_hash(const void * data, const size_t size) {
+  const unsigned char * bytes = static_cast<const unsigned char *>(data);
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < size; i++) {
+    h ^= bytes[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+////////////////////////////////////////////
+// Scene cache.
+////////////////////////////////////////////
+
+bool Scene::read_cache(const string & file_name, const uint64_t hash) {
+  int fd;
+  struct stat st;
+  void * map;
+  const char * cursor, * end;
+  const cache_header_t * header;
+  const cache_camera_t * cam;
+  const cache_environment_t * env;
+  const cache_figure_t * figures, * f;
+  const cache_light_t * lights, * l;
+  const char * tex_file;
+  vector<const cache_bvh_t *> bvhs;
+  vector<const bvh_node_t *> nodes;
+  vector<const uint32_t *> orders;
+  uint32_t group, n_top, first_top;
+  bool valid;
+  mat4 xform;
+  Figure * fig;
+
+  if ((fd = open(file_name.c_str(), O_RDONLY)) < 0)
+    return false;
+
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(cache_header_t)) {
+    close(fd);
+    return false;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return false;
+
+  cursor = static_cast<const char *>(map);
+  end = cursor + st.st_size;
+  header = static_cast<const cache_header_t *>(take(cursor, end, 1, sizeof(cache_header_t)));
+
+  // Reject stale or foreign files.
+  valid = memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 && header->version == SCENE_CACHE_VERSION && header->source_hash == hash;
+
+  cam = valid ? static_cast<const cache_camera_t *>(take(cursor, end, 1, sizeof(cache_camera_t))) : NULL;
+  env = cam != NULL ? static_cast<const cache_environment_t *>(take(cursor, end, 1, sizeof(cache_environment_t))) : NULL;
+  tex_file = env != NULL ? static_cast<const char *>(take(cursor, end, padded(header->tex_file_len), 1)) : NULL;
+  figures = tex_file != NULL ? static_cast<const cache_figure_t *>(take(cursor, end, header->n_figures, sizeof(cache_figure_t))) : NULL;
+  lights = figures != NULL ? static_cast<const cache_light_t *>(take(cursor, end, header->n_lights, sizeof(cache_light_t))) : NULL;
+  valid = lights != NULL || (valid && figures != NULL && header->n_lights == 0);
+
+  for (uint32_t i = 0; valid && i <= header->n_groups; i++) {
+    bvhs.push_back(static_cast<const cache_bvh_t *>(take(cursor, end, 1, sizeof(cache_bvh_t))));
+    valid = bvhs.back() != NULL;
+    nodes.push_back(valid ? static_cast<const bvh_node_t *>(take(cursor, end, bvhs.back()->n_nodes, sizeof(bvh_node_t))) : NULL);
+    orders.push_back(valid ? static_cast<const uint32_t *>(take(cursor, end, bvhs.back()->n_order, sizeof(uint32_t))) : NULL);
+    valid = valid && (nodes.back() != NULL || bvhs.back()->n_nodes == 0) && (orders.back() != NULL || bvhs.back()->n_order == 0);
+  }
+
+  valid = valid && cursor == end;
+
+  // The figures of each group come in order, followed by those of the
+  // scene, and instances only place groups defined before them.
+  group = 0;
+  n_top = 0;
+  for (uint32_t i = 0; valid && i < header->n_figures; i++) {
+    f = &figures[i];
+    valid = f->type <= CACHE_INSTANCE;
+
+    if (f->group != CACHE_NO_GROUP) {
+      valid = valid && n_top == 0 && f->group < header->n_groups && f->group >= group;
+      group = f->group;
+    } else
+      n_top++;
+
+    if (f->type == CACHE_INSTANCE)
+      valid = valid && f->object < (f->group != CACHE_NO_GROUP ? f->group : header->n_groups);
+  }
+
+  first_top = header->n_figures - n_top;
+  for (uint32_t i = 0; valid && i < header->n_lights; i++) {
+    l = &lights[i];
+    valid = l->type <= CACHE_DISK_AREA;
+
+    if (l->type == CACHE_SPHERE_AREA)
+      valid = valid && l->figure < n_top && figures[first_top + l->figure].type == CACHE_SPHERE;
+    else if (l->type == CACHE_DISK_AREA)
+      valid = valid && l->figure < n_top && figures[first_top + l->figure].type == CACHE_DISK;
+  }
+
+  if (!valid) {
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  m_cam = new Camera(to_vec3(cam->eye), to_vec3(cam->look), to_vec3(cam->up));
+  m_env = new Environment(env->has_texture ? string(tex_file, header->tex_file_len).c_str() : NULL, env->light_probe != 0, to_vec3(env->color));
+
+  for (uint32_t i = 0; i < header->n_groups; i++)
+    m_groups.push_back(new Group(""));
+
+  for (uint32_t i = 0; i < header->n_figures; i++) {
+    f = &figures[i];
+
+    if (f->type == CACHE_SPHERE)
+      fig = new Sphere(to_vec3(f->position), f->radius, load_material(*f));
+    else if (f->type == CACHE_DISK)
+      fig = new Disk(to_vec3(f->position), to_vec3(f->normal), f->radius, load_material(*f));
+    else if (f->type == CACHE_PLANE)
+      fig = new Plane(to_vec3(f->position), to_vec3(f->normal), load_material(*f));
+    else {
+      xform = mat4(1.0f);
+      for (int r = 0; r < 3; r++)
+	for (int c = 0; c < 4; c++)
+	  xform[c][r] = f->xform[(r * 4) + c];
+      fig = new Instance(m_groups[f->object], xform, f->own_material ? load_material(*f) : NULL);
+    }
+
+    if (f->group != CACHE_NO_GROUP)
+      m_groups[f->group]->m_figures.push_back(fig);
+    else
+      m_figures.push_back(fig);
+  }
+
+  for (uint32_t i = 0; i < header->n_lights; i++) {
+    l = &lights[i];
+
+    if (l->type == CACHE_DIRECTIONAL)
+      m_lights.push_back(static_cast<Light *>(new DirectionalLight(to_vec3(l->position), to_vec3(l->diffuse), to_vec3(l->specular))));
+    else if (l->type == CACHE_POINT)
+      m_lights.push_back(static_cast<Light *>(new PointLight(to_vec3(l->position), to_vec3(l->diffuse), to_vec3(l->specular),
+							       l->const_att, l->lin_att, l->quad_att)));
+    else if (l->type == CACHE_SPOT)
+      m_lights.push_back(static_cast<Light *>(new SpotLight(to_vec3(l->position), to_vec3(l->diffuse), to_vec3(l->specular),
+							      l->const_att, l->lin_att, l->quad_att, l->spot_cutoff, l->spot_exponent,
+							      to_vec3(l->spot_dir))));
+    else if (l->type == CACHE_SPHERE_AREA)
+      m_lights.push_back(static_cast<Light *>(new SphereAreaLight(static_cast<Sphere *>(m_figures[l->figure]),
+								    l->const_att, l->lin_att, l->quad_att)));
+    else
+      m_lights.push_back(static_cast<Light *>(new DiskAreaLight(static_cast<Disk *>(m_figures[l->figure]),
+								  l->const_att, l->lin_att, l->quad_att)));
+  }
+
+  // Groups only contain instances of earlier groups, so their bounds are
+  // known by the time they are needed. Trees that do not fit are rebuilt.
+  for (uint32_t i = 0; i < header->n_groups; i++)
+    if (!m_groups[i]->m_bvh.assign(m_groups[i]->m_figures, nodes[i], bvhs[i]->n_nodes, orders[i], bvhs[i]->n_order))
+      m_groups[i]->m_bvh.build(m_groups[i]->m_figures);
+
+  if (!m_bvh.assign(m_figures, nodes.back(), bvhs.back()->n_nodes, orders.back(), bvhs.back()->n_order))
+    m_bvh.build(m_figures);
+
+  munmap(map, st.st_size);
+
+  return true;
+}
+
+void Scene::write_cache(const string & file_name, const uint64_t hash) const {
+  FILE * out;
+  cache_header_t header;
+  cache_camera_t cam;
+  cache_environment_t env;
+  cache_figure_t f;
+  cache_light_t l;
+  cache_bvh_t b;
+  const BVH * bvh;
+  AreaLight * al;
+  Instance * ins;
+  Figure * fig;
+  mat4 xform;
+  const char pad[4] = {0, 0, 0, 0};
+  string tmp_name = file_name + ".XXXXXX";
+  uint32_t n_figures = m_figures.size();
+  int fd;
+  bool ok;
+
+  for (size_t g = 0; g < m_groups.size(); g++)
+    n_figures += m_groups[g]->m_figures.size();
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = SCENE_CACHE_VERSION;
+  header.source_hash = hash;
+  header.n_figures = n_figures;
+  header.n_lights = m_lights.size();
+  header.tex_file_len = m_env->texture_file().size();
+  header.n_groups = m_groups.size();
+
+  memset(&cam, 0, sizeof(cam));
+  to_array(cam.eye, m_cam->m_eye);
+  to_array(cam.look, m_cam->m_look);
+  to_array(cam.up, m_cam->m_up);
+
+  memset(&env, 0, sizeof(env));
+  to_array(env.color, m_env->background_color());
+  env.has_texture = !m_env->texture_file().empty();
+  env.light_probe = m_env->light_probe();
+
+  // Write to a temporary file of its own first so that concurrent renders
+  // never map a partially written cache, even when they write it too.
+  if ((fd = mkstemp(&tmp_name[0])) < 0)
+    return;
+
+  // mkstemp() makes the file private, give it the usual permissions of a new file.
+  if (fchmod(fd, 0644) != 0 || (out = fdopen(fd, "wb")) == NULL) {
+    close(fd);
+    remove(tmp_name.c_str());
+    return;
+  }
+
+  ok = fwrite(&header, sizeof(header), 1, out) == 1;
+  ok = ok && fwrite(&cam, sizeof(cam), 1, out) == 1;
+  ok = ok && fwrite(&env, sizeof(env), 1, out) == 1;
+  ok = ok && fwrite(m_env->texture_file().data(), 1, header.tex_file_len, out) == header.tex_file_len;
+  ok = ok && fwrite(pad, 1, padded(header.tex_file_len) - header.tex_file_len, out) == padded(header.tex_file_len) - header.tex_file_len;
+
+  // The figures of every group, then those of the scene.
+  for (size_t g = 0; ok && g <= m_groups.size(); g++) {
+    const vector<Figure *> & figs = g < m_groups.size() ? m_groups[g]->m_figures : m_figures;
+
+    for (size_t i = 0; ok && i < figs.size(); i++) {
+      fig = figs[i];
+      memset(&f, 0, sizeof(f));
+      f.group = g < m_groups.size() ? g : CACHE_NO_GROUP;
+      store_material(f, fig->m_mat);
+
+      // Disks are planes, so they are checked first.
+      if ((ins = dynamic_cast<Instance *>(fig)) != NULL) {
+	f.type = CACHE_INSTANCE;
+	for (f.object = 0; f.object < m_groups.size() && m_groups[f.object] != ins->group(); f.object++);
+	xform = ins->transform();
+	for (int r = 0; r < 3; r++)
+	  for (int c = 0; c < 4; c++)
+	    f.xform[(r * 4) + c] = xform[c][r];
+	f.own_material = ins->own_material();
+      } else if (dynamic_cast<Disk *>(fig) != NULL) {
+	f.type = CACHE_DISK;
+	to_array(f.position, static_cast<Disk *>(fig)->m_point);
+	to_array(f.normal, static_cast<Disk *>(fig)->m_normal);
+	f.radius = static_cast<Disk *>(fig)->m_radius;
+      } else if (dynamic_cast<Plane *>(fig) != NULL) {
+	f.type = CACHE_PLANE;
+	to_array(f.position, static_cast<Plane *>(fig)->m_point);
+	to_array(f.normal, static_cast<Plane *>(fig)->m_normal);
+      } else if (dynamic_cast<Sphere *>(fig) != NULL) {
+	f.type = CACHE_SPHERE;
+	to_array(f.position, static_cast<Sphere *>(fig)->m_center);
+	f.radius = static_cast<Sphere *>(fig)->m_radius;
+      } else
+	ok = false;
+
+      ok = ok && fwrite(&f, sizeof(f), 1, out) == 1;
+    }
+  }
+
+  for (size_t i = 0; ok && i < m_lights.size(); i++) {
+    memset(&l, 0, sizeof(l));
+    to_array(l.position, m_lights[i]->m_position);
+    to_array(l.diffuse, m_lights[i]->m_diffuse);
+    to_array(l.specular, m_lights[i]->m_specular);
+
+    // Spot lights are point lights, so they are checked first.
+    if (dynamic_cast<SpotLight *>(m_lights[i]) != NULL) {
+      l.type = CACHE_SPOT;
+      to_array(l.spot_dir, static_cast<SpotLight *>(m_lights[i])->m_spot_dir);
+      l.spot_cutoff = static_cast<SpotLight *>(m_lights[i])->m_spot_cutoff;
+      l.spot_exponent = static_cast<SpotLight *>(m_lights[i])->m_spot_exponent;
+    } else if (dynamic_cast<PointLight *>(m_lights[i]) != NULL)
+      l.type = CACHE_POINT;
+    else if (dynamic_cast<DirectionalLight *>(m_lights[i]) != NULL)
+      l.type = CACHE_DIRECTIONAL;
+    else if (dynamic_cast<SphereAreaLight *>(m_lights[i]) != NULL)
+      l.type = CACHE_SPHERE_AREA;
+    else if (dynamic_cast<DiskAreaLight *>(m_lights[i]) != NULL)
+      l.type = CACHE_DISK_AREA;
+    else {
+      ok = false;
+      break;
+    }
+
+    if (l.type == CACHE_POINT || l.type == CACHE_SPOT) {
+      l.const_att = static_cast<PointLight *>(m_lights[i])->m_const_att;
+      l.lin_att = static_cast<PointLight *>(m_lights[i])->m_lin_att;
+      l.quad_att = static_cast<PointLight *>(m_lights[i])->m_quad_att;
+    } else if (l.type == CACHE_SPHERE_AREA || l.type == CACHE_DISK_AREA) {
+      al = static_cast<AreaLight *>(m_lights[i]);
+      l.const_att = al->m_const_att;
+      l.lin_att = al->m_lin_att;
+      l.quad_att = al->m_quad_att;
+      for (l.figure = 0; l.figure < m_figures.size() && m_figures[l.figure] != al->m_figure; l.figure++);
+    }
+
+    ok = fwrite(&l, sizeof(l), 1, out) == 1;
+  }
+
+  // The BVH of every group, then that of the scene.
+  for (size_t g = 0; ok && g <= m_groups.size(); g++) {
+    bvh = g < m_groups.size() ? &m_groups[g]->m_bvh : &m_bvh;
+    b.n_nodes = bvh->nodes().size();
+    b.n_order = bvh->order().size();
+    ok = fwrite(&b, sizeof(b), 1, out) == 1;
+    ok = ok && fwrite(bvh->nodes().data(), sizeof(bvh_node_t), b.n_nodes, out) == b.n_nodes;
+    ok = ok && fwrite(bvh->order().data(), sizeof(uint32_t), b.n_order, out) == b.n_order;
+  }
+
+  ok = (fclose(out) == 0) && ok;
+
+  if (!ok || rename(tmp_name.c_str(), file_name.c_str()) != 0)
+    remove(tmp_name.c_str());
+}
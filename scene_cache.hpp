@@ -0,0 +1,96 @@
+#pragma once
+#ifndef SCENE_CACHE_HPP
+#define SCENE_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/* Binary scene cache. A compiled scene is a header followed by fixed size
+ * records: the camera, the environment (followed by the texture file name
+ * padded to four bytes), one record per figure with its material, the
+ * figures of every group first, one record per light and the BVH of every
+ * group and then of the scene. All records are plain arrays of 32 bit
+ * values in the byte order of the machine that wrote them, so the file is
+ * read in place from a read-only mapping. A cache is only used if its
+ * source hash matches the hash of the scene file it was compiled from. */
+
+#define SCENE_CACHE_VERSION 3
+#define CACHE_NO_GROUP 0xffffffffu
+
+typedef struct CACHE_HEADER {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_figures;
+  uint64_t source_hash;
+  uint32_t n_lights;
+  uint32_t tex_file_len;
+  uint32_t n_groups;
+  uint32_t pad;
+} cache_header_t;
+
+typedef struct CACHE_CAMERA {
+  float eye[3];
+  float look[3];
+  float up[3];
+} cache_camera_t;
+
+typedef struct CACHE_ENVIRONMENT {
+  float color[3];
+  uint32_t has_texture;
+  uint32_t light_probe;
+} cache_environment_t;
+
+typedef enum CACHE_FIGURE_TYPE { CACHE_SPHERE = 0, CACHE_PLANE, CACHE_DISK, CACHE_INSTANCE } cache_figure_type_t;
+typedef enum CACHE_BRDF_TYPE { CACHE_PHONG = 0, CACHE_HSA } cache_brdf_type_t;
+
+typedef struct CACHE_FIGURE {
+  uint32_t type;
+  // Group the figure belongs to, or CACHE_NO_GROUP.
+  uint32_t group;
+  // Center of spheres or point of planes and disks.
+  float position[3];
+  float normal[3];
+  float radius;
+  // Group placed by instances, rows of their transform and whether they
+  // have a material of their own.
+  uint32_t object;
+  float xform[12];
+  uint32_t own_material;
+  // Material.
+  uint32_t brdf;
+  uint32_t refract;
+  float emission[3];
+  float diffuse[3];
+  float specular[3];
+  float rho;
+  float shininess;
+  float ref_index;
+} cache_figure_t;
+
+typedef enum CACHE_LIGHT_TYPE { CACHE_DIRECTIONAL = 0, CACHE_POINT, CACHE_SPOT, CACHE_SPHERE_AREA, CACHE_DISK_AREA } cache_light_type_t;
+
+typedef struct CACHE_LIGHT {
+  uint32_t type;
+  // Index of the figure of area lights.
+  uint32_t figure;
+  float position[3];
+  float diffuse[3];
+  float specular[3];
+  float spot_dir[3];
+  float const_att;
+  float lin_att;
+  float quad_att;
+  float spot_cutoff;
+  float spot_exponent;
+} cache_light_t;
+
+// Followed by the nodes and then the order of the figures of a BVH.
+typedef struct CACHE_BVH {
+  uint32_t n_nodes;
+  uint32_t n_order;
+} cache_bvh_t;
+
+// 64 bit FNV-1a hash of a block of memory.
+extern uint64_t scene_hash(const void * data, const size_t size);
+
+#endif
@@ -0,0 +1,342 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.hpp"
+#include "net.hpp"
+#include "sampler.hpp"
+#include "stats.hpp"
+#include "denoise.hpp"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::istringstream;
+using std::ostringstream;
+
+#define ANSI_BOLD_YELLOW "\x1b[1;33m"
+#define ANSI_RESET_STYLE "\x1b[m"
+
+static const int MAX_SIZE = 16384;
+static const size_t MAX_LINE = 4096;
+
+// A job with the values it overrides.
+typedef struct RENDER_JOB {
+  tracer_t tracer;
+  render_settings_t rs;
+  int depth;
+  string sampler;
+  string out;
+  bool has_eye, has_look, has_up;
+  vec3 eye, look, up;
+} render_job_t;
+
+////////////////////////////////////////////
+// Helper functions.
+////////////////////////////////////////////
+
+static bool parse_vector(const string & s, vec3 & v) {
+  return sscanf(s.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+static bool parse_int(const string & s, int & i, const int min, const int max) {
+  char * end;
+  long l = strtol(s.c_str(), &end, 10);
+
+  if (s.empty() || *end != '\0' || l < min || l > max)
+    return false;
+  i = static_cast<int>(l);
+
+  return true;
+}
+
+static bool parse_float(const string & s, float & f) {
+  char * end;
+
+  f = strtof(s.c_str(), &end);
+
+  return !s.empty() && *end == '\0';
+}
+
+// Fills job from a job line, returns an empty string or what is wrong.
+static string parse_job(const string & line, render_job_t & job) {
+  istringstream iss(line);
+  string token, key, value;
+  size_t eq, x;
+
+  while (iss >> token) {
+    if ((eq = token.find('=')) == string::npos)
+      return "Expected key=value, got \"" + token + "\".";
+    key = token.substr(0, eq);
+    value = token.substr(eq + 1);
+
+    if (key == "tracer") {
+      if ((job.tracer = tracer_by_name(value.c_str())) == NONE)
+	return "Invalid ray tracer: " + value;
+
+    } else if (key == "size") {
+      if ((x = value.find('x')) == string::npos || !parse_int(value.substr(0, x), job.rs.w, 1, MAX_SIZE) ||
+	  !parse_int(value.substr(x + 1), job.rs.h, 1, MAX_SIZE))
+	return "Invalid image size: " + value;
+
+    } else if (key == "spp") {
+      if (!parse_int(value, job.rs.samples, 1, 1 << 20))
+	return "Samples per pixel must be a positive integer.";
+
+    } else if (key == "first") {
+      if (!parse_int(value, job.rs.first_sample, 0, 1 << 30))
+	return "The first sample must be a non-negative integer.";
+
+    } else if (key == "fov") {
+      if (!parse_float(value, job.rs.fov) || job.rs.fov < 1.0f)
+	return "FoV must be greater than or equal to 1.0 degrees.";
+
+    } else if (key == "depth") {
+      if (!parse_int(value, job.depth, 1, 1 << 10))
+	return "Recursion depth must be a positive integer.";
+
+    } else if (key == "gamma") {
+      if (!parse_float(value, job.rs.gamma) || job.rs.gamma < 0.0f)
+	return "Gamma must be a number >= 0.";
+
+    } else if (key == "exposure") {
+      if (!parse_float(value, job.rs.exposure) || job.rs.exposure < -8.0f || job.rs.exposure > 8.0f)
+	return "Exposure must be a number in [-8, 8].";
+
+    } else if (key == "denoise") {
+      if (!parse_int(value, job.rs.denoise, 0, MAX_DENOISE_PASSES))
+	return "Denoiser passes must be an integer in [0, " + std::to_string(MAX_DENOISE_PASSES) + "].";
+
+    } else if (key == "sampler") {
+      job.sampler = value;
+
+    } else if (key == "out") {
+      job.out = value;
+
+    } else if (key == "eye") {
+      if (!(job.has_eye = parse_vector(value, job.eye)))
+	return "Invalid eye position: " + value;
+
+    } else if (key == "look") {
+      if (!(job.has_look = parse_vector(value, job.look)))
+	return "Invalid look position: " + value;
+
+    } else if (key == "up") {
+      if (!(job.has_up = parse_vector(value, job.up)))
+	return "Invalid up vector: " + value;
+
+    } else
+      return "Unknown key \"" + key + "\".";
+  }
+
+  return "";
+}
+
+/* Owns the tracers of the server, created on first use since a photon
+ * mapping tracer traces its photon maps when created. */
+class TracerCache {
+public:
+  TracerCache(Scene * s, const tracer_options_t & opts): m_scene(s), m_opts(opts) {
+    for (int i = 0; i <= JENSEN; i++)
+      m_tracers[i] = NULL;
+  }
+
+  ~TracerCache() {
+    for (int i = 0; i <= JENSEN; i++)
+      delete m_tracers[i];
+  }
+
+  Tracer * get(const tracer_t t, const render_settings_t & rs) {
+    if (m_tracers[t] == NULL)
+      m_tracers[t] = create_tracer(t, m_scene, m_opts, rs);
+
+    return m_tracers[t];
+  }
+
+private:
+  Scene * m_scene;
+  tracer_options_t m_opts;
+  Tracer * m_tracers[JENSEN + 1];
+};
+
+/* Removes the socket left at path by an earlier server. Anything else
+ * there is kept, and false is returned with errno set to ENOTSOCK. */
+static bool remove_socket(const char * path) {
+  struct stat st;
+
+  if (lstat(path, &st) != 0)
+    return errno == ENOENT;
+
+  if (!S_ISSOCK(st.st_mode)) {
+    errno = ENOTSOCK;
+    return false;
+  }
+
+  return unlink(path) == 0;
+}
+
+// Renders a job and replies to it. Returns false if the client went away.
+static bool run_job(const int fd, Scene * s, TracerCache & tracers, const render_job_t & job, Framebuffer & fb) {
+  Camera * scene_cam = s->m_cam, * cam = NULL;
+  Sampler * sampler = NULL;
+  Tracer * tracer;
+  unsigned int depth;
+  ostringstream oss;
+  Framebuffer denoised;
+  const Framebuffer * image;
+  bool ok;
+
+  if (!job.sampler.empty() && (sampler = create_sampler(job.sampler.c_str(), static_cast<uint32_t>(job.rs.samples))) == NULL)
+    return write_line(fd, "ERROR Invalid sampler: " + job.sampler);
+
+  if ((tracer = tracers.get(job.tracer, job.rs)) == NULL) {
+    delete sampler;
+    return write_line(fd, "ERROR Could not create the tracer.");
+  }
+
+  if (job.has_eye || job.has_look || job.has_up)
+    cam = new Camera(job.has_eye ? job.eye : scene_cam->m_eye, job.has_look ? job.look : scene_cam->m_look, job.has_up ? job.up : scene_cam->m_up);
+
+  depth = tracer->m_max_depth;
+  if (job.depth > 0)
+    tracer->m_max_depth = static_cast<unsigned int>(job.depth);
+  if (cam != NULL)
+    s->m_cam = cam;
+  set_sampler(sampler);
+
+  phase_begin(PHASE_RENDER);
+  render(s, tracer, job.rs, fb, NULL, false);
+  phase_end(PHASE_RENDER);
+
+  set_sampler(NULL);
+  s->m_cam = scene_cam;
+  tracer->m_max_depth = depth;
+  delete cam;
+  delete sampler;
+
+  if (!job.out.empty()) {
+    if (!save_image(fb, job.rs, job.tracer != WHITTED, job.out.c_str()))
+      return write_line(fd, "ERROR Could not write " + job.out);
+    return write_line(fd, "OK " + job.out);
+  }
+
+  if (job.rs.denoise > 0) {
+    phase_begin(PHASE_DENOISE);
+    denoise(fb, job.rs.denoise, denoised);
+    phase_end(PHASE_DENOISE);
+  }
+  image = job.rs.denoise > 0 ? &denoised : &fb;
+
+  oss << "IMAGE " << image->m_w << " " << image->m_h;
+  ok = write_line(fd, oss.str());
+
+  return ok && write_all(fd, &image->m_pixels[0], image->m_pixels.size() * sizeof(vec3));
+}
+
+////////////////////////////////////////////
+// Server.
+////////////////////////////////////////////
+
+bool serve(const char * socket_path, Scene * s, const tracer_t default_tracer, const tracer_options_t & opts,
+	   const render_settings_t & defaults, const char * sampler_name) {
+  struct sockaddr_un addr;
+  TracerCache tracers(s, opts);
+  Framebuffer fb;
+  render_job_t job;
+  string buffer, line, error;
+  bool quit = false, open;
+  int listener, fd, jobs = 0;
+  double start;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    cerr << "The socket path is too long: " << socket_path << endl;
+    return false;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  if (!remove_socket(socket_path)) {
+    cerr << "Could not replace " << socket_path << ": " << strerror(errno) << endl;
+    return false;
+  }
+
+  if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 8) < 0) {
+    cerr << "Could not listen on " << socket_path << ": " << strerror(errno) << endl;
+    if (listener >= 0)
+      close(listener);
+    return false;
+  }
+
+  cout << "Waiting for render jobs on " << ANSI_BOLD_YELLOW << socket_path << ANSI_RESET_STYLE << "." << endl;
+
+  while (!quit) {
+    if ((fd = accept(listener, NULL, NULL)) < 0) {
+      if (errno == EINTR)
+	continue;
+      cerr << "Could not accept a client: " << strerror(errno) << endl;
+      break;
+    }
+
+    buffer.clear();
+    open = true;
+    while (open && !quit) {
+      // Run every complete line, then read more.
+      while (open && !quit && take_line(buffer, line)) {
+	if (line.find_first_not_of(" \t") == string::npos)
+	  continue;
+	if (line == "quit") {
+	  quit = true;
+	  write_line(fd, "OK quit");
+	  break;
+	}
+
+	job.tracer = default_tracer != NONE ? default_tracer : WHITTED;
+	job.rs = defaults;
+	job.depth = 0;
+	job.sampler = sampler_name != NULL ? sampler_name : "";
+	job.out.clear();
+	job.has_eye = job.has_look = job.has_up = false;
+
+	if (!(error = parse_job(line, job)).empty()) {
+	  open = write_line(fd, "ERROR " + error);
+	  continue;
+	}
+
+	start = stat_time();
+	open = run_job(fd, s, tracers, job, fb);
+	cout << "Job " << ANSI_BOLD_YELLOW << ++jobs << ANSI_RESET_STYLE << " (" << tracer_name(job.tracer) << ", "
+	     << job.rs.w << "x" << job.rs.h << ", " << job.rs.samples << " spp) took " << ANSI_BOLD_YELLOW
+	     << stat_time() - start << ANSI_RESET_STYLE << " seconds." << endl;
+      }
+
+      if (!open || quit)
+	break;
+      if (buffer.size() > MAX_LINE) {
+	open = write_line(fd, "ERROR Line too long.");
+	break;
+      }
+      if (!read_some(fd, buffer))
+	break;
+    }
+
+    close(fd);
+  }
+
+  close(listener);
+  remove_socket(socket_path);
+
+  return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include "scene.hpp"
+#include "render.hpp"
+
+/* Render server for look development. Listens on a UNIX socket and keeps
+ * the scene, its BVH and the tracers, with their photon maps, loaded
+ * between jobs, so a job only costs its render. Clients are served one
+ * at a time and send one job per line, as space separated key=value pairs:
+ *
+ *   tracer=whitted|monte_carlo|jensen  size=WxH  spp=N  first=N  fov=DEGREES
+ *   depth=N  gamma=G  exposure=E  denoise=PASSES  sampler=NAME  out=FILE
+ *   eye=X,Y,Z  look=X,Y,Z  up=X,Y,Z
+ *
+ * Keys that are left out take the values given on the command line. The
+ * camera keys replace the scene camera for the job, taking the parts that
+ * are not given from it. first=N renders the samples N to N + spp - 1,
+ * so the images of successive ranges can be averaged. With out=FILE the
+ * image is saved there and the reply is "OK FILE". Otherwise the reply is
+ * "IMAGE W H" followed by the W * H * 3 floats of the pixels before tone
+ * mapping, denoised with denoise=PASSES, in native byte order, row by row
+ * from the top. Failed jobs are answered with "ERROR reason".
+ * A line with "quit" stops the server. Photon maps are traced once, for
+ * the first jensen job, with the photon options of the command line.
+ * A socket left at socket_path by an earlier server is replaced, any
+ * other file there makes serve fail. */
+extern bool serve(const char * socket_path, Scene * s, const tracer_t default_tracer, const tracer_options_t & opts,
+		  const render_settings_t & defaults, const char * sampler_name);
+
+#endif
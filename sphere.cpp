@@ -7,31 +7,16 @@
 using namespace glm;
 
 bool Sphere::intersect(Ray & r, float & t) const {
-  float t1, t2;
-  float d;
-
-  float a = (r.m_direction.x * r.m_direction.x) +
-    (r.m_direction.y * r.m_direction.y) +
-    (r.m_direction.z * r.m_direction.z);
-
-  float b = (2 * r.m_direction.x * (r.m_origin.x - m_center.x)) +
-    (2 * r.m_direction.y * (r.m_origin.y - m_center.y)) +
-    (2 * r.m_direction.z * (r.m_origin.z - m_center.z));
-
-  float c = (m_center.x * m_center.x) +
-    (m_center.y * m_center.y) +
-    (m_center.z * m_center.z) +
-    (r.m_origin.x * r.m_origin.x) +
-    (r.m_origin.y * r.m_origin.y) +
-    (r.m_origin.z * r.m_origin.z) -
-    2 * ((m_center.x * r.m_origin.x) + (m_center.y * r.m_origin.y) + (m_center.z * r.m_origin.z)) - (m_radius * m_radius);
-
-  d = (b * b) - (4 * a * c);
+  // Half b form of the quadratic on the vector from the center to the
+  // origin, as in closest_sphere().
+  vec3 oc = r.m_origin - m_center;
+  float a = dot(r.m_direction, r.m_direction);
+  float b = dot(oc, r.m_direction);
+  float c = dot(oc, oc) - (m_radius * m_radius);
+  float d = (b * b) - (a * c);
 
   if (d >= 0.0f) {
-    t1 = (-b - sqrt(d)) / (2 * a); 
-    t2 = (-b + sqrt(d)) / (2 * a);
-    t = t1 < t2 ? t1 : t2;
+    t = (0.0f - b - sqrt(d)) / a;
     return t >= 0.0f;
 
   } else
@@ -30,6 +30,11 @@ public:
   virtual bool intersect(Ray & r, float & t) const;
   virtual vec3 normal_at_int(Ray & r, float & t) const;
   virtual vec3 sample_at_surface() const;
+  virtual bool bounding_box(vec3 & b_min, vec3 & b_max) const {
+    b_min = m_center - vec3(m_radius);
+    b_max = m_center + vec3(m_radius);
+    return true;
+  }
 
 private:
   virtual void calculate_inv_area();
@@ -0,0 +1,187 @@
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <utility>
+
+#include <sys/resource.h>
+
+#include "stats.hpp"
+
+using std::mutex;
+using std::lock_guard;
+using std::set;
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+static const char * COUNTER_NAMES[STAT_N_COUNTERS] = {
+  "primary_rays", "secondary_rays", "shadow_rays", "photon_rays",
+  "box_tests", "intersection_tests", "knn_queries", "photons_visited"
+};
+
+static const char * PHASE_NAMES[PHASE_N_PHASES] = {
+  "scene_load", "photon_tracing", "balance", "render", "denoise", "tone_mapping", "save"
+};
+
+thread_local ThreadStats t_stats;
+
+// Blocks of the running threads and totals of the threads that ended.
+static mutex g_lock;
+static set<ThreadStats *> g_threads;
+static uint64_t g_retired[STAT_N_COUNTERS];
+static double g_retired_busy = 0.0;
+static vector<pair<int, vector<trace_event_t> > > g_retired_events;
+static int g_next_tid = 0;
+
+bool g_tracing = false;
+static double g_trace_origin = 0.0;
+static int g_trace_main = -1;
+
+static double g_phase_start[PHASE_N_PHASES];
+static double g_phase_time[PHASE_N_PHASES];
+
+////////////////////////////////////////////
+// Thread statistics.
+////////////////////////////////////////////
+
+ThreadStats::ThreadStats(): m_busy(0.0) {
+  lock_guard<mutex> lock(g_lock);
+
+  for (int i = 0; i < STAT_N_COUNTERS; i++)
+    m_counters[i] = 0;
+  m_tid = g_next_tid++;
+  g_threads.insert(this);
+}
+
+ThreadStats::~ThreadStats() {
+  lock_guard<mutex> lock(g_lock);
+
+  for (int i = 0; i < STAT_N_COUNTERS; i++)
+    g_retired[i] += m_counters[i];
+  g_retired_busy += m_busy;
+  if (!m_events.empty())
+    g_retired_events.push_back(make_pair(m_tid, m_events));
+  g_threads.erase(this);
+}
+
+////////////////////////////////////////////
+// Phases.
+////////////////////////////////////////////
+
+double stat_time() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void phase_begin(const stat_phase_t p) {
+  g_phase_start[p] = stat_time();
+}
+
+void phase_end(const stat_phase_t p) {
+  g_phase_time[p] += stat_time() - g_phase_start[p];
+  trace_event(PHASE_NAMES[p], g_phase_start[p]);
+}
+
+////////////////////////////////////////////
+// Timeline.
+////////////////////////////////////////////
+
+void trace_start() {
+  g_trace_origin = stat_time();
+  g_trace_main = t_stats.m_tid;
+  g_tracing = true;
+}
+
+static void write_events(FILE * out, const int tid, const vector<trace_event_t> & events, bool & first) {
+  for (size_t i = 0; i < events.size(); i++) {
+    // Complete events, with times in microseconds.
+    fprintf(out, "%s    {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+	    first ? "" : ",\n", events[i].name, tid, 1e6 * (events[i].start - g_trace_origin), 1e6 * (events[i].end - events[i].start));
+    if (events[i].arg_name != NULL)
+      fprintf(out, ", \"args\": {\"%s\": %lld}", events[i].arg_name, static_cast<long long>(events[i].arg));
+    fprintf(out, "}");
+    first = false;
+  }
+}
+
+static void write_thread_name(FILE * out, const int tid, bool & first) {
+  if (tid == g_trace_main)
+    fprintf(out, "%s    {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"main\"}}", first ? "" : ",\n", tid);
+  else
+    fprintf(out, "%s    {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"worker %d\"}}", first ? "" : ",\n", tid, tid);
+  first = false;
+}
+
+bool write_trace(const char * file_name) {
+  lock_guard<mutex> lock(g_lock);
+  bool first = true;
+  FILE * out;
+
+  if ((out = fopen(file_name, "w")) == NULL)
+    return false;
+
+  fprintf(out, "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [\n");
+  for (size_t i = 0; i < g_retired_events.size(); i++) {
+    write_thread_name(out, g_retired_events[i].first, first);
+    write_events(out, g_retired_events[i].first, g_retired_events[i].second, first);
+  }
+  for (set<ThreadStats *>::iterator it = g_threads.begin(); it != g_threads.end(); it++) {
+    if ((*it)->m_events.empty() && (*it)->m_tid != g_trace_main)
+      continue;
+    write_thread_name(out, (*it)->m_tid, first);
+    write_events(out, (*it)->m_tid, (*it)->m_events, first);
+  }
+  fprintf(out, "\n  ]\n}\n");
+
+  return fclose(out) == 0;
+}
+
+////////////////////////////////////////////
+// Report.
+////////////////////////////////////////////
+
+bool write_stats(const char * file_name, const char * description, const int threads) {
+  uint64_t c[STAT_N_COUNTERS];
+  double busy, total = 0.0, render = g_phase_time[PHASE_RENDER], photons = g_phase_time[PHASE_PHOTON_TRACING];
+  uint64_t rays;
+  struct rusage usage;
+  FILE * out;
+
+  {
+    lock_guard<mutex> lock(g_lock);
+
+    busy = g_retired_busy;
+    for (int i = 0; i < STAT_N_COUNTERS; i++)
+      c[i] = g_retired[i];
+    for (set<ThreadStats *>::iterator it = g_threads.begin(); it != g_threads.end(); it++) {
+      busy += (*it)->m_busy;
+      for (int i = 0; i < STAT_N_COUNTERS; i++)
+	c[i] += (*it)->m_counters[i];
+    }
+  }
+
+  if ((out = fopen(file_name, "w")) == NULL)
+    return false;
+
+  fprintf(out, "{\n  %s,\n  \"threads\": %d,\n  \"phases\": {\n", description, threads);
+  for (int i = 0; i < PHASE_N_PHASES; i++) {
+    fprintf(out, "    \"%s\": %.6f,\n", PHASE_NAMES[i], g_phase_time[i]);
+    total += g_phase_time[i];
+  }
+  fprintf(out, "    \"total\": %.6f\n  },\n  \"counters\": {\n", total);
+  for (int i = 0; i < STAT_N_COUNTERS; i++)
+    fprintf(out, "    \"%s\": %llu%s\n", COUNTER_NAMES[i], static_cast<unsigned long long>(c[i]), i + 1 < STAT_N_COUNTERS ? "," : "");
+
+  // Rays traced while rendering, photons while tracing them.
+  rays = c[STAT_PRIMARY_RAYS] + c[STAT_SECONDARY_RAYS] + c[STAT_SHADOW_RAYS];
+  fprintf(out, "  },\n  \"rays_per_second\": %.1f,\n", render > 0.0 ? rays / render : 0.0);
+  fprintf(out, "  \"photon_rays_per_second\": %.1f,\n", photons > 0.0 ? c[STAT_PHOTON_RAYS] / photons : 0.0);
+  fprintf(out, "  \"photons_visited_per_query\": %.2f,\n", c[STAT_KNN_QUERIES] > 0 ? static_cast<double>(c[STAT_PHOTONS_VISITED]) / c[STAT_KNN_QUERIES] : 0.0);
+  // Share of the threads busy with pixels during the render phase.
+  fprintf(out, "  \"thread_utilization\": %.4f,\n", render > 0.0 && threads > 0 ? busy / (render * threads) : 0.0);
+  // Kilobytes on Linux.
+  fprintf(out, "  \"peak_rss_kb\": %ld\n}\n", getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0L);
+
+  return fclose(out) == 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <cstdint>
+#include <vector>
+
+/* Render statistics. Every thread counts into its own block, which is
+ * added to the totals when the thread ends or when the totals are read,
+ * so counting is a plain increment of thread local memory. Phases are
+ * timed from the main thread. Counting can be compiled out with
+ * -DNO_STATS; phases are always timed.
+ *
+ * Optionally, a timeline of the render is recorded as well: the phases,
+ * and spans of work like a row of pixels or a block of photons, each on
+ * the thread that did it. Events go to a thread local buffer like the
+ * counters and are written in the Chrome trace event format, which
+ * chrome://tracing and Perfetto open. */
+
+typedef enum STAT_COUNTER {
+  STAT_PRIMARY_RAYS = 0,
+  STAT_SECONDARY_RAYS,
+  STAT_SHADOW_RAYS,
+  STAT_PHOTON_RAYS,
+  STAT_BOX_TESTS,
+  STAT_INTERSECTION_TESTS,
+  STAT_KNN_QUERIES,
+  STAT_PHOTONS_VISITED,
+  STAT_N_COUNTERS
+} stat_counter_t;
+
+typedef enum STAT_PHASE {
+  PHASE_SCENE_LOAD = 0,
+  PHASE_PHOTON_TRACING,
+  PHASE_BALANCE,
+  PHASE_RENDER,
+  PHASE_DENOISE,
+  PHASE_TONE_MAPPING,
+  PHASE_SAVE,
+  PHASE_N_PHASES
+} stat_phase_t;
+
+// A span of work of one thread, with an optional integer argument.
+typedef struct TRACE_EVENT {
+  const char * name;
+  const char * arg_name;
+  int64_t arg;
+  double start;
+  double end;
+} trace_event_t;
+
+class ThreadStats {
+public:
+  uint64_t m_counters[STAT_N_COUNTERS];
+  // Seconds spent doing work inside parallel loops.
+  double m_busy;
+  // Order in which the thread first counted something, used as its id.
+  int m_tid;
+  std::vector<trace_event_t> m_events;
+
+  ThreadStats();
+  ~ThreadStats();
+};
+
+extern thread_local ThreadStats t_stats;
+
+static inline void stat_add(const stat_counter_t c, const uint64_t n = 1) {
+#ifndef NO_STATS
+  t_stats.m_counters[c] += n;
+#endif
+}
+
+static inline void stat_busy(const double seconds) {
+#ifndef NO_STATS
+  t_stats.m_busy += seconds;
+#endif
+}
+
+// Wall clock time in seconds.
+extern double stat_time();
+
+// True while a timeline is being recorded.
+extern bool g_tracing;
+
+// Starts recording the timeline, the calling thread is named "main".
+extern void trace_start();
+
+// Start time of an event, only read from the clock while tracing.
+static inline double trace_now() {
+  return g_tracing ? stat_time() : 0.0;
+}
+
+/* Records an event of the calling thread from start until now. The name
+ * and arg_name must be string literals, they are kept as pointers. */
+static inline void trace_event(const char * name, const double start, const char * arg_name = NULL, const int64_t arg = 0) {
+  trace_event_t e;
+
+  if (!g_tracing)
+    return;
+
+  e.name = name;
+  e.arg_name = arg_name;
+  e.arg = arg;
+  e.start = start;
+  e.end = stat_time();
+  t_stats.m_events.push_back(e);
+}
+
+// Writes the timeline recorded so far. Returns false if the file can not be written.
+extern bool write_trace(const char * file_name);
+
+// Phases are also events of the timeline, on the thread that ends them.
+extern void phase_begin(const stat_phase_t p);
+extern void phase_end(const stat_phase_t p);
+
+/* Writes every phase time and counter as JSON, along with the description
+ * of the render given as a string of "key": value pairs. Returns false if
+ * the file can not be written. */
+extern bool write_stats(const char * file_name, const char * description, const int threads);
+
+#endif
@@ -24,3 +24,12 @@ float Tracer::fresnel(const vec3 & i, const vec3 & n, const float ir1, const flo
 
   return ((fr_par * fr_par) + (fr_per * fr_per)) / 2.0f;
 }
+
+void Tracer::first_hit(first_hit_t * hit, const Figure * f, const Ray & r, const float t, const vec3 & n) const {
+  if (hit == NULL || f == NULL)
+    return;
+
+  hit->albedo = f->m_mat->m_diffuse;
+  hit->normal = dot(n, r.m_direction) > 0.0f ? -n : n;
+  hit->depth = t;
+}
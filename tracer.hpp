@@ -17,6 +17,14 @@ extern const float BIAS;
 
 extern const vec3 BCKG_COLOR;
 
+// The first surface seen by a camera ray, what the denoiser follows edges of.
+typedef struct FIRST_HIT {
+  vec3 albedo;
+  // Facing the ray.
+  vec3 normal;
+  float depth;
+} first_hit_t;
+
 class Tracer {
 public:
   unsigned int m_max_depth;
@@ -27,10 +35,13 @@ public:
 
   virtual ~Tracer() { }
 
-  virtual vec3 trace_ray(Ray & r, Scene * s, unsigned int rec_level) const = 0;
+  /* Radiance along r. When hit is not NULL it gets the first surface r
+   * hits, and is left alone if r escapes the scene. */
+  virtual vec3 trace_ray(Ray & r, Scene * s, unsigned int rec_level, first_hit_t * hit = NULL) const = 0;
 
 protected:
   float fresnel(const vec3 & i, const vec3 & n, const float ir1, const float ir2) const;
+  void first_hit(first_hit_t * hit, const Figure * f, const Ray & r, const float t, const vec3 & n) const;
 };
 
 #endif
@@ -5,14 +5,15 @@
 
 #include "whitted_tracer.hpp"
 #include "area_light.hpp"
+#include "stats.hpp"
 
 using std::numeric_limits;
 using namespace glm;
 
 WhittedTracer::~WhittedTracer() { }
 
-vec3 WhittedTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const {
-  float t, _t;
+vec3 WhittedTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level, first_hit_t * hit) const {
+  float t;
   Figure * _f;
   vec3 n, color, i_pos, ref, dir_diff_color, dir_spec_color;
   Ray mv_r, sr, rr;
@@ -23,19 +24,17 @@ vec3 WhittedTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const
   t = numeric_limits<float>::max();
   _f = NULL;
 
-  // Find the closest intersecting surface.
-  for (size_t f = 0; f < s->m_figures.size(); f++) {
-    if (s->m_figures[f]->intersect(r, _t) && _t < t) {
-      t = _t;
-      _f = s->m_figures[f];
-    }
-  }
+  if (rec_level > 0)
+    stat_add(STAT_SECONDARY_RAYS);
+
+  // Find the closest intersecting surface and its normal.
+  _f = s->intersect(r, t, n);
+  first_hit(hit, _f, r, t, n);
 
   // If this ray intersects something:
   if (_f != NULL) {
-    // Take the intersection point and the normal of the surface at that point.
+    // Take the intersection point.
     i_pos = r.m_origin + (t * r.m_direction);
-    n = _f->normal_at_int(r, t);
     
     is_area_light = false;
     // Check if the object is an area light;
@@ -59,12 +58,7 @@ vec3 WhittedTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const
 	if (s->m_lights[l]->light_type() == Light::INFINITESIMAL) {
 	  // Cast a shadow ray to determine visibility.
 	  sr = Ray(s->m_lights[l]->direction(i_pos), i_pos + n * BIAS);
-	  for (size_t f = 0; f < s->m_figures.size(); f++) {
-	    if (s->m_figures[f]->intersect(sr, _t) && _t < s->m_lights[l]->distance(i_pos)) {
-	      vis = false;
-	      break;
-	    }
-	  }
+	  vis = !s->occluded(sr, s->m_lights[l]->distance(i_pos));
 
 	} else if (s->m_lights[l]->light_type() == Light::AREA) {
 	  // Cast a shadow ray towards a sample point on the surface of the light source.
@@ -72,15 +66,8 @@ vec3 WhittedTracer::trace_ray(Ray & r, Scene * s, unsigned int rec_level) const
 	  al->sample_at_surface();
 	  sr = Ray(al->direction(i_pos), i_pos + (n * BIAS));
 
-	  for (size_t f = 0; f < s->m_figures.size(); f++) {
-	    // Avoid self-intersection with the light source.
-	    if (al->m_figure != s->m_figures[f]) {
-	      if (s->m_figures[f]->intersect(sr, _t) && _t < al->distance(i_pos)) {
-		vis = false;
-		break;
-	      }
-	    }
-	  }
+	  // Avoid self-intersection with the light source.
+	  vis = !s->occluded(sr, al->distance(i_pos), al->m_figure);
 	}
 
 	// Evaluate the shading model accounting for visibility.
@@ -12,7 +12,7 @@ public:
 
   virtual ~WhittedTracer();
 
-  virtual vec3 trace_ray(Ray & r, Scene * s, unsigned int rec_level) const;
+  virtual vec3 trace_ray(Ray & r, Scene * s, unsigned int rec_level, first_hit_t * hit = NULL) const;
 };
 
 #endif